@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "arena.h"
+#include "types.h"
+#include "error.h"
+
+/* Function Definitions */
+
+/*
+ * Function to round a size or an address up to a power of two alignment.
+ */
+static size_t align_up(size_t value, size_t align)
+{
+    return (value + align - 1) & ~(align - 1);
+}
+
+/*
+ * Function to set up an empty arena. The block is only allocated by the
+ * first reset, once it is known how much a job needs.
+ *
+ * INPUTS: The arena.
+ *
+ * RETURNS: Nothing.
+ */
+void arena_init(Arena *arena)
+{
+    if(!arena)
+    {
+	FATAL_ERR_MSG;
+	return;
+    }
+    memset(arena, 0, sizeof(*arena));
+}
+
+/*
+ * Function to allocate memory from an arena, aligned to ARENA_ALIGN.
+ *
+ * Without an arena the memory comes from the heap, so that the same code
+ * serves one-off jobs and arena backed workers; it is given back with
+ * arena_release() either way.
+ *
+ * INPUTS: The arena (may be NULL) and the size in bytes.
+ *
+ * RETURNS: The memory, or NULL on errors.
+ */
+void *arena_alloc(Arena *arena, size_t size)
+{
+    return arena_memalign(arena, ARENA_ALIGN, size);
+}
+
+/*
+ * Function to allocate memory from an arena with a larger alignment, such
+ * as the STREAM_BLOCK_ALIGN of stream buffers.
+ *
+ * The memory is carved out of the arena block when it fits, and otherwise
+ * taken from the heap and chained to the arena until the next reset. All
+ * of it counts toward the block size the next reset sets up.
+ *
+ * INPUTS: The arena (may be NULL), the alignment (a power of two) and the
+ * size in bytes.
+ *
+ * RETURNS: The memory, or NULL on errors.
+ */
+void *arena_memalign(Arena *arena, size_t align, size_t size)
+{
+    if(align < ARENA_ALIGN)
+	align = ARENA_ALIGN;
+
+    void *ptr = NULL;
+    if(!arena)
+	return posix_memalign(&ptr, align, size)? NULL: ptr;
+
+    size = align_up(size? size: 1, ARENA_ALIGN);
+    size_t start = align_up(arena->used, align);
+    arena->needed = align_up(arena->needed, align) + size;
+    if(arena->block && start + size <= arena->size)
+    {
+	arena->used = start + size;
+	return arena->block + start;
+    }
+
+    size_t header_size = align_up(sizeof(ArenaOverflow), align);
+    if(posix_memalign(&ptr, align, header_size + size))
+	return NULL;
+    ArenaOverflow *overflow = ptr;
+    overflow->next = arena->overflow;
+    arena->overflow = overflow;
+    return (unsigned char *)ptr + header_size;
+}
+
+/*
+ * Function to give back memory allocated with arena_alloc() or
+ * arena_memalign(). Arena memory is only given back by arena_reset(), so
+ * this only frees heap memory allocated without an arena.
+ *
+ * INPUTS: The arena (may be NULL) and the memory (may be NULL).
+ *
+ * RETURNS: Nothing.
+ */
+void arena_release(Arena *arena, void *ptr)
+{
+    if(!arena)
+	free(ptr);
+}
+
+/*
+ * Function to give back everything allocated from an arena, at the end of
+ * a job.
+ *
+ * The heap blocks taken for allocations that did not fit are freed, and
+ * the arena block is grown to what the job needed, so that the next job
+ * like it is served from the block alone. The block never shrinks.
+ *
+ * INPUTS: The arena.
+ *
+ * RETURNS: Nothing.
+ */
+void arena_reset(Arena *arena)
+{
+    if(!arena)
+    {
+	FATAL_ERR_MSG;
+	return;
+    }
+
+    while(arena->overflow)
+    {
+	ArenaOverflow *next = arena->overflow->next;
+	free(arena->overflow);
+	arena->overflow = next;
+    }
+
+    size_t needed = align_up(arena->needed, ARENA_BLOCK_ALIGN);
+    if(needed > arena->size)
+    {
+	void *block = NULL;
+	free(arena->block);
+	if(posix_memalign(&block, ARENA_BLOCK_ALIGN, needed))
+	    block = NULL;
+	arena->block = block;
+	arena->size = block? needed: 0;
+    }
+    arena->used = 0;
+    arena->needed = 0;
+}
+
+/*
+ * Function to release the memory held by an arena, leaving it empty.
+ *
+ * INPUTS: The arena.
+ *
+ * RETURNS: Nothing.
+ */
+void arena_free(Arena *arena)
+{
+    if(!arena)
+    {
+	FATAL_ERR_MSG;
+	return;
+    }
+
+    arena->needed = 0;
+    arena_reset(arena);
+    free(arena->block);
+    memset(arena, 0, sizeof(*arena));
+}
@@ -0,0 +1,69 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include "types.h" 	// Contains user defined types
+#include "error.h"	// Contains standard error messages
+
+/* Alignment of every arena allocation: a cache line, enough for the LSB kernels */
+#define ARENA_ALIGN 64
+
+/* Alignment of the arena block itself, and granularity of its size */
+#define ARENA_BLOCK_ALIGN 4096
+
+/*
+ * Header of a block taken from the heap for an allocation that did not fit
+ * in the arena block. The allocation follows the header, at its alignment.
+ */
+typedef struct _ArenaOverflow
+{
+    struct _ArenaOverflow *next;
+
+} ArenaOverflow;
+
+/*
+ * Structure to store a per-job arena.
+ *
+ * The scratch memory of a job (file names, stream buffers and the state of
+ * the direct I/O, throttled and traced streams, row and bit buffers, pixel
+ * arrays, the encoded message and its FEC frame) is carved out of one block
+ * by bumping an offset, and all of it is given back at once by
+ * arena_reset() when the job is done. Allocations that do not fit are
+ * taken from the heap and chained, and the next reset grows the block to
+ * the most any job has used, so a worker that runs jobs of the same shape
+ * stops touching the heap after its first job, but for the FILE objects
+ * stdio allocates itself in fopen() and fopencookie(). An arena is owned
+ * by a single thread, and streams using it must be closed before it is
+ * reset.
+ */
+typedef struct _Arena
+{
+    unsigned char *block;
+    size_t size;
+    size_t used;
+    ArenaOverflow *overflow;	// Heap blocks taken since the last reset
+    size_t needed;		// Bytes the current job would need in one block
+
+} Arena;
+
+/* Arena function prototypes */
+
+/* Set up an empty arena */
+void arena_init(Arena *arena);
+
+/* Allocate from an arena, or from the heap without one */
+void *arena_alloc(Arena *arena, size_t size);
+
+/* Allocate aligned memory from an arena, or from the heap without one */
+void *arena_memalign(Arena *arena, size_t align, size_t size);
+
+/* Give back memory allocated with arena_alloc() or arena_memalign() */
+void arena_release(Arena *arena, void *ptr);
+
+/* Give back everything allocated from an arena since the last reset */
+void arena_reset(Arena *arena);
+
+/* Release the memory held by an arena */
+void arena_free(Arena *arena);
+
+#endif
@@ -0,0 +1,399 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include "broadcast.h"
+#include "encode.h"
+#include "lsb.h"
+#include "directio.h"
+#include "chacha20.h"
+#include "types.h"
+#include "error.h"
+
+/* Function Definitions */
+
+/*
+ * Function to get the base name of a cover, which its output is named after.
+ */
+static const char *get_cover_base_name(const char *cover_fname)
+{
+    const char *base_name = strrchr(cover_fname, '/');
+    return base_name? base_name + 1: cover_fname;
+}
+
+/*
+ * Function to check the broadcast arguments input by the user.
+ *
+ * Broadcasting needs the secret file, an existing output directory and at
+ * least one cover image, in that order:
+ *	--broadcast <secret_file> <output_dir> <cover.bmp> [cover.bmp ...]
+ *
+ * Optional "--" arguments may appear anywhere after the operation argument.
+ *
+ * INPUTS: Argument vector from the main() function and the BroadcastInfo
+ * variable pointer.
+ *
+ * RETURNS: The check status enum: e_success or e_failure.
+ */
+Status read_and_validate_broadcast_args(char *argv[], BroadcastInfo *bcInfo)
+{
+    if(!argv || !bcInfo)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    memset(bcInfo, 0, sizeof(*bcInfo));
+    if(read_steg_options(argv, &bcInfo->options) == e_failure)
+	return e_failure;
+
+    if(!argv[2] || !argv[3] || !argv[4])
+    {
+	fprintf(stderr, "Error: Please input a secret file, an output directory and the cover images:\n%s %s <secret_file> <output_dir> <image%s> [image%s ...]\n", argv[0], BROADCAST_ARG, IMG_FILE_EXTN, IMG_FILE_EXTN);
+	return e_failure;
+    }
+
+    bcInfo->secret_fname = argv[2];
+    bcInfo->output_dir = argv[3];
+    bcInfo->cover_fnames = argv + 4;
+    for(uint i = 0; bcInfo->cover_fnames[i]; ++i)
+    {
+	if(!strstr(bcInfo->cover_fnames[i], IMG_FILE_EXTN))
+	{
+	    fprintf(stderr, "Error: %s is not a %s file.\n", bcInfo->cover_fnames[i], IMG_FILE_EXTN);
+	    return e_failure;
+	}
+	++bcInfo->cover_count;
+    }
+
+    /* Outputs are named after the base names of the covers, which must differ */
+    for(uint i = 0; i < bcInfo->cover_count; ++i)
+	for(uint j = i + 1; j < bcInfo->cover_count; ++j)
+	    if(!strcmp(get_cover_base_name(bcInfo->cover_fnames[i]), get_cover_base_name(bcInfo->cover_fnames[j])))
+	    {
+		fprintf(stderr, "Error: Covers %s and %s would both be written to %s/%s%s.\n", bcInfo->cover_fnames[i], bcInfo->cover_fnames[j],
+			bcInfo->output_dir, DEFAULT_ENCODED_FILE_PREFIX, get_cover_base_name(bcInfo->cover_fnames[i]));
+		return e_failure;
+	    }
+    return e_success;
+}
+
+/*
+ * Function to get the output file name for a cover image.
+ *
+ * The output keeps the base name of the cover, with DEFAULT_ENCODED_FILE_PREFIX
+ * in front of it, and is placed into the output directory.
+ *
+ * CAUTION: The output character array is allocated from the arena, or from the
+ * heap without one, and must be given back with arena_release() at a later
+ * point in time.
+ *
+ * INPUTS: The output directory, the cover file name and the arena (may be NULL).
+ *
+ * RETURNS: A character pointer to the output file name character array.
+ */
+char *get_broadcast_output_filename(const char *output_dir, const char *cover_fname, Arena *arena)
+{
+    if(!output_dir || !cover_fname)
+    {
+	FATAL_ERR_MSG;
+	return NULL;
+    }
+
+    const char *base_name = get_cover_base_name(cover_fname);
+    char *ofile_name = arena_alloc(arena, strlen(output_dir) + 1 + strlen(DEFAULT_ENCODED_FILE_PREFIX) + strlen(base_name) + 1);
+    if(!ofile_name)
+	return NULL;
+    strcpy(ofile_name, output_dir);
+    strcat(ofile_name, "/");
+    strcat(ofile_name, DEFAULT_ENCODED_FILE_PREFIX);
+    strcat(ofile_name, base_name);
+    return ofile_name;
+}
+
+/*
+ * Function to embed an expanded message into a cover image.
+ *
+ * The header of the cover is copied and parsed on the way, the message
+ * bits are blended into the carriers of the pixel rows with one vectorized
+ * pass per row, and the rest of the image is copied as it is, all in one
+ * forward read of the cover. With --verify the carriers are read back
+ * before they are written out and checked against the message. The stego
+ * image is written under its temporary name and renamed once complete, so
+ * a failure, a failed check or a crash never leaves a partial image under
+ * the real name; one left unfinished by a failure is removed.
+ *
+ * INPUTS: The options, the cover and stego image file names, the message
+ * bits (with LSB_KERNEL_SLACK bytes after them), the message length and
+ * the arena the scratch memory comes from (may be NULL).
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status embed_message_bits(const StegOptions *options, const char *cover_fname, const char *stego_fname, const unsigned char *message_bits, uint message_len, Arena *arena)
+{
+    if(!options || !cover_fname || !stego_fname || !message_bits)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    TelemetryJob telemetry;
+    telemetry_job_begin(&telemetry, e_telemetry_batch);
+    char *temp_fname = get_temp_output_filename(stego_fname, arena);
+    FILE *fptr_src = temp_fname? open_image_stream(cover_fname, "rb", options->direct_io, arena): NULL;
+    FILE *fptr_dest = fptr_src? open_image_stream(temp_fname, "wb", options->direct_io, arena): NULL;
+    void *src_stream_buf, *dest_stream_buf;
+    set_stream_block_buffer(fptr_src, &src_stream_buf, arena);
+    set_stream_block_buffer(fptr_dest, &dest_stream_buf, arena);
+    BmpImage bmp_image;
+    LsbCursor cursor;
+    memset(&cursor, 0, sizeof(cursor));
+    Status status = e_failure;
+
+    if(fptr_src && fptr_dest)
+	telemetry_job_stage(&telemetry, e_telemetry_embed);
+    if(!fptr_src || !fptr_dest)
+    {
+	perror("fopen");
+	fprintf(stderr, "ERROR: Unable to open file %s\n", fptr_src? stego_fname: cover_fname);
+    }
+    else if(copy_bmp_header(fptr_src, fptr_dest, &bmp_image) == e_failure || lsb_check_image_support(&bmp_image, options->skip_alpha) == e_failure)
+	fprintf(stderr, "%s: unsupported image.\n", cover_fname);
+    else if(lsb_image_capacity(&bmp_image, options->skip_alpha) < message_len)
+	fprintf(stderr, "%s: image not large enough to hold the encoded data.\n", cover_fname);
+    else if(lsb_cursor_init(&cursor, &bmp_image, fptr_src, fptr_dest, options->skip_alpha, arena) == e_success &&
+	    lsb_cursor_use_options_key(&cursor, options) == e_success &&
+	    (!options->verify || lsb_cursor_enable_verify(&cursor) == e_success) &&
+	    lsb_cursor_write_bits(&cursor, message_bits, (size_t)message_len * 8) == e_success &&
+	    lsb_cursor_flush(&cursor) == e_success &&
+	    (!options->verify || lsb_cursor_check_verify(&cursor) == e_success) &&
+	    copy_remaining_img_data(fptr_src, fptr_dest, NULL) == e_success)
+	status = e_success;
+
+    lsb_cursor_free(&cursor);
+    if(status == e_success)
+	telemetry_job_stage(&telemetry, e_telemetry_commit);
+    if(fptr_src)
+	fclose(fptr_src);
+    if(fptr_dest && fclose(fptr_dest))
+	status = e_failure;
+    arena_release(arena, src_stream_buf);
+    arena_release(arena, dest_stream_buf);
+    if(status == e_success && rename(temp_fname, stego_fname))
+    {
+	FILE_WRITE_ERR;
+	status = e_failure;
+    }
+    if(status == e_failure && temp_fname)
+	remove(temp_fname);
+    arena_release(arena, temp_fname);
+    if(status == e_success)
+    {
+	telemetry.bytes = message_len;
+	telemetry_job_stage(&telemetry, e_telemetry_done);
+    }
+    telemetry_job_end(&telemetry);
+    return status;
+}
+
+/*
+ * Function to embed the expanded message into one cover image.
+ *
+ * The stego image goes into the output directory, and the message bits
+ * are blended in with embed_message_bits(). Nothing about the message is
+ * recomputed per cover.
+ *
+ * INPUTS: The BroadcastInfo object, whose message bits are ready, the
+ * cover file name and the arena of the worker (may be NULL).
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status broadcast_to_cover(const BroadcastInfo *bcInfo, const char *cover_fname, Arena *arena)
+{
+    if(!bcInfo || !cover_fname || !bcInfo->message_bits)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    char *stego_fname = get_broadcast_output_filename(bcInfo->output_dir, cover_fname, arena);
+    if(!stego_fname)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    Status status = embed_message_bits(&bcInfo->options, cover_fname, stego_fname, bcInfo->message_bits, bcInfo->message_len, arena);
+    if(status == e_success)
+	printf("Output file: %s\n", stego_fname);
+    arena_release(arena, stego_fname);
+    return status;
+}
+
+/*
+ * Function to open the journal of a broadcast. The batch is named after
+ * the size and modification time of the secret, the options that change
+ * the stego images and a fingerprint of the key, so that a journal is only
+ * ever resumed by the same broadcast.
+ */
+static Status open_broadcast_journal(BroadcastInfo *bcInfo)
+{
+    struct stat st;
+    if(stat(bcInfo->secret_fname, &st) < 0)
+    {
+	perror("stat");
+	return e_failure;
+    }
+
+    // Without a key, the hash of no bytes stands for it.
+    const StegKey *key = bcInfo->options.key;
+    unsigned char fingerprint[CHACHA20_HASH_SIZE];
+    chacha20_hash(BROADCAST_JOURNAL_DOMAIN, key? key->key_id: NULL, key? sizeof(key->key_id): 0, fingerprint);
+    char fingerprint_hex[2 * BROADCAST_KEY_HASH_BYTES + 1];
+    for(int i = 0; i < BROADCAST_KEY_HASH_BYTES; ++i)
+	sprintf(fingerprint_hex + 2 * i, "%02x", fingerprint[i]);
+
+    char batch_name[128];
+    snprintf(batch_name, sizeof(batch_name), "broadcast %lld %lld.%09ld a%d f%u e%d k%s", (long long)st.st_size, (long long)st.st_mtim.tv_sec,
+	    (long)st.st_mtim.tv_nsec, bcInfo->options.skip_alpha, bcInfo->options.fec_parity, bcInfo->options.encrypt, fingerprint_hex);
+    if(open_batch_journal(&bcInfo->journal, bcInfo->options.journal_file, batch_name, bcInfo->output_dir) == e_failure)
+	return e_failure;
+    bcInfo->journaled = 1;
+    printf("Journal loaded: %u covers done\n", bcInfo->journal.done_count);
+    return e_success;
+}
+
+/*
+ * Function run by each broadcast worker thread: takes covers off the shared
+ * list until none are left. The scratch memory of each cover comes from
+ * the worker's arena, reset after every cover, so once the first cover is
+ * done the covers of the same shape no longer allocate.
+ */
+static void *broadcast_worker_main(void *arg)
+{
+    BroadcastInfo *bcInfo = arg;
+    Arena arena;
+    arena_init(&arena);
+    while(1)
+    {
+	pthread_mutex_lock(&bcInfo->lock);
+	uint index = bcInfo->next_cover++;
+	pthread_mutex_unlock(&bcInfo->lock);
+	if(index >= bcInfo->cover_count)
+	    break;
+
+	const char *cover_fname = bcInfo->cover_fnames[index];
+	if(bcInfo->journaled && batch_journal_has_job(&bcInfo->journal, cover_fname))
+	{
+	    pthread_mutex_lock(&bcInfo->lock);
+	    ++bcInfo->skipped_covers;
+	    pthread_mutex_unlock(&bcInfo->lock);
+	}
+	else if(broadcast_to_cover(bcInfo, cover_fname, &arena) == e_failure ||
+		(bcInfo->journaled && batch_journal_record_job(&bcInfo->journal, cover_fname) == e_failure))
+	{
+	    pthread_mutex_lock(&bcInfo->lock);
+	    ++bcInfo->failed_covers;
+	    pthread_mutex_unlock(&bcInfo->lock);
+	}
+	arena_reset(&arena);
+    }
+    arena_free(&arena);
+    return NULL;
+}
+
+/*
+ * Function to embed one secret into every cover image.
+ *
+ * The secret is read once and the encoded message, header included, is
+ * built and expanded into LSB bits once. A pool of worker threads (--workers,
+ * default DEFAULT_BROADCAST_WORKERS, never more than the covers) then blends
+ * that mask into the covers in parallel. A cover that fails is reported and
+ * skipped; the others are still produced.
+ *
+ * With --journal, the covers done are recorded in a batch journal (see
+ * journal.h) named after the secret and the options, and a rerun after a
+ * crash skips the covers it records, at the cost of one hash lookup each.
+ * Since every stego image only gets its real name once complete, the
+ * covers that were in progress are simply done again.
+ *
+ * INPUTS: Pointer to BroadcastInfo object.
+ *
+ * RETURNS: e_success if every cover was produced, e_failure otherwise.
+ */
+Status do_broadcast(BroadcastInfo *bcInfo)
+{
+    if(!bcInfo)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    FILE *fptr_secret = fopen(bcInfo->secret_fname, "rb");
+    if(!fptr_secret)
+    {
+	perror("fopen");
+	fprintf(stderr, "ERROR: Unable to open file %s\n", bcInfo->secret_fname);
+	return e_failure;
+    }
+    Status message_status = build_encoded_message(bcInfo->secret_fname, fptr_secret, &bcInfo->options, &bcInfo->message, &bcInfo->message_len, NULL);
+    fclose(fptr_secret);
+    if(message_status == e_failure)
+    {
+	fprintf(stderr, "Secret message preparation failed.\n");
+	return e_failure;
+    }
+
+    bcInfo->message_bits = malloc((size_t)bcInfo->message_len * 8 + LSB_KERNEL_SLACK);
+    if(!bcInfo->message_bits)
+    {
+	FATAL_ERR_MSG;
+	free(bcInfo->message);
+	return e_failure;
+    }
+    if(bcInfo->options.journal_file && open_broadcast_journal(bcInfo) == e_failure)
+    {
+	free(bcInfo->message_bits);
+	free(bcInfo->message);
+	return e_failure;
+    }
+    lsb_expand_bits(bcInfo->message, bcInfo->message_len, bcInfo->message_bits);
+    memset(bcInfo->message_bits + (size_t)bcInfo->message_len * 8, 0, LSB_KERNEL_SLACK);
+    printf("Secret message expanded: %u bytes\n", bcInfo->message_len);
+
+    uint worker_count = bcInfo->options.workers? bcInfo->options.workers: DEFAULT_BROADCAST_WORKERS;
+    if(worker_count > bcInfo->cover_count)
+	worker_count = bcInfo->cover_count;
+    pthread_t *workers = malloc(worker_count * sizeof(pthread_t));
+    pthread_mutex_init(&bcInfo->lock, NULL);
+
+    uint started = 0;
+    for(; workers && started < worker_count; ++started)
+	if(pthread_create(&workers[started], NULL, broadcast_worker_main, bcInfo))
+	    break;
+    // With no thread at all, the covers are done on this one.
+    if(!started)
+	broadcast_worker_main(bcInfo);
+    for(uint i = 0; i < started; ++i)
+	pthread_join(workers[i], NULL);
+
+    pthread_mutex_destroy(&bcInfo->lock);
+    free(workers);
+    if(bcInfo->journaled)
+    {
+	if(close_batch_journal(&bcInfo->journal) == e_failure)
+	    fprintf(stderr, "Journal %s could not be completed, some covers will be done again.\n", bcInfo->options.journal_file);
+	printf("Covers already done by an earlier run: %u\n", bcInfo->skipped_covers);
+    }
+    free(bcInfo->message_bits);
+    free(bcInfo->message);
+    bcInfo->message_bits = NULL;
+    bcInfo->message = NULL;
+
+    if(bcInfo->failed_covers)
+    {
+	fprintf(stderr, "%u of %u covers failed.\n", bcInfo->failed_covers, bcInfo->cover_count);
+	return e_failure;
+    }
+    return e_success;
+}
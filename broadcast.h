@@ -0,0 +1,66 @@
+#ifndef BROADCAST_H
+#define BROADCAST_H
+
+#include <pthread.h>
+#include "types.h" 	// Contains user defined types
+#include "common.h"	// Contains common strings
+#include "error.h"	// Contains standard error messages
+#include "journal.h"	// Contains the batch journal
+
+/* Worker threads used for broadcasting unless --workers says otherwise */
+#define DEFAULT_BROADCAST_WORKERS 4
+
+/* Domain of the key fingerprint in the journal batch name, and the bytes of it kept */
+#define BROADCAST_JOURNAL_DOMAIN "steg-journal-v2"
+#define BROADCAST_KEY_HASH_BYTES 8
+
+/*
+ * Structure to store a broadcast job: one secret embedded into many cover
+ * images. The encoded message is expanded into LSB bits once, and the
+ * resulting mask is blended into every cover by the worker threads, which
+ * take covers one at a time through next_cover. With --journal, covers
+ * recorded as done by an earlier run are skipped.
+ */
+typedef struct _BroadcastInfo
+{
+    const char *secret_fname;
+    const char *output_dir;
+    char **cover_fnames;		// NULL terminated list of cover images
+    uint cover_count;
+    StegOptions options;
+
+    /* The encoded message and its expanded bits, shared read-only */
+    unsigned char *message;
+    uint message_len;
+    unsigned char *message_bits;	// message_len * 8 bits + slack
+
+    /* Work distribution between the workers */
+    pthread_mutex_t lock;
+    uint next_cover;
+    uint failed_covers;
+    uint skipped_covers;
+
+    /* Completed covers, with --journal */
+    BatchJournal journal;
+    int journaled;
+
+} BroadcastInfo;
+
+/* Broadcast function prototypes */
+
+/* Read and validate the broadcast args from argv */
+Status read_and_validate_broadcast_args(char *argv[], BroadcastInfo *bcInfo);
+
+/* Embed the secret into every cover */
+Status do_broadcast(BroadcastInfo *bcInfo);
+
+/* Embed an expanded message into a cover, writing the stego image */
+Status embed_message_bits(const StegOptions *options, const char *cover_fname, const char *stego_fname, const unsigned char *message_bits, uint message_len, Arena *arena);
+
+/* Embed the expanded message into one cover */
+Status broadcast_to_cover(const BroadcastInfo *bcInfo, const char *cover_fname, Arena *arena);
+
+/* Get the output file name for a cover */
+char *get_broadcast_output_filename(const char *output_dir, const char *cover_fname, Arena *arena);
+
+#endif
@@ -0,0 +1,379 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/random.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "chacha20.h"
+#include "types.h"
+#include "error.h"
+
+/* Function Definitions */
+
+/*
+ * Function to read a little endian 32 bit word.
+ */
+static uint32_t load_le32(const unsigned char *buf)
+{
+    return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+#if defined(__SSE2__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+/*
+ * Function to rotate each 32 bit lane left by n bits.
+ */
+#define CHACHA20_ROTL(v, n) _mm_or_si128(_mm_slli_epi32((v), (n)), _mm_srli_epi32((v), 32 - (n)))
+
+/*
+ * Function to run the quarter round on the four columns at once, one
+ * 32 bit lane per column.
+ */
+#define CHACHA20_QUARTER_ROUNDS(a, b, c, d) \
+    do \
+    { \
+	a = _mm_add_epi32(a, b); d = _mm_xor_si128(d, a); d = CHACHA20_ROTL(d, 16); \
+	c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c); b = CHACHA20_ROTL(b, 12); \
+	a = _mm_add_epi32(a, b); d = _mm_xor_si128(d, a); d = CHACHA20_ROTL(d, 8); \
+	c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c); b = CHACHA20_ROTL(b, 7); \
+    } while(0)
+#endif
+
+/*
+ * Function to compute one ChaCha20 keystream block.
+ *
+ * The 16 word state is run through 20 rounds and added to the input. With
+ * SSE2 each row of the 4x4 state lives in a vector register, so a column
+ * round is four quarter rounds at once; the rows are rotated with shuffles
+ * to turn the diagonals into columns for the diagonal rounds.
+ *
+ * INPUTS: The input block (constants, key, counter and nonce) and the
+ * output keystream block.
+ *
+ * RETURNS: Nothing.
+ */
+void chacha20_block(const uint32_t input[16], unsigned char output[CHACHA20_BLOCK_SIZE])
+{
+    if(!input || !output)
+    {
+	FATAL_ERR_MSG;
+	return;
+    }
+
+#if defined(__SSE2__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    __m128i row0 = _mm_loadu_si128((const __m128i *)(input + 0));
+    __m128i row1 = _mm_loadu_si128((const __m128i *)(input + 4));
+    __m128i row2 = _mm_loadu_si128((const __m128i *)(input + 8));
+    __m128i row3 = _mm_loadu_si128((const __m128i *)(input + 12));
+    __m128i a = row0, b = row1, c = row2, d = row3;
+    for(int i = 0; i < 10; ++i)
+    {
+	CHACHA20_QUARTER_ROUNDS(a, b, c, d);
+	b = _mm_shuffle_epi32(b, _MM_SHUFFLE(0, 3, 2, 1));
+	c = _mm_shuffle_epi32(c, _MM_SHUFFLE(1, 0, 3, 2));
+	d = _mm_shuffle_epi32(d, _MM_SHUFFLE(2, 1, 0, 3));
+	CHACHA20_QUARTER_ROUNDS(a, b, c, d);
+	b = _mm_shuffle_epi32(b, _MM_SHUFFLE(2, 1, 0, 3));
+	c = _mm_shuffle_epi32(c, _MM_SHUFFLE(1, 0, 3, 2));
+	d = _mm_shuffle_epi32(d, _MM_SHUFFLE(0, 3, 2, 1));
+    }
+    _mm_storeu_si128((__m128i *)(output + 0), _mm_add_epi32(a, row0));
+    _mm_storeu_si128((__m128i *)(output + 16), _mm_add_epi32(b, row1));
+    _mm_storeu_si128((__m128i *)(output + 32), _mm_add_epi32(c, row2));
+    _mm_storeu_si128((__m128i *)(output + 48), _mm_add_epi32(d, row3));
+#else
+    uint32_t x[16];
+    memcpy(x, input, sizeof(x));
+#define CHACHA20_ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define CHACHA20_QUARTER_ROUND(a, b, c, d) \
+    do \
+    { \
+	x[a] += x[b]; x[d] ^= x[a]; x[d] = CHACHA20_ROTL32(x[d], 16); \
+	x[c] += x[d]; x[b] ^= x[c]; x[b] = CHACHA20_ROTL32(x[b], 12); \
+	x[a] += x[b]; x[d] ^= x[a]; x[d] = CHACHA20_ROTL32(x[d], 8); \
+	x[c] += x[d]; x[b] ^= x[c]; x[b] = CHACHA20_ROTL32(x[b], 7); \
+    } while(0)
+    for(int i = 0; i < 10; ++i)
+    {
+	CHACHA20_QUARTER_ROUND(0, 4, 8, 12);
+	CHACHA20_QUARTER_ROUND(1, 5, 9, 13);
+	CHACHA20_QUARTER_ROUND(2, 6, 10, 14);
+	CHACHA20_QUARTER_ROUND(3, 7, 11, 15);
+	CHACHA20_QUARTER_ROUND(0, 5, 10, 15);
+	CHACHA20_QUARTER_ROUND(1, 6, 11, 12);
+	CHACHA20_QUARTER_ROUND(2, 7, 8, 13);
+	CHACHA20_QUARTER_ROUND(3, 4, 9, 14);
+    }
+    for(int i = 0; i < 16; ++i)
+    {
+	uint32_t word = x[i] + input[i];
+	output[4 * i + 0] = word & 0xFF;
+	output[4 * i + 1] = (word >> 8) & 0xFF;
+	output[4 * i + 2] = (word >> 16) & 0xFF;
+	output[4 * i + 3] = (word >> 24) & 0xFF;
+    }
+#endif
+}
+
+/*
+ * Function to set up a ChaCha20 stream.
+ *
+ * INPUTS: The stream, the 256 bit key, the 96 bit nonce and the counter of
+ * the first block.
+ *
+ * RETURNS: Nothing.
+ */
+void chacha20_init(ChaCha20 *cipher, const unsigned char key[CHACHA20_KEY_SIZE], const unsigned char nonce[CHACHA20_NONCE_SIZE], uint32_t counter)
+{
+    if(!cipher || !key || !nonce)
+    {
+	FATAL_ERR_MSG;
+	return;
+    }
+
+    // "expand 32-byte k"
+    cipher->input[0] = 0x61707865;
+    cipher->input[1] = 0x3320646E;
+    cipher->input[2] = 0x79622D32;
+    cipher->input[3] = 0x6B206574;
+    for(int i = 0; i < 8; ++i)
+	cipher->input[4 + i] = load_le32(key + 4 * i);
+    cipher->input[12] = counter;
+    cipher->first_counter = counter;
+    for(int i = 0; i < 3; ++i)
+	cipher->input[13 + i] = load_le32(nonce + 4 * i);
+    cipher->keystream_pos = CHACHA20_BLOCK_SIZE;
+}
+
+/*
+ * Function to move a stream to a byte offset from its start, so that data
+ * can be decrypted from anywhere without going through what precedes it.
+ * The keystream block holding the offset is computed straight away.
+ *
+ * INPUTS: The stream and the byte offset.
+ *
+ * RETURNS: Nothing.
+ */
+void chacha20_seek(ChaCha20 *cipher, uint64_t offset)
+{
+    if(!cipher)
+    {
+	FATAL_ERR_MSG;
+	return;
+    }
+
+    cipher->input[12] = cipher->first_counter + (uint32_t)(offset / CHACHA20_BLOCK_SIZE);
+    chacha20_block(cipher->input, cipher->keystream);
+    ++cipher->input[12];
+    cipher->keystream_pos = offset % CHACHA20_BLOCK_SIZE;
+}
+
+/*
+ * Function to XOR the keystream into data, which encrypts plain data and
+ * decrypts encrypted data. Successive calls continue the keystream, so the
+ * data can be processed in pieces of any size.
+ *
+ * INPUTS: The stream, the data and its length.
+ *
+ * RETURNS: Nothing.
+ */
+void chacha20_xor(ChaCha20 *cipher, unsigned char *data, size_t len)
+{
+    if(!cipher || (!data && len))
+    {
+	FATAL_ERR_MSG;
+	return;
+    }
+
+    while(len)
+    {
+	if(cipher->keystream_pos == CHACHA20_BLOCK_SIZE)
+	{
+	    chacha20_block(cipher->input, cipher->keystream);
+	    ++cipher->input[12];
+	    cipher->keystream_pos = 0;
+	}
+
+	size_t chunk = CHACHA20_BLOCK_SIZE - cipher->keystream_pos;
+	if(chunk > len)
+	    chunk = len;
+	const unsigned char *keystream = cipher->keystream + cipher->keystream_pos;
+	size_t i = 0;
+#if defined(__SSE2__)
+	for(; i + 16 <= chunk; i += 16)
+	{
+	    __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+	    __m128i k = _mm_loadu_si128((const __m128i *)(keystream + i));
+	    _mm_storeu_si128((__m128i *)(data + i), _mm_xor_si128(v, k));
+	}
+#endif
+	for(; i < chunk; ++i)
+	    data[i] ^= keystream[i];
+	cipher->keystream_pos += chunk;
+	data += chunk;
+	len -= chunk;
+    }
+}
+
+/*
+ * Function to hash data of any length into CHACHA20_HASH_SIZE bytes.
+ *
+ * This is a sponge over the ChaCha20 block function: the state is one
+ * input block, whose 32 key bytes are the rate and whose constant, counter
+ * and nonce words are the capacity. It starts as the ChaCha20 constants, a
+ * zero key and the domain string, so that hashes made for different uses
+ * never agree. The data is absorbed CHACHA20_HASH_RATE bytes at a time,
+ * XORed into the key words before each block, the block output becoming
+ * the next state; the last piece is padded with 0x80 and zeros, in a block
+ * of its own when the data fills whole pieces. The digest is the key words
+ * of the final state.
+ *
+ * Every byte of the data goes through its own 20 rounds, chained with all
+ * the bytes before it, so unlike folding the data into 32 bytes, changes
+ * can not cancel out across positions.
+ *
+ * INPUTS: The domain string (at most CHACHA20_DOMAIN_SIZE bytes are used),
+ * the data, its length and the output digest.
+ *
+ * RETURNS: Nothing.
+ */
+void chacha20_hash(const char *domain, const unsigned char *data, size_t len, unsigned char digest[CHACHA20_HASH_SIZE])
+{
+    if(!domain || (!data && len) || !digest)
+    {
+	FATAL_ERR_MSG;
+	return;
+    }
+
+    unsigned char domain_block[CHACHA20_DOMAIN_SIZE] = {0};
+    size_t domain_len = strlen(domain);
+    memcpy(domain_block, domain, domain_len < sizeof(domain_block)? domain_len: sizeof(domain_block));
+    uint32_t state[16] = { 0x61707865, 0x3320646E, 0x79622D32, 0x6B206574 };
+    for(int i = 0; i < 4; ++i)
+	state[12 + i] = load_le32(domain_block + 4 * i);
+
+    unsigned char piece[CHACHA20_HASH_RATE];
+    unsigned char block[CHACHA20_BLOCK_SIZE];
+    for(size_t pos = 0;;)
+    {
+	size_t piece_len = len - pos < CHACHA20_HASH_RATE? len - pos: CHACHA20_HASH_RATE;
+	memset(piece, 0, sizeof(piece));
+	if(piece_len)
+	    memcpy(piece, data + pos, piece_len);
+	if(piece_len < CHACHA20_HASH_RATE)
+	    piece[piece_len] = 0x80;
+	for(int i = 0; i < 8; ++i)
+	    state[4 + i] ^= load_le32(piece + 4 * i);
+	chacha20_block(state, block);
+	for(int i = 0; i < 16; ++i)
+	    state[i] = load_le32(block + 4 * i);
+	pos += piece_len;
+	if(piece_len < CHACHA20_HASH_RATE)
+	    break;
+    }
+
+    memcpy(digest, block + 16, CHACHA20_HASH_SIZE);
+    memset(piece, 0, sizeof(piece));
+    memset(block, 0, sizeof(block));
+    memset(state, 0, sizeof(state));
+}
+
+/*
+ * Function to derive a 256 bit cipher key from a key of any length, as
+ * its chacha20_hash() in the CHACHA20_CIPHER_DOMAIN. This keeps the cipher
+ * key apart from the other values derived from the same key.
+ *
+ * INPUTS: The key, its length and the output cipher key.
+ *
+ * RETURNS: Nothing.
+ */
+void chacha20_derive_key(const unsigned char *key, size_t key_len, unsigned char cipher_key[CHACHA20_KEY_SIZE])
+{
+    if(!key || !cipher_key)
+    {
+	FATAL_ERR_MSG;
+	return;
+    }
+
+    chacha20_hash(CHACHA20_CIPHER_DOMAIN, key, key_len, cipher_key);
+}
+
+/*
+ * Function to derive the seed of the keyed spreading from a key of any
+ * length: the first 8 bytes of its chacha20_hash() in the
+ * CHACHA20_SPREAD_DOMAIN, little endian.
+ *
+ * INPUTS: The key and its length.
+ *
+ * RETURNS: The seed.
+ */
+uint64_t chacha20_derive_spread_seed(const unsigned char *key, size_t key_len)
+{
+    if(!key)
+    {
+	FATAL_ERR_MSG;
+	return 0;
+    }
+
+    unsigned char digest[CHACHA20_HASH_SIZE];
+    chacha20_hash(CHACHA20_SPREAD_DOMAIN, key, key_len, digest);
+    uint64_t seed = load_le32(digest) | (uint64_t)load_le32(digest + 4) << 32;
+    memset(digest, 0, sizeof(digest));
+    return seed;
+}
+
+/*
+ * Function to set up a ChaCha20 stream with the cipher key derived from
+ * the key given by the options (see load_options_key()). Unlike keyed
+ * spreading, encryption needs a key.
+ *
+ * INPUTS: The stream, the options and the nonce.
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status chacha20_init_from_options(ChaCha20 *cipher, const StegOptions *options, const unsigned char nonce[CHACHA20_NONCE_SIZE])
+{
+    if(!cipher || !options || !nonce)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    if(!options->key)
+    {
+	fprintf(stderr, "Encryption needs a key: use %s or set %s.\n", KEY_FILE_ARG, STEG_KEY_ENV);
+	return e_failure;
+    }
+
+    chacha20_init(cipher, options->key->cipher_key, nonce, 1);
+    return e_success;
+}
+
+/*
+ * Function to fill a buffer with random bytes from the kernel.
+ *
+ * INPUTS: The buffer and its length.
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status fill_random_bytes(unsigned char *buffer, size_t len)
+{
+    if(!buffer)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    while(len)
+    {
+	ssize_t got = getrandom(buffer, len, 0);
+	if(got <= 0)
+	{
+	    perror("getrandom");
+	    return e_failure;
+	}
+	buffer += got;
+	len -= got;
+    }
+    return e_success;
+}
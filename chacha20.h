@@ -0,0 +1,70 @@
+#ifndef CHACHA20_H
+#define CHACHA20_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "types.h" 	// Contains user defined types
+#include "common.h"	// Contains common strings
+#include "error.h"	// Contains standard error messages
+
+/* ChaCha20 (RFC 8439) sizes, in bytes */
+#define CHACHA20_KEY_SIZE 32
+#define CHACHA20_NONCE_SIZE 12
+#define CHACHA20_BLOCK_SIZE 64
+
+/* Digest size of chacha20_hash(), and bytes it absorbs per block */
+#define CHACHA20_HASH_SIZE 32
+#define CHACHA20_HASH_RATE 32
+
+/* Room for the domain string of chacha20_hash(), which keeps the keys derived for different uses apart */
+#define CHACHA20_DOMAIN_SIZE 16
+
+/* Domains of the values derived from the steg key */
+#define CHACHA20_CIPHER_DOMAIN "steg-cipher-v2"
+#define CHACHA20_SPREAD_DOMAIN "steg-spread-v2"
+#define CHACHA20_KEY_ID_DOMAIN "steg-key-id-v2"
+
+/*
+ * Structure to store the state of a ChaCha20 stream: the input block of
+ * the next keystream block and the unused part of the current one, so
+ * that data can be encrypted in pieces of any size.
+ */
+typedef struct _ChaCha20
+{
+    uint32_t input[16];
+    unsigned char keystream[CHACHA20_BLOCK_SIZE];
+    uint keystream_pos;		// Next unused keystream byte
+    uint32_t first_counter;	// Block counter at the start of the stream
+
+} ChaCha20;
+
+/* ChaCha20 function prototypes */
+
+/* Compute one keystream block */
+void chacha20_block(const uint32_t input[16], unsigned char output[CHACHA20_BLOCK_SIZE]);
+
+/* Set up a stream with a key, a nonce and the first block counter */
+void chacha20_init(ChaCha20 *cipher, const unsigned char key[CHACHA20_KEY_SIZE], const unsigned char nonce[CHACHA20_NONCE_SIZE], uint32_t counter);
+
+/* Move to a byte offset of the keystream */
+void chacha20_seek(ChaCha20 *cipher, uint64_t offset);
+
+/* Encrypt or decrypt data in place */
+void chacha20_xor(ChaCha20 *cipher, unsigned char *data, size_t len);
+
+/* Hash data of any length, under a domain string */
+void chacha20_hash(const char *domain, const unsigned char *data, size_t len, unsigned char digest[CHACHA20_HASH_SIZE]);
+
+/* Derive a cipher key from a key of any length */
+void chacha20_derive_key(const unsigned char *key, size_t key_len, unsigned char cipher_key[CHACHA20_KEY_SIZE]);
+
+/* Derive the seed of the keyed spreading from a key of any length */
+uint64_t chacha20_derive_spread_seed(const unsigned char *key, size_t key_len);
+
+/* Set up a stream from the key given by the options */
+Status chacha20_init_from_options(ChaCha20 *cipher, const StegOptions *options, const unsigned char nonce[CHACHA20_NONCE_SIZE]);
+
+/* Fill a buffer with random bytes, for nonces */
+Status fill_random_bytes(unsigned char *buffer, size_t len);
+
+#endif
@@ -1,8 +1,21 @@
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include "common.h"
+#include "chacha20.h"
+#include "fec.h"
+#include "throttle.h"
+#include "telemetry.h"
+#include "trace.h"
 #include "types.h"
 
+/* Key material of the run, derived by read_steg_options() */
+static StegKey run_key;
+
 /*
  * Function to find the file extension of a given filename.
  *
@@ -14,6 +27,9 @@
  *
  * INPUTS: The file name pointer and the file extension pointer.
  *
+ * Data read from standard input (STDIO_FILE_NAME) has no name to take the
+ * extension from, so it is given STDIN_SECRET_EXTN.
+ *
  * CAUTION: The file pointer has to point to a character array that is 
  * MAX_FILE_SUFFIX characters long.
  *
@@ -27,6 +43,12 @@ Status get_file_extension(const char *file_name, char *file_extension)
 	return e_failure;
     }
 
+    if(is_stdio_file_name(file_name))
+    {
+	strcpy(file_extension, STDIN_SECRET_EXTN);
+	return e_success;
+    }
+
     char *extn_start = strstr(file_name, ".");
     if(!extn_start)
     {
@@ -46,25 +68,656 @@ Status get_file_extension(const char *file_name, char *file_extension)
 }
 
 /*
- * Function to get the image pixel data offset in bmp files.
+ * Function to check if a file name given by the user stands for the
+ * standard input or output.
+ *
+ * INPUTS: The file name.
+ *
+ * RETURNS: 1 for STDIO_FILE_NAME, 0 otherwise.
+ */
+int is_stdio_file_name(const char *file_name)
+{
+    return file_name && !strcmp(file_name, STDIO_FILE_NAME);
+}
+
+/*
+ * Function to open a data file, where STDIO_FILE_NAME means the standard
+ * input for reading and the standard output for writing.
+ *
+ * When the standard output is taken for data, the stream returned writes
+ * to a duplicate of it and the standard output itself is pointed at the
+ * standard error, so the progress messages printed by the encoding and
+ * decoding stages can not end up in the data.
+ *
+ * INPUTS: The file name and the fopen() mode.
+ *
+ * RETURNS: The opened stream, or NULL on errors.
+ */
+FILE *open_data_stream(const char *file_name, const char *mode)
+{
+    if(!file_name || !mode)
+    {
+	FATAL_ERR_MSG;
+	return NULL;
+    }
+
+    if(!is_stdio_file_name(file_name))
+	return fopen(file_name, mode);
+    if(mode[0] == 'r')
+	return stdin;
+
+    // Messages still buffered in stdout are flushed only after the switch,
+    // so they go to the standard error as well.
+    int data_fd = dup(STDOUT_FILENO);
+    if(data_fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0)
+    {
+	if(data_fd >= 0)
+	    close(data_fd);
+	return NULL;
+    }
+    fflush(stdout);
+
+    FILE *fptr = fdopen(data_fd, mode);
+    if(!fptr)
+	close(data_fd);
+    return fptr;
+}
+
+/*
+ * Function to create the temporary file of an output: the output is
+ * written under this name and renamed to its real name once complete, so
+ * that a crash or a failure never leaves a partial file under the real
+ * name. The name is the output name followed by TEMP_OUTPUT_RANDOM_BYTES
+ * random bytes in hex and TEMP_OUTPUT_SUFFIX, and the file is created with
+ * O_EXCL, so that writers of the same output never share a temporary file
+ * and no existing file is ever truncated. The file is created empty, with
+ * the usual mode, for the caller to open for writing.
+ *
+ * CAUTION: The name is allocated from the arena, or from the heap without
+ * one, and must be given back with arena_release() by the caller, who must
+ * also remove the file unless it is renamed.
+ *
+ * INPUTS: The output file name and the arena (may be NULL).
+ *
+ * RETURNS: The temporary file name, or NULL on errors.
+ */
+char *get_temp_output_filename(const char *file_name, Arena *arena)
+{
+    if(!file_name)
+    {
+	FATAL_ERR_MSG;
+	return NULL;
+    }
+
+    size_t name_len = strlen(file_name);
+    char *temp_name = arena_alloc(arena, name_len + 1 + 2 * TEMP_OUTPUT_RANDOM_BYTES + strlen(TEMP_OUTPUT_SUFFIX) + 1);
+    if(!temp_name)
+	return NULL;
+
+    for(int attempt = 0; attempt < TEMP_OUTPUT_ATTEMPTS; ++attempt)
+    {
+	unsigned char random[TEMP_OUTPUT_RANDOM_BYTES];
+	if(fill_random_bytes(random, sizeof(random)) == e_failure)
+	    break;
+	strcpy(temp_name, file_name);
+	temp_name[name_len] = '.';
+	for(int i = 0; i < TEMP_OUTPUT_RANDOM_BYTES; ++i)
+	    sprintf(temp_name + name_len + 1 + 2 * i, "%02x", random[i]);
+	strcat(temp_name, TEMP_OUTPUT_SUFFIX);
+
+	int fd = open(temp_name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+	if(fd >= 0)
+	{
+	    close(fd);
+	    return temp_name;
+	}
+	if(errno != EEXIST)
+	    break;
+    }
+    perror("open");
+    fprintf(stderr, "ERROR: Unable to create a temporary file for %s\n", file_name);
+    arena_release(arena, temp_name);
+    return NULL;
+}
+
+/*
+ * Function to make sure an input stream can be sized and rewound.
  *
- * This function reads the data offset information bytes in the bmp
- * header and returns it.
+ * Regular files are left alone. A stream that can not seek, such as a pipe,
+ * is read to its end into a memory buffer and replaced by an in-memory
+ * stream over that buffer, so the stages that need the size of the data
+ * before reading it work unchanged. The original stream is closed.
+ *
+ * CAUTION: The buffer returned must be freed after the new stream is closed.
+ *
+ * INPUTS: The stream to check and replace, and where to return the buffer
+ * (NULL when the stream was already seekable).
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status make_stream_seekable(FILE **fptr, void **buffer)
+{
+    if(!fptr || !*fptr || !buffer)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    *buffer = NULL;
+    if(!fseek(*fptr, 0, SEEK_END) && !fseek(*fptr, 0, SEEK_SET))
+	return e_success;
+
+    unsigned char *data = NULL;
+    size_t size = 0, allocated = 0;
+    while(1)
+    {
+	if(size == allocated)
+	{
+	    allocated = allocated? allocated * 2: COPY_BLOCK_SIZE;
+	    unsigned char *grown = realloc(data, allocated);
+	    if(!grown)
+	    {
+		FATAL_ERR_MSG;
+		free(data);
+		return e_failure;
+	    }
+	    data = grown;
+	}
+
+	size_t got = fread(data + size, 1, allocated - size, *fptr);
+	size += got;
+	if(ferror(*fptr))
+	{
+	    FILE_READ_ERR;
+	    free(data);
+	    return e_failure;
+	}
+	if(!got)
+	    break;
+    }
+
+    if(!size)
+    {
+	fprintf(stderr, "The data stream is empty.\n");
+	free(data);
+	return e_failure;
+    }
+
+    FILE *fptr_memory = fmemopen(data, size, "rb");
+    if(!fptr_memory)
+    {
+	perror("fmemopen");
+	free(data);
+	return e_failure;
+    }
+    fclose(*fptr);
+    *fptr = fptr_memory;
+    *buffer = data;
+    return e_success;
+}
+
+/*
+ * Function to move an input stream forward without seeking, so that it
+ * also works on pipes.
  *
- * INPUT: The bmp image file pointer.
+ * INPUTS: The stream and the number of bytes to skip.
  *
- * RETURNS: Pixel data offset if fptr exists, -1 otherwise.
+ * RETURNS: Operation status: e_success or e_failure.
  */
-int get_image_data_offset(FILE *fptr_bmp_image)
+Status skip_stream_bytes(FILE *fptr, uint count)
 {
-    if(!fptr_bmp_image)
+    if(!fptr)
     {
 	FATAL_ERR_MSG;
-	return -1;
+	return e_failure;
+    }
+
+    char buffer[256];
+    while(count)
+    {
+	uint chunk = count < sizeof(buffer)? count: sizeof(buffer);
+	if(fread(buffer, chunk, 1, fptr) != 1)
+	{
+	    FILE_READ_ERR;
+	    return e_failure;
+	}
+	count -= chunk;
+    }
+    return e_success;
+}
+
+/*
+ * Function to read the numeric value following an option argument.
+ *
+ * On success the argument index is moved onto the value, so that the
+ * caller's loop continues after it.
+ */
+static Status read_uint_option_value(char *argv[], int *index, uint *value)
+{
+    const char *option = argv[*index];
+    const char *text = argv[*index + 1];
+    char *end = NULL;
+    unsigned long number = text? strtoul(text, &end, 10): 0;
+    if(!text || end == text || *end || number > 0xFFFFFFFFUL)
+    {
+	fprintf(stderr, "Error: %s needs a numeric value.\n", option);
+	return e_failure;
+    }
+
+    *value = number;
+    ++*index;
+    return e_success;
+}
+
+/*
+ * Function to read the octal permission bits following an option argument.
+ *
+ * On success the argument index is moved onto the value, so that the
+ * caller's loop continues after it.
+ */
+static Status read_mode_option_value(char *argv[], int *index, uint *value)
+{
+    const char *option = argv[*index];
+    const char *text = argv[*index + 1];
+    char *end = NULL;
+    unsigned long number = text? strtoul(text, &end, 8): 0;
+    if(!text || end == text || *end || !number || number > 0777)
+    {
+	fprintf(stderr, "Error: %s needs octal permission bits, such as 600.\n", option);
+	return e_failure;
     }
 
-    int size;
-    fseek(fptr_bmp_image, 10, SEEK_SET);
-    fread(&size, sizeof(int), 1, fptr_bmp_image);
-    return size;
+    *value = number;
+    ++*index;
+    return e_success;
+}
+
+/*
+ * Function to read the text value following an option argument.
+ *
+ * On success the argument index is moved onto the value, so that the
+ * caller's loop continues after it.
+ */
+static Status read_string_option_value(char *argv[], int *index, const char **value)
+{
+    const char *text = argv[*index + 1];
+    if(!text || !*text)
+    {
+	fprintf(stderr, "Error: %s needs a value.\n", argv[*index]);
+	return e_failure;
+    }
+
+    *value = text;
+    ++*index;
+    return e_success;
+}
+
+/*
+ * Function to read the optional arguments given by the user.
+ *
+ * This function scans the argument vector after the encode/decode argument 
+ * for arguments starting with "--", records them in the StegOptions object 
+ * and removes them from the vector. The positional arguments are shifted 
+ * down so the rest of the argument handling sees them at their usual index.
+ * The I/O limits and priority given apply to the whole process from here,
+ * and so do the collection of job stats for --stats-file and the
+ * recording of the trace for --trace. The key is loaded here, once for
+ * the run, and what the jobs need from it is derived into run_key.
+ *
+ * INPUTS: Argument vector from the main() function and the StegOptions
+ *         object to fill in.
+ *
+ * RETURNS: e_success if all options are recognised, e_failure otherwise.
+ */
+Status read_steg_options(char *argv[], StegOptions *options)
+{
+    if(!argv || !options)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    memset(options, 0, sizeof(*options));
+    if(!argv[1])
+	return e_success;
+
+    int out = 2;
+    for(int in = 2; argv[in]; ++in)
+    {
+	if(strncmp(argv[in], "--", 2))
+	{
+	    argv[out++] = argv[in];
+	    continue;
+	}
+
+	if(!strcmp(argv[in], SKIP_ALPHA_ARG))
+	    options->skip_alpha = 1;
+	else if(!strcmp(argv[in], INLINE_ARG))
+	    options->inline_data = 1;
+	else if(!strcmp(argv[in], MEMFD_ARG))
+	    options->fd_passing = 1;
+	else if(!strcmp(argv[in], DIRECT_IO_ARG))
+	    options->direct_io = 1;
+	else if(!strcmp(argv[in], ENCRYPT_ARG))
+	    options->encrypt = 1;
+	else if(!strcmp(argv[in], VERIFY_ARG))
+	    options->verify = 1;
+	else if(!strcmp(argv[in], METRICS_ARG))
+	    options->metrics = 1;
+	else if(!strcmp(argv[in], IDLE_IO_ARG))
+	    options->idle_io = 1;
+	else if(!strcmp(argv[in], MAX_READ_MBPS_ARG))
+	{
+	    if(read_uint_option_value(argv, &in, &options->max_read_mbps) == e_failure)
+		return e_failure;
+	}
+	else if(!strcmp(argv[in], MAX_WRITE_MBPS_ARG))
+	{
+	    if(read_uint_option_value(argv, &in, &options->max_write_mbps) == e_failure)
+		return e_failure;
+	}
+	else if(!strcmp(argv[in], COVER_POOL_ARG))
+	{
+	    if(read_string_option_value(argv, &in, &options->cover_pool) == e_failure)
+		return e_failure;
+	}
+	else if(!strcmp(argv[in], CACHE_DIR_ARG))
+	{
+	    if(read_string_option_value(argv, &in, &options->cache_dir) == e_failure)
+		return e_failure;
+	}
+	else if(!strcmp(argv[in], CACHE_SIZE_ARG))
+	{
+	    if(read_uint_option_value(argv, &in, &options->cache_size_mb) == e_failure)
+		return e_failure;
+	}
+	else if(!strcmp(argv[in], STATS_FILE_ARG))
+	{
+	    if(read_string_option_value(argv, &in, &options->stats_file) == e_failure)
+		return e_failure;
+	}
+	else if(!strcmp(argv[in], STATS_INTERVAL_ARG))
+	{
+	    if(read_uint_option_value(argv, &in, &options->stats_interval) == e_failure)
+		return e_failure;
+	}
+	else if(!strcmp(argv[in], TRACE_ARG))
+	{
+	    if(read_string_option_value(argv, &in, &options->trace_file) == e_failure)
+		return e_failure;
+	}
+	else if(!strcmp(argv[in], PROGRESS_ARG))
+	{
+	    if(read_uint_option_value(argv, &in, &options->progress_ms) == e_failure)
+		return e_failure;
+	}
+	else if(!strcmp(argv[in], JOURNAL_ARG))
+	{
+	    if(read_string_option_value(argv, &in, &options->journal_file) == e_failure)
+		return e_failure;
+	}
+	else if(!strcmp(argv[in], KEY_FILE_ARG))
+	{
+	    if(read_string_option_value(argv, &in, &options->key_file) == e_failure)
+		return e_failure;
+	}
+	else if(!strcmp(argv[in], WORKERS_ARG))
+	{
+	    if(read_uint_option_value(argv, &in, &options->workers) == e_failure)
+		return e_failure;
+	}
+	else if(!strcmp(argv[in], SOCKET_MODE_ARG))
+	{
+	    if(read_mode_option_value(argv, &in, &options->socket_mode) == e_failure)
+		return e_failure;
+	}
+	else if(!strcmp(argv[in], FEC_ARG))
+	{
+	    if(read_uint_option_value(argv, &in, &options->fec_parity) == e_failure || fec_check_parity(options->fec_parity) == e_failure)
+		return e_failure;
+	}
+	else
+	{
+	    fprintf(stderr, "Error: Unknown option %s\n", argv[in]);
+	    return e_failure;
+	}
+    }
+    argv[out] = NULL;
+    if(set_io_limits(options) == e_failure)
+	return e_failure;
+    if(start_telemetry(options->stats_file, options->stats_interval) == e_failure)
+	return e_failure;
+    if(load_options_key(options, &run_key) == e_failure)
+	return e_failure;
+    return start_trace(options->trace_file);
+}
+
+/*
+ * Function to load the key shared by the encoder and the decoder.
+ *
+ * The key is the content of the --key-file file if one is given, and the
+ * value of the STEG_KEY_ENV environment variable otherwise. Without either
+ * there is no key, which is not an error: key is set to NULL then.
+ *
+ * CAUTION: The key is dynamically allocated and must be freed by the caller.
+ *
+ * INPUTS: The options, and where to return the key and its length.
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status load_steg_key(const StegOptions *options, unsigned char **key, size_t *key_len)
+{
+    if(!options || !key || !key_len)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    *key = NULL;
+    *key_len = 0;
+    if(!options->key_file)
+    {
+	const char *env_key = getenv(STEG_KEY_ENV);
+	if(!env_key || !*env_key)
+	    return e_success;
+	*key_len = strlen(env_key);
+	if(*key_len > MAX_KEY_SIZE)
+	{
+	    fprintf(stderr, "The key in %s is too long.\n", STEG_KEY_ENV);
+	    return e_failure;
+	}
+	*key = (unsigned char *)strdup(env_key);
+	if(!*key)
+	{
+	    FATAL_ERR_MSG;
+	    return e_failure;
+	}
+	return e_success;
+    }
+
+    FILE *fptr_key = fopen(options->key_file, "rb");
+    if(!fptr_key)
+    {
+	perror("fopen");
+	fprintf(stderr, "ERROR: Unable to open file %s\n", options->key_file);
+	return e_failure;
+    }
+
+    *key = malloc(MAX_KEY_SIZE + 1);
+    if(!*key)
+    {
+	FATAL_ERR_MSG;
+	fclose(fptr_key);
+	return e_failure;
+    }
+    *key_len = fread(*key, 1, MAX_KEY_SIZE + 1, fptr_key);
+    int read_failed = ferror(fptr_key);
+    fclose(fptr_key);
+    if(read_failed || !*key_len || *key_len > MAX_KEY_SIZE)
+    {
+	fprintf(stderr, "The key file %s must hold 1 to %d bytes.\n", options->key_file, MAX_KEY_SIZE);
+	free(*key);
+	*key = NULL;
+	return e_failure;
+    }
+    return e_success;
+}
+
+/*
+ * Function to load the key given by the options and derive from it what
+ * the jobs need: the cipher key of --encrypt, the seed of the keyed
+ * carrier order and the hash naming the key in the decode cache. The key
+ * is wiped and freed once they are derived. Options copied from these
+ * share the key material, so jobs never load the key again.
+ *
+ * INPUTS: The options, whose key is set to the derived key material, or
+ * to NULL without a key, and where to keep the key material.
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status load_options_key(StegOptions *options, StegKey *key)
+{
+    if(!options || !key)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    unsigned char *raw_key;
+    size_t raw_key_len;
+    options->key = NULL;
+    if(load_steg_key(options, &raw_key, &raw_key_len) == e_failure)
+	return e_failure;
+    if(!raw_key)
+	return e_success;
+
+    chacha20_derive_key(raw_key, raw_key_len, key->cipher_key);
+    key->spread_seed = chacha20_derive_spread_seed(raw_key, raw_key_len);
+    chacha20_hash(CHACHA20_KEY_ID_DOMAIN, raw_key, raw_key_len, key->key_id);
+    memset(raw_key, 0, raw_key_len);
+    free(raw_key);
+    options->key = key;
+    return e_success;
+}
+
+/*
+ * Function to read a little endian 16 bit value from a byte buffer.
+ */
+static uint read_le16(const unsigned char *buf)
+{
+    return buf[0] | (buf[1] << 8);
+}
+
+/*
+ * Function to read a little endian 32 bit value from a byte buffer.
+ */
+static uint read_le32(const unsigned char *buf)
+{
+    return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint)buf[3] << 24);
+}
+
+/*
+ * Function to parse the header bytes of a bmp file into a BmpImage descriptor.
+ *
+ * This function takes the BMP file header and the BITMAPINFOHEADER as read
+ * from the start of the file and fills in the pixel data offset, dimensions,
+ * bits per pixel, the padded row stride and the row orientation. A negative
+ * height in the header denotes a top-down image. Headers whose rows or
+ * padded pixel array do not fit in 32 bits, or whose height is INT_MIN,
+ * which has no positive counterpart, are rejected, and so are compressed
+ * pixel arrays: only BI_RGB, and BI_BITFIELDS at 32 bpp, store the pixels
+ * as they are.
+ *
+ * INPUTS: The first BMP_PARSED_HEADER_SIZE bytes of the image and the
+ * descriptor to fill in.
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status parse_bmp_image_info(const unsigned char *header, BmpImage *bmp_image)
+{
+    if(!header || !bmp_image)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    if(header[0] != 'B' || header[1] != 'M')
+    {
+	fprintf(stderr, "Not a BMP image: signature mismatch.\n");
+	return e_failure;
+    }
+
+    if(read_le32(header + 14) < 40)
+    {
+	fprintf(stderr, "Unsupported BMP info header.\n");
+	return e_failure;
+    }
+
+    int width = (int)read_le32(header + 18);
+    int height = (int)read_le32(header + 22);
+    uint bits_per_pixel = read_le16(header + 28);
+    uint data_offset = read_le32(header + 10);
+    uint compression = read_le32(header + 30);
+    if(compression != BMP_COMPRESSION_RGB && !(compression == BMP_COMPRESSION_BITFIELDS && bits_per_pixel == 32))
+    {
+	fprintf(stderr, "Unsupported BMP compression %u.\n", compression);
+	return e_failure;
+    }
+    if(width <= 0 || height == 0 || height == INT_MIN || bits_per_pixel < 8 || bits_per_pixel % 8 || data_offset < BMP_PARSED_HEADER_SIZE)
+    {
+	fprintf(stderr, "Malformed or unsupported BMP header.\n");
+	return e_failure;
+    }
+
+    // Rows and the pixel array are sized in 32 bits everywhere; the stride
+    // is at least the row size, so checking the array covers both.
+    uint64_t row_size = (uint64_t)width * (bits_per_pixel / 8);
+    uint64_t row_stride = (row_size + 3) & ~(uint64_t)3;
+    if(row_stride * (uint64_t)(height < 0? -(int64_t)height: height) > UINT32_MAX)
+    {
+	fprintf(stderr, "BMP image dimensions are too large.\n");
+	return e_failure;
+    }
+
+    bmp_image->data_offset = data_offset;
+    bmp_image->width = width;
+    bmp_image->top_down = height < 0;
+    bmp_image->height = height < 0? -height: height;
+    bmp_image->bits_per_pixel = bits_per_pixel;
+    bmp_image->bytes_per_pixel = bits_per_pixel / 8;
+    bmp_image->row_size = bmp_image->width * bmp_image->bytes_per_pixel;
+    bmp_image->row_stride = (bmp_image->row_size + 3) & ~3u;
+    return e_success;
+}
+
+/*
+ * Function to parse the header of a bmp file into a BmpImage descriptor.
+ *
+ * This function reads the BMP file header and the BITMAPINFOHEADER in a
+ * single read from the start of the file and parses them with
+ * parse_bmp_image_info().
+ *
+ * The file position indicator is left right after the parsed header, that
+ * is at BMP_PARSED_HEADER_SIZE bytes from the start of the file.
+ *
+ * INPUTS: The bmp image file pointer and the descriptor to fill in.
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status read_bmp_image_info(FILE *fptr_bmp_image, BmpImage *bmp_image)
+{
+    if(!fptr_bmp_image || !bmp_image)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    unsigned char header[BMP_PARSED_HEADER_SIZE];
+    rewind(fptr_bmp_image);
+    if(fread(header, sizeof(header), 1, fptr_bmp_image) != 1)
+    {
+	FILE_READ_ERR;
+	return e_failure;
+    }
+    return parse_bmp_image_info(header, bmp_image);
 }
@@ -1,8 +1,10 @@
 #ifndef COMMON_H
 #define COMMON_H
 
+#include <stdint.h>
 #include "types.h"
 #include "error.h"
+#include "arena.h"
 
 /* Magic string to identify whether stegged or not */
 #define MAGIC_STRING "#*"
@@ -14,10 +16,31 @@
 #define MAX_IMAGE_BUF_SIZE (MAX_SECRET_BUF_SIZE * 8)
 #define MAX_FILE_SUFFIX 4
 
+/* Maximum number of decimal digits in an encoded secret file size */
+#define MAX_FILE_SIZE_DIGITS 10
+
 /* Encode and decode arguments from the user */
 #define ENCODE_ARG "-e"
 #define DECODE_ARG "-d"
 
+/* Daemon and client mode arguments */
+#define SERVE_ARG "--serve"
+#define CLIENT_ARG "--client"
+
+/* Broadcast mode argument: one secret into many covers */
+#define BROADCAST_ARG "--broadcast"
+#define SPAN_ARG "--span"
+#define JOIN_ARG "--join"
+
+/* Cover versus stego image comparison argument */
+#define COMPARE_ARG "--compare"
+
+/* LSB steganalysis screening argument */
+#define DETECT_ARG "--detect"
+
+/* In place update argument: a new secret into an existing stego image */
+#define UPDATE_ARG "--update"
+
 /* The default prefix for encoded .bmp file  */
 #define DEFAULT_ENCODED_FILE_PREFIX "stegged_"
 
@@ -30,15 +53,168 @@
 /* The default suffix for decoded file  */
 #define DEFAULT_DECODED_FILE_PREFIX "destegged_"
 
+/* Optional arguments accepted after the encode/decode argument */
+#define SKIP_ALPHA_ARG "--skip-alpha"
+#define WORKERS_ARG "--workers"
+#define INLINE_ARG "--inline"
+#define MEMFD_ARG "--memfd"
+#define COVER_POOL_ARG "--cover-pool"
+#define DIRECT_IO_ARG "--direct-io"
+#define KEY_FILE_ARG "--key-file"
+#define ENCRYPT_ARG "--encrypt"
+#define FEC_ARG "--fec"
+#define VERIFY_ARG "--verify"
+#define METRICS_ARG "--metrics"
+#define CACHE_DIR_ARG "--cache-dir"
+#define CACHE_SIZE_ARG "--cache-size"
+#define JOURNAL_ARG "--journal"
+#define MAX_READ_MBPS_ARG "--max-read-mbps"
+#define MAX_WRITE_MBPS_ARG "--max-write-mbps"
+#define IDLE_IO_ARG "--idle-io"
+#define STATS_FILE_ARG "--stats-file"
+#define STATS_INTERVAL_ARG "--stats-interval"
+#define TRACE_ARG "--trace"
+#define PROGRESS_ARG "--progress"
+#define SOCKET_MODE_ARG "--socket-mode"
+
+/* Environment variable holding the key when no key file is given */
+#define STEG_KEY_ENV "STEG_KEY"
+
+/* Largest key accepted, in bytes */
+#define MAX_KEY_SIZE 4096
+
+/* Bytes of each digest derived from the key: CHACHA20_HASH_SIZE */
+#define STEG_KEY_DIGEST_SIZE 32
+
+/* Size of the blocks in which image data is copied */
+#define COPY_BLOCK_SIZE (64 * 1024)
+
+/* Size and alignment of the stdio buffers of the encoded image streams */
+#define STREAM_BLOCK_SIZE (1024 * 1024)
+#define STREAM_BLOCK_ALIGN 4096
+
+/* File name standing for standard input or output */
+#define STDIO_FILE_NAME "-"
+
+/* Extension encoded for a secret read from standard input */
+#define STDIN_SECRET_EXTN "bin"
+
+/* Suffix of the name an output file is written under until it is complete */
+#define TEMP_OUTPUT_SUFFIX ".tmp"
+
+/* Random bytes in a temporary output name, and names tried before giving up */
+#define TEMP_OUTPUT_RANDOM_BYTES 8
+#define TEMP_OUTPUT_ATTEMPTS 16
+
 /* File extension of the image file  */
 #define IMG_FILE_EXTN ".bmp"
 
 //#define BMP_HEADER_SIZE 54
 
+/* Size of the BMP file header plus the BITMAPINFOHEADER that we parse */
+#define BMP_PARSED_HEADER_SIZE 54
+
+/* biCompression values of uncompressed pixel arrays: plain, and 32 bpp with channel masks */
+#define BMP_COMPRESSION_RGB 0
+#define BMP_COMPRESSION_BITFIELDS 3
+
+/* Stack chunk the rest of a BMP header (colour table, extra data) is copied through */
+#define BMP_HEADER_COPY_CHUNK 4096
+
+/* 
+ * Structure describing the layout of a BMP image. It is parsed once
+ * from the image header and shared by every encode/decode stage, so
+ * that no stage has to seek back into the header again.
+ */
+typedef struct _BmpImage
+{
+    uint data_offset;		// Offset of the pixel array from file start
+    uint width;			// Width in pixels
+    uint height;		// Height in pixels (absolute value)
+    uint bits_per_pixel;	// Bits per pixel as stored in the header
+    uint bytes_per_pixel;	// Bytes per pixel (bits_per_pixel / 8)
+    uint row_size;		// Bytes of pixel data in each row
+    uint row_stride;		// Row size padded to a multiple of 4 bytes
+    int top_down;		// 1 if the first stored row is the top row
+
+} BmpImage;
+
+/*
+ * Structure to store what the jobs of a run need from the key, derived
+ * once when the options are read, so that jobs neither read the key file
+ * nor allocate for it. The key itself is not kept.
+ */
+typedef struct _StegKey
+{
+    unsigned char cipher_key[STEG_KEY_DIGEST_SIZE];	// ChaCha20 key of --encrypt
+    uint64_t spread_seed;			// Seed of the keyed carrier order
+    unsigned char key_id[STEG_KEY_DIGEST_SIZE];	// Hash naming the key, for the decode cache
+
+} StegKey;
+
+/* 
+ * Structure to store the optional behaviour selected by the user
+ * through the "--" arguments on the command line
+ */
+typedef struct _StegOptions
+{
+    int skip_alpha;		// Leave the alpha byte of 32 bpp pixels untouched
+    uint workers;		// Number of worker threads, 0 for the default
+    int inline_data;		// Client: send the secret / receive the output inline
+    int fd_passing;		// Client: pass descriptors, receive the output as a memfd
+    const char *cover_pool;	// Encode: directory to pick the cover image from
+    int direct_io;		// Read and write images with O_DIRECT
+    const char *key_file;	// File holding the key, STEG_KEY_ENV otherwise
+    const StegKey *key;		// Derived from the key, NULL without one
+    int encrypt;		// Encrypt the secret data with ChaCha20
+    uint fec_parity;		// Reed-Solomon parity bytes per codeword, 0 for no FEC
+    int verify;			// Encode: read the embedded bits back and check them
+    int metrics;		// Encode: print the distortion of the stego image
+    const char *cache_dir;	// Decode: directory of the decoded payload cache
+    uint cache_size_mb;		// Decode: cache size cap in MiB, 0 for the default
+    const char *journal_file;	// Broadcast: journal of the completed covers
+    uint max_read_mbps;		// Image read limit in MB per second, 0 for none
+    uint max_write_mbps;	// Image write limit in MB per second, 0 for none
+    int idle_io;		// Run in the idle I/O scheduling class
+    const char *stats_file;	// File the job stats are written to, in the Prometheus text format
+    uint stats_interval;	// Seconds between refreshes of the stats file, 0 for the default
+    const char *trace_file;	// File the spans of the stages and I/O are written to, in the Chrome trace format
+    uint progress_ms;		// Encode/decode: milliseconds between progress reports, 0 for none
+    uint socket_mode;		// Daemon: permission bits of the socket, 0 for the default
+
+} StegOptions;
+
 /* Function to get file extension */
 Status get_file_extension(const char *file_name, char *file_extension);
 
-/* Function to get the image pixel data offset */
-int get_image_data_offset(FILE *fptr_bmp_image);
+/* Function to check if a file name stands for standard input or output */
+int is_stdio_file_name(const char *file_name);
+
+/* Function to open a file, or standard input/output for STDIO_FILE_NAME */
+FILE *open_data_stream(const char *file_name, const char *mode);
+
+/* Function to get the name an output file is written under until it is complete */
+char *get_temp_output_filename(const char *file_name, Arena *arena);
+
+/* Function to make an input stream seekable, buffering it in memory if needed */
+Status make_stream_seekable(FILE **fptr, void **buffer);
+
+/* Function to skip bytes of an input stream by reading them */
+Status skip_stream_bytes(FILE *fptr, uint count);
+
+/* Function to load the key from the key file or the environment */
+Status load_steg_key(const StegOptions *options, unsigned char **key, size_t *key_len);
+
+/* Function to load the key once and set the key material of the options */
+Status load_options_key(StegOptions *options, StegKey *key);
+
+/* Function to read the optional arguments out of argv */
+Status read_steg_options(char *argv[], StegOptions *options);
+
+/* Function to parse BMP header bytes into a BmpImage descriptor */
+Status parse_bmp_image_info(const unsigned char *header, BmpImage *bmp_image);
+
+/* Function to parse the BMP header into a BmpImage descriptor */
+Status read_bmp_image_info(FILE *fptr_bmp_image, BmpImage *bmp_image);
 
 #endif
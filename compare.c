@@ -0,0 +1,378 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "compare.h"
+#include "lsb.h"
+#include "types.h"
+#include "error.h"
+
+/* Pixel bytes handled per vector step: three 16 byte vectors, a whole number of 3 and 4 byte pixels */
+#define COMPARE_BLOCK 48
+
+/* Function Definitions */
+
+/*
+ * Function to check the compare arguments input by the user.
+ *
+ * Comparing needs the cover and the stego image, in that order:
+ *	--compare <cover.bmp> <stego.bmp>
+ *
+ * INPUTS: Argument vector from the main() function and the CompareInfo
+ * variable pointer.
+ *
+ * RETURNS: The check status enum: e_success or e_failure.
+ */
+Status read_and_validate_compare_args(char *argv[], CompareInfo *cmpInfo)
+{
+    if(!argv || !cmpInfo)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    memset(cmpInfo, 0, sizeof(*cmpInfo));
+    StegOptions options;
+    if(read_steg_options(argv, &options) == e_failure)
+	return e_failure;
+
+    if(!argv[2] || !argv[3] || !strstr(argv[2], IMG_FILE_EXTN) || !strstr(argv[3], IMG_FILE_EXTN))
+    {
+	fprintf(stderr, "Error: Please input the cover and the stego image:\n%s %s <cover%s> <stego%s>\n", argv[0], COMPARE_ARG, IMG_FILE_EXTN, IMG_FILE_EXTN);
+	return e_failure;
+    }
+
+    cmpInfo->cover_fname = argv[2];
+    cmpInfo->stego_fname = argv[3];
+    return e_success;
+}
+
+/*
+ * Function to map an image file read-only and parse its header.
+ *
+ * The image must be one the LSB pipeline supports, and its pixel array
+ * must lie within the file. The mapping is left in place on failure too,
+ * with *map set, for the caller to unmap.
+ *
+ * INPUTS: The file name, where to return the mapping and its size, and
+ * the BmpImage descriptor to fill in.
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status map_bmp_image_file(const char *fname, unsigned char **map, size_t *size, BmpImage *bmp_image)
+{
+    if(!fname || !map || !size || !bmp_image)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    *map = NULL;
+    struct stat st;
+    int fd = open(fname, O_RDONLY);
+    if(fd < 0 || fstat(fd, &st) < 0)
+    {
+	perror("open");
+	fprintf(stderr, "ERROR: Unable to open file %s\n", fname);
+	if(fd >= 0)
+	    close(fd);
+	return e_failure;
+    }
+    if(!S_ISREG(st.st_mode) || st.st_size < BMP_PARSED_HEADER_SIZE)
+    {
+	fprintf(stderr, "%s: not a BMP image file.\n", fname);
+	close(fd);
+	return e_failure;
+    }
+
+    *size = st.st_size;
+    *map = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(*map == MAP_FAILED)
+    {
+	perror("mmap");
+	*map = NULL;
+	return e_failure;
+    }
+    madvise(*map, *size, MADV_SEQUENTIAL);
+
+    if(parse_bmp_image_info(*map, bmp_image) == e_failure || lsb_check_image_support(bmp_image, 0) == e_failure)
+	return e_failure;
+    if(bmp_image->data_offset > *size ||
+	    (size_t)bmp_image->row_stride * bmp_image->height > *size - bmp_image->data_offset)
+    {
+	fprintf(stderr, "%s: the pixel array runs past the end of the file.\n", fname);
+	return e_failure;
+    }
+    return e_success;
+}
+
+/*
+ * Function to count the bytes that differ between two byte ranges.
+ */
+static uint64_t count_changed_bytes(const unsigned char *cover, const unsigned char *stego, size_t len)
+{
+    uint64_t changed = 0;
+    for(size_t i = 0; i < len; ++i)
+	changed += cover[i] != stego[i];
+    return changed;
+}
+
+/*
+ * Function to prepare the metrics for comparing images of the given
+ * layout.
+ *
+ * INPUTS: The metrics and the BmpImage descriptor of the cover.
+ *
+ * RETURNS: Nothing.
+ */
+void compare_metrics_init(CompareMetrics *metrics, const BmpImage *bmp_image)
+{
+    if(!metrics || !bmp_image)
+    {
+	FATAL_ERR_MSG;
+	return;
+    }
+
+    memset(metrics, 0, sizeof(*metrics));
+    metrics->channels = bmp_image->bytes_per_pixel;
+}
+
+/*
+ * Function to add a span of pixel bytes to the metrics.
+ *
+ * The cover and stego bytes are compared COMPARE_BLOCK bytes at a time
+ * with SSE2: the absolute differences give the changed byte mask and the
+ * largest difference, the saturated stego minus cover differences give
+ * the raised byte mask, and the squared differences are summed with
+ * multiply-add. Blocks where nothing changed cost just the compare, since
+ * the per channel counts and histogram deltas are only worked out from
+ * the masks of blocks that did change. Bytes left after the last whole
+ * block, and all of them without SSE2, are handled one at a time.
+ *
+ * INPUTS: The cover and stego bytes, their count and the metrics.
+ *
+ * CAUTION: The span must start on a pixel boundary.
+ *
+ * RETURNS: Nothing.
+ */
+void compare_pixel_bytes(const unsigned char *cover, const unsigned char *stego, size_t len, CompareMetrics *metrics)
+{
+    if(!cover || !stego || !metrics || !metrics->channels || metrics->channels > COMPARE_MAX_CHANNELS)
+    {
+	FATAL_ERR_MSG;
+	return;
+    }
+
+    uint channels = metrics->channels;
+    metrics->pixel_bytes += len;
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    uint64_t channel_mask[COMPARE_MAX_CHANNELS] = { 0 };
+    for(uint b = 0; b < COMPARE_BLOCK; ++b)
+	channel_mask[b % channels] |= 1ULL << b;
+
+    const __m128i zero = _mm_setzero_si128();
+    __m128i max_diff = zero;
+    for(; i + COMPARE_BLOCK <= len; i += COMPARE_BLOCK)
+    {
+	uint64_t changed = 0, raised = 0;
+	__m128i squares = zero;
+	for(uint v = 0; v < COMPARE_BLOCK / 16; ++v)
+	{
+	    __m128i c = _mm_loadu_si128((const __m128i *)(cover + i + 16 * v));
+	    __m128i s = _mm_loadu_si128((const __m128i *)(stego + i + 16 * v));
+	    __m128i up = _mm_subs_epu8(s, c);
+	    __m128i diff = _mm_or_si128(up, _mm_subs_epu8(c, s));
+	    max_diff = _mm_max_epu8(max_diff, diff);
+	    changed |= (uint64_t)(~_mm_movemask_epi8(_mm_cmpeq_epi8(diff, zero)) & 0xFFFF) << (16 * v);
+	    raised |= (uint64_t)(~_mm_movemask_epi8(_mm_cmpeq_epi8(up, zero)) & 0xFFFF) << (16 * v);
+	    __m128i lo = _mm_unpacklo_epi8(diff, zero);
+	    __m128i hi = _mm_unpackhi_epi8(diff, zero);
+	    squares = _mm_add_epi32(squares, _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi)));
+	}
+	if(!changed)
+	    continue;
+
+	uint32_t lanes[4];
+	_mm_storeu_si128((__m128i *)lanes, squares);
+	metrics->squared_error += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+	metrics->changed_bytes += __builtin_popcountll(changed);
+	for(uint ch = 0; ch < channels; ++ch)
+	{
+	    metrics->channel_changed[ch] += __builtin_popcountll(changed & channel_mask[ch]);
+	    metrics->channel_raised[ch] += __builtin_popcountll(raised & channel_mask[ch]);
+	}
+	for(; changed; changed &= changed - 1)
+	{
+	    uint b = __builtin_ctzll(changed);
+	    ++metrics->histogram_delta[b % channels][stego[i + b]];
+	    --metrics->histogram_delta[b % channels][cover[i + b]];
+	}
+    }
+
+    unsigned char max_bytes[16];
+    _mm_storeu_si128((__m128i *)max_bytes, max_diff);
+    for(uint b = 0; b < 16; ++b)
+	if(max_bytes[b] > metrics->max_difference)
+	    metrics->max_difference = max_bytes[b];
+#endif
+
+    for(; i < len; ++i)
+    {
+	if(cover[i] == stego[i])
+	    continue;
+	uint ch = i % channels;
+	uint diff = cover[i] > stego[i]? cover[i] - stego[i]: stego[i] - cover[i];
+	++metrics->changed_bytes;
+	metrics->squared_error += diff * diff;
+	if(diff > metrics->max_difference)
+	    metrics->max_difference = diff;
+	++metrics->channel_changed[ch];
+	metrics->channel_raised[ch] += stego[i] > cover[i];
+	++metrics->histogram_delta[ch][stego[i]];
+	--metrics->histogram_delta[ch][cover[i]];
+    }
+}
+
+/*
+ * Function to print the metrics.
+ *
+ * The PSNR is worked out over all the pixel bytes compared, for a peak
+ * value of 255. The histogram shift of a channel is the number of bytes
+ * that would have to change value to turn the cover histogram into the
+ * stego one, which is what a histogram based steganalysis gets to see.
+ *
+ * INPUTS: The metrics.
+ *
+ * RETURNS: Nothing.
+ */
+void print_compare_metrics(const CompareMetrics *metrics)
+{
+    if(!metrics)
+    {
+	FATAL_ERR_MSG;
+	return;
+    }
+
+    static const char channel_names[COMPARE_MAX_CHANNELS] = { 'B', 'G', 'R', 'A' };
+    double percent = metrics->pixel_bytes? 100.0 * metrics->changed_bytes / metrics->pixel_bytes: 0;
+    printf("Pixel bytes compared: %llu\n", (unsigned long long)metrics->pixel_bytes);
+    printf("Changed pixel bytes: %llu (%.3f%%)\n", (unsigned long long)metrics->changed_bytes, percent);
+    printf("Largest byte difference: %u\n", metrics->max_difference);
+    if(!metrics->squared_error || !metrics->pixel_bytes)
+	printf("PSNR: infinite (identical pixel data)\n");
+    else
+    {
+	double mse = (double)metrics->squared_error / metrics->pixel_bytes;
+	printf("MSE: %.6f\nPSNR: %.2f dB\n", mse, 10 * log10(255.0 * 255.0 / mse));
+    }
+
+    printf("Channel  changed  raised  lowered  histogram shift\n");
+    for(uint ch = 0; ch < metrics->channels && ch < COMPARE_MAX_CHANNELS; ++ch)
+    {
+	uint64_t shift = 0;
+	for(uint v = 0; v < 256; ++v)
+	    shift += metrics->histogram_delta[ch][v] > 0? metrics->histogram_delta[ch][v]: 0;
+	printf("%c  %llu  %llu  %llu  %llu\n", channel_names[ch], (unsigned long long)metrics->channel_changed[ch],
+		(unsigned long long)metrics->channel_raised[ch], (unsigned long long)(metrics->channel_changed[ch] - metrics->channel_raised[ch]),
+		(unsigned long long)shift);
+    }
+    printf("Changed bytes outside the pixel data: %llu\n", (unsigned long long)metrics->other_changed_bytes);
+}
+
+/*
+ * Function to compare a stego image with its cover.
+ *
+ * Both files are mapped read-only and must have the same layout. The
+ * pixel rows go through compare_pixel_bytes(), in one span when the rows
+ * have no padding. Every other byte, the header, the row padding and
+ * whatever follows the pixel array, is expected not to change at all and
+ * is only counted when it does. Bytes one file has and the other has not
+ * count as changed.
+ *
+ * INPUTS: Pointer to CompareInfo object.
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status do_compare(CompareInfo *cmpInfo)
+{
+    if(!cmpInfo)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    if(map_bmp_image_file(cmpInfo->cover_fname, &cmpInfo->cover_map, &cmpInfo->cover_size, &cmpInfo->cover_info) == e_failure ||
+	    map_bmp_image_file(cmpInfo->stego_fname, &cmpInfo->stego_map, &cmpInfo->stego_size, &cmpInfo->stego_info) == e_failure)
+    {
+	cleanup_compare(cmpInfo);
+	return e_failure;
+    }
+
+    const BmpImage *cover_info = &cmpInfo->cover_info;
+    const BmpImage *stego_info = &cmpInfo->stego_info;
+    if(cover_info->width != stego_info->width || cover_info->height != stego_info->height ||
+	    cover_info->bits_per_pixel != stego_info->bits_per_pixel || cover_info->data_offset != stego_info->data_offset)
+    {
+	fprintf(stderr, "The images do not have the same layout.\n");
+	cleanup_compare(cmpInfo);
+	return e_failure;
+    }
+
+    CompareMetrics *metrics = &cmpInfo->metrics;
+    compare_metrics_init(metrics, cover_info);
+    const unsigned char *cover = cmpInfo->cover_map + cover_info->data_offset;
+    const unsigned char *stego = cmpInfo->stego_map + stego_info->data_offset;
+    uint stride = cover_info->row_stride;
+    uint row_size = cover_info->row_size;
+    if(row_size == stride)
+	compare_pixel_bytes(cover, stego, (size_t)stride * cover_info->height, metrics);
+    else
+	for(size_t row = 0; row < cover_info->height; ++row)
+	{
+	    compare_pixel_bytes(cover + row * stride, stego + row * stride, row_size, metrics);
+	    metrics->other_changed_bytes += count_changed_bytes(cover + row * stride + row_size, stego + row * stride + row_size, stride - row_size);
+	}
+
+    size_t pixel_end = cover_info->data_offset + (size_t)stride * cover_info->height;
+    size_t common_size = cmpInfo->cover_size < cmpInfo->stego_size? cmpInfo->cover_size: cmpInfo->stego_size;
+    metrics->other_changed_bytes += count_changed_bytes(cmpInfo->cover_map, cmpInfo->stego_map, cover_info->data_offset);
+    metrics->other_changed_bytes += count_changed_bytes(cmpInfo->cover_map + pixel_end, cmpInfo->stego_map + pixel_end, common_size - pixel_end);
+    metrics->other_changed_bytes += cmpInfo->cover_size + cmpInfo->stego_size - 2 * common_size;
+
+    print_compare_metrics(metrics);
+    cleanup_compare(cmpInfo);
+    return e_success;
+}
+
+/*
+ * Function to unmap the images.
+ *
+ * INPUTS: The CompareInfo object.
+ *
+ * RETURNS: Nothing.
+ */
+void cleanup_compare(CompareInfo *cmpInfo)
+{
+    if(!cmpInfo)
+    {
+	FATAL_ERR_MSG;
+	return;
+    }
+
+    if(cmpInfo->cover_map)
+	munmap(cmpInfo->cover_map, cmpInfo->cover_size);
+    if(cmpInfo->stego_map)
+	munmap(cmpInfo->stego_map, cmpInfo->stego_size);
+    cmpInfo->cover_map = NULL;
+    cmpInfo->stego_map = NULL;
+}
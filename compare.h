@@ -0,0 +1,74 @@
+#ifndef COMPARE_H
+#define COMPARE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "types.h" 	// Contains user defined types
+#include "common.h"	// Contains common strings
+#include "error.h"	// Contains standard error messages
+
+/* Most bytes per pixel of a supported image: blue, green, red and alpha */
+#define COMPARE_MAX_CHANNELS 4
+
+/*
+ * Structure to store the distortion between a cover and a stego image.
+ * Channels are the bytes of a pixel in file order: blue, green, red and,
+ * for 32 bpp images, alpha. The histogram deltas only ever change where
+ * a byte changed, so unchanged pixel data costs no histogram work.
+ */
+typedef struct _CompareMetrics
+{
+    uint channels;			// Bytes per pixel
+    uint64_t pixel_bytes;		// Pixel bytes compared, row padding excluded
+    uint64_t changed_bytes;		// Pixel bytes that differ
+    uint64_t squared_error;		// Sum of the squared byte differences
+    uint max_difference;		// Largest difference between two bytes
+    uint64_t channel_changed[COMPARE_MAX_CHANNELS];
+    uint64_t channel_raised[COMPARE_MAX_CHANNELS];	// Changed bytes higher in the stego image
+    int64_t histogram_delta[COMPARE_MAX_CHANNELS][256];	// Stego minus cover histogram
+    uint64_t other_changed_bytes;	// Changed bytes outside the pixel data
+
+} CompareMetrics;
+
+/*
+ * Structure to store a comparison job between two image files, both
+ * mapped read-only.
+ */
+typedef struct _CompareInfo
+{
+    const char *cover_fname;
+    const char *stego_fname;
+    unsigned char *cover_map;
+    unsigned char *stego_map;
+    size_t cover_size;
+    size_t stego_size;
+    BmpImage cover_info;
+    BmpImage stego_info;
+    CompareMetrics metrics;
+
+} CompareInfo;
+
+/* Compare function prototypes */
+
+/* Read and validate the compare args from argv */
+Status read_and_validate_compare_args(char *argv[], CompareInfo *cmpInfo);
+
+/* Compare a stego image with its cover and print the metrics */
+Status do_compare(CompareInfo *cmpInfo);
+
+/* Map an image file read-only and parse its header */
+Status map_bmp_image_file(const char *fname, unsigned char **map, size_t *size, BmpImage *bmp_image);
+
+/* Prepare the metrics for images of the given layout */
+void compare_metrics_init(CompareMetrics *metrics, const BmpImage *bmp_image);
+
+/* Add a span of cover and stego pixel bytes to the metrics */
+void compare_pixel_bytes(const unsigned char *cover, const unsigned char *stego, size_t len, CompareMetrics *metrics);
+
+/* Print the metrics */
+void print_compare_metrics(const CompareMetrics *metrics);
+
+/* Unmap the images */
+void cleanup_compare(CompareInfo *cmpInfo);
+
+#endif
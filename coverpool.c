@@ -0,0 +1,435 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "coverpool.h"
+#include "lsb.h"
+#include "types.h"
+#include "error.h"
+
+/* Function Definitions */
+
+/*
+ * Function to order cover entries by name, for qsort() and bsearch().
+ */
+static int compare_cover_names(const void *a, const void *b)
+{
+    return strcmp(((const CoverEntry *)a)->name, ((const CoverEntry *)b)->name);
+}
+
+/*
+ * Function to build the path of a file inside the pool directory.
+ *
+ * CAUTION: The path is dynamically allocated and must be freed by the caller.
+ */
+static char *get_pool_path(const char *dir, const char *name)
+{
+    char *path = malloc(strlen(dir) + 1 + strlen(name) + 1);
+    if(!path)
+	return NULL;
+    strcpy(path, dir);
+    strcat(path, "/");
+    strcat(path, name);
+    return path;
+}
+
+/*
+ * Function to append an entry to the pool, taking over its name.
+ */
+static Status add_cover_entry(CoverPool *pool, const CoverEntry *entry)
+{
+    if(pool->count == pool->allocated)
+    {
+	uint allocated = pool->allocated? pool->allocated * 2: 64;
+	CoverEntry *entries = realloc(pool->entries, allocated * sizeof(CoverEntry));
+	if(!entries)
+	{
+	    FATAL_ERR_MSG;
+	    return e_failure;
+	}
+	pool->entries = entries;
+	pool->allocated = allocated;
+    }
+    pool->entries[pool->count++] = *entry;
+    return e_success;
+}
+
+/*
+ * Function to read the index file of a pool, if there is one.
+ *
+ * Each line after the signature holds, separated by single spaces, the
+ * mtime (seconds, a dot and nine digits of nanoseconds), size, width, height, bits per pixel, pixel data offset, both
+ * capacities and finally the file name, which runs to the end of the line.
+ * An index with a different signature is ignored and rebuilt.
+ */
+static Status read_cover_index(CoverPool *pool)
+{
+    char *index_path = get_pool_path(pool->dir, COVER_INDEX_FNAME);
+    if(!index_path)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+    FILE *fptr_index = fopen(index_path, "r");
+    free(index_path);
+    if(!fptr_index)
+	return e_success;
+
+    char line[PATH_MAX + 128];
+    Status status = e_success;
+    if(!fgets(line, sizeof(line), fptr_index))
+	line[0] = '\0';
+    line[strcspn(line, "\n")] = '\0';
+    if(strcmp(line, COVER_INDEX_SIGNATURE))
+    {
+	fclose(fptr_index);
+	pool->changed = 1;
+	return e_success;
+    }
+
+    while(status == e_success && fgets(line, sizeof(line), fptr_index))
+    {
+	CoverEntry entry;
+	memset(&entry, 0, sizeof(entry));
+	long long mtime;
+	long mtime_nsec;
+	int name_start = 0;
+	line[strcspn(line, "\n")] = '\0';
+	if(sscanf(line, "%lld.%ld %lld %u %u %u %u %u %u %n", &mtime, &mtime_nsec, &entry.size, &entry.width, &entry.height, &entry.bits_per_pixel,
+		    &entry.data_offset, &entry.capacity, &entry.capacity_skip_alpha, &name_start) < 9 || !name_start || !line[name_start])
+	{
+	    // A damaged line only costs a rescan of that cover.
+	    pool->changed = 1;
+	    continue;
+	}
+	entry.mtime.tv_sec = mtime;
+	entry.mtime.tv_nsec = mtime_nsec;
+	entry.name = strdup(line + name_start);
+	if(!entry.name || add_cover_entry(pool, &entry) == e_failure)
+	{
+	    free(entry.name);
+	    status = e_failure;
+	}
+    }
+    fclose(fptr_index);
+
+    qsort(pool->entries, pool->count, sizeof(CoverEntry), compare_cover_names);
+    return status;
+}
+
+/*
+ * Function to fill in the header derived fields of an entry by parsing
+ * the BMP header of the cover. Unreadable or unsupported covers get zero
+ * capacities.
+ */
+static void index_cover(const CoverPool *pool, CoverEntry *entry)
+{
+    entry->width = entry->height = entry->bits_per_pixel = entry->data_offset = 0;
+    entry->capacity = entry->capacity_skip_alpha = 0;
+
+    char *path = get_pool_path(pool->dir, entry->name);
+    FILE *fptr_cover = path? fopen(path, "rb"): NULL;
+    free(path);
+    if(!fptr_cover)
+	return;
+
+    BmpImage bmp_image;
+    if(read_bmp_image_info(fptr_cover, &bmp_image) == e_success)
+    {
+	entry->width = bmp_image.width;
+	entry->height = bmp_image.height;
+	entry->bits_per_pixel = bmp_image.bits_per_pixel;
+	entry->data_offset = bmp_image.data_offset;
+	if(bmp_image.bits_per_pixel == 24 || bmp_image.bits_per_pixel == 32)
+	    entry->capacity = lsb_image_capacity(&bmp_image, 0);
+	if(bmp_image.bits_per_pixel == 32)
+	    entry->capacity_skip_alpha = lsb_image_capacity(&bmp_image, 1);
+    }
+    fclose(fptr_cover);
+}
+
+/*
+ * Function to bring the index of a pool up to date with its directory.
+ *
+ * Every .bmp file of the directory is looked up in the index. Only files
+ * that are new, or whose mtime or size changed, have their header parsed.
+ * Entries whose file is gone are dropped.
+ *
+ * INPUTS: The pool, loaded with load_cover_pool().
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status refresh_cover_pool(CoverPool *pool)
+{
+    if(!pool || !pool->dir)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    DIR *dir = opendir(pool->dir);
+    if(!dir)
+    {
+	perror("opendir");
+	fprintf(stderr, "ERROR: Unable to open cover pool %s\n", pool->dir);
+	return e_failure;
+    }
+
+    for(uint i = 0; i < pool->count; ++i)
+	pool->entries[i].seen = 0;
+
+    // Only the entries loaded from the index are sorted and searched;
+    // new covers are appended after them.
+    uint indexed_count = pool->count;
+    Status status = e_success;
+    struct dirent *dir_entry;
+    while(status == e_success && (dir_entry = readdir(dir)))
+    {
+	size_t name_len = strlen(dir_entry->d_name);
+	if(name_len <= strlen(IMG_FILE_EXTN) || strcmp(dir_entry->d_name + name_len - strlen(IMG_FILE_EXTN), IMG_FILE_EXTN))
+	    continue;
+
+	char *path = get_pool_path(pool->dir, dir_entry->d_name);
+	struct stat st;
+	int stat_failed = !path || stat(path, &st) || !S_ISREG(st.st_mode);
+	free(path);
+	if(stat_failed)
+	    continue;
+
+	CoverEntry key = { .name = dir_entry->d_name };
+	CoverEntry *entry = bsearch(&key, pool->entries, indexed_count, sizeof(CoverEntry), compare_cover_names);
+	if(entry && entry->mtime.tv_sec == st.st_mtim.tv_sec && entry->mtime.tv_nsec == st.st_mtim.tv_nsec && entry->size == st.st_size)
+	{
+	    entry->seen = 1;
+	    continue;
+	}
+
+	CoverEntry fresh;
+	memset(&fresh, 0, sizeof(fresh));
+	fresh.mtime = st.st_mtim;
+	fresh.size = st.st_size;
+	fresh.seen = 1;
+	if(entry)
+	{
+	    fresh.name = entry->name;
+	    index_cover(pool, &fresh);
+	    *entry = fresh;
+	}
+	else
+	{
+	    fresh.name = strdup(dir_entry->d_name);
+	    if(!fresh.name)
+	    {
+		FATAL_ERR_MSG;
+		status = e_failure;
+		break;
+	    }
+	    index_cover(pool, &fresh);
+	    status = add_cover_entry(pool, &fresh);
+	    if(status == e_failure)
+		free(fresh.name);
+	}
+	pool->changed = 1;
+    }
+    closedir(dir);
+
+    uint kept = 0;
+    for(uint i = 0; i < pool->count; ++i)
+    {
+	if(pool->entries[i].seen)
+	    pool->entries[kept++] = pool->entries[i];
+	else
+	{
+	    free(pool->entries[i].name);
+	    pool->changed = 1;
+	}
+    }
+    pool->count = kept;
+    qsort(pool->entries, pool->count, sizeof(CoverEntry), compare_cover_names);
+    return status;
+}
+
+/*
+ * Function to load the index of a cover pool directory.
+ *
+ * The index file is read if it exists and then refreshed against the
+ * directory, so the pool always reflects the current covers.
+ *
+ * INPUTS: The pool directory and the pool to fill in.
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status load_cover_pool(const char *dir, CoverPool *pool)
+{
+    if(!dir || !pool)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    memset(pool, 0, sizeof(*pool));
+    pool->dir = dir;
+    if(read_cover_index(pool) == e_failure || refresh_cover_pool(pool) == e_failure)
+    {
+	free_cover_pool(pool);
+	return e_failure;
+    }
+    return e_success;
+}
+
+/*
+ * Function to write the index file of a pool.
+ *
+ * The index is written to a temporary file in the pool directory which
+ * then replaces the old index, so readers never see a partial index.
+ * mkstemp() creates the file private to its owner, so it is given
+ * COVER_INDEX_MODE first, for other users of a shared pool to read it.
+ *
+ * INPUTS: The pool.
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status save_cover_pool(const CoverPool *pool)
+{
+    if(!pool || !pool->dir)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    char *index_path = get_pool_path(pool->dir, COVER_INDEX_FNAME);
+    char *temp_path = get_pool_path(pool->dir, COVER_INDEX_FNAME ".XXXXXX");
+    int fd = (index_path && temp_path)? mkstemp(temp_path): -1;
+    FILE *fptr_index = (fd >= 0 && fchmod(fd, COVER_INDEX_MODE) == 0)? fdopen(fd, "w"): NULL;
+    if(!fptr_index)
+    {
+	perror("mkstemp");
+	if(fd >= 0)
+	{
+	    close(fd);
+	    unlink(temp_path);
+	}
+	free(index_path);
+	free(temp_path);
+	return e_failure;
+    }
+
+    fprintf(fptr_index, "%s\n", COVER_INDEX_SIGNATURE);
+    for(uint i = 0; i < pool->count; ++i)
+    {
+	const CoverEntry *entry = pool->entries + i;
+	fprintf(fptr_index, "%lld.%09ld %lld %u %u %u %u %u %u %s\n", (long long)entry->mtime.tv_sec, (long)entry->mtime.tv_nsec, entry->size, entry->width, entry->height,
+		entry->bits_per_pixel, entry->data_offset, entry->capacity, entry->capacity_skip_alpha, entry->name);
+    }
+
+    Status status = e_success;
+    int write_failed = ferror(fptr_index);
+    if(fclose(fptr_index))
+	write_failed = 1;
+    if(write_failed || rename(temp_path, index_path))
+    {
+	FILE_WRITE_ERR;
+	unlink(temp_path);
+	status = e_failure;
+    }
+    free(index_path);
+    free(temp_path);
+    return status;
+}
+
+/*
+ * Function to find the best fitting cover for a message.
+ *
+ * INPUTS: The pool, the message size in bytes and the skip alpha flag.
+ *
+ * RETURNS: The entry of the smallest cover that can carry the message, or
+ * NULL if none can.
+ */
+const CoverEntry *find_best_fit_cover(const CoverPool *pool, uint message_size, int skip_alpha)
+{
+    if(!pool)
+    {
+	FATAL_ERR_MSG;
+	return NULL;
+    }
+
+    const CoverEntry *best = NULL;
+    uint best_capacity = 0;
+    for(uint i = 0; i < pool->count; ++i)
+    {
+	uint capacity = skip_alpha? pool->entries[i].capacity_skip_alpha: pool->entries[i].capacity;
+	if(capacity >= message_size && (!best || capacity < best_capacity))
+	{
+	    best = pool->entries + i;
+	    best_capacity = capacity;
+	}
+    }
+    return best;
+}
+
+/*
+ * Function to release the memory held by a pool.
+ *
+ * INPUTS: The pool.
+ *
+ * RETURNS: Nothing.
+ */
+void free_cover_pool(CoverPool *pool)
+{
+    if(!pool)
+	return;
+
+    for(uint i = 0; i < pool->count; ++i)
+	free(pool->entries[i].name);
+    free(pool->entries);
+    pool->entries = NULL;
+    pool->count = pool->allocated = 0;
+}
+
+/*
+ * Function to pick a cover for a message from a pool directory.
+ *
+ * The pool index is loaded and refreshed, saved again if any cover was
+ * added, changed or removed, and searched for the smallest cover that fits.
+ * A failure to save the index is reported but does not stop the selection.
+ *
+ * CAUTION: The cover path is dynamically allocated and must be freed by
+ * the caller.
+ *
+ * INPUTS: The pool directory, the message size in bytes, the skip alpha
+ * flag and where to return the path of the picked cover.
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status select_pool_cover(const char *dir, uint message_size, int skip_alpha, char **cover_fname)
+{
+    if(!dir || !cover_fname)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    CoverPool pool;
+    if(load_cover_pool(dir, &pool) == e_failure)
+	return e_failure;
+    if(pool.changed && save_cover_pool(&pool) == e_failure)
+	fprintf(stderr, "Could not update the index of cover pool %s\n", dir);
+
+    const CoverEntry *entry = find_best_fit_cover(&pool, message_size, skip_alpha);
+    *cover_fname = entry? get_pool_path(dir, entry->name): NULL;
+    free_cover_pool(&pool);
+    if(!entry)
+    {
+	fprintf(stderr, "No cover in %s can hold %u bytes.\n", dir, message_size);
+	return e_failure;
+    }
+    if(!*cover_fname)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+    return e_success;
+}
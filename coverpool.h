@@ -0,0 +1,72 @@
+#ifndef COVERPOOL_H
+#define COVERPOOL_H
+
+#include <time.h>
+#include "types.h" 	// Contains user defined types
+#include "common.h"	// Contains common strings
+#include "error.h"	// Contains standard error messages
+
+/* Name of the index file kept inside a cover pool directory, and its mode */
+#define COVER_INDEX_FNAME ".steg_cover_index"
+#define COVER_INDEX_MODE 0644
+
+/* First line of an index file, bumped whenever the line layout changes */
+#define COVER_INDEX_SIGNATURE "STEG-COVER-INDEX 2"
+
+/*
+ * Structure describing one cover of a pool, as recorded in the index.
+ * The mtime, to the nanosecond, and size tell whether the file changed
+ * since it was indexed;
+ * the rest is derived from the BMP header. Images the row pipeline cannot
+ * use are kept with zero capacities so that they are not parsed again.
+ */
+typedef struct _CoverEntry
+{
+    char *name;			// File name inside the pool directory
+    struct timespec mtime;
+    long long size;
+    uint width;
+    uint height;
+    uint bits_per_pixel;
+    uint data_offset;
+    uint capacity;		// Message bytes it can carry
+    uint capacity_skip_alpha;	// Same with --skip-alpha, 0 unless 32 bpp
+    int seen;			// Found by the latest directory scan
+
+} CoverEntry;
+
+/*
+ * Structure to store the index of a cover pool directory. Entries are
+ * kept sorted by name, which is also the order of the index file.
+ */
+typedef struct _CoverPool
+{
+    const char *dir;
+    CoverEntry *entries;
+    uint count;
+    uint allocated;
+    int changed;		// The index file needs rewriting
+
+} CoverPool;
+
+/* Cover pool function prototypes */
+
+/* Load the index of a pool directory and bring it up to date */
+Status load_cover_pool(const char *dir, CoverPool *pool);
+
+/* Rescan the pool directory, parsing only new or changed covers */
+Status refresh_cover_pool(CoverPool *pool);
+
+/* Write the index file of the pool */
+Status save_cover_pool(const CoverPool *pool);
+
+/* Find the smallest cover that can carry the message */
+const CoverEntry *find_best_fit_cover(const CoverPool *pool, uint message_size, int skip_alpha);
+
+/* Release the memory held by a pool */
+void free_cover_pool(CoverPool *pool);
+
+/* Pick a cover for a message from a pool directory */
+Status select_pool_cover(const char *dir, uint message_size, int skip_alpha, char **cover_fname);
+
+#endif
@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#if defined(__SSE4_2__) && defined(__x86_64__)
+#include <nmmintrin.h>
+#define CRC32C_HARDWARE
+#endif
+#include "crc32c.h"
+#include "types.h"
+#include "error.h"
+
+#if !defined(CRC32C_HARDWARE)
+/* Byte at a time table for the reflected polynomial 0x82F63B78 */
+static uint32_t crc32c_table[256];
+
+static pthread_once_t crc32c_table_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Function to fill the CRC-32C table. It runs once, through
+ * pthread_once(), before the first use of the table.
+ */
+static void init_crc32c_table(void)
+{
+    for(uint32_t n = 0; n < 256; ++n)
+    {
+	uint32_t crc = n;
+	for(int bit = 0; bit < 8; ++bit)
+	    crc = (crc >> 1) ^ ((crc & 1)? 0x82F63B78: 0);
+	crc32c_table[n] = crc;
+    }
+}
+#endif
+
+/* Function Definitions */
+
+/*
+ * Function to compute the CRC-32C (Castagnoli) checksum of some data.
+ *
+ * The checksum of data given in pieces is computed by passing the result
+ * for the previous pieces back in, starting from 0. With SSE4.2 the CRC32
+ * instruction handles 8 bytes per step on x86-64; otherwise a byte at a time table
+ * is used.
+ *
+ * INPUTS: The checksum so far, the data and its length.
+ *
+ * RETURNS: The updated checksum.
+ */
+uint32_t crc32c_update(uint32_t crc, const unsigned char *data, size_t len)
+{
+    if(!data && len)
+    {
+	FATAL_ERR_MSG;
+	return crc;
+    }
+
+    crc = ~crc;
+    size_t i = 0;
+#if defined(CRC32C_HARDWARE)
+    uint64_t crc64 = crc;
+    for(; i + 8 <= len; i += 8)
+    {
+	uint64_t word;
+	memcpy(&word, data + i, sizeof(word));
+	crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = crc64;
+    for(; i < len; ++i)
+	crc = _mm_crc32_u8(crc, data[i]);
+#else
+    pthread_once(&crc32c_table_once, init_crc32c_table);
+    for(; i < len; ++i)
+	crc = (crc >> 8) ^ crc32c_table[(crc ^ data[i]) & 0xFF];
+#endif
+    return ~crc;
+}
@@ -0,0 +1,14 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "types.h" 	// Contains user defined types
+#include "error.h"	// Contains standard error messages
+
+/* CRC-32C (Castagnoli) function prototypes */
+
+/* Continue a CRC-32C over more data, starting from 0 */
+uint32_t crc32c_update(uint32_t crc, const unsigned char *data, size_t len);
+
+#endif
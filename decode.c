@@ -2,10 +2,42 @@
 #include <string.h>
 #include <stdlib.h>
 #include "decode.h"
+#include "lsb.h"
+#include "directio.h"
+#include "chacha20.h"
+#include "fec.h"
+#include "decodecache.h"
 #include "types.h"
 #include "error.h"
 #include "common.h"
 
+/*
+ * Function to read the next bytes of the encoded message: from the image,
+ * or from the repaired message when it was protected with --fec.
+ *
+ * INPUTS: The DecodeInfo object, with the row cursor set up, the output
+ * bytes and their count.
+ *
+ * RETURNS: Operation status enum: e_success or e_failure.
+ */
+Status read_message(DecodeInfo *decInfo, unsigned char *data, uint len)
+{
+    if(!decInfo || !data)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    if(!decInfo->fec_message)
+	return lsb_cursor_read(&decInfo->lsb_cursor, data, len);
+
+    if(len > decInfo->fec_message_len - decInfo->fec_message_pos)
+	return e_failure;
+    memcpy(data, decInfo->fec_message + decInfo->fec_message_pos, len);
+    decInfo->fec_message_pos += len;
+    return e_success;
+}
+
 /*
  * Function to check the validity of arguments input by the user and
  * return the status.
@@ -17,6 +49,9 @@
  * Decoding requires an input image file name and an optional argument for the output
  * file name, in that order.
  *
+ * Optional "--" arguments may appear anywhere after the operation argument;
+ * they are read into the options member and removed from argv first.
+ *
  * If all inputs are valid, this function initialized the names of the
  * input files in the appropriate fields of the DecodeInfo object that
  * is passed by reference into this function. If no output file name is
@@ -35,13 +70,18 @@ Status read_and_validate_decode_args(char *argv[], DecodeInfo *decInfo)
 	return e_failure;
     }
 
+    memset(decInfo, 0, sizeof(*decInfo));
+    if(read_steg_options(argv, &decInfo->options) == e_failure)
+	return e_failure;
+    progress_init(&decInfo->progress, &decInfo->options);
+
     if(!argv[2])
     {
 	fprintf(stderr, "Error: Please input a %s file as the second argument:\n%s <%s/%s> <image%s>\n", IMG_FILE_EXTN, argv[0], ENCODE_ARG, DECODE_ARG, IMG_FILE_EXTN);
 	return e_failure;
     }
 
-    if(!strstr(argv[2], ".bmp"))
+    if(!strstr(argv[2], ".bmp") && !is_stdio_file_name(argv[2]))
     {
 	fprintf(stderr, "Error: Please input a %s file as the second argument:\n%s <%s/%s> <image%s>\n", IMG_FILE_EXTN, argv[0], ENCODE_ARG, DECODE_ARG, IMG_FILE_EXTN);
 	return e_failure;
@@ -62,13 +102,18 @@ Status read_and_validate_decode_args(char *argv[], DecodeInfo *decInfo)
  *
  * This functon calls functions to carry out below operations in succession
  *	- Open the image file
+ *	- Parse the image header
  *	- Locate the magic string
  *	- Extract the file extension of the encoded data
  *	- Create the output file
  *	- Copy the encoded data to the output file.
  *
+ * With --cache-dir, the decode cache is looked up once the image is open.
+ * On a hit the cached payload is delivered instead and no pixel data is
+ * read at all; on a miss the payload decoded is added to the cache.
+ *
  * Failure of any one of the above operation leads to the termination of 
- * the program.
+ * the program, after the files opened so far are closed.
  *
  * INPUTS: The DecodeInfo object and the user given output file name.
  *
@@ -82,18 +127,50 @@ Status do_decoding(char *user_given_destegged_file_name, DecodeInfo *decInfo)
 	return e_failure;
     }
 
+    telemetry_job_begin(&decInfo->telemetry, e_telemetry_decode);
     Status file_opening_status = open_files_for_decoding(decInfo);
     if(file_opening_status == e_failure)
     {
 	fprintf(stderr, "File opening failed.\n");
+	cleanup_decoding(decInfo);
 	return e_failure;
     }
     printf("Image file opening succeeded.\n");
 
-    Status find_magic_string_status = find_magic_string(decInfo->fptr_stego_image);
+    int cache_hit = 0;
+    if(decInfo->options.cache_dir)
+	telemetry_job_stage(&decInfo->telemetry, e_telemetry_cache);
+    if(decInfo->options.cache_dir && decode_cache_fetch(decInfo, user_given_destegged_file_name, &cache_hit) == e_failure)
+    {
+	fprintf(stderr, "Cached data copy failed.\n");
+	cleanup_decoding(decInfo);
+	return e_failure;
+    }
+    if(cache_hit)
+    {
+	if(decInfo->secret_fname)
+	    printf("Cached data copied to output file: %s\n", decInfo->secret_fname);
+	else
+	    printf("Cached data copied to memory.\n");
+	telemetry_job_stage(&decInfo->telemetry, e_telemetry_done);
+	cleanup_decoding(decInfo);
+	return e_success;
+    }
+
+    telemetry_job_stage(&decInfo->telemetry, e_telemetry_header);
+    Status header_parse_status = read_bmp_image_info(decInfo->fptr_stego_image, &decInfo->stego_image_info);
+    if(header_parse_status == e_failure)
+    {
+	fprintf(stderr, "Image header parsing failed.\n");
+	cleanup_decoding(decInfo);
+	return e_failure;
+    }
+
+    Status find_magic_string_status = find_magic_string(decInfo);
     if(find_magic_string_status == e_failure)
     {
 	fprintf(stderr, "The input image file contains no data encoded/stegged\n");
+	cleanup_decoding(decInfo);
 	return e_failure;
     }
     printf("Magic string detected.\n");
@@ -102,37 +179,101 @@ Status do_decoding(char *user_given_destegged_file_name, DecodeInfo *decInfo)
     if(get_secret_data_file_extn_status == e_failure)
     {
 	fprintf(stderr, "Secret data file extension acquisition failed\n");
+	cleanup_decoding(decInfo);
 	return e_failure;
     }
     printf("Encoded data file extension acquired.\n");
 
+    telemetry_job_stage(&decInfo->telemetry, e_telemetry_setup);
     Status create_secret_data_file_status = create_secret_data_file(decInfo, user_given_destegged_file_name);
     if(create_secret_data_file_status == e_failure)
     {
 	fprintf(stderr, "Secret data file creation failed\n");
+	cleanup_decoding(decInfo);
 	return e_failure;
     }
-    printf("Output file created.\n");
+    if(decInfo->secret_fname)
+	printf("Output file created.\n");
 
+    telemetry_job_stage(&decInfo->telemetry, e_telemetry_extract);
     Status copy_secret_data_to_secret_data_file_status = copy_data_to_secret_data_file(decInfo);
     if(copy_secret_data_to_secret_data_file_status == e_failure)
     {
 	fprintf(stderr, "Secret data copy failed.\n");
+	cleanup_decoding(decInfo);
 	return e_failure;
     }
-    printf("Encoded data copied to output file: %s\n", decInfo->secret_fname);
 
-    free(decInfo->secret_fname);
-    fclose(decInfo->fptr_stego_image);
-    fclose(decInfo->fptr_secret);
+    telemetry_job_stage(&decInfo->telemetry, e_telemetry_commit);
+    if(commit_secret_data_file(decInfo) == e_failure)
+    {
+	fprintf(stderr, "Output file commit failed.\n");
+	cleanup_decoding(decInfo);
+	return e_failure;
+    }
+    if(decInfo->secret_fname)
+	printf("Encoded data copied to output file: %s\n", decInfo->secret_fname);
+    else
+	printf("Encoded data decoded in memory.\n");
+
+    if(decInfo->options.cache_dir)
+	telemetry_job_stage(&decInfo->telemetry, e_telemetry_store);
+    if(decInfo->options.cache_dir && decode_cache_store(decInfo) == e_success)
+	printf("Decoded data cached.\n");
+
+    telemetry_job_stage(&decInfo->telemetry, e_telemetry_done);
+    cleanup_decoding(decInfo);
     return e_success;
 }
 
+/*
+ * Function to cleanup resources after finishing decoding.
+ *
+ * This function closes the image file and the output file and frees the
+ * dynamically allocated memory held by the DecodeInfo object. Files that
+ * were never opened are skipped, so it is safe to call after a failure at
+ * any stage of the decoding. Closing an in-memory output stream finalises
+ * output_data and output_size, which are left for the caller to free.
+ * An output file that was not committed with commit_secret_data_file() is
+ * removed.
+ *
+ * INPUTS: The DecodeInfo object.
+ *
+ * RETURNS: Nothing.
+ */
+void cleanup_decoding(DecodeInfo *decInfo)
+{
+    if(!decInfo)
+    {
+	FATAL_ERR_MSG;
+	return;
+    }
+
+    telemetry_job_end(&decInfo->telemetry);
+    arena_release(decInfo->arena, decInfo->secret_fname);
+    decInfo->secret_fname = NULL;
+    arena_release(decInfo->arena, decInfo->fec_message);
+    decInfo->fec_message = NULL;
+    lsb_cursor_free(&decInfo->lsb_cursor);
+    if(decInfo->fptr_stego_image)
+	fclose(decInfo->fptr_stego_image);
+    if(decInfo->fptr_secret)
+	fclose(decInfo->fptr_secret);
+    if(decInfo->secret_temp_fname)
+	remove(decInfo->secret_temp_fname);
+    arena_release(decInfo->arena, decInfo->secret_temp_fname);
+    decInfo->secret_temp_fname = NULL;
+    decInfo->fptr_stego_image = NULL;
+    decInfo->fptr_secret = NULL;
+}
+
 /*
  * Function to open files for decoding.
  *
  * This function opens one file: the image file with encoded information for further
- * processing.
+ * processing. If the caller has already set up the image stream, it is used as it is.
+ * STDIO_FILE_NAME stands for the standard input, and --direct-io reads the
+ * image with O_DIRECT.
  *
  * INPUTS: The DecodeInfo object.
  *
@@ -146,7 +287,8 @@ Status open_files_for_decoding(DecodeInfo *decInfo)
 	return e_failure;
     }
 
-    decInfo->fptr_stego_image = fopen(decInfo->stego_image_fname, "rb");
+    if(!decInfo->fptr_stego_image)
+	decInfo->fptr_stego_image = open_image_stream(decInfo->stego_image_fname, "rb", decInfo->options.direct_io, decInfo->arena);
     if (decInfo->fptr_stego_image == NULL)
     {
 	perror("fopen");
@@ -193,99 +335,142 @@ int atoi(const char str[])
 }
 
 /*
- * Function to read encoded data from a byte array of MAX_IMAGE_BUF_SIZE
- * bytes.
- *
- * This function takes in a char buffer of 8 bytes, takes the LSB of each
- * consecutive byte and puts it into successive bits of the output char,
- * starting from the LSB of the output char.
+ * Function to check if the input string is magic string.
  *
- * INPUTS: The data char to which data has to be read and the pointer to
- * the buffer from which the data has to be extracted.
+ * INPUTS: The pointer to the string to be checked.
  *
- * RETURNS: Operation status enum: e_success or e_failure.
+ * REUTRNS: e_success if there is a match, e_failure otherwise.
  */
-Status get_data_from_byte_array(char *data, char *byte_buffer)
+Status is_magic_string(const char *str)
 {
-    if(!data || !byte_buffer)
+    if(!str)
     {
 	FATAL_ERR_MSG;
 	return e_failure;
     }
-
-    *data = 0;
-    for(int i = 0; i < MAX_IMAGE_BUF_SIZE; ++i)
-	*data = *data | ((byte_buffer[i] & 1) << i);
-    return e_success;
+    return strncmp(str, MAGIC_STRING, strlen(MAGIC_STRING))? e_failure: e_success;
 }
 
 /*
- * Function to check if the input string is magic string.
+ * Function to check if the given .bmp file has MAGIC_STRING encoded in it.
  *
- * INPUTS: The pointer to the string to be checked.
+ * This function moves forward from the end of the parsed header to the pixel
+ * data offset recorded in the BmpImage descriptor, without seeking so that
+ * piped images work too, sets up the row cursor there (in the keyed order,
+ * if a key is given) and checks if the first carrier 
+ * bytes have the MAGIC_STRING encoded in it. This signifies that a message 
+ * has been encoded in the image file. With --fec, the protected message is
+ * read and repaired first and the check is made on it.
  *
- * REUTRNS: e_success if there is a match, e_failure otherwise.
+ * INPUTS: The DecodeInfo object.
+ *
+ * RETURNS: e_success if MAGIC_STRING is found, e_failure otherwise.
  */
-Status is_magic_string(const char *str)
+Status find_magic_string(DecodeInfo *decInfo)
 {
-    if(!str)
+    if(!decInfo || !decInfo->fptr_stego_image)
     {
 	FATAL_ERR_MSG;
 	return e_failure;
     }
-    return strncmp(str, MAGIC_STRING, strlen(MAGIC_STRING))? e_failure: e_success;
+
+    FILE *fptr_steg_img = decInfo->fptr_stego_image;
+    if(skip_stream_bytes(fptr_steg_img, decInfo->stego_image_info.data_offset - BMP_PARSED_HEADER_SIZE) == e_failure)
+	return e_failure;
+
+    if(lsb_cursor_init(&decInfo->lsb_cursor, &decInfo->stego_image_info, fptr_steg_img, NULL, decInfo->options.skip_alpha, decInfo->arena) == e_failure ||
+	    lsb_cursor_use_options_key(&decInfo->lsb_cursor, &decInfo->options) == e_failure)
+	return e_failure;
+
+    if(decInfo->options.fec_parity && read_fec_message(decInfo) == e_failure)
+	return e_failure;
+
+    char magic_str[sizeof(MAGIC_STRING)] = {0};
+    if(read_message(decInfo, (unsigned char *)magic_str, strlen(MAGIC_STRING)) == e_failure)
+    {
+	fprintf(stderr, "Data fetch failed while searching for magic string.\n");
+	return e_failure;
+    }
+    return is_magic_string(magic_str);
 }
 
 /*
- * Function to check if the given .bmp file has MAGIC_STRING encoded in it.
+ * Function to read and repair a message protected with --fec.
  *
- * This function seeks to the BMP_HEADER_SIZEth position in the input file and
- * checks if the first bytes have the MAGIC_STRING encoded in it. This signifies
- * that a message has been encoded in the image file.
+ * This function reads the frame header codeword from the row cursor,
+ * repairs it and works out the layout of the protected message from the
+ * message length it holds. It then reads the whole body, LSB_CHUNK_SIZE
+ * bytes at a time, repairs it a codeword group at a time and keeps the
+ * message in the DecodeInfo object, from which the remaining decoding
+ * steps read instead of the image. The progress is reported and the
+ * operation stops if the job has been cancelled along the way.
  *
- * INPUTS: The image file pointer.
+ * INPUTS: The DecodeInfo object, with the row cursor set up.
  *
- * RETURNS: e_success if MAGIC_STRING is found, e_failure otherwise.
+ * RETURNS: Operation status enum: e_success or e_failure.
  */
-Status find_magic_string(FILE *fptr_steg_img)
+Status read_fec_message(DecodeInfo *decInfo)
 {
-    if(!fptr_steg_img)
+    if(!decInfo)
     {
 	FATAL_ERR_MSG;
 	return e_failure;
     }
 
-    int bmp_image_data_offset = get_image_data_offset(fptr_steg_img);
-    fseek(fptr_steg_img, bmp_image_data_offset/*BMP_HEADER_SIZE*/, SEEK_SET);
-    if(ferror(fptr_steg_img))
+    uint parity_len = decInfo->options.fec_parity;
+    unsigned char header[FEC_HEADER_DATA_SIZE + FEC_MAX_PARITY];
+    uint message_len = 0;
+    uint header_fixed = 0;
+    if(lsb_cursor_read(&decInfo->lsb_cursor, header, fec_header_size(parity_len)) == e_failure ||
+	    fec_decode_header(header, parity_len, &message_len, &header_fixed) == e_failure)
+	return e_failure;
+
+    FecLayout layout;
+    uint capacity = lsb_image_capacity(&decInfo->stego_image_info, decInfo->options.skip_alpha);
+    if(fec_get_layout(message_len, parity_len, &layout) == e_failure || fec_encoded_size(message_len, parity_len) > capacity)
     {
-	FILE_SEEK_ERR;
+	fprintf(stderr, "The FEC frame header holds an invalid message length.\n");
 	return e_failure;
     }
 
-    char magic_str[strlen(MAGIC_STRING)];
-    for(int i = 0; i < strlen(MAGIC_STRING); ++i)
+    size_t body_len = fec_body_size(&layout);
+    unsigned char *body = arena_alloc(decInfo->arena, body_len);
+    decInfo->fec_message = arena_alloc(decInfo->arena, message_len);
+    if(!body || !decInfo->fec_message)
     {
-	char byte_arr[MAX_IMAGE_BUF_SIZE];
-	fread(byte_arr, MAX_IMAGE_BUF_SIZE, 1, fptr_steg_img);
-
-	if(feof(fptr_steg_img) || ferror(fptr_steg_img))
-	    break;
+	FATAL_ERR_MSG;
+	arena_release(decInfo->arena, body);
+	return e_failure;
+    }
 
-	Status get_data_status = get_data_from_byte_array(magic_str + i, byte_arr);
-	if(get_data_status == e_failure)
-	{
-	    fprintf(stderr, "Data fetch failed while searching for magic string.\n");
-	    return e_failure;
-	}
+    uint body_fixed = 0;
+    Status status = e_success;
+    progress_begin(&decInfo->progress, "Reading", body_len);
+    for(size_t done = 0; done < body_len && status == e_success;)
+    {
+	size_t chunk = body_len - done < LSB_CHUNK_SIZE? body_len - done: LSB_CHUNK_SIZE;
+	status = lsb_cursor_read(&decInfo->lsb_cursor, body + done, chunk);
+	done += chunk;
+	if(status == e_success)
+	    status = progress_update(&decInfo->progress, done);
     }
-    return is_magic_string(magic_str);
+    if(status == e_success)
+	status = fec_decode_body(body, &layout, decInfo->fec_message, &body_fixed, &decInfo->progress);
+    arena_release(decInfo->arena, body);
+    if(status == e_failure)
+	return e_failure;
+
+    decInfo->fec_message_len = message_len;
+    decInfo->fec_message_pos = 0;
+    if(header_fixed + body_fixed)
+	printf("FEC repaired %u damaged bytes.\n", header_fixed + body_fixed);
+    return e_success;
 }
 
 /*
  * Function to read the file extension of the data encoded in image file.
  *
- * This function expects the file indicator to be at the position immediately 
+ * This function expects the row cursor to be at the carrier immediately 
  * after the MAGIC_STRING string and from which point it reads data until it 
  * encounters the ENC_DATA_SEPARATOR_STRING. At that point it stops reading 
  * and considers the data read till the ENC_DATA_SEPARATOR_STRING to be the 
@@ -304,29 +489,21 @@ Status get_secret_data_file_extn(DecodeInfo *decInfo)
 	return e_failure;
     }
 
-    FILE *fptr_steg_img = decInfo->fptr_stego_image;
-    if(!fptr_steg_img)
-    {
-	FATAL_ERR_MSG;
-	return e_failure;
-    }
-
     int i = 0;
     while(1)
     {
-	char byte_arr[MAX_IMAGE_BUF_SIZE];
-	fread(byte_arr, MAX_IMAGE_BUF_SIZE, 1, fptr_steg_img);
-
-	if(feof(fptr_steg_img) || ferror(fptr_steg_img))
-	    break;
+	if(i == MAX_FILE_SUFFIX)
+	{
+	    fprintf(stderr, "Encoded file extension is too long.\n");
+	    return e_failure;
+	}
 
-	Status get_data_status = get_data_from_byte_array(decInfo->extn_secret_file + i, byte_arr);
-	if(get_data_status == e_failure)
+	if(read_message(decInfo, (unsigned char *)decInfo->extn_secret_file + i, 1) == e_failure)
 	{
 	    fprintf(stderr, "Data fetch failed while fetching file extension.\n");
 	    return e_failure;
 	}
-	if(decInfo->extn_secret_file[i] == '*')
+	if(decInfo->extn_secret_file[i] == ENC_DATA_SEPARATOR_STRING[0])
 	    break;
 	++i;
     }
@@ -344,6 +521,14 @@ Status get_secret_data_file_extn(DecodeInfo *decInfo)
  * opens the file handle on the relevant member of the DecodeInfo object that is 
  * passed as an input to this function. This file will be used to save the decoded 
  * info further down the line.
+ *
+ * When inline_output is set, no file is created: the decoded data is collected in
+ * an in-memory stream whose buffer ends up in output_data and output_size. An
+ * output stream the caller has already set up is used as it is. In both cases
+ * secret_fname is left NULL, as there is no output file to name. A user given
+ * name of STDIO_FILE_NAME writes the data to the standard output. A file is
+ * written under a temporary name until commit_secret_data_file(), so that
+ * a failed or cancelled decoding never leaves a partial file behind.
  * 
  * INPUTS: The DecodeInfo object and the user given name for the output file.
  *
@@ -357,11 +542,23 @@ Status create_secret_data_file(DecodeInfo *decInfo, const char* user_given_name)
 	return e_failure;
     }
 
-    //char *secret_data_file_name = get_default_destegged_output_filename(user_given_name, decInfo->extn_secret_file);
-    decInfo->secret_fname = get_default_destegged_output_filename(user_given_name, decInfo->extn_secret_file);
-
-    //decInfo->fptr_secret = fopen(secret_data_file_name, "wb");
-    decInfo->fptr_secret = fopen(decInfo->secret_fname, "wb");
+    if(decInfo->fptr_secret)
+	return e_success;
+    if(decInfo->inline_output)
+	decInfo->fptr_secret = open_memstream(&decInfo->output_data, &decInfo->output_size);
+    else
+    {
+	//char *secret_data_file_name = get_default_destegged_output_filename(user_given_name, decInfo->extn_secret_file);
+	decInfo->secret_fname = get_default_destegged_output_filename(user_given_name, decInfo->extn_secret_file, decInfo->arena);
+	const char *secret_fname = decInfo->secret_fname;
+	if(secret_fname && !is_stdio_file_name(secret_fname))
+	{
+	    decInfo->secret_temp_fname = get_temp_output_filename(secret_fname, decInfo->arena);
+	    secret_fname = decInfo->secret_temp_fname;
+	}
+	if(secret_fname)
+	    decInfo->fptr_secret = open_data_stream(secret_fname, "wb");
+    }
     if(!decInfo->fptr_secret)
     {
 	perror("fopen");
@@ -372,50 +569,42 @@ Status create_secret_data_file(DecodeInfo *decInfo, const char* user_given_name)
 }
 
 /*
- * Function to copy the secret data into the output file.
+ * Function to read the size of the secret data encoded in the image.
  *
- * This function copies the encoded data into the output file in these steps
- *	- First, it reads the size of the secret data that is encoded in the image file. 
- *	  It expects this size to be encoded as a numeric string, which it then proceeds 
- *	  to convert to an integer type.
- *	- It then allocates the necessary amount of dynamic memory and reads the secret 
- *	  data encoded in the image file based on the size of the data it fetched in the 
- *	  previous step.
- *	- It then writes the contents of this buffer into the output file, which is then 
- *	  seen by the user.
+ * This function expects the row cursor to be right after the file
+ * extension. The size is encoded as a numeric string terminated by the
+ * ENC_DATA_SEPARATOR_STRING, which is converted to an integer type and
+ * checked against the capacity of the image.
  *
- * INPUTS: The DecodeInfo object.
+ * INPUTS: The DecodeInfo object and where to return the size.
  *
  * RETURNS: Operaton status enum: e_success or e_failure.
  */
-Status copy_data_to_secret_data_file(DecodeInfo *decInfo)
+Status get_secret_data_size(DecodeInfo *decInfo, uint *size)
 {
-    if(!decInfo)
+    if(!decInfo || !size)
     {
 	FATAL_ERR_MSG;
 	return e_failure;
     }
 
-    FILE *fptr_steg_img = decInfo->fptr_stego_image;
-
     //read the encoded file size
     int i = 0;
-    char msg_size[10];
+    char msg_size[MAX_FILE_SIZE_DIGITS + 1];
     while(1)
     {
-	char byte_arr[MAX_IMAGE_BUF_SIZE];
-	fread(byte_arr, MAX_IMAGE_BUF_SIZE, 1, fptr_steg_img);
-
-	if(feof(fptr_steg_img) || ferror(fptr_steg_img))
-	    break;
+	if(i == MAX_FILE_SIZE_DIGITS)
+	{
+	    fprintf(stderr, "Encoded secret data size is too long.\n");
+	    return e_failure;
+	}
 
-	Status get_data_status = get_data_from_byte_array(msg_size + i, byte_arr);
-	if(get_data_status == e_failure)
+	if(read_message(decInfo, (unsigned char *)msg_size + i, 1) == e_failure)
 	{
 	    fprintf(stderr, "Data fetch failed while fetching secret data size.\n");
 	    return e_failure;
 	}
-	if(msg_size[i] == '*')
+	if(msg_size[i] == ENC_DATA_SEPARATOR_STRING[0])
 	    break;
 	++i;
     }
@@ -425,44 +614,148 @@ Status copy_data_to_secret_data_file(DecodeInfo *decInfo)
 
     //convert the numeric string to integer
     int msg_size_i = atoi(msg_size);
+    if(msg_size_i <= 0 || (uint)msg_size_i > lsb_image_capacity(&decInfo->stego_image_info, decInfo->options.skip_alpha))
+    {
+	fprintf(stderr, "Encoded secret data size is invalid.\n");
+	return e_failure;
+    }
+    *size = msg_size_i;
+    return e_success;
+}
 
-    i = 0;
-    //allocate memory to store the secret message
-    char *secret_msg = malloc(msg_size_i + 1);
+/*
+ * Function to set up the decryption of secret data encoded with --encrypt,
+ * from the nonce that precedes the encrypted data.
+ *
+ * INPUTS: The DecodeInfo object, with the row cursor right after the
+ * secret data size, and the stream to set up.
+ *
+ * RETURNS: Operaton status enum: e_success or e_failure.
+ */
+Status get_secret_data_cipher(DecodeInfo *decInfo, ChaCha20 *cipher)
+{
+    if(!decInfo || !cipher)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
 
-    //read the encoded secret message.
-    for(int j = 0; j < msg_size_i; ++j)
+    unsigned char nonce[CHACHA20_NONCE_SIZE];
+    if(read_message(decInfo, nonce, sizeof(nonce)) == e_failure || chacha20_init_from_options(cipher, &decInfo->options, nonce) == e_failure)
     {
-	char byte_arr[MAX_IMAGE_BUF_SIZE];
-	fread(byte_arr, MAX_IMAGE_BUF_SIZE, 1, fptr_steg_img);
+	fprintf(stderr, "Decryption setup failed.\n");
+	return e_failure;
+    }
+    return e_success;
+}
 
-	if(feof(fptr_steg_img) || ferror(fptr_steg_img))
-	    break;
+/*
+ * Function to copy the secret data into the output file.
+ *
+ * This function copies the encoded data into the output file in these steps
+ *	- First, it reads the size of the secret data that is encoded in the image
+ *	  file with get_secret_data_size().
+ *	- It then reads the secret data encoded in the image file, based on the size of 
+ *	  the data it fetched in the previous step, LSB_CHUNK_SIZE bytes at a time.
+ *	- It writes each chunk into the output file, which is then seen by the user. The
+ *	  data is written as raw bytes, so binary secrets survive. With --encrypt, the 
+ *	  nonce is read first and each chunk is decrypted between the two steps.
+ *	- After each chunk, it reports the progress and stops if the job has been
+ *	  cancelled.
+ *
+ * INPUTS: The DecodeInfo object.
+ *
+ * RETURNS: Operaton status enum: e_success or e_failure.
+ */
+Status copy_data_to_secret_data_file(DecodeInfo *decInfo)
+{
+    if(!decInfo)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    uint secret_size;
+    if(get_secret_data_size(decInfo, &secret_size) == e_failure)
+	return e_failure;
+
+    //set up decryption with the nonce that precedes the encrypted data
+    ChaCha20 cipher;
+    if(decInfo->options.encrypt && get_secret_data_cipher(decInfo, &cipher) == e_failure)
+	return e_failure;
 
-	Status get_data_status = get_data_from_byte_array(secret_msg + i, byte_arr);
-	if(get_data_status == e_failure)
+    //read, decrypt and write the secret message a chunk at a time
+    unsigned char secret_msg[LSB_CHUNK_SIZE];
+    FILE *fptr_sec_data_file = decInfo->fptr_secret;
+    Status status = e_success;
+    progress_begin(&decInfo->progress, "Decoding", secret_size);
+    for(uint remaining = secret_size; remaining;)
+    {
+	uint chunk = remaining < LSB_CHUNK_SIZE? remaining: LSB_CHUNK_SIZE;
+	if(read_message(decInfo, secret_msg, chunk) == e_failure)
 	{
 	    fprintf(stderr, "Data fetch failed while fetching secret data.\n");
-	    return e_failure;
+	    status = e_failure;
+	    break;
+	}
+	if(decInfo->options.encrypt)
+	    chacha20_xor(&cipher, secret_msg, chunk);
+	if(fwrite(secret_msg, chunk, 1, fptr_sec_data_file) != 1)
+	{
+	    FILE_WRITE_ERR;
+	    status = e_failure;
+	    break;
+	}
+	remaining -= chunk;
+	if(progress_update(&decInfo->progress, secret_size - remaining) == e_failure)
+	{
+	    status = e_failure;
+	    break;
 	}
-	++i;
     }
+    if(status == e_success)
+	decInfo->telemetry.bytes = secret_size;
 
-    //append null terminator
-    secret_msg[i] = 0;
+    if(decInfo->options.encrypt)
+	memset(&cipher, 0, sizeof(cipher));
+    memset(secret_msg, 0, sizeof(secret_msg));
+    return status;
+}
 
-    //write decoded data to output file
-    FILE *fptr_sec_data_file = decInfo->fptr_secret;
-    fwrite(secret_msg, strlen(secret_msg), 1, fptr_sec_data_file);
-    if(ferror(fptr_sec_data_file))
+/*
+ * Function to rename the complete secret data file from its temporary name
+ * to its real name, which it only ever has complete. The stream is flushed
+ * but left open, for the decode cache to read the data back. Streams the
+ * caller set up, in-memory output and the standard output are only
+ * flushed.
+ *
+ * INPUTS: The DecodeInfo object.
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status commit_secret_data_file(DecodeInfo *decInfo)
+{
+    if(!decInfo || !decInfo->fptr_secret)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    if(fflush(decInfo->fptr_secret))
     {
 	FILE_WRITE_ERR;
-	free(secret_msg);
 	return e_failure;
     }
+    if(!decInfo->secret_temp_fname)
+	return e_success;
 
-    //free memory
-    free(secret_msg);
+    if(rename(decInfo->secret_temp_fname, decInfo->secret_fname))
+    {
+	FILE_WRITE_ERR;
+	return e_failure;
+    }
+    arena_release(decInfo->arena, decInfo->secret_temp_fname);
+    decInfo->secret_temp_fname = NULL;
     return e_success;
 }
 
@@ -473,25 +766,28 @@ Status copy_data_to_secret_data_file(DecodeInfo *decInfo)
  * file a default name that bears DEFAULT_DECODED_FILE_PREFIX, __TIME__ and DEFAULT_DECODED_FILE_SUFFIX 
  * along with the input file extension string.
  *
- * CAUTION: This function dynamically allocates memory for the output character array and must be 
- * deallocated at a later point in time.
+ * CAUTION: The output character array is allocated from the arena, or from the heap without one,
+ * and must be given back with arena_release() at a later point in time.
  *
- * INPUTS: User suggested output filename pointer.
+ * INPUTS: User suggested output filename pointer, the file extension and the arena (may be NULL).
  *
  * RETURNS: A character pointer to the output file name character array.
  */
-char *get_default_destegged_output_filename(const char* user_given_name, const char *file_extn)
+char *get_default_destegged_output_filename(const char* user_given_name, const char *file_extn, Arena *arena)
 {
     char *ofile_name = NULL;
 
     if(user_given_name)
     {
-	ofile_name = malloc(strlen(user_given_name + 1));
-	strcpy(ofile_name, user_given_name);
+	ofile_name = arena_alloc(arena, strlen(user_given_name) + 1);
+	if(ofile_name)
+	    strcpy(ofile_name, user_given_name);
 	return ofile_name;
     }
 
-    ofile_name = malloc(strlen(DEFAULT_DECODED_FILE_PREFIX) + strlen(__TIME__) + strlen(DEFAULT_DECODED_FILE_SUFFIX) + strlen(file_extn) + 1);
+    ofile_name = arena_alloc(arena, strlen(DEFAULT_DECODED_FILE_PREFIX) + strlen(__TIME__) + strlen(DEFAULT_DECODED_FILE_SUFFIX) + strlen(file_extn) + 1);
+    if(!ofile_name)
+	return NULL;
     strcpy(ofile_name, DEFAULT_DECODED_FILE_PREFIX);
     strcat(ofile_name, __TIME__);
     strcat(ofile_name, DEFAULT_DECODED_FILE_SUFFIX);
@@ -4,6 +4,10 @@
 #include "types.h" 	// Contains user defined types
 #include "common.h"	// Contains common strings
 #include "error.h"	// Contains standard error messages
+#include "lsb.h"	// Contains the LSB row pipeline
+#include "chacha20.h"	// Contains the ChaCha20 stream cipher
+#include "telemetry.h"	// Contains the job stats
+#include "progress.h"	// Contains the progress reports and cancellation
 
 /* 
  * Structure to store information required for
@@ -17,11 +21,30 @@ typedef struct _DecodeInfo
     /* Secret File Info */
     char *secret_fname;
     FILE *fptr_secret;
+    char *secret_temp_fname;	// Name written under until complete, set if create_secret_data_file() created the file
     char extn_secret_file[MAX_FILE_SUFFIX];
 
+    /* In-memory output, filled instead of a file when inline_output is set */
+    int inline_output;
+    char *output_data;
+    size_t output_size;
+
     /* Stego Image Info */
     char *stego_image_fname;
     FILE *fptr_stego_image;
+    BmpImage stego_image_info;
+
+    /* Options and the row cursor shared by the decoding stages */
+    StegOptions options;
+    Arena *arena;		// Arena the scratch memory comes from, NULL for the heap
+    LsbCursor lsb_cursor;
+    TelemetryJob telemetry;	// Stage timings for --stats-file and --trace
+    Progress progress;		// Progress reports and cancellation of the data loop
+
+    /* Message repaired with --fec, read from memory instead of the image */
+    unsigned char *fec_message;
+    uint fec_message_len;
+    uint fec_message_pos;
 
 } DecodeInfo;
 
@@ -33,14 +56,17 @@ Status read_and_validate_decode_args(char *argv[], DecodeInfo *decInfo);
 /* Perform the encoding */
 Status do_decoding(char *user_given_destgged_file_name, DecodeInfo *decInfo);
 
+/* Function to release allocated memory and close files after decoding */
+void cleanup_decoding(DecodeInfo *decInfo);
+
 /* Get File pointers for i/p and o/p files */
 Status open_files_for_decoding(DecodeInfo *decInfo);
 
-/* Find the magic string in the image file */
-Status find_magic_string(FILE *fptr_steg_img);
+/* Read and repair a message protected with forward error correction */
+Status read_fec_message(DecodeInfo *decInfo);
 
-/* Get the encoded data inside a byte array of 8 bytes */
-Status get_data_from_byte_array(char *data, char *byte_buffer);
+/* Find the magic string in the image file */
+Status find_magic_string(DecodeInfo *decInfo);
 
 /* Check if the given string is the magic string */
 Status is_magic_string(const char *str);
@@ -51,11 +77,23 @@ Status get_secret_data_file_extn(DecodeInfo *decInfo);
 /* Create the secret data file */
 Status create_secret_data_file(DecodeInfo *decInfo, const char* user_given_name);
 
+/* Read the next bytes of the encoded message */
+Status read_message(DecodeInfo *decInfo, unsigned char *data, uint len);
+
+/* Get the secret data size */
+Status get_secret_data_size(DecodeInfo *decInfo, uint *size);
+
+/* Set up the decryption of the secret data */
+Status get_secret_data_cipher(DecodeInfo *decInfo, ChaCha20 *cipher);
+
 /* Copy the secret data to the secret data file */
 Status copy_data_to_secret_data_file(DecodeInfo *decInfo);
 
+/* Rename the complete secret data file into place */
+Status commit_secret_data_file(DecodeInfo *decInfo);
+
 /* Function to get a default output file name */
 //char *get_default_destegged_output_filename(const char* input_filename, const char* user_given_name, const char *file_extn);
-char *get_default_destegged_output_filename(const char* user_given_name, const char *file_extn);
+char *get_default_destegged_output_filename(const char* user_given_name, const char *file_extn, Arena *arena);
 
 #endif
@@ -0,0 +1,576 @@
+/* copy_file_range() */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include "decodecache.h"
+#include "decode.h"
+#include "chacha20.h"
+#include "types.h"
+#include "error.h"
+
+/*
+ * Size estimate of the cache this process last trimmed: its size after
+ * the trim plus what the process stored in it since, guarded by the lock
+ */
+static pthread_mutex_t cache_usage_lock = PTHREAD_MUTEX_INITIALIZER;
+static char cache_usage_dir[PATH_MAX];
+static unsigned long long cache_usage_bytes;
+
+/* Function Definitions */
+
+/*
+ * Function to build a path inside a directory into a PATH_MAX buffer.
+ */
+static Status get_cache_path(char path[PATH_MAX], const char *dir, const char *name)
+{
+    int len = snprintf(path, PATH_MAX, "%s/%s", dir, name);
+    return (len < 0 || len >= PATH_MAX)? e_failure: e_success;
+}
+
+/*
+ * Function to find the payload file of an entry whose name starts with
+ * the given prefix and is followed by an extension, and copy its name.
+ */
+static Status find_cached_payload(const char *entry_path, const char *prefix, char payload_name[DECODE_CACHE_NAME_SIZE])
+{
+    DIR *dir = opendir(entry_path);
+    if(!dir)
+	return e_failure;
+
+    Status status = e_failure;
+    size_t prefix_len = strlen(prefix);
+    for(struct dirent *dirent = readdir(dir); dirent; dirent = readdir(dir))
+    {
+	if(!strncmp(dirent->d_name, prefix, prefix_len) && strlen(dirent->d_name) < DECODE_CACHE_NAME_SIZE)
+	{
+	    strcpy(payload_name, dirent->d_name);
+	    status = e_success;
+	    break;
+	}
+    }
+    closedir(dir);
+    return status;
+}
+
+/*
+ * Function to copy a whole file into another one, sharing its blocks when
+ * the file system supports reflinks and copying in the kernel otherwise.
+ * The source offset is left alone.
+ */
+static Status clone_file(int src_fd, int dest_fd, off_t size)
+{
+    if(!ioctl(dest_fd, FICLONE, src_fd))
+	return e_success;
+
+    loff_t offset = 0;
+    while(offset < size)
+    {
+	ssize_t copied = copy_file_range(src_fd, &offset, dest_fd, NULL, size - offset, 0);
+	if(copied < 0 && errno == EINTR)
+	    continue;
+	if(copied <= 0)
+	    return e_failure;
+    }
+    return e_success;
+}
+
+/*
+ * Function to create a new file next to a path, under a random name, for
+ * an output to be renamed over the path once it is complete.
+ */
+static int open_temp_beside(const char *path, char temp_path[PATH_MAX])
+{
+    unsigned char random[8];
+    if(fill_random_bytes(random, sizeof(random)) == e_failure)
+	return -1;
+    int len = snprintf(temp_path, PATH_MAX, "%s.%02x%02x%02x%02x%02x%02x%02x%02x.tmp", path,
+	    random[0], random[1], random[2], random[3], random[4], random[5], random[6], random[7]);
+    if(len < 0 || len >= PATH_MAX)
+	return -1;
+    return open(temp_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+}
+
+/*
+ * Function to put a cached payload in place as the output file. The
+ * output is built under a temporary name, as a reflink of the payload or
+ * as a copy of it, and then renamed over the output path. It is never a
+ * hard link: the output is the user's to change, and a link would share
+ * the payload inode and carry every change into the cache.
+ */
+static Status link_cached_payload(int payload_fd, off_t size, const char *output_path)
+{
+    char temp_path[PATH_MAX];
+    int fd = open_temp_beside(output_path, temp_path);
+    if(fd < 0)
+	return e_failure;
+
+    Status status = clone_file(payload_fd, fd, size);
+    if(close(fd))
+	status = e_failure;
+    if(status == e_failure || rename(temp_path, output_path))
+    {
+	unlink(temp_path);
+	return e_failure;
+    }
+    return e_success;
+}
+
+/*
+ * Function to copy a cached payload into the output stream.
+ */
+static Status copy_cached_payload(int payload_fd, FILE *fptr_secret, Arena *arena)
+{
+    unsigned char *buffer = arena_alloc(arena, COPY_BLOCK_SIZE);
+    if(!buffer)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    Status status = e_success;
+    off_t offset = 0;
+    while(status == e_success)
+    {
+	ssize_t got = pread(payload_fd, buffer, COPY_BLOCK_SIZE, offset);
+	if(got < 0 && errno == EINTR)
+	    continue;
+	if(got <= 0)
+	{
+	    status = got? e_failure: e_success;
+	    break;
+	}
+	if(fwrite(buffer, got, 1, fptr_secret) != 1)
+	    status = e_failure;
+	offset += got;
+    }
+    arena_release(arena, buffer);
+    return status;
+}
+
+/*
+ * Function to remove an entry: it is first renamed to a temporary name,
+ * so that other processes stop finding it at once, and then emptied and
+ * removed. Processes that already opened its payload keep reading it.
+ */
+static void remove_cache_entry(const char *cache_dir, const char *name)
+{
+    char path[PATH_MAX], temp_path[PATH_MAX], file_path[PATH_MAX];
+    if(get_cache_path(path, cache_dir, name) == e_failure ||
+	    get_cache_path(temp_path, cache_dir, DECODE_CACHE_TEMP_PREFIX "XXXXXX") == e_failure)
+	return;
+
+    // Temporary entries are already private to whoever removes them.
+    if(strncmp(name, DECODE_CACHE_TEMP_PREFIX, strlen(DECODE_CACHE_TEMP_PREFIX)))
+    {
+	if(!mkdtemp(temp_path))
+	    return;
+	if(rename(path, temp_path))
+	{
+	    rmdir(temp_path);
+	    return;
+	}
+	strcpy(path, temp_path);
+    }
+
+    DIR *dir = opendir(path);
+    if(dir)
+    {
+	for(struct dirent *dirent = readdir(dir); dirent; dirent = readdir(dir))
+	    if(strcmp(dirent->d_name, ".") && strcmp(dirent->d_name, "..") && get_cache_path(file_path, path, dirent->d_name) == e_success)
+		unlink(file_path);
+	closedir(dir);
+    }
+    rmdir(path);
+}
+
+/*
+ * Function to order cache entries from the least recently used, for qsort().
+ */
+static int compare_entry_atimes(const void *a, const void *b)
+{
+    const struct timespec *ta = &((const DecodeCacheEntry *)a)->atime;
+    const struct timespec *tb = &((const DecodeCacheEntry *)b)->atime;
+    if(ta->tv_sec != tb->tv_sec)
+	return ta->tv_sec < tb->tv_sec? -1: 1;
+    return (ta->tv_nsec > tb->tv_nsec) - (ta->tv_nsec < tb->tv_nsec);
+}
+
+/*
+ * Function to build the name of the cache entry holding the payload of an
+ * image decoded with the given options.
+ *
+ * The image is identified by its device, inode, size and modification
+ * time, so that a lookup costs one stat() and no pixel data is read; any
+ * change to the file makes a new name. The name also records every option
+ * that changes what decodes out of the image, the key included: it selects
+ * the carriers and the keystream, so the name carries a fingerprint of the
+ * key, made with chacha20_hash() from the key hash loaded with the options
+ * and telling nothing about the key.
+ *
+ * The payload of an entry is named after the payload prefix, which holds a
+ * second hash of the key in another domain, followed by the extension.
+ * Lookups only take a payload under their own prefix, so even if two keys
+ * ever shared an entry name, the wrong key would still miss the cache.
+ *
+ * Images read from a pipe or a memory stream, and messages encoded with
+ * --encrypt, whose payload must not be stored in the clear, have no entry.
+ *
+ * INPUTS: The DecodeInfo object, with the image opened, and where to
+ * return the entry name and the payload prefix.
+ *
+ * RETURNS: e_success if the decode can be cached, e_failure otherwise.
+ */
+Status decode_cache_entry_name(const DecodeInfo *decInfo, char name[DECODE_CACHE_NAME_SIZE], char payload_prefix[DECODE_CACHE_NAME_SIZE])
+{
+    if(!decInfo || !name || !payload_prefix)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    const StegOptions *options = &decInfo->options;
+    if(!options->cache_dir || options->encrypt)
+	return e_failure;
+
+    struct stat st;
+    int image_fd = decInfo->fptr_stego_image? fileno(decInfo->fptr_stego_image): -1;
+    if(image_fd >= 0)
+    {
+	if(fstat(image_fd, &st) < 0)
+	    return e_failure;
+    }
+    else if(!decInfo->stego_image_fname || !*decInfo->stego_image_fname ||
+	    is_stdio_file_name(decInfo->stego_image_fname) || stat(decInfo->stego_image_fname, &st) < 0)
+	return e_failure;
+    if(!S_ISREG(st.st_mode))
+	return e_failure;
+
+    // Without a key, the hashes of no bytes stand for it.
+    const unsigned char *key_id = options->key? options->key->key_id: NULL;
+    size_t key_id_len = options->key? sizeof(options->key->key_id): 0;
+    unsigned char fingerprint[CHACHA20_HASH_SIZE], check[CHACHA20_HASH_SIZE];
+    chacha20_hash(DECODE_CACHE_NAME_DOMAIN, key_id, key_id_len, fingerprint);
+    chacha20_hash(DECODE_CACHE_CHECK_DOMAIN, key_id, key_id_len, check);
+
+    char fingerprint_hex[2 * DECODE_CACHE_KEY_HASH_BYTES + 1], check_hex[2 * DECODE_CACHE_KEY_HASH_BYTES + 1];
+    for(int i = 0; i < DECODE_CACHE_KEY_HASH_BYTES; ++i)
+    {
+	sprintf(fingerprint_hex + 2 * i, "%02x", fingerprint[i]);
+	sprintf(check_hex + 2 * i, "%02x", check[i]);
+    }
+    int len = snprintf(name, DECODE_CACHE_NAME_SIZE, "%llx-%llx-%llx-%llx.%09ld-a%d-f%u-k%s",
+	    (unsigned long long)st.st_dev, (unsigned long long)st.st_ino, (unsigned long long)st.st_size,
+	    (unsigned long long)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec, options->skip_alpha, options->fec_parity, fingerprint_hex);
+    if(len < 0 || len >= DECODE_CACHE_NAME_SIZE)
+	return e_failure;
+    len = snprintf(payload_prefix, DECODE_CACHE_NAME_SIZE, "%s%s.", DECODE_CACHE_PAYLOAD_NAME, check_hex);
+    return (len < 0 || len >= DECODE_CACHE_NAME_SIZE)? e_failure: e_success;
+}
+
+/*
+ * Function to deliver the cached payload of an image, if the cache has it.
+ *
+ * Every entry of the cache is a directory holding a single read-only
+ * payload file, named after the key check of the decode (see
+ * decode_cache_entry_name()) and the extension of the payload. When the output
+ * is a file, it is made a reflink of the payload where the file system
+ * supports it and a copy otherwise; in any case the output appears under
+ * its name in one rename, as a file of its own. The other
+ * outputs (standard output, in-memory or caller provided streams) get a
+ * copy of the payload. The access time of the payload is refreshed on
+ * every hit; it orders the entries for eviction.
+ *
+ * A miss is not an error. An entry evicted by another process during the
+ * lookup is simply a miss, since its payload is opened before use.
+ *
+ * INPUTS: The DecodeInfo object, with the image opened, the user given
+ * output file name and where to return whether the payload was delivered.
+ *
+ * RETURNS: Operation status: e_failure if the payload could not be
+ * delivered to an output stream that was already started.
+ */
+Status decode_cache_fetch(DecodeInfo *decInfo, const char *user_given_name, int *hit)
+{
+    if(!decInfo || !hit)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    *hit = 0;
+    char name[DECODE_CACHE_NAME_SIZE], entry_path[PATH_MAX], payload_prefix[DECODE_CACHE_NAME_SIZE], payload_name[DECODE_CACHE_NAME_SIZE], payload_path[PATH_MAX];
+    if(decode_cache_entry_name(decInfo, name, payload_prefix) == e_failure ||
+	    get_cache_path(entry_path, decInfo->options.cache_dir, name) == e_failure ||
+	    find_cached_payload(entry_path, payload_prefix, payload_name) == e_failure)
+	return e_success;
+    const char *extn = payload_name + strlen(payload_prefix);
+    if(strlen(extn) >= MAX_FILE_SUFFIX || get_cache_path(payload_path, entry_path, payload_name) == e_failure)
+	return e_success;
+
+    struct stat st;
+    int payload_fd = open(payload_path, O_RDONLY | O_CLOEXEC);
+    if(payload_fd < 0)
+	return e_success;
+    if(fstat(payload_fd, &st) < 0)
+    {
+	close(payload_fd);
+	return e_success;
+    }
+
+    Status status = e_success;
+    strcpy(decInfo->extn_secret_file, extn);
+    int to_file = !decInfo->fptr_secret && !decInfo->inline_output && !(user_given_name && is_stdio_file_name(user_given_name));
+    if(to_file)
+    {
+	decInfo->secret_fname = get_default_destegged_output_filename(user_given_name, decInfo->extn_secret_file, decInfo->arena);
+	if(decInfo->secret_fname && link_cached_payload(payload_fd, st.st_size, decInfo->secret_fname) == e_success)
+	    *hit = 1;
+	else
+	{
+	    arena_release(decInfo->arena, decInfo->secret_fname);
+	    decInfo->secret_fname = NULL;
+	}
+    }
+    else if(create_secret_data_file(decInfo, user_given_name) == e_failure || copy_cached_payload(payload_fd, decInfo->fptr_secret, decInfo->arena) == e_failure)
+	status = e_failure;
+    else
+	*hit = 1;
+
+    if(*hit)
+    {
+	struct timespec times[2] = { { 0, UTIME_NOW }, { 0, UTIME_OMIT } };
+	futimens(payload_fd, times);
+	decInfo->telemetry.bytes = st.st_size;
+    }
+    close(payload_fd);
+    return status;
+}
+
+/*
+ * Function to trim a cache after a store, when it is due. A trim reads
+ * every entry, so it is not done for each store: only once the size
+ * estimate of the process goes over the cap, or once the stamp file shows
+ * that no process trimmed the cache for DECODE_CACHE_TRIM_INTERVAL
+ * seconds, which also covers the entries other processes added. The cap
+ * may be overshot by what is stored in between.
+ */
+static Status trim_cache_if_due(const char *cache_dir, unsigned long long max_bytes, off_t stored)
+{
+    pthread_mutex_lock(&cache_usage_lock);
+    int known = !strcmp(cache_usage_dir, cache_dir);
+    if(known)
+	cache_usage_bytes += stored;
+    int due = known && cache_usage_bytes > max_bytes;
+    pthread_mutex_unlock(&cache_usage_lock);
+
+    char stamp_path[PATH_MAX];
+    struct stat st;
+    if(get_cache_path(stamp_path, cache_dir, DECODE_CACHE_TRIM_STAMP) == e_failure)
+	return e_failure;
+    if(!due && !stat(stamp_path, &st) && time(NULL) - st.st_mtime < DECODE_CACHE_TRIM_INTERVAL)
+	return e_success;
+
+    // Stamp first, so that concurrent stores do not all trim at once.
+    int stamp_fd = open(stamp_path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if(stamp_fd >= 0)
+    {
+	futimens(stamp_fd, NULL);
+	close(stamp_fd);
+    }
+
+    unsigned long long cache_bytes;
+    if(decode_cache_trim(cache_dir, max_bytes, &cache_bytes) == e_failure)
+	return e_failure;
+    pthread_mutex_lock(&cache_usage_lock);
+    snprintf(cache_usage_dir, sizeof(cache_usage_dir), "%s", cache_dir);
+    cache_usage_bytes = cache_bytes;
+    pthread_mutex_unlock(&cache_usage_lock);
+    return e_success;
+}
+
+/*
+ * Function to add the payload just decoded to the cache.
+ *
+ * The payload is read back from the output: from the in-memory output, or
+ * from the output file or memfd through /proc, as a reflink where the file
+ * system supports it. Outputs that can not be read back, such as pipes,
+ * are not cached. The entry is built in a temporary directory inside the
+ * cache and renamed into place, so that other processes either see the
+ * whole entry or none of it; if one of them stored the same entry first,
+ * its copy is kept and this one dropped. The cache is then trimmed to its
+ * size cap, when a trim is due (see trim_cache_if_due()).
+ *
+ * INPUTS: The DecodeInfo object, after the payload has been decoded.
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status decode_cache_store(DecodeInfo *decInfo)
+{
+    if(!decInfo || !decInfo->fptr_secret)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    char name[DECODE_CACHE_NAME_SIZE], payload_prefix[DECODE_CACHE_NAME_SIZE], payload_name[DECODE_CACHE_NAME_SIZE];
+    if(decode_cache_entry_name(decInfo, name, payload_prefix) == e_failure)
+	return e_success;
+    int payload_name_len = snprintf(payload_name, sizeof(payload_name), "%s%s", payload_prefix, decInfo->extn_secret_file);
+    if(payload_name_len < 0 || payload_name_len >= (int)sizeof(payload_name))
+	return e_success;
+    if(fflush(decInfo->fptr_secret))
+	return e_failure;
+
+    struct stat st;
+    int output_fd = -1;
+    if(!decInfo->inline_output)
+    {
+	char proc_path[PATH_MAX];
+	int fd = fileno(decInfo->fptr_secret);
+	if(fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+	    return e_success;
+	snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+	output_fd = open(proc_path, O_RDONLY | O_CLOEXEC);
+	if(output_fd < 0)
+	    return e_success;
+    }
+
+    const char *cache_dir = decInfo->options.cache_dir;
+    char temp_path[PATH_MAX], entry_path[PATH_MAX], payload_path[PATH_MAX];
+    if(mkdir(cache_dir, 0700) < 0 && errno != EEXIST)
+	perror("mkdir");
+    Status status = e_failure;
+    if(get_cache_path(entry_path, cache_dir, name) == e_success &&
+	    get_cache_path(temp_path, cache_dir, DECODE_CACHE_TEMP_PREFIX "XXXXXX") == e_success && mkdtemp(temp_path))
+    {
+	int payload_fd = get_cache_path(payload_path, temp_path, payload_name) == e_success?
+	    open(payload_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0444): -1;
+	if(payload_fd >= 0)
+	{
+	    if(decInfo->inline_output)
+		status = (!decInfo->output_size || write(payload_fd, decInfo->output_data, decInfo->output_size) == (ssize_t)decInfo->output_size)? e_success: e_failure;
+	    else
+		status = clone_file(output_fd, payload_fd, st.st_size);
+	    if(close(payload_fd))
+		status = e_failure;
+	}
+
+	// Losing the race to another process storing the same entry is fine.
+	if(status == e_failure || rename(temp_path, entry_path))
+	{
+	    const char *temp_name = strrchr(temp_path, '/') + 1;
+	    remove_cache_entry(cache_dir, temp_name);
+	}
+    }
+    if(output_fd >= 0)
+	close(output_fd);
+    if(status == e_failure)
+    {
+	fprintf(stderr, "Could not add the payload to the decode cache %s.\n", cache_dir);
+	return e_failure;
+    }
+
+    uint cache_size_mb = decInfo->options.cache_size_mb? decInfo->options.cache_size_mb: DEFAULT_DECODE_CACHE_SIZE_MB;
+    return trim_cache_if_due(cache_dir, (unsigned long long)cache_size_mb << 20, decInfo->inline_output? (off_t)decInfo->output_size: st.st_size);
+}
+
+/*
+ * Function to trim a cache directory to its size cap.
+ *
+ * The payload sizes of all entries are added up, and while they exceed
+ * the cap, the least recently used entries are removed. Temporary entries
+ * older than DECODE_CACHE_STALE_AGE were left by processes that died while
+ * storing, and are removed too. Removing an entry is safe while other
+ * processes use the cache (see remove_cache_entry()).
+ *
+ * INPUTS: The cache directory, its cap in bytes and where to return the
+ * payload bytes left in it (may be NULL).
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status decode_cache_trim(const char *cache_dir, unsigned long long max_bytes, unsigned long long *cache_bytes)
+{
+    if(!cache_dir)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    DIR *dir = opendir(cache_dir);
+    if(!dir)
+    {
+	perror("opendir");
+	return e_failure;
+    }
+
+    DecodeCacheEntry *entries = NULL;
+    uint count = 0, allocated = 0;
+    unsigned long long total = 0;
+    time_t now = time(NULL);
+    Status status = e_success;
+    for(struct dirent *dirent = readdir(dir); dirent && status == e_success; dirent = readdir(dir))
+    {
+	char entry_path[PATH_MAX], payload_path[PATH_MAX], payload_name[DECODE_CACHE_NAME_SIZE];
+	struct stat st;
+	if(dirent->d_name[0] == '.' && strncmp(dirent->d_name, DECODE_CACHE_TEMP_PREFIX, strlen(DECODE_CACHE_TEMP_PREFIX)))
+	    continue;
+	if(strlen(dirent->d_name) >= DECODE_CACHE_NAME_SIZE || get_cache_path(entry_path, cache_dir, dirent->d_name) == e_failure)
+	    continue;
+	if(dirent->d_name[0] == '.')
+	{
+	    if(!lstat(entry_path, &st) && now - st.st_mtime > DECODE_CACHE_STALE_AGE)
+		remove_cache_entry(cache_dir, dirent->d_name);
+	    continue;
+	}
+
+	if(find_cached_payload(entry_path, DECODE_CACHE_PAYLOAD_NAME, payload_name) == e_failure)
+	    continue;
+	if(get_cache_path(payload_path, entry_path, payload_name) == e_failure || stat(payload_path, &st) < 0)
+	    continue;
+
+	if(count == allocated)
+	{
+	    uint new_allocated = allocated? allocated * 2: 64;
+	    DecodeCacheEntry *new_entries = realloc(entries, new_allocated * sizeof(DecodeCacheEntry));
+	    if(!new_entries)
+	    {
+		FATAL_ERR_MSG;
+		status = e_failure;
+		break;
+	    }
+	    entries = new_entries;
+	    allocated = new_allocated;
+	}
+	strcpy(entries[count].name, dirent->d_name);
+	entries[count].atime = st.st_atim;
+	entries[count].size = st.st_size;
+	total += st.st_size;
+	++count;
+    }
+    closedir(dir);
+
+    if(status == e_success && total > max_bytes)
+    {
+	qsort(entries, count, sizeof(DecodeCacheEntry), compare_entry_atimes);
+	for(uint i = 0; i < count && total > max_bytes; ++i)
+	{
+	    remove_cache_entry(cache_dir, entries[i].name);
+	    total -= entries[i].size;
+	}
+    }
+    free(entries);
+    if(cache_bytes)
+	*cache_bytes = total;
+    return status;
+}
@@ -0,0 +1,68 @@
+#ifndef DECODECACHE_H
+#define DECODECACHE_H
+
+#include <time.h>
+#include <sys/types.h>
+#include "types.h" 	// Contains user defined types
+#include "common.h"	// Contains common strings
+#include "error.h"	// Contains standard error messages
+#include "decode.h"	// Contains the decoding stages
+
+/* Cache size cap used unless --cache-size says otherwise, in MiB */
+#define DEFAULT_DECODE_CACHE_SIZE_MB 1024
+
+/* Prefix of the entries being built or evicted in a cache directory */
+#define DECODE_CACHE_TEMP_PREFIX ".tmp-"
+
+/* Name of the payload file of an entry, followed by the key check, a dot and the payload extension */
+#define DECODE_CACHE_PAYLOAD_NAME "payload."
+
+/* Domains of the key fingerprint in an entry name and of the key check in its payload name */
+#define DECODE_CACHE_NAME_DOMAIN "steg-cache-v2"
+#define DECODE_CACHE_CHECK_DOMAIN "steg-check-v2"
+
+/* Bytes of the key hashes written into the names, in hex */
+#define DECODE_CACHE_KEY_HASH_BYTES 16
+
+/* Age after which a temporary entry left by a dead process is removed, in seconds */
+#define DECODE_CACHE_STALE_AGE 3600
+
+/*
+ * Seconds between two trims of a cache, unless the stores of the process
+ * take its size estimate over the cap first, and the stamp file whose
+ * modification time records the last trim, for all the processes
+ */
+#define DECODE_CACHE_TRIM_INTERVAL 60
+#define DECODE_CACHE_TRIM_STAMP ".trimmed"
+
+/* Room for an entry name */
+#define DECODE_CACHE_NAME_SIZE 192
+
+/*
+ * Structure describing one entry of a cache directory, as seen when the
+ * cache is trimmed. The access time of the payload orders the entries
+ * from the least recently used.
+ */
+typedef struct _DecodeCacheEntry
+{
+    char name[DECODE_CACHE_NAME_SIZE];
+    struct timespec atime;
+    off_t size;
+
+} DecodeCacheEntry;
+
+/* Decode cache function prototypes */
+
+/* Build the name of the cache entry for an image and the decode options */
+Status decode_cache_entry_name(const DecodeInfo *decInfo, char name[DECODE_CACHE_NAME_SIZE], char payload_prefix[DECODE_CACHE_NAME_SIZE]);
+
+/* Deliver a cached payload to the output, if there is one */
+Status decode_cache_fetch(DecodeInfo *decInfo, const char *user_given_name, int *hit);
+
+/* Add a freshly decoded payload to the cache */
+Status decode_cache_store(DecodeInfo *decInfo);
+
+/* Evict the least recently used entries until the cache fits its cap */
+Status decode_cache_trim(const char *cache_dir, unsigned long long max_bytes, unsigned long long *cache_bytes);
+
+#endif
@@ -0,0 +1,557 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <sys/mman.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "detect.h"
+#include "compare.h"
+#include "types.h"
+#include "error.h"
+
+/* Bytes of a row handled per vector step: three 16 byte vectors, a whole number of 3 and 4 byte pixels */
+#define DETECT_BLOCK 48
+
+/* Pairs of histogram bins holding fewer values are left out of the chi-square sum */
+#define DETECT_MIN_PAIR_COUNT 4
+
+/* Function Definitions */
+
+/*
+ * Function to check the detect arguments input by the user.
+ *
+ * Screening takes one or more images:
+ *	--detect <image.bmp> [image.bmp ...] [--workers <count>]
+ *
+ * INPUTS: Argument vector from the main() function and the DetectInfo
+ * variable pointer.
+ *
+ * RETURNS: The check status enum: e_success or e_failure.
+ */
+Status read_and_validate_detect_args(char *argv[], DetectInfo *detInfo)
+{
+    if(!argv || !detInfo)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    memset(detInfo, 0, sizeof(*detInfo));
+    if(read_steg_options(argv, &detInfo->options) == e_failure)
+	return e_failure;
+
+    if(!argv[2])
+    {
+	fprintf(stderr, "Error: Please input the images to screen:\n%s %s <image%s> [image%s ...]\n", argv[0], DETECT_ARG, IMG_FILE_EXTN, IMG_FILE_EXTN);
+	return e_failure;
+    }
+
+    for(uint i = 2; argv[i]; ++i)
+    {
+	if(!strstr(argv[i], IMG_FILE_EXTN))
+	{
+	    fprintf(stderr, "Error: %s is not a %s file.\n", argv[i], IMG_FILE_EXTN);
+	    return e_failure;
+	}
+	++detInfo->image_count;
+    }
+
+    detInfo->results = calloc(detInfo->image_count, sizeof(DetectResult));
+    if(!detInfo->results)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+    for(uint i = 0; i < detInfo->image_count; ++i)
+	detInfo->results[i].image_fname = argv[2 + i];
+    return e_success;
+}
+
+/*
+ * Function to get the regularized upper incomplete gamma function Q(a, x),
+ * by its series below a + 1 and by its continued fraction above.
+ */
+static double upper_gamma_q(double a, double x)
+{
+    if(x <= 0)
+	return 1;
+
+    double log_prefix = -x + a * log(x) - lgamma(a);
+    if(x < a + 1)
+    {
+	double term = 1 / a, sum = term;
+	for(uint n = 1; n < 1000 && fabs(term) > fabs(sum) * 1e-15; ++n)
+	{
+	    term *= x / (a + n);
+	    sum += term;
+	}
+	return 1 - sum * exp(log_prefix);
+    }
+
+    // Modified Lentz evaluation of the continued fraction.
+    double b = x + 1 - a, c = 1 / 1e-300, d = 1 / b, h = d;
+    for(uint n = 1; n < 1000; ++n)
+    {
+	double an = -(double)n * (n - a);
+	b += 2;
+	d = an * d + b;
+	if(fabs(d) < 1e-300)
+	    d = 1e-300;
+	c = b + an / c;
+	if(fabs(c) < 1e-300)
+	    c = 1e-300;
+	d = 1 / d;
+	double delta = d * c;
+	h *= delta;
+	if(fabs(delta - 1) < 1e-15)
+	    break;
+    }
+    return exp(log_prefix) * h;
+}
+
+/*
+ * Function to get the p-value of the chi-square attack on one histogram.
+ *
+ * LSB replacement moves values between 2k and 2k + 1 only, which evens out
+ * the two counts of every such pair. The statistic compares the count of
+ * 2k with the mean of the pair; a p-value close to 1 means the pairs are
+ * as even as a fully embedded image would have them.
+ */
+static double chi_square_p(const uint64_t *histogram)
+{
+    double chi = 0;
+    uint pairs = 0;
+    for(uint k = 0; k < 256; k += 2)
+    {
+	uint64_t pair_count = histogram[k] + histogram[k + 1];
+	if(pair_count < DETECT_MIN_PAIR_COUNT)
+	    continue;
+	double expected = pair_count / 2.0;
+	chi += (histogram[k] - expected) * (histogram[k] - expected) / expected;
+	++pairs;
+    }
+    if(pairs < 2)
+	return 0;
+    return upper_gamma_q((pairs - 1) / 2.0, chi / 2);
+}
+
+/*
+ * Function to add a row to the per channel histograms.
+ *
+ * Every channel has a table of its own, so consecutive bytes of a pixel
+ * never wait on the same counter.
+ *
+ * INPUTS: The row bytes, without padding, their count and the statistics.
+ *
+ * RETURNS: Nothing.
+ */
+void detect_histogram_row(const unsigned char *row, uint row_size, DetectStats *stats)
+{
+    if(!row || !stats || !stats->channels)
+    {
+	FATAL_ERR_MSG;
+	return;
+    }
+
+    uint channels = stats->channels;
+    for(uint x = 0; x + channels <= row_size; x += channels)
+	for(uint ch = 0; ch < channels; ++ch)
+	    ++stats->histogram[ch][row[x + ch]];
+}
+
+/*
+ * Function to get the variation |b - a| + |c - b| + |d - c| of a group.
+ */
+static int group_variation(int a, int b, int c, int d)
+{
+    return abs(b - a) + abs(c - b) + abs(d - c);
+}
+
+/*
+ * Function to get the shifted flip F-1 of a value: 0 and -1 swap places,
+ * 1 and 2, and so on up to 255 and 256.
+ */
+static int shifted_flip(int x)
+{
+    return ((x + 1) ^ 1) - 1;
+}
+
+/*
+ * Function to classify one group under the four RS flips, one at a time.
+ */
+static void classify_group(int a, int b, int c, int d, uint ch, DetectStats *stats)
+{
+    for(uint flipped = 0; flipped < 2; ++flipped)
+    {
+	if(flipped)
+	{
+	    a ^= 1;
+	    b ^= 1;
+	    c ^= 1;
+	    d ^= 1;
+	}
+	int f0 = group_variation(a, b, c, d);
+	int f1 = group_variation(a, b ^ 1, c ^ 1, d);
+	int fn = group_variation(a, shifted_flip(b), shifted_flip(c), d);
+	stats->regular[flipped][0][ch] += f1 > f0;
+	stats->singular[flipped][0][ch] += f1 < f0;
+	stats->regular[flipped][1][ch] += fn > f0;
+	stats->singular[flipped][1][ch] += fn < f0;
+    }
+    ++stats->groups[ch];
+}
+
+#if defined(__SSE2__)
+/*
+ * Function to get the absolute differences of signed 16 bit lanes.
+ */
+static inline __m128i abs_diff_epi16(__m128i x, __m128i y)
+{
+    __m128i d = _mm_sub_epi16(x, y);
+    return _mm_max_epi16(d, _mm_sub_epi16(_mm_setzero_si128(), d));
+}
+
+/*
+ * Function to get the variation of eight groups at once.
+ */
+static inline __m128i group_variation_epi16(__m128i a, __m128i b, __m128i c, __m128i d)
+{
+    return _mm_add_epi16(_mm_add_epi16(abs_diff_epi16(b, a), abs_diff_epi16(c, b)), abs_diff_epi16(d, c));
+}
+
+/*
+ * Function to get the shifted flip of eight values at once.
+ */
+static inline __m128i shifted_flip_epi16(__m128i x, __m128i one)
+{
+    return _mm_sub_epi16(_mm_xor_si128(_mm_add_epi16(x, one), one), one);
+}
+
+/*
+ * Function to classify the sixteen groups of a column of four 16 byte
+ * vectors under the four RS flips. The result masks hold one bit per
+ * group, indexed by [all LSBs flipped][shifted flip].
+ */
+static inline void classify_groups_epi16(const __m128i rows[4], uint regular[2][2], uint singular[2][2])
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi16(1);
+    __m128i reg[2][2][2], sing[2][2][2];
+    for(uint half = 0; half < 2; ++half)
+    {
+	__m128i v[4];
+	for(uint r = 0; r < 4; ++r)
+	    v[r] = half? _mm_unpackhi_epi8(rows[r], zero): _mm_unpacklo_epi8(rows[r], zero);
+	for(uint flipped = 0; flipped < 2; ++flipped)
+	{
+	    if(flipped)
+		for(uint r = 0; r < 4; ++r)
+		    v[r] = _mm_xor_si128(v[r], one);
+	    __m128i f0 = group_variation_epi16(v[0], v[1], v[2], v[3]);
+	    __m128i f1 = group_variation_epi16(v[0], _mm_xor_si128(v[1], one), _mm_xor_si128(v[2], one), v[3]);
+	    __m128i fn = group_variation_epi16(v[0], shifted_flip_epi16(v[1], one), shifted_flip_epi16(v[2], one), v[3]);
+	    reg[flipped][0][half] = _mm_cmpgt_epi16(f1, f0);
+	    sing[flipped][0][half] = _mm_cmpgt_epi16(f0, f1);
+	    reg[flipped][1][half] = _mm_cmpgt_epi16(fn, f0);
+	    sing[flipped][1][half] = _mm_cmpgt_epi16(f0, fn);
+	}
+    }
+    for(uint flipped = 0; flipped < 2; ++flipped)
+	for(uint shifted = 0; shifted < 2; ++shifted)
+	{
+	    regular[flipped][shifted] = _mm_movemask_epi8(_mm_packs_epi16(reg[flipped][shifted][0], reg[flipped][shifted][1]));
+	    singular[flipped][shifted] = _mm_movemask_epi8(_mm_packs_epi16(sing[flipped][shifted][0], sing[flipped][shifted][1]));
+	}
+}
+#endif
+
+/*
+ * Function to add a band of four rows to the RS counts.
+ *
+ * Each byte column of the band is a group. With SSE2 the groups are
+ * classified DETECT_BLOCK columns at a time in 16 bit lanes, and the
+ * regular and singular masks are shared out between the channels with a
+ * popcount per channel mask, the way compare_pixel_bytes() does it. The
+ * columns left after the last whole block, and all of them without SSE2,
+ * are classified one at a time.
+ *
+ * INPUTS: The four rows, their size without padding and the statistics.
+ *
+ * RETURNS: Nothing.
+ */
+void detect_rs_band(const unsigned char *rows[4], uint row_size, DetectStats *stats)
+{
+    if(!rows || !stats || !stats->channels || stats->channels > COMPARE_MAX_CHANNELS)
+    {
+	FATAL_ERR_MSG;
+	return;
+    }
+
+    uint channels = stats->channels;
+    uint i = 0;
+
+#if defined(__SSE2__)
+    uint64_t channel_mask[COMPARE_MAX_CHANNELS] = { 0 };
+    for(uint b = 0; b < DETECT_BLOCK; ++b)
+	channel_mask[b % channels] |= 1ULL << b;
+
+    for(; i + DETECT_BLOCK <= row_size; i += DETECT_BLOCK)
+    {
+	uint64_t regular[2][2] = { { 0 } }, singular[2][2] = { { 0 } };
+	for(uint v = 0; v < DETECT_BLOCK / 16; ++v)
+	{
+	    __m128i column[4];
+	    for(uint r = 0; r < 4; ++r)
+		column[r] = _mm_loadu_si128((const __m128i *)(rows[r] + i + 16 * v));
+	    uint reg[2][2], sing[2][2];
+	    classify_groups_epi16(column, reg, sing);
+	    for(uint flipped = 0; flipped < 2; ++flipped)
+		for(uint shifted = 0; shifted < 2; ++shifted)
+		{
+		    regular[flipped][shifted] |= (uint64_t)reg[flipped][shifted] << (16 * v);
+		    singular[flipped][shifted] |= (uint64_t)sing[flipped][shifted] << (16 * v);
+		}
+	}
+
+	for(uint ch = 0; ch < channels; ++ch)
+	{
+	    for(uint flipped = 0; flipped < 2; ++flipped)
+		for(uint shifted = 0; shifted < 2; ++shifted)
+		{
+		    stats->regular[flipped][shifted][ch] += __builtin_popcountll(regular[flipped][shifted] & channel_mask[ch]);
+		    stats->singular[flipped][shifted][ch] += __builtin_popcountll(singular[flipped][shifted] & channel_mask[ch]);
+		}
+	    stats->groups[ch] += __builtin_popcountll(channel_mask[ch]);
+	}
+    }
+#endif
+
+    for(; i < row_size; ++i)
+	classify_group(rows[0][i], rows[1][i], rows[2][i], rows[3][i], i % channels, stats);
+}
+
+/*
+ * Function to get the RS estimate of the fraction of carriers of one
+ * channel that were embedded into, from the root of smaller magnitude of
+ * the RS quadratic. Channels too flat to tell, such as a constant alpha
+ * channel, come out as 0.
+ */
+static double rs_estimate(const DetectStats *stats, uint ch)
+{
+    if(!stats->groups[ch])
+	return 0;
+
+    double n = stats->groups[ch];
+    double d0 = (stats->regular[0][0][ch] - (double)stats->singular[0][0][ch]) / n;
+    double d1 = (stats->regular[1][0][ch] - (double)stats->singular[1][0][ch]) / n;
+    double dn0 = (stats->regular[0][1][ch] - (double)stats->singular[0][1][ch]) / n;
+    double dn1 = (stats->regular[1][1][ch] - (double)stats->singular[1][1][ch]) / n;
+    double a = 2 * (d1 + d0);
+    double b = dn0 - dn1 - d1 - 3 * d0;
+    double c = d0 - dn0;
+
+    double z;
+    if(fabs(a) < 1e-12)
+    {
+	if(fabs(b) < 1e-12)
+	    return 0;
+	z = -c / b;
+    }
+    else
+    {
+	double discriminant = b * b - 4 * a * c;
+	if(discriminant < 0)
+	    discriminant = 0;
+	double z1 = (-b + sqrt(discriminant)) / (2 * a);
+	double z2 = (-b - sqrt(discriminant)) / (2 * a);
+	z = fabs(z1) < fabs(z2)? z1: z2;
+    }
+    if(fabs(z - 0.5) < 1e-12)
+	return 1;
+    double estimate = z / (z - 0.5);
+    return estimate < 0? 0: estimate > 1? 1: estimate;
+}
+
+/*
+ * Function to screen one image for LSB embedding.
+ *
+ * The image is mapped read-only and its rows are taken in file order,
+ * which is the order the message is embedded in without a key. Each row
+ * goes into the histograms, every band of four rows into the RS counts,
+ * and at the end of every segment the chi-square p-value of the pixel data
+ * so far is noted. The suspicion score is the RS estimate of the fraction
+ * of the carriers embedded into, which holds for sequential and spread messages
+ * alike. The chi-square run, the leading fraction of the pixel data whose
+ * p-value is above DETECT_CHI_P_THRESHOLD, is reported next to it as how
+ * far a sequential message seems to reach; it is not part of the score
+ * since images with smooth histograms raise it on their own. Both are
+ * taken from the channel that shows the most.
+ *
+ * INPUTS: The result, with the image file name set.
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status detect_image(DetectResult *result)
+{
+    if(!result || !result->image_fname)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    unsigned char *map;
+    size_t size;
+    BmpImage bmp_image;
+    if(map_bmp_image_file(result->image_fname, &map, &size, &bmp_image) == e_failure)
+    {
+	if(map)
+	    munmap(map, size);
+	return e_failure;
+    }
+
+    DetectStats *stats = calloc(1, sizeof(DetectStats));
+    if(!stats)
+    {
+	FATAL_ERR_MSG;
+	munmap(map, size);
+	return e_failure;
+    }
+    stats->channels = bmp_image.bytes_per_pixel;
+
+    const unsigned char *pixels = map + bmp_image.data_offset;
+    const unsigned char *band[4];
+    uint segment = 0;
+    for(size_t row = 0; row < bmp_image.height; ++row)
+    {
+	band[row % 4] = pixels + row * bmp_image.row_stride;
+	detect_histogram_row(band[row % 4], bmp_image.row_size, stats);
+	if(row % 4 == 3)
+	    detect_rs_band(band, bmp_image.row_size, stats);
+	for(; segment < DETECT_SEGMENTS && row + 1 >= (segment + 1) * (size_t)bmp_image.height / DETECT_SEGMENTS; ++segment)
+	    for(uint ch = 0; ch < stats->channels; ++ch)
+	    {
+		double p = chi_square_p(stats->histogram[ch]);
+		if(p > stats->segment_p[segment])
+		    stats->segment_p[segment] = p;
+	    }
+    }
+    munmap(map, size);
+
+    uint leading = 0;
+    while(leading < DETECT_SEGMENTS && stats->segment_p[leading] > DETECT_CHI_P_THRESHOLD)
+	++leading;
+    result->chi_fraction = (double)leading / DETECT_SEGMENTS;
+    result->rs_estimate = 0;
+    for(uint ch = 0; ch < stats->channels; ++ch)
+    {
+	double estimate = rs_estimate(stats, ch);
+	if(estimate > result->rs_estimate)
+	    result->rs_estimate = estimate;
+    }
+    free(stats);
+    return e_success;
+}
+
+/*
+ * Function run by each detect worker thread: takes images off the shared
+ * list until none are left.
+ */
+static void *detect_worker_main(void *arg)
+{
+    DetectInfo *detInfo = arg;
+    while(1)
+    {
+	pthread_mutex_lock(&detInfo->lock);
+	uint index = detInfo->next_image++;
+	pthread_mutex_unlock(&detInfo->lock);
+	if(index >= detInfo->image_count)
+	    break;
+
+	DetectResult *result = &detInfo->results[index];
+	result->status = detect_image(result);
+    }
+    return NULL;
+}
+
+/*
+ * Function to screen every image for LSB embedding.
+ *
+ * A pool of worker threads (--workers, default DEFAULT_DETECT_WORKERS,
+ * never more than the images) screens the images in parallel with
+ * detect_image(). The verdicts are printed afterwards, one line per image
+ * in the order given. Unlike find_magic_string(), this looks for LSB
+ * embedding of any kind, not just our own format.
+ *
+ * INPUTS: Pointer to DetectInfo object.
+ *
+ * RETURNS: e_success if every image was screened, e_failure otherwise.
+ */
+Status do_detect(DetectInfo *detInfo)
+{
+    if(!detInfo || !detInfo->results)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    uint worker_count = detInfo->options.workers? detInfo->options.workers: DEFAULT_DETECT_WORKERS;
+    if(worker_count > detInfo->image_count)
+	worker_count = detInfo->image_count;
+    pthread_t *workers = malloc(worker_count * sizeof(pthread_t));
+    pthread_mutex_init(&detInfo->lock, NULL);
+
+    uint started = 0;
+    for(; workers && started < worker_count; ++started)
+	if(pthread_create(&workers[started], NULL, detect_worker_main, detInfo))
+	    break;
+    // With no thread at all, the images are done on this one.
+    if(!started)
+	detect_worker_main(detInfo);
+    for(uint i = 0; i < started; ++i)
+	pthread_join(workers[i], NULL);
+    pthread_mutex_destroy(&detInfo->lock);
+    free(workers);
+
+    uint failed = 0;
+    for(uint i = 0; i < detInfo->image_count; ++i)
+    {
+	const DetectResult *result = &detInfo->results[i];
+	if(result->status == e_failure)
+	{
+	    fprintf(stderr, "%s: could not be screened.\n", result->image_fname);
+	    ++failed;
+	    continue;
+	}
+	printf("%s: %s, score %.3f, chi-square run %.0f%% of the pixel data\n", result->image_fname,
+		result->rs_estimate >= DETECT_SUSPICION_THRESHOLD? "suspicious": "clean", result->rs_estimate, 100 * result->chi_fraction);
+    }
+    cleanup_detect(detInfo);
+
+    if(failed)
+    {
+	fprintf(stderr, "%u of %u images could not be screened.\n", failed, detInfo->image_count);
+	return e_failure;
+    }
+    return e_success;
+}
+
+/*
+ * Function to release the results.
+ *
+ * INPUTS: The DetectInfo object.
+ *
+ * RETURNS: Nothing.
+ */
+void cleanup_detect(DetectInfo *detInfo)
+{
+    if(!detInfo)
+    {
+	FATAL_ERR_MSG;
+	return;
+    }
+
+    free(detInfo->results);
+    detInfo->results = NULL;
+}
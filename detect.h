@@ -0,0 +1,99 @@
+#ifndef DETECT_H
+#define DETECT_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "types.h" 	// Contains user defined types
+#include "common.h"	// Contains common strings
+#include "error.h"	// Contains standard error messages
+#include "compare.h"	// Contains COMPARE_MAX_CHANNELS
+
+/* Worker threads used for screening unless --workers says otherwise */
+#define DEFAULT_DETECT_WORKERS 4
+
+/* Parts the pixel data is cut into, in file order, for the sequential chi-square test */
+#define DETECT_SEGMENTS 16
+
+/* Chi-square p-value above which a part of the image looks embedded into */
+#define DETECT_CHI_P_THRESHOLD 0.95
+
+/* RS estimate from which an image is reported as suspicious */
+#define DETECT_SUSPICION_THRESHOLD 0.05
+
+/*
+ * Structure to store the statistics gathered over the pixel data of one
+ * image, per channel.
+ *
+ * The histograms feed the chi-square attack, which looks for the pairs of
+ * values 2k and 2k + 1 that LSB replacement evens out. A snapshot of the
+ * p-value is taken at the end of every segment, so that a message embedded
+ * from the start of the pixel data shows up as a run of high p-values.
+ *
+ * The RS counts feed the RS analysis. Groups are four vertically adjacent
+ * bytes of the same column, so the groups of a band of four rows are
+ * plain loads of the four rows. Each group is counted as regular or
+ * singular under the LSB flip (F1) and the shifted flip (F-1) of its two
+ * middle bytes, for the image as it is and with all its LSBs flipped.
+ */
+typedef struct _DetectStats
+{
+    uint channels;
+    uint64_t histogram[COMPARE_MAX_CHANNELS][256];
+    double segment_p[DETECT_SEGMENTS];		// Chi-square p-value of each prefix
+
+    /* Indexed by [all LSBs flipped][shifted flip][channel] */
+    uint64_t regular[2][2][COMPARE_MAX_CHANNELS];
+    uint64_t singular[2][2][COMPARE_MAX_CHANNELS];
+    uint64_t groups[COMPARE_MAX_CHANNELS];
+
+} DetectStats;
+
+/*
+ * Structure to store the verdict on one image.
+ */
+typedef struct _DetectResult
+{
+    const char *image_fname;
+    Status status;
+    double rs_estimate;		// RS estimate of the fraction of carriers used: the score
+    double chi_fraction;	// Leading fraction of the pixel data with a high chi-square p-value
+
+} DetectResult;
+
+/*
+ * Structure to store a screening job. The images are handed out to the
+ * worker threads one at a time through next_image.
+ */
+typedef struct _DetectInfo
+{
+    DetectResult *results;
+    uint image_count;
+    StegOptions options;
+
+    /* Work distribution between the workers */
+    pthread_mutex_t lock;
+    uint next_image;
+
+} DetectInfo;
+
+/* Detect function prototypes */
+
+/* Read and validate the detect args from argv */
+Status read_and_validate_detect_args(char *argv[], DetectInfo *detInfo);
+
+/* Screen every image in parallel and print a verdict per image */
+Status do_detect(DetectInfo *detInfo);
+
+/* Screen one image */
+Status detect_image(DetectResult *result);
+
+/* Add a band of four rows to the RS counts */
+void detect_rs_band(const unsigned char *rows[4], uint row_size, DetectStats *stats);
+
+/* Add a row to the histograms */
+void detect_histogram_row(const unsigned char *row, uint row_size, DetectStats *stats);
+
+/* Release the results */
+void cleanup_detect(DetectInfo *detInfo);
+
+#endif
@@ -0,0 +1,253 @@
+/* O_DIRECT, fopencookie() and sync_file_range() */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "directio.h"
+#include "throttle.h"
+#include "trace.h"
+#include "types.h"
+#include "error.h"
+
+/* Function Definitions */
+
+/*
+ * Function to tell the kernel that the pages of a block are not needed
+ * again. Written blocks are sent to the disk first, since dirty pages
+ * can not be dropped.
+ */
+static void drop_cached_block(const DirectStream *stream, off_t offset, size_t len)
+{
+    if(stream->direct || !len)
+	return;
+    if(stream->writing)
+	sync_file_range(stream->fd, offset, len, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(stream->fd, offset, len, POSIX_FADV_DONTNEED);
+}
+
+/*
+ * Function to write the whole block buffer out. Only the final block may
+ * be partial; O_DIRECT is turned off for it, since its length is not
+ * aligned.
+ */
+static int write_block(DirectStream *stream)
+{
+    if(stream->direct && stream->block_len % DIRECT_IO_ALIGN)
+    {
+	int flags = fcntl(stream->fd, F_GETFL);
+	if(flags < 0 || fcntl(stream->fd, F_SETFL, flags & ~O_DIRECT) < 0)
+	    return -1;
+	stream->direct = 0;
+    }
+
+    size_t done = 0;
+    while(done < stream->block_len)
+    {
+	ssize_t wrote = pwrite(stream->fd, stream->block + done, stream->block_len - done, stream->offset + done);
+	if(wrote < 0 && errno == EINTR)
+	    continue;
+	if(wrote <= 0)
+	    return -1;
+	done += wrote;
+    }
+    drop_cached_block(stream, stream->offset, stream->block_len);
+    stream->offset += stream->block_len;
+    stream->block_len = 0;
+    return 0;
+}
+
+/*
+ * Function called by stdio to read from a direct I/O stream.
+ */
+static ssize_t direct_stream_read(void *cookie, char *buf, size_t size)
+{
+    DirectStream *stream = cookie;
+    size_t done = 0;
+    while(done < size)
+    {
+	if(stream->block_pos == stream->block_len)
+	{
+	    drop_cached_block(stream, stream->offset - stream->block_len, stream->block_len);
+
+	    // Whole blocks are read until the file ends, so the offset stays
+	    // aligned; only the last read comes back short.
+	    ssize_t got;
+	    do
+		got = pread(stream->fd, stream->block, DIRECT_IO_BLOCK_SIZE, stream->offset);
+	    while(got < 0 && errno == EINTR);
+	    if(got < 0)
+		return done? (ssize_t)done: -1;
+	    if(!got)
+		break;
+	    stream->block_len = got;
+	    stream->block_pos = 0;
+	    stream->offset += got;
+	}
+
+	size_t chunk = stream->block_len - stream->block_pos;
+	if(chunk > size - done)
+	    chunk = size - done;
+	memcpy(buf + done, stream->block + stream->block_pos, chunk);
+	stream->block_pos += chunk;
+	done += chunk;
+    }
+    return done;
+}
+
+/*
+ * Function called by stdio to write to a direct I/O stream.
+ */
+static ssize_t direct_stream_write(void *cookie, const char *buf, size_t size)
+{
+    DirectStream *stream = cookie;
+    size_t done = 0;
+    while(done < size)
+    {
+	size_t chunk = DIRECT_IO_BLOCK_SIZE - stream->block_len;
+	if(chunk > size - done)
+	    chunk = size - done;
+	memcpy(stream->block + stream->block_len, buf + done, chunk);
+	stream->block_len += chunk;
+	done += chunk;
+
+	if(stream->block_len == DIRECT_IO_BLOCK_SIZE && write_block(stream) < 0)
+	    return done > chunk? (ssize_t)(done - chunk): -1;
+    }
+    return done;
+}
+
+/*
+ * Function called by stdio when a direct I/O stream is closed: writes out
+ * the final partial block and releases the stream.
+ */
+static int direct_stream_close(void *cookie)
+{
+    DirectStream *stream = cookie;
+    int status = 0;
+    if(stream->writing && stream->block_len && write_block(stream) < 0)
+	status = -1;
+    if(!stream->writing)
+	drop_cached_block(stream, stream->offset - stream->block_len, stream->block_len);
+    if(close(stream->fd) < 0)
+	status = -1;
+    Arena *arena = stream->arena;
+    arena_release(arena, stream->block);
+    arena_release(arena, stream);
+    return status;
+}
+
+/*
+ * Function to open a file as a direct I/O stream.
+ *
+ * The file is opened with O_DIRECT so that the data bypasses the page
+ * cache and does not evict anything from it. stdio works on top of an
+ * aligned block buffer which is filled or drained DIRECT_IO_BLOCK_SIZE
+ * bytes at a time at aligned offsets; the unaligned tail of a written file
+ * goes out with O_DIRECT turned off. If the file system does not support
+ * O_DIRECT, the file is read or written through the page cache with a
+ * sequential hint, and every block is dropped from the cache after use.
+ *
+ * The stream can not seek, which the single pass encoder and the decoder
+ * do not need. Its state and block come from the arena, which must outlive
+ * the stream.
+ *
+ * INPUTS: The file name, the fopen() mode, "rb" or "wb", and the arena
+ * (may be NULL).
+ *
+ * RETURNS: The opened stream, or NULL on errors.
+ */
+FILE *open_direct_stream(const char *fname, const char *mode, Arena *arena)
+{
+    if(!fname || !mode)
+    {
+	FATAL_ERR_MSG;
+	return NULL;
+    }
+
+    DirectStream *stream = arena_alloc(arena, sizeof(DirectStream));
+    if(!stream)
+    {
+	FATAL_ERR_MSG;
+	return NULL;
+    }
+    memset(stream, 0, sizeof(DirectStream));
+    stream->arena = arena;
+    stream->writing = mode[0] == 'w';
+    int flags = stream->writing? O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC: O_RDONLY | O_CLOEXEC;
+
+    stream->direct = 1;
+    stream->fd = open(fname, flags | O_DIRECT, 0666);
+    if(stream->fd < 0 && errno == EINVAL)
+    {
+	stream->direct = 0;
+	stream->fd = open(fname, flags, 0666);
+	if(stream->fd >= 0)
+	    posix_fadvise(stream->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    if(stream->fd >= 0)
+	stream->block = arena_memalign(arena, DIRECT_IO_ALIGN, DIRECT_IO_BLOCK_SIZE);
+    if(stream->fd < 0 || !stream->block)
+    {
+	if(stream->fd >= 0)
+	    close(stream->fd);
+	arena_release(arena, stream);
+	return NULL;
+    }
+
+    cookie_io_functions_t functions = {
+	.read = stream->writing? NULL: direct_stream_read,
+	.write = stream->writing? direct_stream_write: NULL,
+	.seek = NULL,
+	.close = direct_stream_close
+    };
+    FILE *fptr = fopencookie(stream, mode, functions);
+    if(!fptr)
+    {
+	close(stream->fd);
+	arena_release(arena, stream->block);
+	arena_release(arena, stream);
+    }
+    return fptr;
+}
+
+/*
+ * Function to open an image file for the encoding and decoding stages.
+ *
+ * STDIO_FILE_NAME stands for the standard input or output. Otherwise the
+ * image is opened as a direct I/O stream when direct_io is set, and with
+ * fopen() and a sequential read hint when it is not. Under an I/O limit
+ * the stream is wrapped with throttle_stream(), and under --trace with
+ * trace_stream(), outside the limit so that the read and write spans
+ * include the waits for it. The state of these streams comes from the
+ * arena, which must outlive them.
+ *
+ * INPUTS: The file name, the fopen() mode, the direct I/O flag and the
+ * arena (may be NULL).
+ *
+ * RETURNS: The opened stream, or NULL on errors.
+ */
+FILE *open_image_stream(const char *fname, const char *mode, int direct_io, Arena *arena)
+{
+    if(!fname || !mode)
+    {
+	FATAL_ERR_MSG;
+	return NULL;
+    }
+
+    FILE *fptr;
+    if(is_stdio_file_name(fname))
+	fptr = open_data_stream(fname, mode);
+    else if(direct_io)
+	fptr = open_direct_stream(fname, mode, arena);
+    else
+    {
+	fptr = fopen(fname, mode);
+	if(fptr && mode[0] == 'r')
+	    posix_fadvise(fileno(fptr), 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    return trace_stream(throttle_stream(fptr, mode, arena), mode, arena);
+}
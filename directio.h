@@ -0,0 +1,44 @@
+#ifndef DIRECTIO_H
+#define DIRECTIO_H
+
+#include <stdio.h>
+#include <sys/types.h>
+#include "types.h" 	// Contains user defined types
+#include "common.h"	// Contains common strings
+#include "error.h"	// Contains standard error messages
+
+/* Size of the aligned blocks moved by direct I/O streams */
+#define DIRECT_IO_BLOCK_SIZE (1024 * 1024)
+
+/* Alignment of direct I/O buffers, file offsets and transfer sizes */
+#define DIRECT_IO_ALIGN 4096
+
+/*
+ * Structure to store the state of a direct I/O stream. The stream moves
+ * whole aligned blocks between the file and its block buffer, and stdio
+ * reads from or writes to the block buffer. When the file system refuses
+ * O_DIRECT, the same blocks go through the page cache instead, with hints
+ * that drop the pages once they are used.
+ */
+typedef struct _DirectStream
+{
+    int fd;
+    int writing;		// Opened for writing, reading otherwise
+    int direct;			// O_DIRECT is in effect
+    unsigned char *block;	// DIRECT_IO_BLOCK_SIZE bytes, DIRECT_IO_ALIGN aligned
+    size_t block_len;		// Valid bytes in the block
+    size_t block_pos;		// Next byte of the block to hand out, when reading
+    off_t offset;		// File offset of the block
+    Arena *arena;		// Arena the stream and its block come from (may be NULL)
+
+} DirectStream;
+
+/* Direct I/O function prototypes */
+
+/* Open a file as a direct I/O stream */
+FILE *open_direct_stream(const char *fname, const char *mode, Arena *arena);
+
+/* Open an image file, with direct I/O if asked for */
+FILE *open_image_stream(const char *fname, const char *mode, int direct_io, Arena *arena);
+
+#endif
@@ -1,7 +1,13 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 #include "encode.h"
+#include "coverpool.h"
+#include "directio.h"
+#include "chacha20.h"
+#include "fec.h"
+#include "lsb.h"
 #include "types.h"
 #include "error.h"
 
@@ -18,48 +24,76 @@
  *	b. If not NULL, continues.
  *
  * 2. Opens the source image file, secret data file and a new image
- *    file to encode secret data.
+ *    file to encode secret data. The image streams get large, page
+ *    aligned buffers so that they are read and written in big blocks.
  *	a. If opening any of the above fails, prins error message
  *	   and returns failure flag.
  *	b. Otherwise, continues.
  *
- * 3. Checks for the size of secret message.
+ * 3. Copies the header of the source image to the destination image,
+ *    parsing it on the way into the BmpImage descriptor that is shared
+ *    by the remaining stages.
+ *	a. If the header is malformed, prints error message and returns
+ *	   failure flag.
+ *	b. Otherwise, continues.
+ *
+ * 4. Checks for the size of secret message.
  *	a. If the size is 0, prints error message and return failure
  *	   flag.
  *	b. Otherwise, continues.
  *
- * 4. Checks if the source image file can accomodate the secret
+ * 5. Checks if the carrier bytes of the source image, which exclude
+ *    row padding and skipped alpha bytes, can accomodate the secret
  *    message.
  *	a. If it can't, prints error message and returns failure flag.
  *	b. Otherwise, continues.
  *
- * 5. Copies header info from source image to destination image.
- *	a. If copy fails, prints error message and returns failure flag.
+ * 6. Sets up the row cursor over the pixel data, spreading the message
+ *    in a keyed order when a key is given.
+ *	a. If it fails, prints error message and returns failure flag.
  *	b. Otherwise, continues.
  *
- * 6. Encodes magic string in the destination image.
+ * 7. Encodes magic string in the destination image.
  *	a. If this fails, prints error message and returns failure flag.
  *	b. Otherwise, continues.
  *
- * 7. Encodes secret data file extension in the destination image.
+ * 8. Encodes secret data file extension in the destination image.
  *	a. If this fails, prints error message and returns failure flag.
  *	b. Otherwise, continues.
  *
- * 8. Encodes secret data file size in the destination image.
+ * 9. Encodes secret data file size in the destination image.
  *	a. If this fails, prints error message and returns failure flag.
  *	b. Otherwise, continues.
  *
- * 9. Encodes secret data in the destination image.
+ * 10. Encodes secret data in the destination image.
  *	a. If this fails, prints error message and returns failure flag.
  *	b. Otherwise, continues.
  *
- * 10. Copies the remaining data from the source image to the
- *     destination image.
+ *    With --fec, steps 7 to 10 are replaced by a single one that builds
+ *    the message in memory, protects it with Reed-Solomon codes and
+ *    encodes the result.
+ *
+ * 11. Writes out the last partially used row and copies the remaining 
+ *     data from the source image to the destination image.
  *	a. If this fails, prints error message and returns failure flag.
  *	b. Otherwise, continues.
  *
+ *    With --verify, the bits embedded are read back from the row buffers
+ *    as they are written out and checked against the message with
+ *    CRC-32C. On a mismatch the output image is removed and the failure
+ *    flag is returned.
+ *
+ *    With --metrics, the rows are also compared with the cover as they
+ *    are written out, and the distortion is printed.
+ *
+ * The source image is read exactly once, front to back: the header, the
+ * rows that carry the message and the remaining data follow each other
+ * without any seek, so covers on pipes or network mounts cost a single
+ * sequential read.
+ *
  * Note that all the above operations are done by other functions, which
- * are called by this function.
+ * are called by this function. Whenever a step fails, the files opened so
+ * far are closed with cleanup() before returning.
  *
  * INPUTS: Pointer to EncodeInfo object.
  *
@@ -74,137 +108,211 @@ Status do_encoding(EncodeInfo *encInfo)
     }
 
     //Open files.
+    telemetry_job_begin(&encInfo->telemetry, e_telemetry_encode);
     if(open_files(encInfo) == e_failure)
     {
 	fprintf(stderr, "File error.\n");
+	cleanup(encInfo);
 	return e_failure;
     }
     printf("Files opened.\n");
 
+    //Copy and parse the source image header.
+    telemetry_job_stage(&encInfo->telemetry, e_telemetry_header);
+    if(copy_bmp_header(encInfo->fptr_src_image, encInfo->fptr_stego_image, &encInfo->src_image_info) == e_failure)
+    {
+	fprintf(stderr, "BMP file header copy failed.\n");
+	cleanup(encInfo);
+	return e_failure;
+    }
+    printf("Header copied.\n");
+
     //Check secret data size.
-    uint secret_msg_byte_size = get_file_size(encInfo->fptr_secret) + 1;
+    telemetry_job_stage(&encInfo->telemetry, e_telemetry_capacity);
+    uint secret_msg_byte_size = get_file_size(encInfo->fptr_secret);
     if(!secret_msg_byte_size)
     {
 	fprintf(stderr, "The data file contains no data to encode. Encoding failed.\n");
+	cleanup(encInfo);
 	return e_failure;
     }
     printf("Secret message size check complete: %u bytes\n", secret_msg_byte_size);
 
     //Check the image file can accomodate the secret data.
-    uint image_byte_size = get_image_size_for_bmp(encInfo->fptr_src_image);
-    uint magic_str_byte_size = strlen(MAGIC_STRING);
-    uint file_ext_byte_size = MAX_FILE_SUFFIX;
-    uint file_size_str_byte_size = sizeof(long) + 1;
-    uint total_encoded_msg_byte_size = secret_msg_byte_size + magic_str_byte_size + file_ext_byte_size + file_size_str_byte_size;
-    if(!(image_byte_size >= total_encoded_msg_byte_size * 8))
+    if(lsb_check_image_support(&encInfo->src_image_info, encInfo->options.skip_alpha) == e_failure)
+    {
+	cleanup(encInfo);
+	return e_failure;
+    }
+    encInfo->image_capacity = lsb_image_capacity(&encInfo->src_image_info, encInfo->options.skip_alpha);
+    size_t total_encoded_msg_byte_size = get_message_size_allowance(secret_msg_byte_size, &encInfo->options);
+    if(!total_encoded_msg_byte_size || !(encInfo->image_capacity >= total_encoded_msg_byte_size))
     {
 	fprintf(stderr, "Image file not large enough to hold the encoded data.\n");
+	cleanup(encInfo);
 	return e_failure;
     }
     printf("File size check complete.\n");
-
-    //Copy header.
-    Status header_copy_staus = copy_bmp_header(encInfo->fptr_src_image, encInfo->fptr_stego_image);
-    if(header_copy_staus == e_failure)
+    encInfo->telemetry.bytes = secret_msg_byte_size;
+
+    //Set up the row cursor over the pixel data.
+    telemetry_job_stage(&encInfo->telemetry, e_telemetry_setup);
+    if(lsb_cursor_init(&encInfo->lsb_cursor, &encInfo->src_image_info, encInfo->fptr_src_image, encInfo->fptr_stego_image, encInfo->options.skip_alpha, encInfo->arena) == e_failure ||
+	    lsb_cursor_use_options_key(&encInfo->lsb_cursor, &encInfo->options) == e_failure ||
+	    (encInfo->options.verify && lsb_cursor_enable_verify(&encInfo->lsb_cursor) == e_failure) ||
+	    (encInfo->options.metrics && lsb_cursor_enable_metrics(&encInfo->lsb_cursor, &encInfo->metrics) == e_failure))
     {
-	fprintf(stderr, "BMP file header copy failed.\n");
+	fprintf(stderr, "Pixel row pipeline setup failed.\n");
+	cleanup(encInfo);
 	return e_failure;
     }
-    printf("Header copied.\n");
 
-    //Encode magic string.
-    Status magic_string_encode_status = encode_magic_string(MAGIC_STRING, encInfo);
-    if(magic_string_encode_status == e_failure)
+    telemetry_job_stage(&encInfo->telemetry, e_telemetry_embed);
+    if(encInfo->options.fec_parity)
     {
-	fprintf(stderr, "Magic String encoding failed.\n");
-	return e_failure;
+	//Encode the whole message protected by FEC.
+	if(encode_fec_message(encInfo) == e_failure)
+	{
+	    fprintf(stderr, "FEC message encoding failed.\n");
+	    cleanup(encInfo);
+	    return e_failure;
+	}
+	printf("Message encoded with FEC.\n");
     }
-    printf("Message encoding started.\n");
-    printf("Magic string encoded.\n");
-
-    //Get file extension from secret data filename.
-    char file_extn[MAX_FILE_SUFFIX];
-    Status file_extension_acquisition_status = get_file_extension(encInfo->secret_fname, file_extn);
-    if(file_extension_acquisition_status == e_failure)
+    else
     {
-	fprintf(stderr, "File extension acquisition failed.\n");
-	return e_failure;
+	//Encode magic string.
+	Status magic_string_encode_status = encode_magic_string(MAGIC_STRING, encInfo);
+	if(magic_string_encode_status == e_failure)
+	{
+	    fprintf(stderr, "Magic String encoding failed.\n");
+	    cleanup(encInfo);
+	    return e_failure;
+	}
+	printf("Message encoding started.\n");
+	printf("Magic string encoded.\n");
+
+	//Get file extension from secret data filename.
+	char file_extn[MAX_FILE_SUFFIX];
+	Status file_extension_acquisition_status = get_file_extension(encInfo->secret_fname, file_extn);
+	if(file_extension_acquisition_status == e_failure)
+	{
+	    fprintf(stderr, "File extension acquisition failed.\n");
+	    cleanup(encInfo);
+	    return e_failure;
+	}
+	printf("File extension acquired.\n");
+
+	//Encode secret data file extension.
+	Status sec_file_extn_encode_status = encode_secret_file_extn(file_extn, encInfo);
+	if(sec_file_extn_encode_status == e_failure)
+	{
+	    fprintf(stderr, "Secret file extension encoding failed.\n");
+	    cleanup(encInfo);
+	    return e_failure;
+	}
+	printf("Secret file extension encoded.\n");
+
+	//Encode secret file size.
+	Status file_size_encode_status = encode_secret_file_size(secret_msg_byte_size, encInfo);
+	if(file_size_encode_status == e_failure)
+	{
+	    fprintf(stderr, "Secret file size encoding failed.\n");
+	    cleanup(encInfo);
+	    return e_failure;
+	}
+	printf("Secret file size encoded.\n");
+
+	//Encode secret data.
+	Status secret_data_encode_status = encode_secret_file_data(encInfo);
+	if(secret_data_encode_status == e_failure)
+	{
+	    fprintf(stderr, "Secret data encoding failed.\n");
+	    cleanup(encInfo);
+	    return e_failure;
+	}
+	printf("Secret data encoded.\n");
     }
-    printf("File extension acquired.\n");
 
-    //Encode secret data file extension.
-    Status sec_file_extn_encode_status = encode_secret_file_extn(file_extn, encInfo);
-    if(sec_file_extn_encode_status == e_failure)
+    //Write out the last used row.
+    telemetry_job_stage(&encInfo->telemetry, e_telemetry_flush);
+    if(lsb_cursor_flush(&encInfo->lsb_cursor) == e_failure)
     {
-	fprintf(stderr, "Secret file extension encoding failed.\n");
+	fprintf(stderr, "Pixel row write failed.\n");
+	cleanup(encInfo);
 	return e_failure;
     }
-    printf("Secret file extension encoded.\n");
 
-    //Encode secret file size.
-    Status file_size_encode_status = encode_secret_file_size(secret_msg_byte_size, encInfo);
-    if(file_size_encode_status == e_failure)
+    //Check the embedded bits read back right.
+    if(encInfo->options.verify && lsb_cursor_check_verify(&encInfo->lsb_cursor) == e_failure)
     {
-	fprintf(stderr, "Secret file size encoding failed.\n");
+	fprintf(stderr, "Encoding verification failed, output removed.\n");
+	cleanup(encInfo);
 	return e_failure;
     }
-    printf("Secret file size encoded.\n");
+    if(encInfo->options.verify)
+	printf("Embedded message verified.\n");
 
-    //Encode secret data.
-    Status secret_data_encode_status = encode_secret_file_data(encInfo);
-    if(secret_data_encode_status == e_failure)
+    //Report the distortion, the rows past the message being copied as they are.
+    if(encInfo->options.metrics)
     {
-	fprintf(stderr, "Secret data encoding failed.\n");
-	return e_failure;
+	encInfo->metrics.pixel_bytes = (uint64_t)encInfo->src_image_info.row_size * encInfo->src_image_info.height;
+	print_compare_metrics(&encInfo->metrics);
     }
-    printf("Secret data encoded.\n");
 
     //Copy remaining data.
-    Status cpy_remaining_data_status = copy_remaining_img_data(encInfo->fptr_src_image, encInfo->fptr_stego_image);
+    telemetry_job_stage(&encInfo->telemetry, e_telemetry_copy);
+    Status cpy_remaining_data_status = copy_remaining_img_data(encInfo->fptr_src_image, encInfo->fptr_stego_image, &encInfo->progress);
     if(cpy_remaining_data_status == e_failure)
     {
 	fprintf(stderr, "Remaining data encoding failed.\n");
+	cleanup(encInfo);
 	return e_failure;
     }
     printf("Remaining data encoded.\n");
 
+    telemetry_job_stage(&encInfo->telemetry, e_telemetry_commit);
+    if(commit_stego_file(encInfo) == e_failure)
+    {
+	fprintf(stderr, "Output file write failed.\n");
+	cleanup(encInfo);
+	return e_failure;
+    }
     printf("Output file: %s\n", encInfo->stego_image_fname);
 
+    telemetry_job_stage(&encInfo->telemetry, e_telemetry_done);
     cleanup(encInfo);
     return e_success;
 }
 
-/* Get image size
- * Input: Image file ptr
- * Output: width * height * bytes per pixel (3 in our case)
- * Description: In BMP Image, width is stored in offset 18,
- * and height after that. size is 4 bytes
+/*
+ * Function to give a freshly opened stream a STREAM_BLOCK_SIZE buffer
+ * aligned to STREAM_BLOCK_ALIGN, so that stdio moves its data in large
+ * aligned blocks. Without the buffer the stream keeps its default one.
+ *
+ * CAUTION: The buffer must outlive the stream and be given back with
+ * arena_release() after fclose().
+ *
+ * INPUTS: The stream (may be NULL), where to return the buffer and the
+ * arena to allocate it from (may be NULL).
+ *
+ * RETURNS: Nothing.
  */
-uint get_image_size_for_bmp(FILE *fptr_image)
+void set_stream_block_buffer(FILE *fptr, void **buffer, Arena *arena)
 {
-    if(fptr_image)
+    if(!buffer)
     {
-	uint width, height;
-
-	rewind(fptr_image);
-	// Seek to 18th byte
-	fseek(fptr_image, 18, SEEK_SET);
-
-	// Read the width (an int)
-	fread(&width, sizeof(int), 1, fptr_image);
-	//printf("width = %u\n", width);
-
-	// Read the height (an int)
-	fread(&height, sizeof(int), 1, fptr_image);
-	//printf("height = %u\n", height);
-
-	// Return image capacity
-	return width * height * 3;
+	FATAL_ERR_MSG;
+	return;
     }
-    else
+
+    *buffer = NULL;
+    if(!fptr || !(*buffer = arena_memalign(arena, STREAM_BLOCK_ALIGN, STREAM_BLOCK_SIZE)))
+	return;
+    if(setvbuf(fptr, *buffer, _IOFBF, STREAM_BLOCK_SIZE))
     {
-	FATAL_ERR_MSG;
-	return 0;
+	arena_release(arena, *buffer);
+	*buffer = NULL;
     }
 }
 
@@ -213,6 +321,13 @@ uint get_image_size_for_bmp(FILE *fptr_image)
  * Inputs: Src Image file, Secret file and
  * Stego Image file
  * Output: FILE pointer for above files
+ * Description: A stream the caller has already set up,
+ * such as an in-memory secret, is used as it is.
+ * STDIO_FILE_NAME stands for stdin/stdout, and a
+ * secret that can not seek is buffered in memory.
+ * The stego image file is written under its
+ * temporary name until commit_stego_file().
+ * The images use direct I/O with --direct-io
  * Return Value: e_success or e_failure, on file errors
  */
 Status open_files(EncodeInfo *encInfo)
@@ -224,7 +339,11 @@ Status open_files(EncodeInfo *encInfo)
     }
 
     // Src Image file
-    encInfo->fptr_src_image = fopen(encInfo->src_image_fname, "rb");
+    if(!encInfo->fptr_src_image)
+    {
+	encInfo->fptr_src_image = open_image_stream(encInfo->src_image_fname, "rb", encInfo->options.direct_io, encInfo->arena);
+	set_stream_block_buffer(encInfo->fptr_src_image, &encInfo->src_stream_buf, encInfo->arena);
+    }
     // Do Error handling
     if (encInfo->fptr_src_image == NULL)
     {
@@ -234,8 +353,13 @@ Status open_files(EncodeInfo *encInfo)
 	return e_failure;
     }
 
-    // Secret file
-    encInfo->fptr_secret = fopen(encInfo->secret_fname, "rb");
+    // Secret file, which has to be sized before it is encoded
+    if(!encInfo->fptr_secret)
+    {
+	encInfo->fptr_secret = open_data_stream(encInfo->secret_fname, "rb");
+	if(encInfo->fptr_secret && make_stream_seekable(&encInfo->fptr_secret, &encInfo->secret_stream_buf) == e_failure)
+	    return e_failure;
+    }
     // Do Error handling
     if (encInfo->fptr_secret == NULL)
     {
@@ -246,7 +370,18 @@ Status open_files(EncodeInfo *encInfo)
     }
 
     // Stego Image file
-    encInfo->fptr_stego_image = fopen(encInfo->stego_image_fname, "wb");
+    if(!encInfo->fptr_stego_image)
+    {
+	const char *stego_fname = encInfo->stego_image_fname;
+	if(!is_stdio_file_name(stego_fname))
+	{
+	    encInfo->stego_temp_fname = get_temp_output_filename(stego_fname, encInfo->arena);
+	    stego_fname = encInfo->stego_temp_fname;
+	}
+	if(stego_fname)
+	    encInfo->fptr_stego_image = open_image_stream(stego_fname, "wb", encInfo->options.direct_io, encInfo->arena);
+	set_stream_block_buffer(encInfo->fptr_stego_image, &encInfo->stego_stream_buf, encInfo->arena);
+    }
     // Do Error handling
     if (encInfo->fptr_stego_image == NULL)
     {
@@ -266,7 +401,9 @@ Status open_files(EncodeInfo *encInfo)
  *
  * INPUTS: The argument vector from the main() function.
  *
- * RETURNS: The operation type enum: e_encode, e_decode or e_unsupported.
+ * RETURNS: The operation type enum: e_encode, e_decode, e_serve, e_client,
+ * e_broadcast, e_span, e_join, e_update, e_compare, e_detect or
+ * e_unsupported.
  */
 OperationType check_operation_type(char *argv[])
 {
@@ -282,11 +419,75 @@ OperationType check_operation_type(char *argv[])
 	    return e_encode;
 	if(!strcmp(argv[1], DECODE_ARG))
 	    return e_decode;
+	if(!strcmp(argv[1], SERVE_ARG))
+	    return e_serve;
+	if(!strcmp(argv[1], CLIENT_ARG))
+	    return e_client;
+	if(!strcmp(argv[1], BROADCAST_ARG))
+	    return e_broadcast;
+	if(!strcmp(argv[1], SPAN_ARG))
+	    return e_span;
+	if(!strcmp(argv[1], JOIN_ARG))
+	    return e_join;
+	if(!strcmp(argv[1], UPDATE_ARG))
+	    return e_update;
+	if(!strcmp(argv[1], COMPARE_ARG))
+	    return e_compare;
+	if(!strcmp(argv[1], DETECT_ARG))
+	    return e_detect;
 	return e_unsupported;
     }
     return e_unsupported;
 }
 
+/*
+ * Function to check the encode arguments when the cover is picked from a
+ * pool with --cover-pool. The image argument is left out then:
+ *	-e <secret_file> [output.bmp] --cover-pool <dir>
+ *
+ * The smallest cover of the pool that can hold the secret, with the same
+ * size allowance do_encoding() checks for, becomes the source image.
+ */
+static Status read_cover_pool_encode_args(char *argv[], EncodeInfo *encInfo)
+{
+    if(!argv[2])
+    {
+	fprintf(stderr, "Error: Please input a file to be encoded as the second argument:\n%s %s <secret_msg_file> [output%s] %s <dir>\n", argv[0], ENCODE_ARG, IMG_FILE_EXTN, COVER_POOL_ARG);
+	return e_failure;
+    }
+
+    if(is_stdio_file_name(argv[2]))
+    {
+	fprintf(stderr, "Error: %s picks the cover by the size of the secret, so the secret can not be read from standard input.\n", COVER_POOL_ARG);
+	return e_failure;
+    }
+
+    struct stat st;
+    if(stat(argv[2], &st))
+    {
+	perror("stat");
+	fprintf(stderr, "ERROR: Unable to open file %s\n", argv[2]);
+	return e_failure;
+    }
+
+    uint message_size = get_message_size_allowance(st.st_size, &encInfo->options);
+    if(select_pool_cover(encInfo->options.cover_pool, message_size, encInfo->options.skip_alpha, &encInfo->pool_cover_fname) == e_failure)
+	return e_failure;
+    printf("Cover picked from the pool: %s\n", encInfo->pool_cover_fname);
+
+    encInfo->src_image_fname = encInfo->pool_cover_fname;
+    encInfo->secret_fname = argv[2];
+    encInfo->stego_image_fname = get_default_stegged_output_filename(argv[3], encInfo->arena);
+    if(!encInfo->stego_image_fname)
+    {
+	FATAL_ERR_MSG;
+	free(encInfo->pool_cover_fname);
+	encInfo->pool_cover_fname = NULL;
+	return e_failure;
+    }
+    return e_success;
+}
+
 /*
  * Function to check the validity of arguments input by the user and
  * return the status.
@@ -300,6 +501,12 @@ OperationType check_operation_type(char *argv[])
  * file name, in that order. Similarly for decoding, except it does
  * not require the file containing secret data.
  *
+ * Optional "--" arguments may appear anywhere after the operation argument;
+ * they are read into the options member and removed from argv first.
+ *
+ * Any of the files may be given as STDIO_FILE_NAME for the standard input
+ * (image or secret, not both) or the standard output.
+ *
  * If all inputs are valid, this function initialized the names of the
  * input files in the appropriate fields of the EncodeInfo object that
  * is passed by reference into this function. If no output file name is
@@ -318,13 +525,21 @@ Status read_and_validate_encode_args(char *argv[], EncodeInfo *encInfo)
 	return e_failure;
     }
 
+    memset(encInfo, 0, sizeof(*encInfo));
+    if(read_steg_options(argv, &encInfo->options) == e_failure)
+	return e_failure;
+    progress_init(&encInfo->progress, &encInfo->options);
+
+    if(encInfo->options.cover_pool)
+	return read_cover_pool_encode_args(argv, encInfo);
+
     if(!argv[2])
     {
 	fprintf(stderr, "Error: Please input a %s file as the second argument:\n%s <%s/%s> <image%s>\n", IMG_FILE_EXTN, argv[0], ENCODE_ARG, DECODE_ARG, IMG_FILE_EXTN);
 	return e_failure;
     }
 
-    if(!strstr(argv[2], ".bmp"))
+    if(!strstr(argv[2], ".bmp") && !is_stdio_file_name(argv[2]))
     {
 	fprintf(stderr, "Error: Please input a %s file as the second argument:\n%s <%s/%s> <image%s>\n", IMG_FILE_EXTN, argv[0], ENCODE_ARG, DECODE_ARG, IMG_FILE_EXTN);
 	return e_failure;
@@ -336,9 +551,15 @@ Status read_and_validate_encode_args(char *argv[], EncodeInfo *encInfo)
 	return e_failure;
     }
 
+    if(is_stdio_file_name(argv[2]) && is_stdio_file_name(argv[3]))
+    {
+	fprintf(stderr, "Error: The image and the secret can not both be read from the standard input.\n");
+	return e_failure;
+    }
+
     encInfo->src_image_fname = argv[2];
     encInfo->secret_fname = argv[3];
-    encInfo->stego_image_fname = get_default_stegged_output_filename(argv[4]);
+    encInfo->stego_image_fname = get_default_stegged_output_filename(argv[4], encInfo->arena);
     if(!encInfo->stego_image_fname)
     {
 	FATAL_ERR_MSG;
@@ -354,25 +575,28 @@ Status read_and_validate_encode_args(char *argv[], EncodeInfo *encInfo)
  * file a default name that bears DEFAULT_DECODED_FILE_PREFIX, __TIME__ and DEFAULT_ENCODED_FILE_SUFFIX 
  * along with the IMG_FILE_EXTN.
  *
- * CAUTION: This function dynamically allocates memory for the output character array and must be 
- * deallocated at a later point in time.
+ * CAUTION: The output character array is allocated from the arena, or from the heap without one,
+ * and must be given back with arena_release() at a later point in time.
  *
- * INPUTS: User suggested output filename pointer.
+ * INPUTS: User suggested output filename pointer and the arena (may be NULL).
  *
  * RETURNS: A character pointer to the output file name character array.
  */
-char *get_default_stegged_output_filename(const char* user_given_name)
+char *get_default_stegged_output_filename(const char* user_given_name, Arena *arena)
 {
     char *ofile_name = NULL;
 
     if(user_given_name)
     {
-	ofile_name = malloc(strlen(user_given_name + 1));
-	strcpy(ofile_name, user_given_name);
+	ofile_name = arena_alloc(arena, strlen(user_given_name) + 1);
+	if(ofile_name)
+	    strcpy(ofile_name, user_given_name);
 	return ofile_name;
     }
 
-    ofile_name = malloc(strlen(DEFAULT_ENCODED_FILE_PREFIX) + strlen(__TIME__) + strlen(IMG_FILE_EXTN) + strlen(DEFAULT_ENCODED_FILE_SUFFIX) + 1);
+    ofile_name = arena_alloc(arena, strlen(DEFAULT_ENCODED_FILE_PREFIX) + strlen(__TIME__) + strlen(IMG_FILE_EXTN) + strlen(DEFAULT_ENCODED_FILE_SUFFIX) + 1);
+    if(!ofile_name)
+	return NULL;
     strcpy(ofile_name, DEFAULT_ENCODED_FILE_PREFIX);
     strcat(ofile_name, __TIME__);
     strcat(ofile_name, DEFAULT_ENCODED_FILE_SUFFIX);
@@ -381,11 +605,46 @@ char *get_default_stegged_output_filename(const char* user_given_name)
     return ofile_name;
 }
 
+/*
+ * Function to close the stego image once it is complete and rename it from
+ * its temporary name to its real name, which it only ever has complete.
+ * Streams the caller set up, and the standard output, are only flushed.
+ *
+ * INPUTS: The EncodeInfo object.
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status commit_stego_file(EncodeInfo *encInfo)
+{
+    if(!encInfo || !encInfo->fptr_stego_image)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    if(!encInfo->stego_temp_fname)
+	return fflush(encInfo->fptr_stego_image)? e_failure: e_success;
+
+    int close_failed = fclose(encInfo->fptr_stego_image);
+    encInfo->fptr_stego_image = NULL;
+    if(close_failed || rename(encInfo->stego_temp_fname, encInfo->stego_image_fname))
+    {
+	FILE_WRITE_ERR;
+	return e_failure;
+    }
+    arena_release(encInfo->arena, encInfo->stego_temp_fname);
+    encInfo->stego_temp_fname = NULL;
+    return e_success;
+}
+
 /*
  * Function to cleanup resources after finishing encoding.
  *
  * This function closes opened files: source image, destination image
- * secret file and frees dynamically allocated memory.
+ * secret file and frees dynamically allocated memory. Files that were
+ * never opened are skipped, so it is safe to call after a failure at any
+ * stage of the encoding. A stego image file that was not committed with
+ * commit_stego_file() is removed.
  *
  * INPUTS: The EncodeInfo object.
  *
@@ -399,49 +658,63 @@ void cleanup(EncodeInfo *encInfo)
 	return;
     }
 
+    telemetry_job_end(&encInfo->telemetry);
     if(encInfo->stego_image_fname)
-	free(encInfo->stego_image_fname);
-    fclose(encInfo->fptr_src_image);
-    fclose(encInfo->fptr_secret);
-    fclose(encInfo->fptr_stego_image);
+	arena_release(encInfo->arena, encInfo->stego_image_fname);
+    encInfo->stego_image_fname = NULL;
+    free(encInfo->pool_cover_fname);
+    encInfo->pool_cover_fname = NULL;
+    encInfo->src_image_fname = NULL;
+    lsb_cursor_free(&encInfo->lsb_cursor);
+    if(encInfo->fptr_src_image)
+	fclose(encInfo->fptr_src_image);
+    if(encInfo->fptr_secret)
+	fclose(encInfo->fptr_secret);
+    if(encInfo->fptr_stego_image)
+	fclose(encInfo->fptr_stego_image);
+    if(encInfo->stego_temp_fname)
+	remove(encInfo->stego_temp_fname);
+    arena_release(encInfo->arena, encInfo->stego_temp_fname);
+    encInfo->stego_temp_fname = NULL;
+    encInfo->fptr_src_image = NULL;
+    encInfo->fptr_secret = NULL;
+    encInfo->fptr_stego_image = NULL;
+    arena_release(encInfo->arena, encInfo->src_stream_buf);
+    arena_release(encInfo->arena, encInfo->stego_stream_buf);
+    free(encInfo->secret_stream_buf);
+    encInfo->src_stream_buf = NULL;
+    encInfo->stego_stream_buf = NULL;
+    encInfo->secret_stream_buf = NULL;
 }
 
 /*
  * Function to return the size of the file pointed by a file pointer
  *
  * This function needs a file pointer refering to a file opened in binary
- * read mode. It reads through each byte and returns the number of bytes
- * read, which is the size of the file in bytes.
+ * read mode. It seeks to the end of the file and takes the position there
+ * as the size, then rewinds the file for the readers that follow.
  *
  * If null file pointer is input, it throws an error message. This is a
  * fatal situation and indicates a semantic error in the program.
  *
  * INPUTS: File pointer of file whose size is required.
  *
- * RETURNS: The size of the file in bytes.
+ * RETURNS: The size of the file in bytes, 0 on errors.
  */
 uint get_file_size(FILE *fptr)
 {    
     if(fptr)
     {
-	char c;
+	long size = -1;
+	if(!fseek(fptr, 0, SEEK_END))
+	    size = ftell(fptr);
 	rewind(fptr);
-	uint size = 0;
-	while(1)
+	if(size < 0 || size > 0xFFFFFFFFL)
 	{
-	    fread(&c, sizeof(c), 1, fptr);
-	    if(ferror(fptr))
-	    {
-		fprintf(stderr, "File read error.\n");
-		return 0;
-	    }
-	    if(feof(fptr))
-		break;
-	    ++size;
+	    fprintf(stderr, "File read error.\n");
+	    return 0;
 	}
-	//uint size = ftell(fptr);
-	//return size? size - 1: 0;
-	return size - 1;
+	return size;
     }
     FATAL_ERR_MSG;
     return 0;
@@ -451,145 +724,102 @@ uint get_file_size(FILE *fptr)
  * Function to copy the header information of source BMP file to the 
  * destination BMP file.
  *
- * This function simply copies 54 initial bytes (the size of header in
- * .bmp files) in the source file to the destination file. So, obviously
- * this works only for standard BMP image files.
+ * This function copies all the bytes before the pixel data offset in
+ * the source file to the destination file. This covers the file header,
+ * the info header and any colour table or extra header data. The header
+ * is parsed into the BmpImage descriptor as it goes through, so the
+ * source is only read forward, once, and the rest of the header is
+ * copied through a small stack buffer, so nothing is allocated.
+ *
+ * CAUTION: Both files must be positioned at their start. Their position
+ * indicators are left at the pixel data offset, ready for the encoding
+ * stages that follow.
  *
- * INPUTS: Two file pointers: Source and destination .bmp image files.
+ * INPUTS: Two file pointers: Source and destination .bmp image files and
+ * the BmpImage descriptor to fill in.
  * 
  * RETURNS: The status enum for the operation: e_success or e_failure.
  */
-Status copy_bmp_header(FILE *fptr_src_image, FILE *fptr_dest_image)
+Status copy_bmp_header(FILE *fptr_src_image, FILE *fptr_dest_image, BmpImage *bmp_image)
 {
-    if(!fptr_src_image || !fptr_dest_image)
+    if(!fptr_src_image || !fptr_dest_image || !bmp_image)
     {
 	FATAL_ERR_MSG;
 	return e_failure;
     }
 
-    int bmp_pixel_data_offset = get_image_size_for_bmp(fptr_src_image);
-    void *buffer = malloc(bmp_pixel_data_offset/*BMP_HEADER_SIZE*/);
-    while(!buffer)
-	buffer = malloc(bmp_pixel_data_offset/*BMP_HEADER_SIZE*/);
-
-    rewind(fptr_src_image);
-    rewind(fptr_dest_image);
-
-    fread(buffer, bmp_pixel_data_offset/*BMP_HEADER_SIZE*/, 1, fptr_src_image);
-    if(ferror(fptr_src_image))
+    unsigned char parsed_header[BMP_PARSED_HEADER_SIZE];
+    if(fread(parsed_header, sizeof(parsed_header), 1, fptr_src_image) != 1)
     {
 	FILE_READ_ERR;
-	free(buffer);
 	return e_failure;
     }
+    if(parse_bmp_image_info(parsed_header, bmp_image) == e_failure)
+	return e_failure;
 
-    fwrite(buffer, bmp_pixel_data_offset/*BMP_HEADER_SIZE*/, 1, fptr_dest_image);
-    if(ferror(fptr_dest_image))
+    fwrite(parsed_header, sizeof(parsed_header), 1, fptr_dest_image);
+    unsigned char buffer[BMP_HEADER_COPY_CHUNK];
+    for(uint rest = bmp_image->data_offset - sizeof(parsed_header); rest && !ferror(fptr_dest_image);)
     {
-	FILE_READ_ERR;
-	free(buffer);
-	return e_failure;
+	uint chunk = rest < sizeof(buffer)? rest: sizeof(buffer);
+	if(fread(buffer, chunk, 1, fptr_src_image) != 1)
+	{
+	    FILE_READ_ERR;
+	    return e_failure;
+	}
+	fwrite(buffer, chunk, 1, fptr_dest_image);
+	rest -= chunk;
     }
-
-    free(buffer);
-    return e_success;
-}
-
-/*
- * Function to encode a data byte into 8 successive image buffer bytes.
- *
- * This function takes a data byte and encodes each bit to each of the 8 
- * bytes of the image buffer. It starts at the LSB of the data byte and 
- * encodes each bit into the LSB of each successive byte of the image 
- * buffer starting at index 0 of the image buffer. At the end of the 
- * operation, each bit of the data byte from LSB side could be found in 
- * the LSB of each successive byte of the image buffer starting at the 
- * 0th position.
- *
- * If the image buffer is NULL, the function displays an error message and
- * returns the failure flag.
- *
- * INPUTS: The data byte and the image buffer.
- *
- * CAUTION: Ensure the image buffer has 8 bytes in it.
- *
- * RETURNS: Operation status: e_success or e_failure.
- * 
- */
-Status encode_byte_to_lsb(char data, char *image_buffer)
-{
-    if(!image_buffer)
+    if(ferror(fptr_dest_image))
     {
-	FATAL_ERR_MSG;
+	FILE_WRITE_ERR;
 	return e_failure;
     }
-
-    for(int i = 0; i < MAX_IMAGE_BUF_SIZE; ++i)
-	image_buffer[i] = ((data >> i) & 1) | ((image_buffer[i] >> 1) << 1);
     return e_success;
 }
 
 /*
  * Function to encode a string into a destination BMP image file.
  *
- * This function takes in a string, the source BMP image pointer and the destination 
- * BMP image file pointer. It takes each character from the string, copies (no. of 
- * characters * 8 bytes) of data from the source image file at the position pointed 
- * to by the position indicator of the source file stream. It then encodes each bit 
- * of the character into consecutive bytes of the copied bytes and puts them into the 
- * same location as in the source file into the destination file. It then returns a
- * success flag.
+ * This function takes in a string and the row cursor over the source and 
+ * destination images. Each bit of each character of the string is encoded, 
+ * starting from the LSB of the character, into the LSB of consecutive 
+ * carrier bytes of the pixel rows, 8 carrier bytes per character. Finished
+ * rows are written into the destination file at the same location as in the
+ * source file.
  *
  * If even one of the input data is NULL, it displays error message and returns a 
  * failure flag.
  * 
- * CAUTION: This function simply copies and encodes the data at position pointed to by
- * the file stream position indicators. Ensure they are pointing at the right index
- * before calling this function.
+ * CAUTION: This function continues from the carrier at which the previous call
+ * left the cursor.
  * 
- * INPUTS: The string to be encoded, the source and destination image file pointers.
+ * INPUTS: The string to be encoded and the row cursor.
  *
  * RETURNS: Operation status: e_success or e_failure.
  */
-Status encode_string_to_image(const char *string, FILE *fptr_src_image, FILE *fptr_dest_image)
+Status encode_string_to_image(const char *string, LsbCursor *cursor)
 {
-    if(!string || !fptr_src_image || !fptr_dest_image)
+    if(!string || !cursor)
     {
 	FATAL_ERR_MSG;
 	return e_failure;
     }
 
-    for(int i = 0; i < strlen(string); ++i)
-    {
-	char image_buffer[MAX_IMAGE_BUF_SIZE];
-	fread(image_buffer, MAX_IMAGE_BUF_SIZE, 1, fptr_src_image);
-	if(ferror(fptr_dest_image))
-	{
-	    FILE_READ_ERR;
-	    return e_failure;
-	}
-
-	encode_byte_to_lsb(string[i], image_buffer);
-
-	fwrite(image_buffer, MAX_IMAGE_BUF_SIZE, 1, fptr_dest_image);
-	if(ferror(fptr_dest_image))
-	{
-	    FILE_WRITE_ERR;
-	    return e_failure;
-	}
-    }
-    return e_success;
+    return lsb_cursor_write(cursor, (const unsigned char *)string, strlen(string));
 }
 
 /*
  * Function to encode the magic string to the destination BMP image file.
  *
- * This function first sets the position indicator to the BMP_HEADER_SIZEth
- * byte in both the source image file and the stegged image file. From there,
- * it will encode each character of the magic string into 8 consecutive bytes
- * of the source image file starting at positon BMP_HEADER_SIZE. It returns
- * the success flag if this operation was successful otherwise it will stop
- * operation at the first failure and return failure flag.
+ * This function encodes each character of the magic string into 8 
+ * consecutive bytes of the source image file starting at the pixel data
+ * offset. It returns the success flag if this operation was successful 
+ * otherwise it will stop operation at the first failure and return 
+ * failure flag.
+ *
+ * CAUTION: This function expects the row cursor to be freshly set up at 
+ * the pixel data offset, which is where copy_bmp_header() leaves the files.
  *
  * INPUTS: The magic string pointer and pointer to EncodeInfo object.
  *
@@ -603,20 +833,7 @@ Status encode_magic_string(const char *magic_string, EncodeInfo *encInfo)
 	return e_failure;
     }
 
-    FILE *fptr_dest_image = encInfo->fptr_stego_image;
-    FILE *fptr_src_image = encInfo->fptr_src_image;
-
-    int bmp_pixel_data_offset = get_image_data_offset(fptr_src_image);
-
-    fseek(fptr_src_image, bmp_pixel_data_offset/*BMP_HEADER_SIZE*/, SEEK_SET);
-    fseek(fptr_dest_image, bmp_pixel_data_offset/*BMP_HEADER_SIZE*/, SEEK_SET);
-    if(ferror(fptr_src_image) || ferror(fptr_dest_image))
-    {
-	FILE_SEEK_ERR;
-	return e_failure;
-    }
-
-    return encode_string_to_image(MAGIC_STRING, fptr_src_image, fptr_dest_image);
+    return encode_string_to_image(magic_string, &encInfo->lsb_cursor);
 }
 
 /*
@@ -647,19 +864,10 @@ Status encode_secret_file_extn(const char *file_extn, EncodeInfo *encInfo)
 
     strcpy(encInfo->extn_secret_file, file_extn);
 
-    FILE *fptr_src_image = encInfo->fptr_src_image;
-    FILE *fptr_dest_image = encInfo->fptr_stego_image;
+    Status encode_file_extn_status = encode_string_to_image(file_extn, &encInfo->lsb_cursor);
+    Status encode_file_extn_terminator_status = encode_string_to_image(ENC_DATA_SEPARATOR_STRING, &encInfo->lsb_cursor);
 
-    if(ferror(fptr_dest_image) || ferror(fptr_src_image))
-    {
-	FILE_SEEK_ERR;
-	return e_failure;
-    }
-
-    Status encode_file_extn_status = encode_string_to_image(file_extn, fptr_src_image, fptr_dest_image);
-    Status encode_file_extn_terminator_status = encode_string_to_image(ENC_DATA_SEPARATOR_STRING, fptr_src_image, fptr_dest_image);
-
-    return (encode_file_extn_terminator_status && encode_file_extn_status);
+    return (encode_file_extn_terminator_status == e_failure || encode_file_extn_status == e_failure)? e_failure: e_success;
 }
 
 /*
@@ -737,38 +945,29 @@ Status encode_secret_file_size(long file_size, EncodeInfo *encInfo)
 
     encInfo->size_secret_file = file_size;
 
-    FILE *fptr_src_image = encInfo->fptr_src_image;
-    FILE *fptr_dest_image = encInfo->fptr_stego_image;
-
-    if(ferror(fptr_dest_image) || ferror(fptr_src_image))
-    {
-	FILE_SEEK_ERR;
-	return e_failure;
-    }
-
-    char file_size_as_str[sizeof(file_size) + 1];
+    char file_size_as_str[MAX_FILE_SIZE_DIGITS + 2];
     itoa(file_size, file_size_as_str);
     strcat(file_size_as_str, ENC_DATA_SEPARATOR_STRING);
-    return encode_string_to_image(file_size_as_str, fptr_src_image, fptr_dest_image);
+    return encode_string_to_image(file_size_as_str, &encInfo->lsb_cursor);
 }
 
 /*
  * Function to encode the secret message to the destination BMP image file.
  *
- * This function first copies the secret message in the secret data file into a 
- * dynamic character array. It then appends the ENC_DATA_SEPARATOR_STRING and the
- * null terminator thereby constructing the secret data string.
- * 
- * It  will then encode each character of the secret message string and a terminator 
- * character '*' into 8 consecutive bytes of the source image file starting at positon 
- * previously set. It returns the success flag if this operation was successful 
- * otherwise it will stop operation at the first failure and return failure flag.
+ * This function reads the secret message from the secret data file 
+ * LSB_CHUNK_SIZE bytes at a time and encodes each byte of it, followed by
+ * the terminator character '*', into 8 consecutive carrier bytes of the
+ * image rows, continuing from where the row cursor was left. The message
+ * is treated as raw bytes, so binary secret files are encoded as they are.
  *
- * CAUTION: This function assumes that the file position indicators are at the
- * correct position at the time of calling this function and starts reading and 
- * encoding from the indicated position.
+ * With --encrypt, a random nonce is encoded first and every chunk is
+ * encrypted with ChaCha20 right before it is embedded, so the plain data
+ * is never written anywhere. After each chunk the progress is reported and
+ * the operation stops if the job has been cancelled. It returns the success
+ * flag if this operation was successful otherwise it will stop operation at
+ * the first failure and return failure flag.
  *
- * INPUTS: The file extn  string pointer and pointer to EncodeInfo object.
+ * INPUTS: Pointer to EncodeInfo object.
  *
  * RETURNS: The operation status enum: e_success or e_failure.
  */
@@ -780,26 +979,44 @@ Status encode_secret_file_data(EncodeInfo *encInfo)
 	return e_failure;
     }
 
-    FILE *fptr_src_image = encInfo->fptr_src_image;
-    FILE *fptr_dest_image = encInfo->fptr_stego_image;
     FILE *fptr_secret_data = encInfo->fptr_secret;
+    ChaCha20 cipher;
+    if(encInfo->options.encrypt)
+    {
+	unsigned char nonce[CHACHA20_NONCE_SIZE];
+	if(fill_random_bytes(nonce, sizeof(nonce)) == e_failure ||
+		chacha20_init_from_options(&cipher, &encInfo->options, nonce) == e_failure ||
+		lsb_cursor_write(&encInfo->lsb_cursor, nonce, sizeof(nonce)) == e_failure)
+	    return e_failure;
+    }
 
-    char *secret_data = malloc(encInfo->size_secret_file + 2);
+    unsigned char secret_data[LSB_CHUNK_SIZE];
+    Status secret_data_encode_status = e_success;
     rewind(fptr_secret_data);
-    fread(secret_data, encInfo->size_secret_file, 1, fptr_secret_data);
-    if(ferror(fptr_secret_data))
+    progress_begin(&encInfo->progress, "Encoding", encInfo->size_secret_file);
+    for(long remaining = encInfo->size_secret_file; remaining && secret_data_encode_status == e_success;)
     {
-	FILE_READ_ERR;
-	free(secret_data);
-	return e_failure;
+	uint chunk = remaining < LSB_CHUNK_SIZE? remaining: LSB_CHUNK_SIZE;
+	if(fread(secret_data, chunk, 1, fptr_secret_data) != 1)
+	{
+	    FILE_READ_ERR;
+	    secret_data_encode_status = e_failure;
+	    break;
+	}
+	if(encInfo->options.encrypt)
+	    chacha20_xor(&cipher, secret_data, chunk);
+	secret_data_encode_status = lsb_cursor_write(&encInfo->lsb_cursor, secret_data, chunk);
+	remaining -= chunk;
+	if(secret_data_encode_status == e_success)
+	    secret_data_encode_status = progress_update(&encInfo->progress, encInfo->size_secret_file - remaining);
     }
 
-    secret_data[encInfo->size_secret_file] = ENC_DATA_SEPARATOR_STRING[0];
-    secret_data[encInfo->size_secret_file + 1] = '\0';
-    Status secret_data_encode_status = encode_string_to_image(secret_data, fptr_src_image, fptr_dest_image);
-    free(secret_data);
-
-    return secret_data_encode_status;
+    if(encInfo->options.encrypt)
+	memset(&cipher, 0, sizeof(cipher));
+    memset(secret_data, 0, sizeof(secret_data));
+    if(secret_data_encode_status == e_failure)
+	return e_failure;
+    return encode_string_to_image(ENC_DATA_SEPARATOR_STRING, &encInfo->lsb_cursor);
 }
 
 /*
@@ -808,17 +1025,19 @@ Status encode_secret_file_data(EncodeInfo *encInfo)
  *
  * This function simply copies the bytes from the indicator position of
  * the source image file to the destination file till the end of the file
- * for the source image is reached.
+ * for the source image is reached, a block at a time. The copy stops
+ * before the next block once the job has been cancelled.
  *
  * CAUTION: This function assumes that the file position indicators are at the
  * correct position at the time of calling this function and starts reading and 
  * encoding from the indicated position.
  *
- * INPUTS: File pointers for source and destination image files.
+ * INPUTS: File pointers for source and destination image files and the
+ * progress state of the job (may be NULL).
  *
  * RETURNS: Operation status: e_success or e_failure.
  */
-Status copy_remaining_img_data(FILE *fptr_src, FILE *fptr_dest)
+Status copy_remaining_img_data(FILE *fptr_src, FILE *fptr_dest, const Progress *progress)
 {
     if(!fptr_dest || !fptr_src)
     {
@@ -826,24 +1045,225 @@ Status copy_remaining_img_data(FILE *fptr_src, FILE *fptr_dest)
 	return e_failure;
     }
 
+    char buffer[COPY_BLOCK_SIZE];
     while(1)
     {
-	char c;
-	fread(&c, 1, 1, fptr_src);
+	if(progress_cancelled(progress))
+	{
+	    fprintf(stderr, "Image copy cancelled.\n");
+	    return e_failure;
+	}
+
+	size_t got = fread(buffer, 1, sizeof(buffer), fptr_src);
 	if(ferror(fptr_src))
 	{
 	    FILE_READ_ERR;
 	    return e_failure;
 	}
+
+	if(got && fwrite(buffer, got, 1, fptr_dest) != 1)
+	{
+	    FILE_WRITE_ERR;
+	    return e_failure;
+	}
 	if(feof(fptr_src))
 	    break;
+    }
+    return e_success;
+}
 
-	fwrite(&c, 1, 1, fptr_dest);
-	if(ferror(fptr_dest))
+/*
+ * Function to build the complete encoded message for a secret in memory.
+ *
+ * The message is laid out exactly as do_encoding() embeds it: the magic
+ * string, the file extension and its terminator, the decimal file size and
+ * its terminator, the raw secret data (after a nonce, and encrypted, with
+ * --encrypt) and a final terminator. With --fec, the message is then
+ * protected with Reed-Solomon codes as described in fec.h. Callers that
+ * embed the same secret into many images build it once with this function.
+ *
+ * CAUTION: The message is allocated from the arena and must be given back
+ * with arena_release().
+ *
+ * INPUTS: The secret file name (for its extension), the opened secret file,
+ * the options, where to return the message and its length, and the arena
+ * to allocate it from (may be NULL).
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status build_encoded_message(const char *secret_fname, FILE *fptr_secret, const StegOptions *options, unsigned char **message, uint *message_len, Arena *arena)
+{
+    if(!secret_fname || !fptr_secret || !options || !message || !message_len)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    char file_extn[MAX_FILE_SUFFIX];
+    if(get_file_extension(secret_fname, file_extn) == e_failure)
+	return e_failure;
+
+    uint secret_size = get_file_size(fptr_secret);
+    if(!secret_size)
+    {
+	fprintf(stderr, "The data file contains no data to encode.\n");
+	return e_failure;
+    }
+
+    char file_size_as_str[MAX_FILE_SIZE_DIGITS + 2];
+    itoa(secret_size, file_size_as_str);
+
+    char header[sizeof(MAGIC_STRING) + MAX_FILE_SUFFIX + MAX_FILE_SIZE_DIGITS + 2];
+    int header_len = snprintf(header, sizeof(header), "%s%s%s%s%s", MAGIC_STRING, file_extn, ENC_DATA_SEPARATOR_STRING, file_size_as_str, ENC_DATA_SEPARATOR_STRING);
+
+    uint nonce_len = options->encrypt? CHACHA20_NONCE_SIZE: 0;
+    *message_len = header_len + nonce_len + secret_size + 1;
+    *message = arena_alloc(arena, *message_len);
+    if(!*message)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    memcpy(*message, header, header_len);
+    unsigned char *nonce = *message + header_len;
+    unsigned char *secret_data = nonce + nonce_len;
+    ChaCha20 cipher;
+    if(fread(secret_data, secret_size, 1, fptr_secret) != 1)
+    {
+	FILE_READ_ERR;
+	arena_release(arena, *message);
+	*message = NULL;
+	return e_failure;
+    }
+    if(options->encrypt)
+    {
+	if(fill_random_bytes(nonce, nonce_len) == e_failure || chacha20_init_from_options(&cipher, options, nonce) == e_failure)
 	{
-	    FILE_READ_ERR;
+	    arena_release(arena, *message);
+	    *message = NULL;
 	    return e_failure;
 	}
+	chacha20_xor(&cipher, secret_data, secret_size);
+	memset(&cipher, 0, sizeof(cipher));
     }
+    (*message)[*message_len - 1] = ENC_DATA_SEPARATOR_STRING[0];
+    if(!options->fec_parity)
+	return e_success;
+
+    unsigned char *protected_message = NULL;
+    size_t protected_len = 0;
+    Status fec_status = fec_encode(*message, *message_len, options->fec_parity, &protected_message, &protected_len, arena);
+    arena_release(arena, *message);
+    *message = protected_message;
+    if(fec_status == e_failure || protected_len > 0xFFFFFFFFU)
+    {
+	fprintf(stderr, "The message is too large for FEC.\n");
+	arena_release(arena, *message);
+	*message = NULL;
+	return e_failure;
+    }
+    *message_len = protected_len;
     return e_success;
 }
+
+/*
+ * Function to get the number of carrier bytes to set aside for the
+ * encoded message of a secret.
+ *
+ * This is the secret itself plus the largest possible magic string,
+ * extension and size fields, the nonce with --encrypt, and all of that
+ * grown by the Reed-Solomon overhead with --fec. Images with at least
+ * this capacity are sure to hold the message.
+ *
+ * INPUTS: The secret size and the options.
+ *
+ * RETURNS: The size in bytes, 0 if the options cannot be used.
+ */
+size_t get_message_size_allowance(uint secret_size, const StegOptions *options)
+{
+    if(!options)
+    {
+	FATAL_ERR_MSG;
+	return 0;
+    }
+
+    size_t size = (size_t)secret_size + strlen(MAGIC_STRING) + MAX_FILE_SUFFIX + MAX_FILE_SIZE_DIGITS + 1;
+    if(options->encrypt)
+	size += CHACHA20_NONCE_SIZE;
+    if(options->fec_parity)
+	size = size > 0xFFFFFFFFU? 0: fec_encoded_size(size, options->fec_parity);
+    return size;
+}
+
+/*
+ * Function to get the exact size of the encoded message of a secret, as
+ * build_encoded_message() lays it out: the magic string, the extension and
+ * the size fields with their terminators, the nonce with --encrypt, the
+ * secret and the final terminator, grown by the Reed-Solomon overhead with
+ * --fec. It gives the carriers a decoded message took up.
+ *
+ * INPUTS: The file extension as encoded, the secret size and the options.
+ *
+ * RETURNS: The size in bytes, 0 if the options cannot be used.
+ */
+size_t get_encoded_message_size(const char *file_extn, uint secret_size, const StegOptions *options)
+{
+    if(!file_extn || !options)
+    {
+	FATAL_ERR_MSG;
+	return 0;
+    }
+
+    char file_size_as_str[MAX_FILE_SIZE_DIGITS + 2];
+    itoa(secret_size, file_size_as_str);
+    size_t size = strlen(MAGIC_STRING) + strlen(file_extn) + 1 + strlen(file_size_as_str) + 1;
+    size += (options->encrypt? CHACHA20_NONCE_SIZE: 0) + (size_t)secret_size + 1;
+    if(options->fec_parity)
+	size = size > 0xFFFFFFFFU? 0: fec_encoded_size(size, options->fec_parity);
+    return size;
+}
+
+/*
+ * Function to encode the whole message, protected by forward error
+ * correction, into the destination image.
+ *
+ * The message is built in memory with build_encoded_message(), which
+ * protects it with Reed-Solomon codes when --fec is given, and embedded in
+ * one go from the current position of the row cursor. Unlike the plain
+ * layout, the magic string and the '*' separated fields are covered by the
+ * codes too, so occasional flipped LSBs anywhere in the message are
+ * repaired by the decoder. The message is embedded LSB_CHUNK_SIZE bytes at
+ * a time, the progress being reported and the operation stopping if the
+ * job has been cancelled after each chunk.
+ *
+ * INPUTS: Pointer to EncodeInfo object.
+ *
+ * RETURNS: The operation status enum: e_success or e_failure.
+ */
+Status encode_fec_message(EncodeInfo *encInfo)
+{
+    if(!encInfo)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    unsigned char *message = NULL;
+    uint message_len = 0;
+    if(build_encoded_message(encInfo->secret_fname, encInfo->fptr_secret, &encInfo->options, &message, &message_len, encInfo->arena) == e_failure)
+	return e_failure;
+
+    Status status = e_success;
+    progress_begin(&encInfo->progress, "Encoding", message_len);
+    for(uint done = 0; done < message_len && status == e_success;)
+    {
+	uint chunk = message_len - done < LSB_CHUNK_SIZE? message_len - done: LSB_CHUNK_SIZE;
+	status = lsb_cursor_write(&encInfo->lsb_cursor, message + done, chunk);
+	done += chunk;
+	if(status == e_success)
+	    status = progress_update(&encInfo->progress, done);
+    }
+    arena_release(encInfo->arena, message);
+    return status;
+}
@@ -4,6 +4,9 @@
 #include "types.h" 	// Contains user defined types
 #include "common.h"	// Contains common strings
 #include "error.h"	// Contains standard error messages
+#include "lsb.h"	// Contains the LSB row pipeline
+#include "telemetry.h"	// Contains the job stats
+#include "progress.h"	// Contains the progress reports and cancellation
 
 /* 
  * Structure to store information required for
@@ -16,7 +19,9 @@ typedef struct _EncodeInfo
 {
     /* Source Image info */
     char *src_image_fname;
+    char *pool_cover_fname;			// Cover picked with --cover-pool, owned
     FILE *fptr_src_image;
+    BmpImage src_image_info;
     uint image_capacity;
     //uint bits_per_pixel;			//unnecessary
     //char image_data[MAX_IMAGE_BUF_SIZE];	//unnecessary
@@ -31,6 +36,20 @@ typedef struct _EncodeInfo
     /* Stego Image Info */
     char *stego_image_fname;
     FILE *fptr_stego_image;
+    char *stego_temp_fname;			// Name written under until complete, set if open_files() created the file
+
+    /* Options and the row cursor shared by the encoding stages */
+    StegOptions options;
+    Arena *arena;			// Arena the scratch memory comes from, NULL for the heap
+    LsbCursor lsb_cursor;
+    CompareMetrics metrics;		// Distortion measured with --metrics
+    TelemetryJob telemetry;		// Stage timings for --stats-file and --trace
+    Progress progress;			// Progress reports and cancellation of the data loops
+
+    /* Stream buffers, freed after the streams are closed */
+    void *src_stream_buf;
+    void *stego_stream_buf;
+    void *secret_stream_buf;		// In-memory copy of a piped secret
 
 } EncodeInfo;
 
@@ -52,14 +71,14 @@ Status open_files(EncodeInfo *encInfo);
 /* check capacity */
 Status check_capacity(EncodeInfo *encInfo);
 
-/* Get image size */
-uint get_image_size_for_bmp(FILE *fptr_image);
-
 /* Get file size */
 uint get_file_size(FILE *fptr);
 
 /* Copy bmp image header */
-Status copy_bmp_header(FILE *fptr_src_image, FILE *fptr_dest_image);
+Status copy_bmp_header(FILE *fptr_src_image, FILE *fptr_dest_image, BmpImage *bmp_image);
+
+/* Give a stream a large aligned buffer */
+void set_stream_block_buffer(FILE *fptr, void **buffer, Arena *arena);
 
 /* Store Magic String */
 Status encode_magic_string(const char *magic_string, EncodeInfo *encInfo);
@@ -73,19 +92,31 @@ Status encode_secret_file_size(long file_size, EncodeInfo *encInfo);
 /* Encode secret file data*/
 Status encode_secret_file_data(EncodeInfo *encInfo);
 
-/* Encode a byte into LSB of image data array */
-Status encode_byte_to_lsb(char data, char *image_buffer);
+/* Close the stego image and give it its real name */
+Status commit_stego_file(EncodeInfo *encInfo);
 
 /* Copy remaining image bytes from src to stego image after encoding */
-Status copy_remaining_img_data(FILE *fptr_src, FILE *fptr_dest);
+Status copy_remaining_img_data(FILE *fptr_src, FILE *fptr_dest, const Progress *progress);
+
+/* Build the whole encoded message for a secret in memory */
+Status build_encoded_message(const char *secret_fname, FILE *fptr_secret, const StegOptions *options, unsigned char **message, uint *message_len, Arena *arena);
+
+/* Carrier bytes to set aside for the encoded message of a secret */
+size_t get_message_size_allowance(uint secret_size, const StegOptions *options);
+
+/* Size of the encoded message of a secret with the given extension */
+size_t get_encoded_message_size(const char *file_extn, uint secret_size, const StegOptions *options);
+
+/* Encode the whole message protected by forward error correction */
+Status encode_fec_message(EncodeInfo *encInfo);
 
 /* Function to release allocated memory and close files after encoding */
 void cleanup(EncodeInfo*);
 
 /* Function to get a default output file name */
-char *get_default_stegged_output_filename(const char* user_given_name);
+char *get_default_stegged_output_filename(const char* user_given_name, Arena *arena);
 
 /* Function to encode a string into destination image file after mixing it with the bytes of source file */
-Status encode_string_to_image(const char *string, FILE *fptr_src_image, FILE *fptr_dest_image);
+Status encode_string_to_image(const char *string, LsbCursor *cursor);
 
 #endif
@@ -0,0 +1,603 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+#include "fec.h"
+#include "types.h"
+#include "error.h"
+
+/* GF(256) antilog table, doubled so that sums of two logs need no modulo */
+static unsigned char gf_exp[2 * FEC_CODEWORD_MAX];
+
+/* GF(256) log table, gf_log[0] is unused */
+static unsigned char gf_log[256];
+
+static pthread_once_t gf_tables_once = PTHREAD_ONCE_INIT;
+
+/* Function Definitions */
+
+/*
+ * Function to fill the GF(256) log and antilog tables, over the field
+ * polynomial x^8 + x^4 + x^3 + x^2 + 1 (0x11D) with generator 2. It runs
+ * once, through pthread_once(), before the first use of the tables.
+ */
+static void init_gf_tables(void)
+{
+    uint x = 1;
+    for(uint i = 0; i < FEC_CODEWORD_MAX; ++i)
+    {
+	gf_exp[i] = gf_exp[i + FEC_CODEWORD_MAX] = x;
+	gf_log[x] = i;
+	x <<= 1;
+	if(x & 0x100)
+	    x ^= 0x11D;
+    }
+}
+
+/*
+ * Function to multiply two GF(256) elements.
+ */
+static unsigned char gf_mul(unsigned char a, unsigned char b)
+{
+    return (a && b)? gf_exp[gf_log[a] + gf_log[b]]: 0;
+}
+
+/*
+ * Function to divide a GF(256) element by a non zero one.
+ */
+static unsigned char gf_div(unsigned char a, unsigned char b)
+{
+    return a? gf_exp[gf_log[a] + FEC_CODEWORD_MAX - gf_log[b]]: 0;
+}
+
+/*
+ * Function to raise the generator to a power given as a log, which may be
+ * any non negative value.
+ */
+static unsigned char gf_pow(uint log)
+{
+    return gf_exp[log % FEC_CODEWORD_MAX];
+}
+
+/*
+ * Function to build the nibble tables that multiply by a constant: the
+ * first 16 bytes hold c * n and the last 16 hold c * (n << 4), for every
+ * nibble n. A byte is multiplied by c by looking up both of its nibbles
+ * and adding (XORing) the two products, which is what PSHUFB does for 16
+ * bytes at once.
+ */
+static void gf_mul_tables(unsigned char c, unsigned char tables[32])
+{
+    for(uint n = 0; n < 16; ++n)
+    {
+	tables[n] = gf_mul(c, n);
+	tables[16 + n] = gf_mul(c, n << 4);
+    }
+}
+
+#if defined(__SSSE3__)
+/*
+ * Function to multiply 16 bytes, split into their low and high nibbles,
+ * by the constant whose nibble tables are given.
+ */
+static inline __m128i gf_mul_vec(__m128i lo, __m128i hi, const unsigned char tables[32])
+{
+    return _mm_xor_si128(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)tables), lo),
+	    _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(tables + 16)), hi));
+}
+#endif
+
+/*
+ * Function to build the generator polynomial of the code: the product of
+ * (x - a^i) for i from 0 to parity_len - 1. The coefficients are stored
+ * highest degree first, so gen[0] is 1.
+ */
+static void build_generator(uint parity_len, unsigned char gen[FEC_MAX_PARITY + 1])
+{
+    memset(gen, 0, FEC_MAX_PARITY + 1);
+    gen[0] = 1;
+    for(uint i = 0; i < parity_len; ++i)
+    {
+	unsigned char root = gf_pow(i);
+	gen[i + 1] = gf_mul(gen[i], root);
+	for(uint j = i; j > 0; --j)
+	    gen[j] ^= gf_mul(gen[j - 1], root);
+    }
+}
+
+/*
+ * Function to compute the parity bytes of one codeword, whose bytes are
+ * stride bytes apart: data_len data bytes followed by parity_len parity
+ * bytes. It runs the usual division by the generator, one data byte at a
+ * time, in a shift register of parity_len bytes.
+ */
+static void encode_codeword(unsigned char *codeword, uint stride, uint data_len, uint parity_len, const unsigned char *gen)
+{
+    unsigned char reg[FEC_MAX_PARITY] = {0};
+    for(uint j = 0; j < data_len; ++j)
+    {
+	unsigned char f = codeword[j * stride] ^ reg[0];
+	for(uint i = 0; i + 1 < parity_len; ++i)
+	    reg[i] = reg[i + 1] ^ gf_mul(f, gen[i + 1]);
+	reg[parity_len - 1] = gf_mul(f, gen[parity_len]);
+    }
+    for(uint i = 0; i < parity_len; ++i)
+	codeword[(data_len + i) * stride] = reg[i];
+}
+
+/*
+ * Function to compute the parity bytes of a group of FEC_GROUP interleaved
+ * codewords.
+ *
+ * With SSSE3 the shift registers of the 16 codewords are run side by side,
+ * one codeword per byte lane: each step feeds in a row of 16 data bytes,
+ * and every multiplication by a generator coefficient is two PSHUFB
+ * lookups. The nibbles of the feedback bytes are split once per row.
+ */
+static void encode_group(unsigned char *group, const FecLayout *layout, const unsigned char *gen, const unsigned char gen_tables[][32])
+{
+    uint data_len = layout->data_len;
+    uint parity_len = layout->parity_len;
+#if defined(__SSSE3__)
+    (void)gen;
+    const __m128i mask = _mm_set1_epi8(0x0F);
+    __m128i reg[FEC_MAX_PARITY];
+    for(uint i = 0; i < parity_len; ++i)
+	reg[i] = _mm_setzero_si128();
+
+    for(uint j = 0; j < data_len; ++j)
+    {
+	__m128i f = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(group + j * FEC_GROUP)), reg[0]);
+	__m128i lo = _mm_and_si128(f, mask);
+	__m128i hi = _mm_and_si128(_mm_srli_epi64(f, 4), mask);
+	for(uint i = 0; i + 1 < parity_len; ++i)
+	    reg[i] = _mm_xor_si128(reg[i + 1], gf_mul_vec(lo, hi, gen_tables[i + 1]));
+	reg[parity_len - 1] = gf_mul_vec(lo, hi, gen_tables[parity_len]);
+    }
+    for(uint i = 0; i < parity_len; ++i)
+	_mm_storeu_si128((__m128i *)(group + (data_len + i) * FEC_GROUP), reg[i]);
+#else
+    (void)gen_tables;
+    for(uint lane = 0; lane < FEC_GROUP; ++lane)
+	encode_codeword(group + lane, FEC_GROUP, data_len, parity_len, gen);
+#endif
+}
+
+/*
+ * Function to compute the syndromes of one codeword, whose bytes are
+ * stride bytes apart: the codeword evaluated at a^i for each i below
+ * parity_len, by Horner's rule. They are all zero for an intact codeword.
+ * Syndrome i is stored at syn[i * syn_stride].
+ */
+static void compute_syndromes(const unsigned char *codeword, uint stride, uint codeword_len, uint parity_len, unsigned char *syn, uint syn_stride)
+{
+    for(uint i = 0; i < parity_len; ++i)
+    {
+	unsigned char root = gf_pow(i);
+	unsigned char s = 0;
+	for(uint j = 0; j < codeword_len; ++j)
+	    s = gf_mul(s, root) ^ codeword[j * stride];
+	syn[i * syn_stride] = s;
+    }
+}
+
+/*
+ * Function to compute the syndromes of a group of FEC_GROUP interleaved
+ * codewords, syndrome i of lane l going to syn[i * FEC_GROUP + l].
+ *
+ * This is the check every codeword goes through, damaged or not, so with
+ * SSSE3 it runs on the 16 lanes at once: for each row of the group, each
+ * syndrome vector is multiplied by its root with two PSHUFB lookups and
+ * the row is added in.
+ */
+static void group_syndromes(const unsigned char *group, const FecLayout *layout, const unsigned char root_tables[][32], unsigned char *syn)
+{
+    uint codeword_len = layout->codeword_len;
+    uint parity_len = layout->parity_len;
+#if defined(__SSSE3__)
+    const __m128i mask = _mm_set1_epi8(0x0F);
+    __m128i s[FEC_MAX_PARITY];
+    for(uint i = 0; i < parity_len; ++i)
+	s[i] = _mm_setzero_si128();
+
+    for(uint j = 0; j < codeword_len; ++j)
+    {
+	__m128i row = _mm_loadu_si128((const __m128i *)(group + j * FEC_GROUP));
+	for(uint i = 0; i < parity_len; ++i)
+	{
+	    __m128i lo = _mm_and_si128(s[i], mask);
+	    __m128i hi = _mm_and_si128(_mm_srli_epi64(s[i], 4), mask);
+	    s[i] = _mm_xor_si128(gf_mul_vec(lo, hi, root_tables[i]), row);
+	}
+    }
+    for(uint i = 0; i < parity_len; ++i)
+	_mm_storeu_si128((__m128i *)(syn + i * FEC_GROUP), s[i]);
+#else
+    (void)root_tables;
+    for(uint lane = 0; lane < FEC_GROUP; ++lane)
+	compute_syndromes(group + lane, FEC_GROUP, codeword_len, parity_len, syn + lane, FEC_GROUP);
+#endif
+}
+
+/*
+ * Function to correct the errors in one codeword from its syndromes.
+ *
+ * The error locator polynomial is found with the Berlekamp-Massey
+ * algorithm, its roots (the error positions) with a Chien search and the
+ * error values with Forney's formula. Up to parity_len / 2 damaged bytes
+ * can be corrected. Polynomials here are stored lowest degree first.
+ *
+ * INPUTS: The codeword, its length, the parity length and the syndromes.
+ *
+ * RETURNS: The number of corrected bytes, or -1 if the codeword has more
+ * errors than the code can correct.
+ */
+static int correct_codeword(unsigned char *codeword, uint codeword_len, uint parity_len, const unsigned char *syn)
+{
+    unsigned char lambda[FEC_MAX_PARITY + 1] = {1};
+    unsigned char prev[FEC_MAX_PARITY + 1] = {1};
+    unsigned char temp[FEC_MAX_PARITY + 1];
+    uint errors = 0;
+    uint shift = 1;
+    unsigned char prev_discrepancy = 1;
+
+    //Berlekamp-Massey
+    for(uint r = 0; r < parity_len; ++r)
+    {
+	unsigned char discrepancy = syn[r];
+	for(uint i = 1; i <= errors; ++i)
+	    discrepancy ^= gf_mul(lambda[i], syn[r - i]);
+	if(!discrepancy)
+	{
+	    ++shift;
+	    continue;
+	}
+
+	unsigned char coef = gf_div(discrepancy, prev_discrepancy);
+	memcpy(temp, lambda, sizeof(temp));
+	for(uint i = 0; i + shift <= parity_len; ++i)
+	    lambda[i + shift] ^= gf_mul(coef, prev[i]);
+	if(2 * errors <= r)
+	{
+	    errors = r + 1 - errors;
+	    memcpy(prev, temp, sizeof(prev));
+	    prev_discrepancy = discrepancy;
+	    shift = 1;
+	}
+	else
+	    ++shift;
+    }
+    if(2 * errors > parity_len)
+	return -1;
+
+    //Error evaluator: syndromes times locator, modulo x^parity_len
+    unsigned char omega[FEC_MAX_PARITY] = {0};
+    for(uint i = 0; i < parity_len; ++i)
+	for(uint j = 0; j <= errors && j <= i; ++j)
+	    omega[i] ^= gf_mul(syn[i - j], lambda[j]);
+
+    //Chien search and Forney's formula
+    uint found = 0;
+    for(uint j = 0; j < codeword_len && found < errors; ++j)
+    {
+	uint degree = codeword_len - 1 - j;
+	uint inv_log = (FEC_CODEWORD_MAX - degree) % FEC_CODEWORD_MAX;
+	unsigned char value = 0;
+	unsigned char derivative = 0;
+	for(uint i = 0; i <= errors; ++i)
+	{
+	    value ^= gf_mul(lambda[i], gf_pow(inv_log * i));
+	    if(i & 1)
+		derivative ^= gf_mul(lambda[i], gf_pow(inv_log * (i - 1)));
+	}
+	if(value)
+	    continue;
+	if(!derivative)
+	    return -1;
+
+	unsigned char evaluator = 0;
+	for(uint i = 0; i < parity_len; ++i)
+	    evaluator ^= gf_mul(omega[i], gf_pow(inv_log * i));
+	codeword[j] ^= gf_mul(gf_pow(degree), gf_div(evaluator, derivative));
+	++found;
+    }
+    return found == errors? (int)found: -1;
+}
+
+/*
+ * Function to check a parity length given by the user.
+ *
+ * Each codeword corrects up to half as many damaged bytes as it has
+ * parity bytes, so the length must be even, between FEC_MIN_PARITY and
+ * FEC_MAX_PARITY.
+ *
+ * INPUTS: The parity length.
+ *
+ * RETURNS: e_success if the length can be used, e_failure otherwise.
+ */
+Status fec_check_parity(uint parity_len)
+{
+    if(parity_len < FEC_MIN_PARITY || parity_len > FEC_MAX_PARITY || parity_len % 2)
+    {
+	fprintf(stderr, "Error: The FEC parity length must be an even number from %d to %d.\n", FEC_MIN_PARITY, FEC_MAX_PARITY);
+	return e_failure;
+    }
+    return e_success;
+}
+
+/*
+ * Function to work out the layout of a protected message.
+ *
+ * The message is shared out evenly between the fewest groups of FEC_GROUP
+ * codewords that can hold it, so that the codewords of small messages are
+ * shortened instead of padded to full length.
+ *
+ * INPUTS: The message length, the parity length and the layout to fill.
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status fec_get_layout(uint message_len, uint parity_len, FecLayout *layout)
+{
+    if(!layout)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    if(!message_len || fec_check_parity(parity_len) == e_failure)
+	return e_failure;
+
+    uint64_t group_capacity = (uint64_t)FEC_GROUP * (FEC_CODEWORD_MAX - parity_len);
+    uint64_t groups = (message_len + group_capacity - 1) / group_capacity;
+    layout->parity_len = parity_len;
+    layout->message_len = message_len;
+    layout->codeword_count = groups * FEC_GROUP;
+    layout->data_len = (message_len + layout->codeword_count - 1) / layout->codeword_count;
+    layout->codeword_len = layout->data_len + parity_len;
+    return e_success;
+}
+
+/*
+ * Function to get the size of the frame header codeword.
+ *
+ * INPUTS: The parity length.
+ *
+ * RETURNS: The size in bytes.
+ */
+uint fec_header_size(uint parity_len)
+{
+    return FEC_HEADER_DATA_SIZE + parity_len;
+}
+
+/*
+ * Function to get the size of the body of a protected message.
+ *
+ * INPUTS: The layout of the message.
+ *
+ * RETURNS: The size in bytes.
+ */
+size_t fec_body_size(const FecLayout *layout)
+{
+    if(!layout)
+    {
+	FATAL_ERR_MSG;
+	return 0;
+    }
+    return (size_t)layout->codeword_count * layout->codeword_len;
+}
+
+/*
+ * Function to get the size of a protected message, frame header included.
+ *
+ * INPUTS: The message length and the parity length.
+ *
+ * RETURNS: The size in bytes, 0 if the parity length is invalid.
+ */
+size_t fec_encoded_size(uint message_len, uint parity_len)
+{
+    FecLayout layout;
+    if(fec_get_layout(message_len, parity_len, &layout) == e_failure)
+	return 0;
+    return fec_header_size(parity_len) + fec_body_size(&layout);
+}
+
+/*
+ * Function to protect a message with Reed-Solomon codes over GF(256).
+ *
+ * The output starts with the frame header codeword, which carries the
+ * message length so that the decoder can work out the layout of the body,
+ * followed by the body laid out as described for FecLayout. Every
+ * codeword can repair up to parity_len / 2 damaged bytes.
+ *
+ * CAUTION: The output is allocated from the arena and must be given back
+ * with arena_release().
+ *
+ * INPUTS: The message, its length, the parity length, where to return the
+ * output and its length, and the arena to allocate it from (may be NULL).
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status fec_encode(const unsigned char *message, uint message_len, uint parity_len, unsigned char **encoded, size_t *encoded_len, Arena *arena)
+{
+    if(!message || !encoded || !encoded_len)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    FecLayout layout;
+    if(fec_get_layout(message_len, parity_len, &layout) == e_failure)
+	return e_failure;
+    pthread_once(&gf_tables_once, init_gf_tables);
+
+    uint header_len = fec_header_size(parity_len);
+    size_t body_len = fec_body_size(&layout);
+    *encoded_len = header_len + body_len;
+    *encoded = arena_alloc(arena, *encoded_len);
+    if(!*encoded)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+    memset(*encoded, 0, *encoded_len);
+
+    unsigned char gen[FEC_MAX_PARITY + 1];
+    unsigned char gen_tables[FEC_MAX_PARITY + 1][32];
+    build_generator(parity_len, gen);
+    for(uint i = 0; i <= parity_len; ++i)
+	gf_mul_tables(gen[i], gen_tables[i]);
+
+    //Frame header
+    unsigned char *header = *encoded;
+    for(uint i = 0; i < FEC_HEADER_DATA_SIZE; ++i)
+	header[i] = message_len >> (8 * i);
+    encode_codeword(header, 1, FEC_HEADER_DATA_SIZE, parity_len, gen);
+
+    //Body: interleave the data bytes of each group, then add the parity rows
+    unsigned char *body = *encoded + header_len;
+    size_t group_size = (size_t)FEC_GROUP * layout.codeword_len;
+    for(uint c = 0; c < layout.codeword_count; ++c)
+    {
+	unsigned char *dest = body + (c / FEC_GROUP) * group_size + c % FEC_GROUP;
+	size_t start = (size_t)c * layout.data_len;
+	for(uint j = 0; j < layout.data_len && start + j < message_len; ++j)
+	    dest[j * FEC_GROUP] = message[start + j];
+    }
+    for(size_t offset = 0; offset < body_len; offset += group_size)
+	encode_group(body + offset, &layout, gen, gen_tables);
+    return e_success;
+}
+
+/*
+ * Function to correct the frame header codeword and read the message
+ * length from it.
+ *
+ * INPUTS: The frame header codeword (corrected in place), the parity
+ * length, and where to return the message length and the number of bytes
+ * corrected.
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status fec_decode_header(unsigned char *header, uint parity_len, uint *message_len, uint *corrected)
+{
+    if(!header || !message_len || !corrected)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    if(fec_check_parity(parity_len) == e_failure)
+	return e_failure;
+    pthread_once(&gf_tables_once, init_gf_tables);
+
+    unsigned char syn[FEC_MAX_PARITY];
+    uint header_len = fec_header_size(parity_len);
+    compute_syndromes(header, 1, header_len, parity_len, syn, 1);
+
+    *corrected = 0;
+    for(uint i = 0; i < parity_len; ++i)
+    {
+	if(!syn[i])
+	    continue;
+	int fixed = correct_codeword(header, header_len, parity_len, syn);
+	if(fixed < 0)
+	{
+	    fprintf(stderr, "The FEC frame header is damaged beyond repair.\n");
+	    return e_failure;
+	}
+	*corrected = fixed;
+	break;
+    }
+
+    *message_len = 0;
+    for(uint i = 0; i < FEC_HEADER_DATA_SIZE; ++i)
+	*message_len |= (uint)header[i] << (8 * i);
+    return e_success;
+}
+
+/*
+ * Function to correct the body of a protected message and gather the
+ * message out of it.
+ *
+ * The syndromes of each group are computed for its 16 codewords at once.
+ * Only the codewords with a non zero syndrome, which are rare, are
+ * de-interleaved and run through the scalar corrector, and the repaired
+ * bytes are put back before the message is gathered. After each group the
+ * progress is reported and the repair stops if the job has been cancelled.
+ *
+ * INPUTS: The body (corrected in place), its layout, the message buffer
+ * of layout->message_len bytes, where to return the number of bytes
+ * corrected and the progress state of the job (may be NULL).
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status fec_decode_body(unsigned char *body, const FecLayout *layout, unsigned char *message, uint *corrected, Progress *progress)
+{
+    if(!body || !layout || !message || !corrected)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    pthread_once(&gf_tables_once, init_gf_tables);
+    uint parity_len = layout->parity_len;
+    uint codeword_len = layout->codeword_len;
+    unsigned char root_tables[FEC_MAX_PARITY][32];
+    for(uint i = 0; i < parity_len; ++i)
+	gf_mul_tables(gf_pow(i), root_tables[i]);
+
+    *corrected = 0;
+    size_t group_size = (size_t)FEC_GROUP * codeword_len;
+    size_t body_len = fec_body_size(layout);
+    if(progress)
+	progress_begin(progress, "Repairing", body_len);
+    for(size_t offset = 0; offset < body_len; offset += group_size)
+    {
+	if(progress && progress_update(progress, offset) == e_failure)
+	    return e_failure;
+
+	unsigned char *group = body + offset;
+	unsigned char syn[FEC_MAX_PARITY * FEC_GROUP];
+	group_syndromes(group, layout, root_tables, syn);
+	for(uint lane = 0; lane < FEC_GROUP; ++lane)
+	{
+	    unsigned char lane_syn[FEC_MAX_PARITY];
+	    int damaged = 0;
+	    for(uint i = 0; i < parity_len; ++i)
+	    {
+		lane_syn[i] = syn[i * FEC_GROUP + lane];
+		damaged |= lane_syn[i];
+	    }
+	    if(!damaged)
+		continue;
+
+	    unsigned char codeword[FEC_CODEWORD_MAX];
+	    for(uint j = 0; j < codeword_len; ++j)
+		codeword[j] = group[j * FEC_GROUP + lane];
+	    int fixed = correct_codeword(codeword, codeword_len, parity_len, lane_syn);
+	    if(fixed < 0)
+	    {
+		fprintf(stderr, "FEC codeword %zu is damaged beyond repair.\n", offset / codeword_len + lane);
+		return e_failure;
+	    }
+	    for(uint j = 0; j < codeword_len; ++j)
+		group[j * FEC_GROUP + lane] = codeword[j];
+	    *corrected += fixed;
+	}
+    }
+    if(progress && progress_update(progress, body_len) == e_failure)
+	return e_failure;
+
+    for(uint c = 0; c < layout->codeword_count; ++c)
+    {
+	const unsigned char *src = body + (c / FEC_GROUP) * group_size + c % FEC_GROUP;
+	size_t start = (size_t)c * layout->data_len;
+	for(uint j = 0; j < layout->data_len && start + j < layout->message_len; ++j)
+	    message[start + j] = src[j * FEC_GROUP];
+    }
+    return e_success;
+}
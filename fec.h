@@ -0,0 +1,68 @@
+#ifndef FEC_H
+#define FEC_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "types.h" 	// Contains user defined types
+#include "common.h"	// Contains common strings
+#include "progress.h"	// Contains the progress state of a job
+#include "error.h"	// Contains standard error messages
+
+/* Reed-Solomon codewords are at most this long, in bytes */
+#define FEC_CODEWORD_MAX 255
+
+/* Limits on the parity bytes per codeword, which must be even */
+#define FEC_MIN_PARITY 2
+#define FEC_MAX_PARITY 64
+
+/* Codewords interleaved byte by byte in each group of the body */
+#define FEC_GROUP 16
+
+/* Bytes of the frame header: the message length, little endian */
+#define FEC_HEADER_DATA_SIZE 4
+
+/*
+ * Layout of a protected message: the frame header codeword, holding the
+ * message length and parity_len parity bytes, followed by the body. The
+ * body is codeword_count codewords of data_len message bytes (the last
+ * ones zero padded) and parity_len parity bytes each. The codewords are
+ * taken FEC_GROUP at a time and interleaved byte by byte, so that a burst
+ * of damaged carriers is shared out between the codewords of a group.
+ */
+typedef struct _FecLayout
+{
+    uint parity_len;		// Parity bytes per codeword
+    uint message_len;		// Bytes of the message
+    uint codeword_count;	// Codewords in the body, a multiple of FEC_GROUP
+    uint data_len;		// Message bytes per codeword
+    uint codeword_len;		// data_len + parity_len
+
+} FecLayout;
+
+/* Forward error correction function prototypes */
+
+/* Check a parity length given by the user */
+Status fec_check_parity(uint parity_len);
+
+/* Work out the layout of a protected message */
+Status fec_get_layout(uint message_len, uint parity_len, FecLayout *layout);
+
+/* Bytes of the frame header codeword */
+uint fec_header_size(uint parity_len);
+
+/* Bytes of the body of a protected message */
+size_t fec_body_size(const FecLayout *layout);
+
+/* Bytes of a protected message, frame header included */
+size_t fec_encoded_size(uint message_len, uint parity_len);
+
+/* Protect a message with the frame header and the interleaved codewords */
+Status fec_encode(const unsigned char *message, uint message_len, uint parity_len, unsigned char **encoded, size_t *encoded_len, Arena *arena);
+
+/* Correct the frame header codeword and read the message length from it */
+Status fec_decode_header(unsigned char *header, uint parity_len, uint *message_len, uint *corrected);
+
+/* Correct the body in place and gather the message out of it */
+Status fec_decode_body(unsigned char *body, const FecLayout *layout, unsigned char *message, uint *corrected, Progress *progress);
+
+#endif
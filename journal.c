@@ -0,0 +1,326 @@
+/* memrchr() and syncfs() */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "journal.h"
+#include "crc32c.h"
+#include "types.h"
+#include "error.h"
+
+/* Function Definitions */
+
+/*
+ * Function to find the hash set slot of a job name: the slot holding it,
+ * or the empty slot where it belongs.
+ */
+static char **find_job_slot(char **slots, uint slot_count, const char *job_name)
+{
+    uint index = crc32c_update(0, (const unsigned char *)job_name, strlen(job_name)) & (slot_count - 1);
+    while(slots[index] && strcmp(slots[index], job_name))
+	index = (index + 1) & (slot_count - 1);
+    return slots + index;
+}
+
+/*
+ * Function to write a whole buffer to a file, retrying short writes.
+ */
+static Status write_all(int fd, const void *buf, size_t len)
+{
+    const unsigned char *pos = buf;
+    while(len)
+    {
+	ssize_t wrote = write(fd, pos, len);
+	if(wrote < 0 && errno == EINTR)
+	    continue;
+	if(wrote <= 0)
+	    return e_failure;
+	pos += wrote;
+	len -= wrote;
+    }
+    return e_success;
+}
+
+/*
+ * Function to read the records of a journal into its hash set.
+ *
+ * The journal text is kept, and its lines are cut into the job names the
+ * set points to. A last line without its newline was torn by a crash: it
+ * is cut off the file, so that the next record starts on a line of its own.
+ * A line holding a NUL byte, like the zero filled tail a crash can leave,
+ * is a damaged record and is skipped.
+ */
+static Status load_journal_records(BatchJournal *journal, const char *header)
+{
+    struct stat st;
+    if(fstat(journal->fd, &st) < 0)
+    {
+	perror("fstat");
+	return e_failure;
+    }
+
+    size_t size = st.st_size;
+    journal->records = malloc(size + 1);
+    if(!journal->records)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+    for(size_t done = 0; done < size;)
+    {
+	ssize_t got = pread(journal->fd, journal->records + done, size - done, done);
+	if(got < 0 && errno == EINTR)
+	    continue;
+	if(got <= 0)
+	{
+	    FILE_READ_ERR;
+	    return e_failure;
+	}
+	done += got;
+    }
+    journal->records[size] = '\0';
+
+    char *end = memrchr(journal->records, '\n', size);
+    size_t valid = end? end - journal->records + 1: 0;
+    size_t header_len = strlen(header);
+    if(valid < header_len || memcmp(journal->records, header, header_len))
+    {
+	fprintf(stderr, "%s: not the journal of this batch.\n", journal->fname);
+	return e_failure;
+    }
+    if(valid < size && ftruncate(journal->fd, valid) < 0)
+    {
+	perror("ftruncate");
+	return e_failure;
+    }
+
+    uint lines = 0;
+    for(size_t i = header_len; i < valid; ++i)
+	lines += journal->records[i] == '\n';
+    journal->slot_count = 16;
+    while(journal->slot_count < lines * 2)
+	journal->slot_count *= 2;
+    journal->done = calloc(journal->slot_count, sizeof(char *));
+    if(!journal->done)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    char *records_end = journal->records + valid;
+    for(char *line = journal->records + header_len; line < records_end;)
+    {
+	char *newline = memchr(line, '\n', records_end - line);
+	int damaged = memchr(line, '\0', newline - line) != NULL;
+	*newline = '\0';
+	if(damaged)
+	{
+	    line = newline + 1;
+	    continue;
+	}
+	char **slot = find_job_slot(journal->done, journal->slot_count, line);
+	if(*line && !*slot)
+	{
+	    *slot = line;
+	    ++journal->done_count;
+	}
+	line = newline + 1;
+    }
+    return e_success;
+}
+
+/*
+ * Function to open the journal of a batch, creating it if needed.
+ *
+ * A new journal starts with a header naming the batch. An existing one
+ * must name the same batch, and its records are loaded, so that the jobs
+ * completed by an earlier run can be skipped. The output directory is
+ * kept open, to sync the outputs before each batch of records.
+ *
+ * INPUTS: The journal, its file name, the batch name (a single line that
+ * changes whenever the outputs would) and the output directory.
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status open_batch_journal(BatchJournal *journal, const char *fname, const char *batch_name, const char *output_dir)
+{
+    if(!journal || !fname || !batch_name || !output_dir)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    memset(journal, 0, sizeof(*journal));
+    pthread_mutex_init(&journal->lock, NULL);
+    journal->fname = fname;
+    journal->fd = open(fname, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+    journal->sync_fd = open(output_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    char *header = malloc(strlen(JOURNAL_SIGNATURE) + 1 + strlen(batch_name) + 2);
+    if(journal->fd < 0 || journal->sync_fd < 0 || !header)
+    {
+	perror("open");
+	fprintf(stderr, "ERROR: Unable to open file %s\n", journal->fd < 0? fname: output_dir);
+	free(header);
+	close_batch_journal(journal);
+	return e_failure;
+    }
+    sprintf(header, "%s %s\n", JOURNAL_SIGNATURE, batch_name);
+
+    struct stat st;
+    Status status = e_success;
+    if(fstat(journal->fd, &st) == 0 && !st.st_size)
+    {
+	if(write_all(journal->fd, header, strlen(header)) == e_failure || fdatasync(journal->fd) < 0)
+	{
+	    FILE_WRITE_ERR;
+	    status = e_failure;
+	}
+    }
+    if(status == e_success)
+	status = load_journal_records(journal, header);
+    free(header);
+    if(status == e_failure)
+    {
+	close_batch_journal(journal);
+	return e_failure;
+    }
+    return e_success;
+}
+
+/*
+ * Function to check whether a job was recorded as completed in the
+ * journal, when it was opened.
+ *
+ * INPUTS: The journal and the job name.
+ *
+ * RETURNS: 1 if the job is recorded, 0 otherwise.
+ */
+int batch_journal_has_job(const BatchJournal *journal, const char *job_name)
+{
+    if(!journal || !job_name)
+    {
+	FATAL_ERR_MSG;
+	return 0;
+    }
+    return journal->done && *find_job_slot(journal->done, journal->slot_count, job_name) != NULL;
+}
+
+/*
+ * Function to record a completed job. The record is kept pending until
+ * JOURNAL_SYNC_BATCH jobs are, and then written with batch_journal_flush().
+ * Job names holding a newline can not be recorded; such jobs are simply
+ * done again by the next run. Safe to call from several threads.
+ *
+ * INPUTS: The journal and the job name.
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status batch_journal_record_job(BatchJournal *journal, const char *job_name)
+{
+    if(!journal || !job_name)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    size_t len = strlen(job_name);
+    if(!len || memchr(job_name, '\n', len))
+	return e_success;
+
+    Status status = e_success;
+    pthread_mutex_lock(&journal->lock);
+    if(journal->pending_len + len + 1 > journal->pending_size)
+    {
+	size_t new_size = (journal->pending_len + len + 1) * 2;
+	char *new_pending = realloc(journal->pending, new_size);
+	if(!new_pending)
+	    status = e_failure;
+	else
+	{
+	    journal->pending = new_pending;
+	    journal->pending_size = new_size;
+	}
+    }
+    if(status == e_success)
+    {
+	memcpy(journal->pending + journal->pending_len, job_name, len);
+	journal->pending[journal->pending_len + len] = '\n';
+	journal->pending_len += len + 1;
+	if(++journal->pending_jobs >= JOURNAL_SYNC_BATCH)
+	    status = batch_journal_flush(journal);
+    }
+    pthread_mutex_unlock(&journal->lock);
+    return status;
+}
+
+/*
+ * Function to record the pending jobs.
+ *
+ * The file system of the output directory is synced first, so that the
+ * outputs of the jobs are on disk before the records naming them. The
+ * records are then appended in one write and synced.
+ *
+ * CAUTION: Callers other than batch_journal_record_job() must not run
+ * concurrently with it.
+ *
+ * INPUTS: The journal.
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status batch_journal_flush(BatchJournal *journal)
+{
+    if(!journal)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    if(!journal->pending_len)
+	return e_success;
+    if(syncfs(journal->sync_fd) < 0 ||
+	    write_all(journal->fd, journal->pending, journal->pending_len) == e_failure || fdatasync(journal->fd) < 0)
+    {
+	FILE_WRITE_ERR;
+	return e_failure;
+    }
+    journal->pending_len = 0;
+    journal->pending_jobs = 0;
+    return e_success;
+}
+
+/*
+ * Function to record the pending jobs and close a journal.
+ *
+ * INPUTS: The journal.
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status close_batch_journal(BatchJournal *journal)
+{
+    if(!journal)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    Status status = e_success;
+    if(journal->fd >= 0 && journal->sync_fd >= 0)
+	status = batch_journal_flush(journal);
+    pthread_mutex_destroy(&journal->lock);
+    if(journal->fd >= 0)
+	close(journal->fd);
+    if(journal->sync_fd >= 0)
+	close(journal->sync_fd);
+    free(journal->records);
+    free(journal->done);
+    free(journal->pending);
+    memset(journal, 0, sizeof(*journal));
+    journal->fd = -1;
+    journal->sync_fd = -1;
+    return status;
+}
@@ -0,0 +1,66 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <pthread.h>
+#include "types.h" 	// Contains user defined types
+#include "common.h"	// Contains common strings
+#include "error.h"	// Contains standard error messages
+
+/* First word of the first line of a journal, bumped whenever the layout changes */
+#define JOURNAL_SIGNATURE "STEG-JOURNAL 1"
+
+/* Completed jobs recorded in one go, after the outputs are synced */
+#define JOURNAL_SYNC_BATCH 64
+
+/*
+ * Structure to store an open batch journal.
+ *
+ * A journal is an append-only text file. Its first line names the batch,
+ * so that a journal is never applied to another batch, and every other
+ * line names a completed job. The jobs found in it when it is opened are
+ * kept in an open addressing hash set, so checking a job costs O(1).
+ *
+ * Jobs completed since are kept pending and recorded in batches: the file
+ * system holding the outputs is synced first, then the records are
+ * appended and synced, so a recorded job always has its output on disk. A
+ * crash loses at most the last JOURNAL_SYNC_BATCH jobs.
+ */
+typedef struct _BatchJournal
+{
+    const char *fname;
+    int fd;
+    int sync_fd;		// Output directory, synced before the records
+
+    /* Jobs found in the journal when it was opened */
+    char *records;		// The journal text, holding the job names
+    char **done;		// Hash set slots, NULL when empty
+    uint slot_count;		// Power of two
+    uint done_count;
+
+    /* Jobs completed since, not recorded yet */
+    pthread_mutex_t lock;
+    char *pending;
+    size_t pending_len;
+    size_t pending_size;
+    uint pending_jobs;
+
+} BatchJournal;
+
+/* Journal function prototypes */
+
+/* Open or create the journal of a batch */
+Status open_batch_journal(BatchJournal *journal, const char *fname, const char *batch_name, const char *output_dir);
+
+/* Check whether a job is recorded as completed */
+int batch_journal_has_job(const BatchJournal *journal, const char *job_name);
+
+/* Record a completed job */
+Status batch_journal_record_job(BatchJournal *journal, const char *job_name);
+
+/* Sync the outputs and record the pending jobs */
+Status batch_journal_flush(BatchJournal *journal);
+
+/* Record the pending jobs and close the journal */
+Status close_batch_journal(BatchJournal *journal);
+
+#endif
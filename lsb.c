@@ -0,0 +1,1043 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+#include "lsb.h"
+#include "crc32c.h"
+#include "chacha20.h"
+#include "types.h"
+#include "error.h"
+
+/*
+ * Function to expand every bit of the data bytes into a byte of its own.
+ *
+ * Bit i of data[j] ends up as the value 0 or 1 in bits[8 * j + i], which
+ * is the order in which bits are laid over the carrier bytes: the LSB of a
+ * data byte goes into the first of its 8 carrier bytes.
+ *
+ * On little endian hosts each data byte is spread over a 64 bit word with
+ * a multiply and a mask, so that all 8 bits are produced at once.
+ *
+ * INPUTS: The data bytes, their count and the output bit array.
+ *
+ * CAUTION: The bits array must have room for 8 * len bytes.
+ *
+ * RETURNS: Nothing.
+ */
+void lsb_expand_bits(const unsigned char *data, uint len, unsigned char *bits)
+{
+    if(!data || !bits)
+    {
+	FATAL_ERR_MSG;
+	return;
+    }
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for(uint i = 0; i < len; ++i)
+    {
+	uint64_t spread = (data[i] * 0x0101010101010101ULL) & 0x8040201008040201ULL;
+	spread = ((spread + 0x7F7F7F7F7F7F7F7FULL) >> 7) & 0x0101010101010101ULL;
+	memcpy(bits + 8 * i, &spread, sizeof(spread));
+    }
+#else
+    for(uint i = 0; i < len; ++i)
+	for(int j = 0; j < 8; ++j)
+	    bits[8 * i + j] = (data[i] >> j) & 1;
+#endif
+}
+
+/*
+ * Function to pack expanded bits back into data bytes.
+ *
+ * This is the inverse of lsb_expand_bits(): bits[8 * j + i] becomes bit i
+ * of data[j]. Only bit 0 of each input byte is used.
+ *
+ * INPUTS: The bit array, the output data bytes and the number of data bytes.
+ *
+ * RETURNS: Nothing.
+ */
+void lsb_pack_bits(const unsigned char *bits, unsigned char *data, uint len)
+{
+    if(!bits || !data)
+    {
+	FATAL_ERR_MSG;
+	return;
+    }
+
+    uint i = 0;
+#if defined(__SSE2__)
+    // Shifting each 16 bit lane left by 7 moves bit 0 of both bytes into
+    // their sign bits, which movemask then collects 16 at a time.
+    for(; i + 2 <= len; i += 2)
+    {
+	__m128i v = _mm_loadu_si128((const __m128i *)(bits + 8 * i));
+	int mask = _mm_movemask_epi8(_mm_slli_epi16(v, 7));
+	data[i] = mask & 0xFF;
+	data[i + 1] = (mask >> 8) & 0xFF;
+    }
+#endif
+    for(; i < len; ++i)
+    {
+	unsigned char byte = 0;
+	for(int j = 0; j < 8; ++j)
+	    byte |= (bits[8 * i + j] & 1) << j;
+	data[i] = byte;
+    }
+}
+
+/*
+ * Function to replace the LSBs of consecutive carrier bytes.
+ *
+ * Each carrier byte keeps its upper 7 bits and takes its LSB from the
+ * matching byte of the bit array, which must hold 0 or 1.
+ *
+ * INPUTS: The carrier bytes, the bit array and the number of carriers.
+ *
+ * RETURNS: Nothing.
+ */
+void lsb_blend(unsigned char *carriers, const unsigned char *bits, uint count)
+{
+    if(!carriers || !bits)
+    {
+	FATAL_ERR_MSG;
+	return;
+    }
+
+    uint i = 0;
+#if defined(__SSE2__)
+    const __m128i keep = _mm_set1_epi8((char)0xFE);
+    for(; i + 16 <= count; i += 16)
+    {
+	__m128i c = _mm_loadu_si128((const __m128i *)(carriers + i));
+	__m128i b = _mm_loadu_si128((const __m128i *)(bits + i));
+	_mm_storeu_si128((__m128i *)(carriers + i), _mm_or_si128(_mm_and_si128(c, keep), b));
+    }
+#endif
+    for(; i < count; ++i)
+	carriers[i] = (carriers[i] & 0xFE) | bits[i];
+}
+
+/*
+ * Function to collect the LSBs of consecutive carrier bytes.
+ *
+ * INPUTS: The carrier bytes, the output bit array and the number of carriers.
+ *
+ * RETURNS: Nothing.
+ */
+void lsb_gather(const unsigned char *carriers, unsigned char *bits, uint count)
+{
+    if(!carriers || !bits)
+    {
+	FATAL_ERR_MSG;
+	return;
+    }
+
+    uint i = 0;
+#if defined(__SSE2__)
+    const __m128i one = _mm_set1_epi8(1);
+    for(; i + 16 <= count; i += 16)
+    {
+	__m128i c = _mm_loadu_si128((const __m128i *)(carriers + i));
+	_mm_storeu_si128((__m128i *)(bits + i), _mm_and_si128(c, one));
+    }
+#endif
+    for(; i < count; ++i)
+	bits[i] = carriers[i] & 1;
+}
+
+/*
+ * Function to replace the colour LSBs of 32 bpp pixels.
+ *
+ * Every pixel takes 3 bits, one in each of its blue, green and red bytes,
+ * while the alpha byte is left as it is. With SSSE3, 4 pixels are handled
+ * per step: a shuffle spreads 12 bits over the 16 pixel bytes and zeroes
+ * the alpha lanes, whose mask keeps the full original byte.
+ *
+ * INPUTS: The pixel bytes, the bit array and the number of pixels.
+ *
+ * CAUTION: The bit array is read 16 bytes at a time, so it must have
+ * LSB_KERNEL_SLACK readable bytes after the last used bit.
+ *
+ * RETURNS: Nothing.
+ */
+void lsb_blend_skip_alpha(unsigned char *pixels, const unsigned char *bits, uint pixel_count)
+{
+    if(!pixels || !bits)
+    {
+	FATAL_ERR_MSG;
+	return;
+    }
+
+    uint i = 0;
+#if defined(__SSSE3__)
+    const __m128i spread = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m128i keep = _mm_setr_epi8((char)0xFE, (char)0xFE, (char)0xFE, (char)0xFF, (char)0xFE, (char)0xFE, (char)0xFE, (char)0xFF,
+	    (char)0xFE, (char)0xFE, (char)0xFE, (char)0xFF, (char)0xFE, (char)0xFE, (char)0xFE, (char)0xFF);
+    for(; i + 4 <= pixel_count; i += 4)
+    {
+	__m128i p = _mm_loadu_si128((const __m128i *)(pixels + 4 * i));
+	__m128i b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(bits + 3 * i)), spread);
+	_mm_storeu_si128((__m128i *)(pixels + 4 * i), _mm_or_si128(_mm_and_si128(p, keep), b));
+    }
+#endif
+    for(; i < pixel_count; ++i)
+	for(int j = 0; j < 3; ++j)
+	    pixels[4 * i + j] = (pixels[4 * i + j] & 0xFE) | bits[3 * i + j];
+}
+
+/*
+ * Function to collect the colour LSBs of 32 bpp pixels.
+ *
+ * This is the inverse of lsb_blend_skip_alpha(): 3 bits are collected from
+ * every pixel and the alpha byte is skipped. With SSSE3 a shuffle packs the
+ * 12 colour lanes of 4 pixels together per step.
+ *
+ * INPUTS: The pixel bytes, the output bit array and the number of pixels.
+ *
+ * CAUTION: The bit array is written 16 bytes at a time, so it must have
+ * LSB_KERNEL_SLACK writable bytes after the last collected bit.
+ *
+ * RETURNS: Nothing.
+ */
+void lsb_gather_skip_alpha(const unsigned char *pixels, unsigned char *bits, uint pixel_count)
+{
+    if(!pixels || !bits)
+    {
+	FATAL_ERR_MSG;
+	return;
+    }
+
+    uint i = 0;
+#if defined(__SSSE3__)
+    const __m128i pack = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    const __m128i one = _mm_set1_epi8(1);
+    for(; i + 4 <= pixel_count; i += 4)
+    {
+	__m128i p = _mm_and_si128(_mm_loadu_si128((const __m128i *)(pixels + 4 * i)), one);
+	_mm_storeu_si128((__m128i *)(bits + 3 * i), _mm_shuffle_epi8(p, pack));
+    }
+#endif
+    for(; i < pixel_count; ++i)
+	for(int j = 0; j < 3; ++j)
+	    bits[3 * i + j] = pixels[4 * i + j] & 1;
+}
+
+/*
+ * Function to check that the row pipeline can handle the image layout.
+ *
+ * Only 24 and 32 bpp images are supported, and skipping the alpha channel
+ * only makes sense for 32 bpp images.
+ *
+ * INPUTS: The BmpImage descriptor and the skip alpha flag.
+ *
+ * RETURNS: e_success if the layout is supported, e_failure otherwise.
+ */
+Status lsb_check_image_support(const BmpImage *bmp_image, int skip_alpha)
+{
+    if(!bmp_image)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    if(bmp_image->bits_per_pixel != 24 && bmp_image->bits_per_pixel != 32)
+    {
+	fprintf(stderr, "Only 24 and 32 bpp BMP images are supported, this one is %u bpp.\n", bmp_image->bits_per_pixel);
+	return e_failure;
+    }
+
+    if(skip_alpha && bmp_image->bits_per_pixel != 32)
+    {
+	fprintf(stderr, "Skipping the alpha channel needs a 32 bpp BMP image.\n");
+	return e_failure;
+    }
+    return e_success;
+}
+
+/*
+ * Function to get the number of carrier bytes in each row of the image.
+ */
+static uint carriers_per_row(const BmpImage *bmp_image, int skip_alpha)
+{
+    return skip_alpha? bmp_image->width * 3: bmp_image->row_size;
+}
+
+/*
+ * Function to get the number of message bytes an image can carry.
+ *
+ * Each message byte needs 8 carrier bytes. Row padding is not counted and
+ * neither are alpha bytes when they are skipped.
+ *
+ * INPUTS: The BmpImage descriptor and the skip alpha flag.
+ *
+ * RETURNS: The capacity in message bytes.
+ */
+uint lsb_image_capacity(const BmpImage *bmp_image, int skip_alpha)
+{
+    if(!bmp_image)
+    {
+	FATAL_ERR_MSG;
+	return 0;
+    }
+
+    return (uint)(((unsigned long long)carriers_per_row(bmp_image, skip_alpha) * bmp_image->height) / 8);
+}
+
+/*
+ * Function to prepare a cursor over the pixel rows of an image.
+ *
+ * The cursor reads rows from the current position of fptr_src, which must
+ * be at the pixel data offset, and writes finished rows to fptr_dest if it
+ * is not NULL. The buffers of the cursor come from the arena, if given,
+ * and are then given back when the arena is reset.
+ *
+ * INPUTS: The cursor, the BmpImage descriptor, the source and destination
+ * image file pointers, the skip alpha flag and the arena (may be NULL).
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status lsb_cursor_init(LsbCursor *cursor, const BmpImage *bmp_image, FILE *fptr_src, FILE *fptr_dest, int skip_alpha, Arena *arena)
+{
+    if(!cursor || !bmp_image || !fptr_src)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    if(lsb_check_image_support(bmp_image, skip_alpha) == e_failure)
+	return e_failure;
+
+    memset(cursor, 0, sizeof(*cursor));
+    cursor->bmp_image = bmp_image;
+    cursor->arena = arena;
+    cursor->fptr_src = fptr_src;
+    cursor->fptr_dest = fptr_dest;
+    cursor->skip_alpha = skip_alpha;
+    cursor->carriers_per_row = carriers_per_row(bmp_image, skip_alpha);
+    cursor->row = arena_alloc(cursor->arena, bmp_image->row_stride + LSB_KERNEL_SLACK);
+    cursor->bits = arena_alloc(cursor->arena, LSB_CHUNK_SIZE * 8 + LSB_KERNEL_SLACK);
+    if(!cursor->row || !cursor->bits)
+    {
+	FATAL_ERR_MSG;
+	lsb_cursor_free(cursor);
+	return e_failure;
+    }
+    return e_success;
+}
+
+/*
+ * Function to prepare a cursor that edits a pixel array in place.
+ *
+ * The carriers are visited in the same order as with lsb_cursor_init(),
+ * or in the keyed order once a key is set, but they are read from and
+ * written to the given pixel array directly. Writes skip the carriers
+ * whose LSB is already right, so a shared file mapping only gets dirty
+ * pages where the message really changes. The array stays owned by the
+ * caller and lsb_cursor_flush() has nothing to do.
+ *
+ * INPUTS: The cursor, the BmpImage descriptor, the pixel array (row_stride
+ * * height bytes), the skip alpha flag and the arena (may be NULL).
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status lsb_cursor_init_mapped(LsbCursor *cursor, const BmpImage *bmp_image, unsigned char *pixels, int skip_alpha, Arena *arena)
+{
+    if(!cursor || !bmp_image || !pixels)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    if(lsb_check_image_support(bmp_image, skip_alpha) == e_failure)
+	return e_failure;
+
+    memset(cursor, 0, sizeof(*cursor));
+    cursor->bmp_image = bmp_image;
+    cursor->arena = arena;
+    cursor->skip_alpha = skip_alpha;
+    cursor->carriers_per_row = carriers_per_row(bmp_image, skip_alpha);
+    cursor->carrier_count = (size_t)cursor->carriers_per_row * bmp_image->height;
+    cursor->row_index = bmp_image->height;
+    cursor->pixels = pixels;
+    cursor->mapped = 1;
+    cursor->bits = arena_alloc(cursor->arena, LSB_CHUNK_SIZE * 8 + LSB_KERNEL_SLACK);
+    if(!cursor->bits)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+    return e_success;
+}
+
+/*
+ * Function to read the next row of the image into the row buffer.
+ */
+static Status load_row(LsbCursor *cursor)
+{
+    if(cursor->row_index >= cursor->bmp_image->height)
+    {
+	fprintf(stderr, "Image capacity exceeded.\n");
+	return e_failure;
+    }
+
+    if(fread(cursor->row, cursor->bmp_image->row_stride, 1, cursor->fptr_src) != 1)
+    {
+	FILE_READ_ERR;
+	return e_failure;
+    }
+    if(cursor->metrics)
+	memcpy(cursor->cover_copy, cursor->row, cursor->bmp_image->row_stride);
+    cursor->row_pos = 0;
+    cursor->row_loaded = 1;
+    return e_success;
+}
+
+static void extract_span(LsbCursor *cursor, unsigned char *bits, uint count);
+
+/*
+ * Function to read back the used carriers of the buffered row, when
+ * verifying, and add them to the read back checksum.
+ */
+static void read_back_row(LsbCursor *cursor)
+{
+    uint used = cursor->row_pos;
+    cursor->row_pos = 0;
+    extract_span(cursor, cursor->readback_bits, used);
+    cursor->row_pos = used;
+    cursor->readback_crc = crc32c_update(cursor->readback_crc, cursor->readback_bits, used);
+}
+
+/*
+ * Function to write the buffered row out and move on to the next row.
+ */
+static Status store_row(LsbCursor *cursor)
+{
+    if(cursor->verify)
+	read_back_row(cursor);
+    if(cursor->metrics)
+	compare_pixel_bytes(cursor->cover_copy, cursor->row, cursor->bmp_image->row_size, cursor->metrics);
+    if(cursor->fptr_dest)
+    {
+	fwrite(cursor->row, cursor->bmp_image->row_stride, 1, cursor->fptr_dest);
+	if(ferror(cursor->fptr_dest))
+	{
+	    FILE_WRITE_ERR;
+	    return e_failure;
+	}
+    }
+    cursor->row_loaded = 0;
+    ++cursor->row_index;
+    return e_success;
+}
+
+/*
+ * Function to embed bits into a span of carriers of the buffered row.
+ *
+ * With the alpha channel skipped, carrier k of a row lives in byte
+ * 4 * (k / 3) + k % 3. A span that does not start or end on a pixel
+ * boundary has its partial pixels handled byte by byte.
+ */
+static void embed_span(LsbCursor *cursor, const unsigned char *bits, uint count)
+{
+    uint pos = cursor->row_pos;
+    if(!cursor->skip_alpha)
+    {
+	lsb_blend(cursor->row + pos, bits, count);
+	return;
+    }
+
+    unsigned char *row = cursor->row;
+    for(; count && pos % 3; --count, ++pos, ++bits)
+	row[4 * (pos / 3) + pos % 3] = (row[4 * (pos / 3) + pos % 3] & 0xFE) | *bits;
+
+    uint pixels = count / 3;
+    lsb_blend_skip_alpha(row + 4 * (pos / 3), bits, pixels);
+    pos += 3 * pixels;
+    bits += 3 * pixels;
+    count -= 3 * pixels;
+
+    for(; count; --count, ++pos, ++bits)
+	row[4 * (pos / 3) + pos % 3] = (row[4 * (pos / 3) + pos % 3] & 0xFE) | *bits;
+}
+
+/*
+ * Function to extract bits from a span of carriers of the buffered row.
+ *
+ * This is the extracting counterpart of embed_span().
+ */
+static void extract_span(LsbCursor *cursor, unsigned char *bits, uint count)
+{
+    uint pos = cursor->row_pos;
+    if(!cursor->skip_alpha)
+    {
+	lsb_gather(cursor->row + pos, bits, count);
+	return;
+    }
+
+    const unsigned char *row = cursor->row;
+    for(; count && pos % 3; --count, ++pos, ++bits)
+	*bits = row[4 * (pos / 3) + pos % 3] & 1;
+
+    uint pixels = count / 3;
+    lsb_gather_skip_alpha(row + 4 * (pos / 3), bits, pixels);
+    pos += 3 * pixels;
+    bits += 3 * pixels;
+    count -= 3 * pixels;
+
+    for(; count; --count, ++pos, ++bits)
+	*bits = row[4 * (pos / 3) + pos % 3] & 1;
+}
+
+/*
+ * Function to step the splitmix64 generator used for keyed spreading.
+ */
+static uint64_t next_spread_random(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/*
+ * Function to fill an array with a keyed permutation of 0 .. count - 1
+ * (Fisher-Yates shuffle).
+ */
+static void keyed_permutation(uint *order, uint count, uint64_t seed)
+{
+    uint64_t state = seed;
+    for(uint i = 0; i < count; ++i)
+	order[i] = i;
+    for(uint i = count; i > 1; --i)
+    {
+	uint j = (uint)(((next_spread_random(&state) >> 32) * i) >> 32);
+	uint temp = order[i - 1];
+	order[i - 1] = order[j];
+	order[j] = temp;
+    }
+}
+
+/*
+ * Function to get the byte offset of a carrier within the pixel array.
+ */
+static size_t carrier_offset(const LsbCursor *cursor, size_t carrier)
+{
+    size_t row = carrier / cursor->carriers_per_row;
+    uint k = carrier % cursor->carriers_per_row;
+    return row * cursor->bmp_image->row_stride + (cursor->skip_alpha? 4 * (k / 3) + k % 3: k);
+}
+
+/*
+ * Function to get the byte offset of the next carrier in the keyed order.
+ *
+ * The carrier map of a tile is built when the visiting order enters the
+ * tile, so it is built once per tile and every access stays within the
+ * few kilobytes of pixel data the tile covers.
+ */
+static size_t next_spread_offset(LsbCursor *cursor)
+{
+    uint tile = cursor->tile_order[cursor->carrier_seq / LSB_SPREAD_TILE];
+    if(tile != cursor->tile_map_tile)
+    {
+	size_t tile_start = (size_t)tile * LSB_SPREAD_TILE;
+	size_t tile_len = cursor->carrier_count - tile_start;
+	if(tile_len > LSB_SPREAD_TILE)
+	    tile_len = LSB_SPREAD_TILE;
+	uint64_t state = cursor->spread_seed ^ ((tile + 1) * 0xD1B54A32D192ED03ULL);
+	keyed_permutation(cursor->tile_map, tile_len, next_spread_random(&state));
+	cursor->tile_map_tile = tile;
+    }
+
+    // Only the last tile can be partial; it is visited last, in its own
+    // keyed order like the others.
+    uint within = cursor->carrier_seq % LSB_SPREAD_TILE;
+    ++cursor->carrier_seq;
+    return carrier_offset(cursor, (size_t)tile * LSB_SPREAD_TILE + cursor->tile_map[within]);
+}
+
+/*
+ * Function to get the byte offset of the next carrier of a cursor that
+ * holds the whole pixel array: in the keyed order if a key is set, in
+ * file order otherwise.
+ */
+static size_t next_carrier_offset(LsbCursor *cursor)
+{
+    if(cursor->spread)
+	return next_spread_offset(cursor);
+    return carrier_offset(cursor, cursor->carrier_seq++);
+}
+
+/*
+ * Function to check that the keyed order has count carriers left.
+ */
+static Status check_spread_room(const LsbCursor *cursor, size_t count)
+{
+    if(count > cursor->carrier_count - cursor->carrier_seq)
+    {
+	fprintf(stderr, "Image capacity exceeded.\n");
+	return e_failure;
+    }
+    return e_success;
+}
+
+/*
+ * Function to spread the message over the image in a keyed order.
+ *
+ * The seed, derived from the key with chacha20_derive_spread_seed(), fixes
+ * the order of the tiles and the order of the carriers inside each tile.
+ * The whole pixel array is read into memory here, unless the cursor is
+ * mapped, so this must be called right after initialising the cursor and
+ * before any data is embedded or extracted. Encoding and decoding have to
+ * use the same key.
+ *
+ * The order only hides where the message is; it does not encrypt it.
+ *
+ * INPUTS: The cursor and the seed derived from the key.
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status lsb_cursor_set_key(LsbCursor *cursor, uint64_t spread_seed)
+{
+    if(!cursor || !cursor->bits)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    cursor->spread_seed = spread_seed;
+
+    const BmpImage *bmp_image = cursor->bmp_image;
+    size_t pixel_array_size = (size_t)bmp_image->row_stride * bmp_image->height;
+    cursor->carrier_count = (size_t)cursor->carriers_per_row * bmp_image->height;
+    cursor->tile_count = (cursor->carrier_count + LSB_SPREAD_TILE - 1) / LSB_SPREAD_TILE;
+    cursor->tile_map_tile = cursor->tile_count;
+    if(!cursor->mapped)
+	cursor->pixels = arena_alloc(cursor->arena, pixel_array_size);
+    cursor->tile_order = arena_alloc(cursor->arena, cursor->tile_count * sizeof(uint));
+    cursor->tile_map = arena_alloc(cursor->arena, LSB_SPREAD_TILE * sizeof(uint));
+    if(!cursor->pixels || !cursor->tile_order || !cursor->tile_map)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    if(!cursor->mapped && fread(cursor->pixels, pixel_array_size, 1, cursor->fptr_src) != 1)
+    {
+	FILE_READ_ERR;
+	return e_failure;
+    }
+    // A partial last tile stays last, so that positions in the visiting
+    // order map onto tiles by plain division.
+    uint full_tiles = cursor->carrier_count / LSB_SPREAD_TILE;
+    keyed_permutation(cursor->tile_order, full_tiles, cursor->spread_seed);
+    if(full_tiles < cursor->tile_count)
+	cursor->tile_order[full_tiles] = full_tiles;
+    cursor->spread = 1;
+    return e_success;
+}
+
+/*
+ * Function to set the key given by the options on a cursor, if there is
+ * one, from the key material loaded with the options. Without a key the
+ * cursor is left in its contiguous layout.
+ *
+ * INPUTS: The cursor and the options.
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status lsb_cursor_use_options_key(LsbCursor *cursor, const StegOptions *options)
+{
+    if(!cursor || !options)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    return options->key? lsb_cursor_set_key(cursor, options->key->spread_seed): e_success;
+}
+
+/*
+ * Function to have the carriers read back before they are written out.
+ *
+ * Every bit embedded from now on is added to a CRC-32C of the source bits.
+ * The carriers of each row are read back from the row buffer as the row
+ * is written, and with a key set the whole keyed order is walked again
+ * when lsb_cursor_flush() writes the pixel array, so the bits checked are
+ * the ones that really leave memory. lsb_cursor_check_verify() compares
+ * the two checksums once the cursor is flushed.
+ *
+ * INPUTS: A cursor made with lsb_cursor_init(), before anything is embedded.
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status lsb_cursor_enable_verify(LsbCursor *cursor)
+{
+    if(!cursor || cursor->mapped)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    cursor->readback_bits = arena_alloc(cursor->arena, cursor->carriers_per_row + LSB_KERNEL_SLACK);
+    if(!cursor->readback_bits)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+    cursor->verify = 1;
+    cursor->source_crc = 0;
+    cursor->readback_crc = 0;
+    return e_success;
+}
+
+/*
+ * Function to check the carriers read back hold the bits that were
+ * embedded.
+ *
+ * INPUTS: A verifying cursor, after lsb_cursor_flush().
+ *
+ * RETURNS: e_success if the checksums match, e_failure otherwise.
+ */
+Status lsb_cursor_check_verify(const LsbCursor *cursor)
+{
+    if(!cursor || !cursor->verify)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    if(cursor->readback_crc != cursor->source_crc)
+    {
+	fprintf(stderr, "Verification failed: the carriers read back as %08x instead of %08x.\n", (unsigned)cursor->readback_crc, (unsigned)cursor->source_crc);
+	return e_failure;
+    }
+    return e_success;
+}
+
+/*
+ * Function to measure the distortion of the rows as they are written out.
+ *
+ * The cover bytes of every row are kept as the row is read and compared
+ * with compare_pixel_bytes() as it is written. With a key set, the whole
+ * pixel array already read is copied here and compared when it is
+ * flushed. Rows the message does not reach are copied as they are and not
+ * compared, so they are not counted in the pixel bytes of the metrics.
+ *
+ * INPUTS: A cursor made with lsb_cursor_init(), after its key is set and
+ * before anything is embedded, and the metrics to add to.
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status lsb_cursor_enable_metrics(LsbCursor *cursor, CompareMetrics *metrics)
+{
+    if(!cursor || !metrics || cursor->mapped)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    const BmpImage *bmp_image = cursor->bmp_image;
+    size_t copy_size = cursor->spread? (size_t)bmp_image->row_stride * bmp_image->height: bmp_image->row_stride;
+    cursor->cover_copy = arena_alloc(cursor->arena, copy_size);
+    if(!cursor->cover_copy)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+    if(cursor->spread)
+	memcpy(cursor->cover_copy, cursor->pixels, copy_size);
+    compare_metrics_init(metrics, bmp_image);
+    cursor->metrics = metrics;
+    return e_success;
+}
+
+/*
+ * Function to embed already expanded bits into the next carriers.
+ *
+ * The bits are laid over the carriers of as many rows as it takes, one
+ * vectorized blend per row span. Rows whose carriers are all used are
+ * written to the destination image straight away. This lets a message that
+ * is embedded into many images be expanded with lsb_expand_bits() once.
+ *
+ * INPUTS: The cursor, the bit array (0 or 1 per byte) and the bit count.
+ *
+ * CAUTION: The bit array must have LSB_KERNEL_SLACK readable bytes after
+ * the last bit.
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status lsb_cursor_write_bits(LsbCursor *cursor, const unsigned char *bits, size_t bit_count)
+{
+    if(!cursor || !bits)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    if(cursor->verify)
+	cursor->source_crc = crc32c_update(cursor->source_crc, bits, bit_count);
+    if(cursor->spread || cursor->mapped)
+    {
+	if(check_spread_room(cursor, bit_count) == e_failure)
+	    return e_failure;
+	for(size_t i = 0; i < bit_count; ++i)
+	{
+	    size_t offset = next_carrier_offset(cursor);
+	    if((cursor->pixels[offset] & 1) != bits[i])
+	    {
+		cursor->pixels[offset] ^= 1;
+		++cursor->changed_carriers;
+	    }
+	}
+	return e_success;
+    }
+
+    while(bit_count)
+    {
+	if(!cursor->row_loaded && load_row(cursor) == e_failure)
+	    return e_failure;
+
+	uint span = cursor->carriers_per_row - cursor->row_pos;
+	if(span > bit_count)
+	    span = bit_count;
+	embed_span(cursor, bits, span);
+	cursor->row_pos += span;
+	bits += span;
+	bit_count -= span;
+
+	if(cursor->row_pos == cursor->carriers_per_row && store_row(cursor) == e_failure)
+	    return e_failure;
+    }
+    return e_success;
+}
+
+/*
+ * Function to embed data bytes into the next carriers of the image.
+ *
+ * The data is expanded into bits LSB_CHUNK_SIZE bytes at a time and each
+ * chunk is laid over the carriers with lsb_cursor_write_bits().
+ *
+ * INPUTS: The cursor, the data bytes and their count.
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status lsb_cursor_write(LsbCursor *cursor, const unsigned char *data, uint len)
+{
+    if(!cursor || !data)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    while(len)
+    {
+	uint chunk = len < LSB_CHUNK_SIZE? len: LSB_CHUNK_SIZE;
+	lsb_expand_bits(data, chunk, cursor->bits);
+	if(lsb_cursor_write_bits(cursor, cursor->bits, (size_t)chunk * 8) == e_failure)
+	    return e_failure;
+	data += chunk;
+	len -= chunk;
+    }
+    return e_success;
+}
+
+/*
+ * Function to move a mapped cursor past the carriers of len data bytes
+ * without reading or writing them, for message blocks that are already
+ * in place.
+ *
+ * INPUTS: The mapped cursor and the number of data bytes to skip.
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status lsb_cursor_skip(LsbCursor *cursor, uint len)
+{
+    if(!cursor || !cursor->mapped)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    if(check_spread_room(cursor, (size_t)len * 8) == e_failure)
+	return e_failure;
+    cursor->carrier_seq += (size_t)len * 8;
+    return e_success;
+}
+
+/*
+ * Function to move a mapped cursor to the carriers of the data byte at
+ * pos, counted from the first carrier, so that the message can be read
+ * from anywhere in it.
+ *
+ * INPUTS: The mapped cursor and the data byte position.
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status lsb_cursor_seek(LsbCursor *cursor, size_t pos)
+{
+    if(!cursor || !cursor->mapped)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    if(pos > cursor->carrier_count / 8)
+    {
+	fprintf(stderr, "Image capacity exceeded.\n");
+	return e_failure;
+    }
+    cursor->carrier_seq = pos * 8;
+    return e_success;
+}
+
+/*
+ * Function to extract data bytes from the next carriers of the image.
+ *
+ * The LSBs of as many rows as it takes are collected into the bit buffer
+ * LSB_CHUNK_SIZE bytes worth at a time and packed into the data bytes.
+ *
+ * INPUTS: The cursor, the output data bytes and their count.
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status lsb_cursor_read(LsbCursor *cursor, unsigned char *data, uint len)
+{
+    if(!cursor || !data)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    while(len)
+    {
+	uint chunk = len < LSB_CHUNK_SIZE? len: LSB_CHUNK_SIZE;
+	unsigned char *bits = cursor->bits;
+	uint bit_count = chunk * 8;
+	if(cursor->spread || cursor->mapped)
+	{
+	    if(check_spread_room(cursor, bit_count) == e_failure)
+		return e_failure;
+	    for(uint i = 0; i < bit_count; ++i)
+		bits[i] = cursor->pixels[next_carrier_offset(cursor)] & 1;
+	    bit_count = 0;
+	}
+	while(bit_count)
+	{
+	    if(!cursor->row_loaded && load_row(cursor) == e_failure)
+		return e_failure;
+
+	    uint span = cursor->carriers_per_row - cursor->row_pos;
+	    if(span > bit_count)
+		span = bit_count;
+	    extract_span(cursor, bits, span);
+	    cursor->row_pos += span;
+	    bits += span;
+	    bit_count -= span;
+
+	    if(cursor->row_pos == cursor->carriers_per_row && store_row(cursor) == e_failure)
+		return e_failure;
+	}
+
+	lsb_pack_bits(cursor->bits, data, chunk);
+	data += chunk;
+	len -= chunk;
+    }
+    return e_success;
+}
+
+/*
+ * Function to walk the keyed order again up to the last embedded carrier,
+ * when verifying, and add the carriers to the read back checksum.
+ */
+static void read_back_spread(LsbCursor *cursor)
+{
+    size_t used = cursor->carrier_seq;
+    cursor->carrier_seq = 0;
+    while(cursor->carrier_seq < used)
+    {
+	size_t count = used - cursor->carrier_seq;
+	if(count > LSB_CHUNK_SIZE * 8)
+	    count = LSB_CHUNK_SIZE * 8;
+	for(size_t i = 0; i < count; ++i)
+	    cursor->bits[i] = cursor->pixels[next_spread_offset(cursor)] & 1;
+	cursor->readback_crc = crc32c_update(cursor->readback_crc, cursor->bits, count);
+    }
+}
+
+/*
+ * Function to write out the partially used row after embedding.
+ *
+ * After this call the source and destination position indicators are
+ * both at the start of the first untouched row. With a key set, the whole
+ * pixel array is written out, since the message is spread all over it.
+ * When verifying, the carriers are read back first, and with metrics
+ * enabled the rows are compared with the cover first.
+ *
+ * INPUTS: The cursor.
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status lsb_cursor_flush(LsbCursor *cursor)
+{
+    if(!cursor)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    if(cursor->spread && !cursor->mapped && cursor->row_index < cursor->bmp_image->height)
+    {
+	cursor->row_index = cursor->bmp_image->height;
+	if(cursor->verify)
+	    read_back_spread(cursor);
+	if(cursor->metrics)
+	    for(size_t row = 0; row < cursor->bmp_image->height; ++row)
+		compare_pixel_bytes(cursor->cover_copy + row * cursor->bmp_image->row_stride, cursor->pixels + row * cursor->bmp_image->row_stride,
+			cursor->bmp_image->row_size, cursor->metrics);
+	if(cursor->fptr_dest && fwrite(cursor->pixels, (size_t)cursor->bmp_image->row_stride * cursor->bmp_image->height, 1, cursor->fptr_dest) != 1)
+	{
+	    FILE_WRITE_ERR;
+	    return e_failure;
+	}
+	return e_success;
+    }
+
+    if(cursor->row_loaded)
+	return store_row(cursor);
+    return e_success;
+}
+
+/*
+ * Function to release the buffers held by a cursor.
+ *
+ * INPUTS: The cursor.
+ *
+ * RETURNS: Nothing.
+ */
+void lsb_cursor_free(LsbCursor *cursor)
+{
+    if(!cursor)
+	return;
+
+    arena_release(cursor->arena, cursor->row);
+    arena_release(cursor->arena, cursor->bits);
+    if(!cursor->mapped)
+	arena_release(cursor->arena, cursor->pixels);
+    arena_release(cursor->arena, cursor->tile_order);
+    arena_release(cursor->arena, cursor->tile_map);
+    arena_release(cursor->arena, cursor->readback_bits);
+    arena_release(cursor->arena, cursor->cover_copy);
+    cursor->readback_bits = NULL;
+    cursor->cover_copy = NULL;
+    cursor->row = NULL;
+    cursor->bits = NULL;
+    cursor->pixels = NULL;
+    cursor->tile_order = NULL;
+    cursor->tile_map = NULL;
+}
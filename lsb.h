@@ -0,0 +1,162 @@
+#ifndef LSB_H
+#define LSB_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "types.h" 	// Contains user defined types
+#include "common.h"	// Contains common strings
+#include "error.h"	// Contains standard error messages
+#include "compare.h"	// Contains the distortion metrics
+#include "arena.h"	// Contains the per-job arena
+
+/* Number of message bytes expanded into LSB bits per kernel call */
+#define LSB_CHUNK_SIZE 4096
+
+/* Bytes of slack after the bit buffer for the 16 byte wide kernels */
+#define LSB_KERNEL_SLACK 16
+
+/* Carriers per tile when the message is spread with a key */
+#define LSB_SPREAD_TILE 4096
+
+/*
+ * Structure to walk the carrier bytes of a BMP pixel array row by row.
+ *
+ * Carrier bytes are the colour bytes of each row in file order. The row
+ * padding is never touched and neither is the alpha byte of 32 bpp pixels
+ * when skip_alpha is set. Rows are read from fptr_src into the row buffer,
+ * embedded into or extracted from, and written to fptr_dest (if any) once
+ * all their carriers are used.
+ *
+ * With a key set, the message is spread over the whole image instead. The
+ * carriers are split into tiles of LSB_SPREAD_TILE carriers, the tiles are
+ * visited in a keyed order and the carriers of each tile in a keyed order
+ * of their own. The pixel array is then held in memory as a whole, read
+ * when the key is set and written out by lsb_cursor_flush().
+ *
+ * A mapped cursor works on a pixel array owned by the caller, typically a
+ * shared mapping of the image file, and edits it in place: carriers whose
+ * LSB already has the right value are not written at all.
+ *
+ * With verification enabled, the carriers of every row are read back from
+ * the row buffer, or from the whole pixel array when spreading, right
+ * before they are written out. The bits read back and the bits handed to
+ * the cursor are both run through CRC-32C, so a finished encode can be
+ * checked without decoding the output again.
+ *
+ * With metrics enabled, a copy of the cover bytes is kept next to the
+ * carriers being embedded into, and every row is compared with it on its
+ * way out, so the distortion of the stego image is measured without
+ * reading anything twice.
+ */
+typedef struct _LsbCursor
+{
+    const BmpImage *bmp_image;
+    Arena *arena;		// Arena the buffers come from, NULL for the heap
+    FILE *fptr_src;		// Image the rows are read from
+    FILE *fptr_dest;		// Image the rows are written to, NULL when decoding
+    int skip_alpha;		// Leave the alpha byte of 32 bpp pixels untouched
+    uint carriers_per_row;	// Carrier bytes in each row
+    uint row_index;		// Index of the buffered row in file order
+    uint row_pos;		// Next unused carrier in the buffered row
+    int row_loaded;		// 1 if the row buffer holds an unfinished row
+    unsigned char *row;		// Row buffer: row_stride bytes
+    unsigned char *bits;	// LSB_CHUNK_SIZE * 8 expanded message bits
+
+    /* Keyed spreading state, unused without a key */
+    int spread;			// 1 once a key is set
+    uint64_t spread_seed;	// Seed derived from the key
+    unsigned char *pixels;	// The whole pixel array
+    size_t carrier_count;	// Carriers in the image
+    size_t carrier_seq;		// Next carrier in the keyed visiting order
+    uint *tile_order;		// Keyed order of the tiles
+    uint tile_count;
+    uint *tile_map;		// Keyed order of the carriers of one tile
+    uint tile_map_tile;		// Tile the map is for, tile_count if none
+
+    /* In place editing state, unused unless mapped */
+    int mapped;			// 1 if pixels is the caller's pixel array
+    size_t changed_carriers;	// Carriers whose LSB was flipped
+
+    /* Read back state, unused unless verify is set */
+    int verify;			// 1 to read carriers back before they are written out
+    uint32_t source_crc;	// CRC-32C of the bits handed to the cursor
+    uint32_t readback_crc;	// CRC-32C of the bits read back from the carriers
+    unsigned char *readback_bits;	// Bits read back from one row
+
+    /* Distortion metrics state, unused unless metrics is set */
+    CompareMetrics *metrics;	// Metrics the rows written out are added to
+    unsigned char *cover_copy;	// Cover bytes of the buffered row, or of the whole pixel array
+
+} LsbCursor;
+
+/* LSB kernel prototypes */
+
+/* Expand each bit of the data bytes into a byte of its own */
+void lsb_expand_bits(const unsigned char *data, uint len, unsigned char *bits);
+
+/* Pack the expanded bits back into data bytes */
+void lsb_pack_bits(const unsigned char *bits, unsigned char *data, uint len);
+
+/* Replace the LSBs of consecutive carrier bytes with the given bits */
+void lsb_blend(unsigned char *carriers, const unsigned char *bits, uint count);
+
+/* Collect the LSBs of consecutive carrier bytes */
+void lsb_gather(const unsigned char *carriers, unsigned char *bits, uint count);
+
+/* Replace the colour LSBs of 32 bpp pixels, leaving the alpha byte alone */
+void lsb_blend_skip_alpha(unsigned char *pixels, const unsigned char *bits, uint pixel_count);
+
+/* Collect the colour LSBs of 32 bpp pixels, skipping the alpha byte */
+void lsb_gather_skip_alpha(const unsigned char *pixels, unsigned char *bits, uint pixel_count);
+
+/* Row cursor prototypes */
+
+/* Check the image layout is one the row pipeline supports */
+Status lsb_check_image_support(const BmpImage *bmp_image, int skip_alpha);
+
+/* Number of message bytes the image can carry */
+uint lsb_image_capacity(const BmpImage *bmp_image, int skip_alpha);
+
+/* Prepare a cursor positioned at the first pixel row */
+Status lsb_cursor_init(LsbCursor *cursor, const BmpImage *bmp_image, FILE *fptr_src, FILE *fptr_dest, int skip_alpha, Arena *arena);
+
+/* Prepare a cursor that edits a pixel array in memory in place */
+Status lsb_cursor_init_mapped(LsbCursor *cursor, const BmpImage *bmp_image, unsigned char *pixels, int skip_alpha, Arena *arena);
+
+/* Spread the message over the image in a keyed order */
+Status lsb_cursor_set_key(LsbCursor *cursor, uint64_t spread_seed);
+
+/* Spread the message with the key given by the options, if any */
+Status lsb_cursor_use_options_key(LsbCursor *cursor, const StegOptions *options);
+
+/* Read the embedded carriers back before they are written out */
+Status lsb_cursor_enable_verify(LsbCursor *cursor);
+
+/* Check the bits read back match the bits embedded */
+Status lsb_cursor_check_verify(const LsbCursor *cursor);
+
+/* Measure the distortion of the rows as they are written out */
+Status lsb_cursor_enable_metrics(LsbCursor *cursor, CompareMetrics *metrics);
+
+/* Embed already expanded bits into the next carriers */
+Status lsb_cursor_write_bits(LsbCursor *cursor, const unsigned char *bits, size_t bit_count);
+
+/* Embed data bytes into the next carriers */
+Status lsb_cursor_write(LsbCursor *cursor, const unsigned char *data, uint len);
+
+/* Move a mapped cursor past carriers without touching them */
+Status lsb_cursor_skip(LsbCursor *cursor, uint len);
+
+/* Move a mapped cursor to the carriers of a data byte */
+Status lsb_cursor_seek(LsbCursor *cursor, size_t pos);
+
+/* Extract data bytes from the next carriers */
+Status lsb_cursor_read(LsbCursor *cursor, unsigned char *data, uint len);
+
+/* Write out the partially used row, if any */
+Status lsb_cursor_flush(LsbCursor *cursor);
+
+/* Release the cursor buffers */
+void lsb_cursor_free(LsbCursor *cursor);
+
+#endif
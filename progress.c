@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include "progress.h"
+#include "trace.h"
+#include "types.h"
+#include "error.h"
+
+/* Set by the SIGINT and SIGTERM handler */
+static volatile sig_atomic_t cancel_signalled;
+
+/* Function Definitions */
+
+/*
+ * Function to set up the progress reports asked for with --progress,
+ * printed by print_progress() every options->progress_ms milliseconds.
+ * Without the option no reports are made; a job can still be cancelled.
+ *
+ * INPUTS: The progress state of the job and the options.
+ *
+ * RETURNS: Nothing.
+ */
+void progress_init(Progress *progress, const StegOptions *options)
+{
+    if(!progress || !options)
+    {
+	FATAL_ERR_MSG;
+	return;
+    }
+
+    memset(progress, 0, sizeof(*progress));
+    if(!options->progress_ms)
+	return;
+    progress->callback = print_progress;
+    progress->interval_ms = options->progress_ms;
+}
+
+/*
+ * Function to start timing the data loop of a job. The callback, interval
+ * and cancel flag set by the caller are kept.
+ *
+ * INPUTS: The progress state, the operation name for the reports and the
+ * payload bytes the loop is going to move.
+ *
+ * RETURNS: Nothing.
+ */
+void progress_begin(Progress *progress, const char *operation, uint64_t total)
+{
+    if(!progress || !operation)
+    {
+	FATAL_ERR_MSG;
+	return;
+    }
+
+    progress->operation = operation;
+    progress->total = total;
+    progress->start_ns = progress->callback? trace_now(): 0;
+    progress->next_report_ns = progress->start_ns + (uint64_t)progress->interval_ms * 1000000;
+}
+
+/*
+ * Function to check whether a job has been cancelled, by its own flag or
+ * by a signal. It is cheap enough to be called for every block.
+ *
+ * INPUTS: The progress state of the job (may be NULL for the signal only).
+ *
+ * RETURNS: 1 if the job should stop, 0 otherwise.
+ */
+int progress_cancelled(const Progress *progress)
+{
+    if(cancel_signalled)
+	return 1;
+    return progress && progress->cancel && __atomic_load_n(progress->cancel, __ATOMIC_RELAXED);
+}
+
+/*
+ * Function to be called by a data loop after each block. It reports the
+ * progress through the callback once the interval is up, and always when
+ * the last byte is done, so the caller sees a final 100% report.
+ *
+ * INPUTS: The progress state and the payload bytes done so far.
+ *
+ * RETURNS: e_success to go on, e_failure once the job has been cancelled.
+ */
+Status progress_update(Progress *progress, uint64_t done)
+{
+    if(!progress)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    if(progress_cancelled(progress))
+    {
+	fprintf(stderr, "%s cancelled after %llu of %llu bytes.\n", progress->operation? progress->operation: "Job",
+		(unsigned long long)done, (unsigned long long)progress->total);
+	return e_failure;
+    }
+
+    if(!progress->callback)
+	return e_success;
+    uint64_t now = trace_now();
+    if(now < progress->next_report_ns && done < progress->total)
+	return e_success;
+
+    ProgressReport report;
+    report.operation = progress->operation;
+    report.done = done;
+    report.total = progress->total;
+    report.elapsed = (now - progress->start_ns) / 1e9;
+    report.rate = report.elapsed > 0? done / report.elapsed: 0;
+    report.eta = report.rate > 0? (progress->total - done) / report.rate: -1;
+    progress->callback(&report, progress->callback_data);
+    progress->next_report_ns = now + (uint64_t)progress->interval_ms * 1000000;
+    return e_success;
+}
+
+/*
+ * Function to print a progress report on the standard error, a line per
+ * report. It is the callback set up by --progress.
+ *
+ * INPUTS: The report and the callback data (unused).
+ *
+ * RETURNS: Nothing.
+ */
+void print_progress(const ProgressReport *report, void *data)
+{
+    (void)data;
+    if(!report)
+    {
+	FATAL_ERR_MSG;
+	return;
+    }
+
+    double percent = report->total? 100.0 * report->done / report->total: 100;
+    fprintf(stderr, "%s: %.1f of %.1f MiB (%.0f%%), %.1f MiB/s", report->operation? report->operation: "Job",
+	    report->done / PROGRESS_MIB, report->total / PROGRESS_MIB, percent, report->rate / PROGRESS_MIB);
+    if(report->eta >= 0 && report->done < report->total)
+	fprintf(stderr, ", ETA %.1f s", report->eta);
+    fputc('\n', stderr);
+}
+
+/*
+ * Function called on SIGINT and SIGTERM. The handler is reset by the
+ * signal, so a second one kills the process as usual.
+ */
+static void cancel_signal_handler(int signal_number)
+{
+    (void)signal_number;
+    cancel_signalled = 1;
+}
+
+/*
+ * Function to cancel the running jobs on SIGINT or SIGTERM instead of
+ * dying, so that they stop at their next block and remove their partial
+ * output. A second signal kills the process.
+ *
+ * INPUTS: None.
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status watch_cancel_signals(void)
+{
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = cancel_signal_handler;
+    action.sa_flags = SA_RESETHAND;
+    sigemptyset(&action.sa_mask);
+    if(sigaction(SIGINT, &action, NULL) < 0 || sigaction(SIGTERM, &action, NULL) < 0)
+    {
+	perror("sigaction");
+	return e_failure;
+    }
+    return e_success;
+}
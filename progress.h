@@ -0,0 +1,73 @@
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+#include <stdint.h>
+#include "types.h" 	// Contains user defined types
+#include "common.h"	// Contains common strings
+#include "error.h"	// Contains standard error messages
+
+/* Bytes in the mebibyte of the progress lines */
+#define PROGRESS_MIB (1024.0 * 1024.0)
+
+/* Progress of a job, as handed to a ProgressCallback */
+typedef struct _ProgressReport
+{
+    const char *operation;	// "Encoding", "Decoding", or "Reading" and "Repairing" with --fec
+    uint64_t done;		// Payload bytes embedded or extracted so far
+    uint64_t total;
+    double elapsed;		// Seconds since the data loop started
+    double rate;		// Bytes per second so far
+    double eta;			// Seconds left at that rate, negative until known
+
+} ProgressReport;
+
+/* Function called with the progress of a job, from the thread running it */
+typedef void (*ProgressCallback)(const ProgressReport *report, void *data);
+
+/*
+ * Structure to store the progress reporting and cancellation state of a
+ * job. It lives in the EncodeInfo or DecodeInfo object of the job: the
+ * caller sets the callback, its interval and the cancellation flag before
+ * the job starts, and the data loops update the rest once per block.
+ *
+ * A job stops at the next block once its cancel flag is set, from any
+ * thread, or once the process got SIGINT or SIGTERM after
+ * watch_cancel_signals(), and fails like any other, its partial output
+ * being removed.
+ */
+typedef struct _Progress
+{
+    ProgressCallback callback;	// NULL for no reports
+    void *callback_data;
+    uint interval_ms;		// Milliseconds between two reports
+    const int *cancel;		// Flag that stops the job once set, NULL for none
+
+    /* Set by progress_begin() */
+    const char *operation;
+    uint64_t total;
+    uint64_t start_ns;
+    uint64_t next_report_ns;
+
+} Progress;
+
+/* Progress function prototypes */
+
+/* Set up the reports asked for with --progress */
+void progress_init(Progress *progress, const StegOptions *options);
+
+/* Start timing the data loop of a job */
+void progress_begin(Progress *progress, const char *operation, uint64_t total);
+
+/* Report the bytes done if the interval is up, and check for cancellation */
+Status progress_update(Progress *progress, uint64_t done);
+
+/* Check whether a job has been cancelled */
+int progress_cancelled(const Progress *progress);
+
+/* Print a progress report on the standard error */
+void print_progress(const ProgressReport *report, void *data);
+
+/* Cancel the running jobs on SIGINT or SIGTERM */
+Status watch_cancel_signals(void);
+
+#endif
@@ -0,0 +1,1209 @@
+/* memfd_create(), fmemopen() and open_memstream() */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "server.h"
+#include "encode.h"
+#include "decode.h"
+#include "fec.h"
+#include "types.h"
+#include "error.h"
+
+/* Seconds an idle client connection is kept open by a worker */
+#define SERVER_IDLE_TIMEOUT_SEC 10
+
+/*
+ * Function to read exactly len bytes from a socket.
+ *
+ * This function keeps reading until len bytes have arrived, retrying reads
+ * interrupted by signals. A closed connection or a read error before all
+ * bytes have arrived is reported as failure.
+ *
+ * INPUTS: The socket descriptor, the buffer and the number of bytes.
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status read_full(int fd, void *buf, size_t len)
+{
+    unsigned char *pos = buf;
+    while(len)
+    {
+	ssize_t got = read(fd, pos, len);
+	if(got < 0 && errno == EINTR)
+	    continue;
+	if(got <= 0)
+	    return e_failure;
+	pos += got;
+	len -= got;
+    }
+    return e_success;
+}
+
+/*
+ * Function to write exactly len bytes to a socket.
+ *
+ * A peer that has gone away is reported as failure instead of raising
+ * SIGPIPE.
+ *
+ * INPUTS: The socket descriptor, the buffer and the number of bytes.
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status write_full(int fd, const void *buf, size_t len)
+{
+    const unsigned char *pos = buf;
+    while(len)
+    {
+	ssize_t sent = send(fd, pos, len, MSG_NOSIGNAL);
+	if(sent < 0 && errno == EINTR)
+	    continue;
+	if(sent <= 0)
+	    return e_failure;
+	pos += sent;
+	len -= sent;
+    }
+    return e_success;
+}
+
+/*
+ * Function to fill in a Unix domain socket address for a path.
+ */
+static Status make_socket_address(const char *socket_path, struct sockaddr_un *addr)
+{
+    if(strlen(socket_path) >= sizeof(addr->sun_path))
+    {
+	fprintf(stderr, "Socket path %s is too long.\n", socket_path);
+	return e_failure;
+    }
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, socket_path);
+    return e_success;
+}
+
+/*
+ * Function to read exactly len bytes along with any descriptors passed
+ * with them through SCM_RIGHTS.
+ *
+ * The descriptors arrive with the first bytes of the message, so only the
+ * first read uses recvmsg(); the rest, if the kernel split the message,
+ * is read normally. Up to max_fds descriptors are stored in fds and must
+ * be closed by the caller; any beyond that are closed straight away.
+ */
+static Status recv_with_fds(int fd, void *buf, size_t len, int *fds, int max_fds, int *fd_count)
+{
+    union
+    {
+	struct cmsghdr align;
+	char buf[CMSG_SPACE(MAX_PASSED_FDS * sizeof(int))];
+    } control;
+    struct iovec iov = { buf, len };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    *fd_count = 0;
+    ssize_t got;
+    do
+	got = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    while(got < 0 && errno == EINTR);
+    if(got <= 0)
+	return e_failure;
+
+    for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+	if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+	    continue;
+	int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+	for(int i = 0; i < count; ++i)
+	{
+	    int passed_fd;
+	    memcpy(&passed_fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+	    if(*fd_count < max_fds)
+		fds[(*fd_count)++] = passed_fd;
+	    else
+		close(passed_fd);
+	}
+    }
+
+    if(read_full(fd, (unsigned char *)buf + got, len - got) == e_failure)
+    {
+	for(int i = 0; i < *fd_count; ++i)
+	    close(fds[i]);
+	*fd_count = 0;
+	return e_failure;
+    }
+    return e_success;
+}
+
+/*
+ * Function to send exactly len bytes, passing fd_count descriptors along
+ * with the first of them through SCM_RIGHTS.
+ */
+static Status send_with_fds(int fd, const void *buf, size_t len, const int *fds, int fd_count)
+{
+    if(fd_count <= 0)
+	return write_full(fd, buf, len);
+
+    union
+    {
+	struct cmsghdr align;
+	char buf[CMSG_SPACE(MAX_PASSED_FDS * sizeof(int))];
+    } control;
+    struct iovec iov = { (void *)buf, len };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(fd_count * sizeof(int));
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(fd_count * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, fd_count * sizeof(int));
+
+    ssize_t sent;
+    do
+	sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    while(sent < 0 && errno == EINTR);
+    if(sent <= 0)
+	return e_failure;
+    return write_full(fd, (const unsigned char *)buf + sent, len - sent);
+}
+
+/*
+ * Function to map a passed descriptor and open the mapping as a read-only
+ * stream, so that the encode/decode stages read the caller's memory
+ * directly instead of a file on disk.
+ */
+static FILE *open_mapped_fd(int fd, MappedFile *mapped)
+{
+    struct stat st;
+    if(fstat(fd, &st) < 0 || st.st_size <= 0)
+    {
+	fprintf(stderr, "Passed descriptor is empty or unusable.\n");
+	return NULL;
+    }
+
+    mapped->size = st.st_size;
+    mapped->data = mmap(NULL, mapped->size, PROT_READ, MAP_SHARED, fd, 0);
+    if(mapped->data == MAP_FAILED)
+    {
+	perror("mmap");
+	mapped->data = NULL;
+	return NULL;
+    }
+    return fmemopen(mapped->data, mapped->size, "rb");
+}
+
+/*
+ * Function to create a memfd of the given size, map it and open the
+ * mapping as a writable stream. The stego image is exactly as large as
+ * the cover, so the encode stages fill the memfd in place.
+ */
+static FILE *open_output_memfd(size_t size, MappedFile *mapped, int *memfd)
+{
+    *memfd = memfd_create("stegged_image", MFD_CLOEXEC);
+    if(*memfd < 0 || ftruncate(*memfd, size) < 0)
+    {
+	perror("memfd_create");
+	return NULL;
+    }
+
+    mapped->size = size;
+    mapped->data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, *memfd, 0);
+    if(mapped->data == MAP_FAILED)
+    {
+	perror("mmap");
+	mapped->data = NULL;
+	return NULL;
+    }
+    return fmemopen(mapped->data, size, "r+b");
+}
+
+/*
+ * Function to unmap a mapping set up by open_mapped_fd() or
+ * open_output_memfd().
+ */
+static void unmap_file(MappedFile *mapped)
+{
+    if(mapped->data)
+	munmap(mapped->data, mapped->size);
+    mapped->data = NULL;
+}
+
+/*
+ * Function to run an encode request in a worker.
+ *
+ * The paths are used as they are; serve_request() only lets absolute ones
+ * through.
+ * An inline secret is read from the request buffer through an in-memory
+ * stream, with the secret path only supplying the file extension. Passed
+ * descriptors replace the image and secret paths and are mapped rather
+ * than read, and with REQ_FLAG_FD_OUTPUT the stego image is written into
+ * a memfd that is handed back through output_fd.
+ */
+static Status serve_encode(ServerWorker *worker, const RequestHeader *request, char *image_path, char *secret_path, char *output_path, unsigned char *inline_data, const int *fds, int *output_fd)
+{
+    EncodeInfo encInfo;
+    memset(&encInfo, 0, sizeof(encInfo));
+    encInfo.src_image_fname = image_path;
+    encInfo.secret_fname = secret_path;
+    encInfo.options.skip_alpha = (request->flags & REQ_FLAG_SKIP_ALPHA) != 0;
+    encInfo.options.encrypt = (request->flags & REQ_FLAG_ENCRYPT) != 0;
+    encInfo.options.verify = (request->flags & REQ_FLAG_VERIFY) != 0;
+    encInfo.options.fec_parity = request->fec_parity;
+    encInfo.options.key = worker->options->key;
+    encInfo.arena = &worker->arena;
+    encInfo.stego_image_fname = get_default_stegged_output_filename(*output_path? output_path: NULL, encInfo.arena);
+    if(!encInfo.stego_image_fname)
+	return e_failure;
+    snprintf(worker->reply_name, sizeof(worker->reply_name), "%s", encInfo.stego_image_fname);
+
+    MappedFile image_map = { NULL, 0 }, secret_map = { NULL, 0 }, output_map = { NULL, 0 };
+    Status status = e_success;
+    if(request->flags & REQ_FLAG_FD_IMAGE)
+    {
+	encInfo.fptr_src_image = open_mapped_fd(*fds++, &image_map);
+	if(!encInfo.fptr_src_image)
+	    status = e_failure;
+    }
+
+    if(status == e_success && (request->flags & REQ_FLAG_FD_SECRET))
+    {
+	encInfo.fptr_secret = open_mapped_fd(*fds++, &secret_map);
+	if(!encInfo.fptr_secret)
+	    status = e_failure;
+    }
+    else if(status == e_success && (request->flags & REQ_FLAG_INLINE_SECRET))
+    {
+	encInfo.fptr_secret = request->inline_data_len? fmemopen(inline_data, request->inline_data_len, "rb"): NULL;
+	if(!encInfo.fptr_secret)
+	{
+	    fprintf(stderr, "Inline secret data is empty or unreadable.\n");
+	    status = e_failure;
+	}
+    }
+
+    if(status == e_success && (request->flags & REQ_FLAG_FD_OUTPUT))
+    {
+	struct stat st;
+	size_t cover_size = image_map.data? image_map.size: (stat(image_path, &st) == 0? (size_t)st.st_size: 0);
+	encInfo.fptr_stego_image = cover_size? open_output_memfd(cover_size, &output_map, output_fd): NULL;
+	if(!encInfo.fptr_stego_image)
+	    status = e_failure;
+    }
+
+    if(status == e_success)
+	status = do_encoding(&encInfo);
+    else
+	cleanup(&encInfo);
+
+    unmap_file(&image_map);
+    unmap_file(&secret_map);
+    unmap_file(&output_map);
+    return status;
+}
+
+/*
+ * Function to run a decode request in a worker.
+ *
+ * With REQ_FLAG_INLINE_OUTPUT the decoded data is collected in memory and
+ * handed back through data and data_len for the reply, to be freed by the
+ * caller. With REQ_FLAG_FD_IMAGE the image is mapped from the passed
+ * descriptor, and with REQ_FLAG_FD_OUTPUT the decoded data is written into
+ * a memfd handed back through output_fd.
+ */
+static Status serve_decode(ServerWorker *worker, const RequestHeader *request, char *image_path, char *output_path, const int *fds, char **data, size_t *data_len, int *output_fd)
+{
+    DecodeInfo decInfo;
+    memset(&decInfo, 0, sizeof(decInfo));
+    decInfo.stego_image_fname = image_path;
+    decInfo.options.skip_alpha = (request->flags & REQ_FLAG_SKIP_ALPHA) != 0;
+    decInfo.options.encrypt = (request->flags & REQ_FLAG_ENCRYPT) != 0;
+    decInfo.options.fec_parity = request->fec_parity;
+    decInfo.inline_output = (request->flags & REQ_FLAG_INLINE_OUTPUT) != 0;
+    decInfo.arena = &worker->arena;
+    decInfo.options.cache_dir = worker->options->cache_dir;
+    decInfo.options.cache_size_mb = worker->options->cache_size_mb;
+    decInfo.options.key = worker->options->key;
+
+    MappedFile image_map = { NULL, 0 };
+    Status status = e_success;
+    if(request->flags & REQ_FLAG_FD_IMAGE)
+    {
+	decInfo.fptr_stego_image = open_mapped_fd(*fds, &image_map);
+	if(!decInfo.fptr_stego_image)
+	    status = e_failure;
+    }
+
+    if(status == e_success && (request->flags & REQ_FLAG_FD_OUTPUT))
+    {
+	*output_fd = memfd_create("destegged_data", MFD_CLOEXEC);
+	int stream_fd = *output_fd >= 0? dup(*output_fd): -1;
+	decInfo.fptr_secret = stream_fd >= 0? fdopen(stream_fd, "wb"): NULL;
+	if(!decInfo.fptr_secret)
+	{
+	    perror("memfd_create");
+	    if(stream_fd >= 0)
+		close(stream_fd);
+	    status = e_failure;
+	}
+    }
+
+    if(status == e_success)
+	status = do_decoding(*output_path? output_path: NULL, &decInfo);
+    else
+	cleanup_decoding(&decInfo);
+    unmap_file(&image_map);
+    *data = decInfo.output_data;
+    *data_len = decInfo.output_size;
+    if(status == e_failure)
+	return e_failure;
+
+    if(*output_path)
+	snprintf(worker->reply_name, sizeof(worker->reply_name), "%s", output_path);
+    else
+    {
+	char *default_name = get_default_destegged_output_filename(NULL, decInfo.extn_secret_file, decInfo.arena);
+	snprintf(worker->reply_name, sizeof(worker->reply_name), "%s", default_name? default_name: "");
+	arena_release(decInfo.arena, default_name);
+    }
+    return e_success;
+}
+
+/*
+ * Function to check a path of a request that the daemon is going to open.
+ * Such a path must be absolute and can not stand for a standard stream;
+ * an optional one may be empty, for the default name. Paths that only
+ * supply a name are not checked.
+ */
+static Status check_request_path(const char *path, int opened, int optional)
+{
+    if(!opened || (optional && !*path))
+	return e_success;
+    if(path[0] != '/' || is_stdio_file_name(path))
+    {
+	fprintf(stderr, "Request with a relative path \"%s\" dropped.\n", path);
+	return e_failure;
+    }
+    return e_success;
+}
+
+/*
+ * Function to read one request from a connection, run it and send the
+ * reply.
+ *
+ * The paths and inline data are read into the worker's request buffer,
+ * which only grows when a request needs more room than any before it.
+ * The descriptors passed with the request header must match its
+ * REQ_FLAG_FD_IMAGE and REQ_FLAG_FD_SECRET flags, in that order.
+ *
+ * RETURNS: e_failure if the connection should be dropped, e_success
+ * otherwise, whether or not the job itself succeeded.
+ */
+static Status serve_request(ServerWorker *worker, int fd, const RequestHeader *request, const int *fds, int fd_count)
+{
+    int expected_fds = ((request->flags & REQ_FLAG_FD_IMAGE) != 0) + ((request->flags & REQ_FLAG_FD_SECRET) != 0);
+    if(request->magic != STEG_PROTOCOL_MAGIC || request->image_path_len >= MAX_REQUEST_PATH_SIZE ||
+	    request->secret_path_len >= MAX_REQUEST_PATH_SIZE || request->output_path_len >= MAX_REQUEST_PATH_SIZE ||
+	    request->inline_data_len > MAX_REQUEST_INLINE_SIZE || fd_count != expected_fds)
+    {
+	fprintf(stderr, "Malformed request dropped.\n");
+	return e_failure;
+    }
+
+    size_t needed = request->image_path_len + request->secret_path_len + request->output_path_len + 3 + request->inline_data_len;
+    if(needed > worker->request_buf_size)
+    {
+	unsigned char *grown = realloc(worker->request_buf, needed);
+	if(!grown)
+	{
+	    FATAL_ERR_MSG;
+	    return e_failure;
+	}
+	worker->request_buf = grown;
+	worker->request_buf_size = needed;
+    }
+
+    char *image_path = (char *)worker->request_buf;
+    char *secret_path = image_path + request->image_path_len + 1;
+    char *output_path = secret_path + request->secret_path_len + 1;
+    unsigned char *inline_data = (unsigned char *)output_path + request->output_path_len + 1;
+    if(read_full(fd, image_path, request->image_path_len) == e_failure ||
+	    read_full(fd, secret_path, request->secret_path_len) == e_failure ||
+	    read_full(fd, output_path, request->output_path_len) == e_failure ||
+	    read_full(fd, inline_data, request->inline_data_len) == e_failure)
+	return e_failure;
+    image_path[request->image_path_len] = '\0';
+    secret_path[request->secret_path_len] = '\0';
+    output_path[request->output_path_len] = '\0';
+
+    // Paths the daemon opens must be absolute: its standard streams and
+    // working directory are not the client's.
+    int encode = request->operation == e_encode;
+    int file_output = encode? !(request->flags & REQ_FLAG_FD_OUTPUT): !(request->flags & (REQ_FLAG_INLINE_OUTPUT | REQ_FLAG_FD_OUTPUT));
+    if(check_request_path(image_path, !(request->flags & REQ_FLAG_FD_IMAGE), 0) == e_failure ||
+	    check_request_path(secret_path, encode && !(request->flags & (REQ_FLAG_FD_SECRET | REQ_FLAG_INLINE_SECRET)), 0) == e_failure ||
+	    check_request_path(output_path, file_output, 1) == e_failure)
+	return e_failure;
+    if(request->fec_parity && fec_check_parity(request->fec_parity) == e_failure)
+	return e_failure;
+
+    char *data = NULL;
+    size_t data_len = 0;
+    int output_fd = -1;
+    Status status = e_failure;
+    worker->reply_name[0] = '\0';
+    if(request->operation == e_encode)
+	status = serve_encode(worker, request, image_path, secret_path, output_path, inline_data, fds, &output_fd);
+    else if(request->operation == e_decode)
+	status = serve_decode(worker, request, image_path, output_path, fds, &data, &data_len, &output_fd);
+    else
+	fprintf(stderr, "Unsupported operation %u requested.\n", request->operation);
+
+    ReplyHeader reply;
+    memset(&reply, 0, sizeof(reply));
+    reply.magic = STEG_PROTOCOL_MAGIC;
+    reply.status = status;
+    reply.name_len = status == e_success? strlen(worker->reply_name): 0;
+    reply.data_len = status == e_success? data_len: 0;
+
+    int reply_fd_count = status == e_success && output_fd >= 0;
+    Status reply_status = send_with_fds(fd, &reply, sizeof(reply), &output_fd, reply_fd_count);
+    if(reply_status == e_success)
+	reply_status = write_full(fd, worker->reply_name, reply.name_len);
+    if(reply_status == e_success)
+	reply_status = write_full(fd, data, reply.data_len);
+    free(data);
+    if(output_fd >= 0)
+	close(output_fd);
+    arena_reset(&worker->arena);
+    return reply_status;
+}
+
+/*
+ * Function to check the credentials of a client, taken with SO_PEERCRED
+ * when it connected. The user running the daemon and root are always
+ * served; the daemon's group and other users only when the socket mode
+ * grants them access, so that the check matches the permissions even if
+ * the socket was reached through a path they do not apply to.
+ */
+static int peer_allowed(int fd, uint socket_mode)
+{
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    if(getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0)
+    {
+	perror("getsockopt");
+	return 0;
+    }
+
+    if(cred.uid == geteuid() || cred.uid == 0 || (socket_mode & 0007) || ((socket_mode & 0070) && cred.gid == getegid()))
+	return 1;
+    fprintf(stderr, "Connection from uid %u refused.\n", (uint)cred.uid);
+    return 0;
+}
+
+/*
+ * Function run by each worker thread of the daemon.
+ *
+ * All workers block in accept() on the shared listening socket and serve
+ * the requests of a connection one after the other until the client closes
+ * it or stays idle for SERVER_IDLE_TIMEOUT_SEC. Connections from users the
+ * socket mode does not let in are closed at once. The loop ends when the
+ * listening socket is shut down.
+ */
+static void *worker_main(void *arg)
+{
+    ServerWorker *worker = arg;
+    while(1)
+    {
+	int fd = accept(worker->listen_fd, NULL, NULL);
+	if(fd < 0)
+	{
+	    if(errno == EINTR || errno == ECONNABORTED)
+		continue;
+	    break;
+	}
+	if(!peer_allowed(fd, worker->socket_mode))
+	{
+	    close(fd);
+	    continue;
+	}
+
+	struct timeval idle_timeout = { SERVER_IDLE_TIMEOUT_SEC, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &idle_timeout, sizeof(idle_timeout));
+
+	RequestHeader request;
+	int fds[MAX_PASSED_FDS];
+	int fd_count;
+	while(recv_with_fds(fd, &request, sizeof(request), fds, MAX_PASSED_FDS, &fd_count) == e_success)
+	{
+	    Status status = serve_request(worker, fd, &request, fds, fd_count);
+	    for(int i = 0; i < fd_count; ++i)
+		close(fds[i]);
+	    if(status == e_failure)
+		break;
+	}
+	close(fd);
+    }
+    return NULL;
+}
+
+/*
+ * Function to run the tool as a long-running daemon.
+ *
+ * This function listens on the Unix domain socket path given after the
+ * --serve argument and starts a pool of worker threads (--workers, default
+ * DEFAULT_SERVER_WORKERS) that serve encode and decode requests with the
+ * protocol described in server.h. With --cache-dir, the decode requests
+ * share a decoded payload cache. The per-job progress messages are sent
+ * to /dev/null; errors still go to stderr. The daemon runs until it gets
+ * SIGINT or SIGTERM, then waits for the workers and removes the socket.
+ *
+ * The socket gets the permission bits of --socket-mode, DEFAULT_SOCKET_MODE
+ * by default, from the moment it is created, and each client is checked
+ * against them by its credentials. A socket left behind at the path by an
+ * earlier daemon is replaced; any other file there is left alone.
+ *
+ * INPUTS: Argument vector from the main() function.
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status run_server(char *argv[])
+{
+    if(!argv)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    StegOptions options;
+    if(read_steg_options(argv, &options) == e_failure)
+	return e_failure;
+
+    if(!argv[2])
+    {
+	fprintf(stderr, "Error: Please input a socket path:\n%s %s <socket_path> [%s <count>]\n", argv[0], SERVE_ARG, WORKERS_ARG);
+	return e_failure;
+    }
+
+    const char *socket_path = argv[2];
+    struct sockaddr_un addr;
+    if(make_socket_address(socket_path, &addr) == e_failure)
+	return e_failure;
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(listen_fd < 0)
+    {
+	perror("socket");
+	return e_failure;
+    }
+
+    struct stat st;
+    if(lstat(socket_path, &st) == 0)
+    {
+	if(!S_ISSOCK(st.st_mode))
+	{
+	    fprintf(stderr, "Error: %s exists and is not a socket.\n", socket_path);
+	    close(listen_fd);
+	    return e_failure;
+	}
+	unlink(socket_path);
+    }
+
+    // The socket is created with no access for anyone else, then opened up
+    // to the mode asked for.
+    uint socket_mode = options.socket_mode? options.socket_mode: DEFAULT_SOCKET_MODE;
+    mode_t old_umask = umask(0177);
+    int bound = bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(old_umask);
+    if(bound < 0 || chmod(socket_path, socket_mode) < 0 || listen(listen_fd, SOMAXCONN) < 0)
+    {
+	perror("bind/listen");
+	if(bound == 0)
+	    unlink(socket_path);
+	close(listen_fd);
+	return e_failure;
+    }
+
+    // Only the main thread takes the stop signals, through sigwait().
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    uint worker_count = options.workers? options.workers: DEFAULT_SERVER_WORKERS;
+    ServerWorker *workers = calloc(worker_count, sizeof(ServerWorker));
+    if(!workers)
+    {
+	FATAL_ERR_MSG;
+	close(listen_fd);
+	unlink(socket_path);
+	return e_failure;
+    }
+
+    if(!freopen("/dev/null", "w", stdout))
+	fprintf(stderr, "Could not silence job progress messages.\n");
+
+    uint started = 0;
+    for(; started < worker_count; ++started)
+    {
+	workers[started].listen_fd = listen_fd;
+	workers[started].options = &options;
+	workers[started].socket_mode = socket_mode;
+	arena_init(&workers[started].arena);
+	if(pthread_create(&workers[started].thread, NULL, worker_main, &workers[started]))
+	{
+	    fprintf(stderr, "Could not start worker %u.\n", started);
+	    break;
+	}
+    }
+
+    Status status = e_failure;
+    if(started == worker_count)
+    {
+	fprintf(stderr, "Serving on %s with %u workers.\n", socket_path, worker_count);
+	int signal_number;
+	sigwait(&stop_signals, &signal_number);
+	status = e_success;
+    }
+
+    // Shutting the listening socket down wakes up the workers in accept().
+    shutdown(listen_fd, SHUT_RDWR);
+    for(uint i = 0; i < started; ++i)
+    {
+	pthread_join(workers[i].thread, NULL);
+	free(workers[i].request_buf);
+	arena_free(&workers[i].arena);
+    }
+    free(workers);
+    close(listen_fd);
+    unlink(socket_path);
+    return status;
+}
+
+/*
+ * Function to turn a path into an absolute one for the daemon, whose
+ * working directory differs from the client's. Existing files are
+ * resolved fully; other paths are prefixed with the working directory.
+ */
+static Status make_absolute_path(const char *path, char *absolute)
+{
+    if(realpath(path, absolute))
+	return e_success;
+
+    if(path[0] == '/')
+    {
+	snprintf(absolute, PATH_MAX, "%s", path);
+	return e_success;
+    }
+
+    char cwd[PATH_MAX];
+    if(!getcwd(cwd, sizeof(cwd)) || strlen(cwd) + strlen(path) + 2 > PATH_MAX)
+    {
+	fprintf(stderr, "Cannot resolve path %s\n", path);
+	return e_failure;
+    }
+    strcpy(absolute, cwd);
+    strcat(absolute, "/");
+    strcat(absolute, path);
+    return e_success;
+}
+
+/*
+ * Function to read a whole file into a newly allocated buffer.
+ */
+static Status read_whole_file(const char *fname, unsigned char **data, size_t *len)
+{
+    FILE *fptr = fopen(fname, "rb");
+    if(!fptr)
+    {
+	perror("fopen");
+	fprintf(stderr, "ERROR: Unable to open file %s\n", fname);
+	return e_failure;
+    }
+
+    fseek(fptr, 0, SEEK_END);
+    long size = ftell(fptr);
+    rewind(fptr);
+    *data = size > 0? malloc(size): NULL;
+    if(!*data || fread(*data, size, 1, fptr) != 1)
+    {
+	FILE_READ_ERR;
+	free(*data);
+	fclose(fptr);
+	return e_failure;
+    }
+    *len = size;
+    fclose(fptr);
+    return e_success;
+}
+
+/*
+ * Function to send one request to a daemon and wait for its reply.
+ *
+ * The path lengths of the request are filled in from the strings given.
+ * The descriptors in fds are passed with the request header. On success
+ * the reply header and name are filled in, the reply data (if any) is
+ * returned in a newly allocated buffer, and a memfd passed back with the
+ * reply, if any, is returned through reply_fd (-1 otherwise).
+ *
+ * RETURNS: e_success if a reply was received, whatever its status.
+ */
+static Status exchange_request(const char *socket_path, RequestHeader *request, const char *image_path, const char *secret_path, const char *output_path,
+	const unsigned char *inline_data, const int *fds, int fd_count, ReplyHeader *reply, char *reply_name, unsigned char **reply_data, int *reply_fd)
+{
+    request->magic = STEG_PROTOCOL_MAGIC;
+    request->image_path_len = strlen(image_path);
+    request->secret_path_len = strlen(secret_path);
+    request->output_path_len = strlen(output_path);
+    *reply_data = NULL;
+    *reply_fd = -1;
+
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd < 0 || make_socket_address(socket_path, &addr) == e_failure || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+	perror("connect");
+	if(fd >= 0)
+	    close(fd);
+	return e_failure;
+    }
+
+    int reply_fd_count = 0;
+    Status status = send_with_fds(fd, request, sizeof(*request), fds, fd_count);
+    if(status == e_success)
+	status = write_full(fd, image_path, request->image_path_len);
+    if(status == e_success)
+	status = write_full(fd, secret_path, request->secret_path_len);
+    if(status == e_success)
+	status = write_full(fd, output_path, request->output_path_len);
+    if(status == e_success)
+	status = write_full(fd, inline_data, request->inline_data_len);
+    if(status == e_success)
+	status = recv_with_fds(fd, reply, sizeof(*reply), reply_fd, 1, &reply_fd_count);
+    if(status == e_failure || reply->magic != STEG_PROTOCOL_MAGIC || reply->name_len >= PATH_MAX)
+    {
+	fprintf(stderr, "No valid reply from the daemon.\n");
+	status = e_failure;
+    }
+
+    if(status == e_success && reply->data_len)
+    {
+	*reply_data = malloc(reply->data_len);
+	if(!*reply_data)
+	    status = e_failure;
+    }
+    if(status == e_success && (read_full(fd, reply_name, reply->name_len) == e_failure ||
+		read_full(fd, *reply_data, reply->data_len) == e_failure))
+    {
+	fprintf(stderr, "Truncated reply from the daemon.\n");
+	status = e_failure;
+    }
+    close(fd);
+
+    if(status == e_failure)
+    {
+	free(*reply_data);
+	*reply_data = NULL;
+	if(reply_fd_count)
+	    close(*reply_fd);
+	*reply_fd = -1;
+	return e_failure;
+    }
+    reply_name[reply->name_len] = '\0';
+    if(!reply_fd_count)
+	*reply_fd = -1;
+    return e_success;
+}
+
+/*
+ * Function to set the request flags and fields for the job options.
+ *
+ * The daemon applies its own key, cache and limits, so an option the
+ * request can not carry is refused rather than silently dropped.
+ */
+static Status set_request_options(RequestHeader *request, const StegOptions *options)
+{
+    const char *unsupported = NULL;
+    if(options->cover_pool)
+	unsupported = COVER_POOL_ARG;
+    else if(options->direct_io)
+	unsupported = DIRECT_IO_ARG;
+    else if(options->key_file)
+	unsupported = KEY_FILE_ARG;
+    else if(options->metrics)
+	unsupported = METRICS_ARG;
+    else if(options->cache_dir)
+	unsupported = CACHE_DIR_ARG;
+    else if(options->cache_size_mb)
+	unsupported = CACHE_SIZE_ARG;
+    else if(options->journal_file)
+	unsupported = JOURNAL_ARG;
+    else if(options->workers)
+	unsupported = WORKERS_ARG;
+    else if(options->max_read_mbps)
+	unsupported = MAX_READ_MBPS_ARG;
+    else if(options->max_write_mbps)
+	unsupported = MAX_WRITE_MBPS_ARG;
+    else if(options->idle_io)
+	unsupported = IDLE_IO_ARG;
+    else if(options->progress_ms)
+	unsupported = PROGRESS_ARG;
+    else if(options->socket_mode)
+	unsupported = SOCKET_MODE_ARG;
+    if(unsupported)
+    {
+	fprintf(stderr, "Error: %s can not be sent to the daemon.\n", unsupported);
+	return e_failure;
+    }
+
+    if(options->skip_alpha)
+	request->flags |= REQ_FLAG_SKIP_ALPHA;
+    if(options->encrypt)
+	request->flags |= REQ_FLAG_ENCRYPT;
+    if(options->verify)
+	request->flags |= REQ_FLAG_VERIFY;
+    request->fec_parity = options->fec_parity;
+    return e_success;
+}
+
+/*
+ * Function to encode through a daemon without touching the file system.
+ *
+ * The image and secret are passed as descriptors (memfds, typically) which
+ * the daemon maps, and the stego image comes back as a memfd holding the
+ * whole image. The secret name only supplies the file extension that is
+ * encoded along with the secret.
+ *
+ * INPUTS: The daemon socket path, the image and secret descriptors, the
+ * secret name, the job options and where to return the stego memfd.
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status daemon_encode_fds(const char *socket_path, int image_fd, int secret_fd, const char *secret_name, const StegOptions *options, int *stego_fd)
+{
+    if(!socket_path || !secret_name || !options || !stego_fd)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    RequestHeader request;
+    memset(&request, 0, sizeof(request));
+    request.operation = e_encode;
+    request.flags = REQ_FLAG_FD_IMAGE | REQ_FLAG_FD_SECRET | REQ_FLAG_FD_OUTPUT;
+    if(set_request_options(&request, options) == e_failure)
+	return e_failure;
+
+    int fds[MAX_PASSED_FDS] = { image_fd, secret_fd };
+    ReplyHeader reply;
+    char reply_name[PATH_MAX];
+    unsigned char *reply_data;
+    if(exchange_request(socket_path, &request, "", secret_name, "", NULL, fds, MAX_PASSED_FDS, &reply, reply_name, &reply_data, stego_fd) == e_failure)
+	return e_failure;
+    free(reply_data);
+
+    if(reply.status != e_success || *stego_fd < 0)
+    {
+	if(*stego_fd >= 0)
+	    close(*stego_fd);
+	*stego_fd = -1;
+	return e_failure;
+    }
+    return e_success;
+}
+
+/*
+ * Function to decode through a daemon without touching the file system.
+ *
+ * The image is passed as a descriptor which the daemon maps, and the
+ * decoded data comes back as a memfd. The default output name, which
+ * carries the encoded file extension, is copied into secret_name.
+ *
+ * INPUTS: The daemon socket path, the image descriptor, the job options,
+ * where to return the data memfd and a buffer for the name.
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status daemon_decode_fd(const char *socket_path, int image_fd, const StegOptions *options, int *secret_fd, char *secret_name, size_t name_size)
+{
+    if(!socket_path || !options || !secret_fd || !secret_name)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    RequestHeader request;
+    memset(&request, 0, sizeof(request));
+    request.operation = e_decode;
+    request.flags = REQ_FLAG_FD_IMAGE | REQ_FLAG_FD_OUTPUT;
+    if(set_request_options(&request, options) == e_failure)
+	return e_failure;
+
+    ReplyHeader reply;
+    char reply_name[PATH_MAX];
+    unsigned char *reply_data;
+    if(exchange_request(socket_path, &request, "", "", "", NULL, &image_fd, 1, &reply, reply_name, &reply_data, secret_fd) == e_failure)
+	return e_failure;
+    free(reply_data);
+
+    if(reply.status != e_success || *secret_fd < 0)
+    {
+	if(*secret_fd >= 0)
+	    close(*secret_fd);
+	*secret_fd = -1;
+	return e_failure;
+    }
+    snprintf(secret_name, name_size, "%s", reply_name);
+    return e_success;
+}
+
+/*
+ * Function to write the whole content of a descriptor into a file.
+ */
+static Status save_fd_to_file(int fd, const char *fname)
+{
+    FILE *fptr = fopen(fname, "wb");
+    if(!fptr)
+    {
+	perror("fopen");
+	fprintf(stderr, "ERROR: Unable to open file %s\n", fname);
+	return e_failure;
+    }
+
+    unsigned char buffer[64 * 1024];
+    ssize_t got;
+    Status status = e_success;
+    lseek(fd, 0, SEEK_SET);
+    while((got = read(fd, buffer, sizeof(buffer))) > 0)
+	if(fwrite(buffer, got, 1, fptr) != 1)
+	    break;
+    if(got != 0 || ferror(fptr))
+    {
+	FILE_WRITE_ERR;
+	status = e_failure;
+    }
+    fclose(fptr);
+    return status;
+}
+
+/*
+ * Function to run a client job with --memfd: the input files are opened
+ * here and passed to the daemon as descriptors, and the output memfd it
+ * returns is saved to the output file.
+ */
+static Status run_fd_client(const char *socket_path, OperationType operation, char **job_argv)
+{
+    Status status = e_failure;
+    int result_fd = -1;
+    char result_name[PATH_MAX];
+    const char *output_name = NULL;
+
+    if(operation == e_encode)
+    {
+	EncodeInfo encInfo;
+	if(read_and_validate_encode_args(job_argv, &encInfo) == e_failure)
+	    return e_failure;
+
+	int image_fd = open(encInfo.src_image_fname, O_RDONLY | O_CLOEXEC);
+	int secret_fd = open(encInfo.secret_fname, O_RDONLY | O_CLOEXEC);
+	if(image_fd < 0 || secret_fd < 0)
+	    perror("open");
+	else
+	    status = daemon_encode_fds(socket_path, image_fd, secret_fd, encInfo.secret_fname, &encInfo.options, &result_fd);
+	snprintf(result_name, sizeof(result_name), "%s", encInfo.stego_image_fname);
+	output_name = result_name;
+	free(encInfo.stego_image_fname);
+	free(encInfo.pool_cover_fname);
+	if(image_fd >= 0)
+	    close(image_fd);
+	if(secret_fd >= 0)
+	    close(secret_fd);
+    }
+    else
+    {
+	DecodeInfo decInfo;
+	if(read_and_validate_decode_args(job_argv, &decInfo) == e_failure)
+	    return e_failure;
+
+	int image_fd = open(decInfo.stego_image_fname, O_RDONLY | O_CLOEXEC);
+	if(image_fd < 0)
+	    perror("open");
+	else
+	    status = daemon_decode_fd(socket_path, image_fd, &decInfo.options, &result_fd, result_name, sizeof(result_name));
+	output_name = job_argv[3]? job_argv[3]: result_name;
+	if(image_fd >= 0)
+	    close(image_fd);
+    }
+
+    if(status == e_success)
+    {
+	status = save_fd_to_file(result_fd, output_name);
+	close(result_fd);
+	if(status == e_success)
+	    printf("Output file: %s\n", output_name);
+    }
+    return status;
+}
+
+/*
+ * Function to send an encode or decode request to a running daemon.
+ *
+ * The arguments after the socket path are the usual encode/decode ones:
+ *	--client <socket_path> -e <image.bmp> <secret_file> [output.bmp] [options]
+ *	--client <socket_path> -d <stegged.bmp> [output_file] [options]
+ *
+ * Paths are sent as absolute paths. With --inline the secret is sent in the
+ * request instead of being read by the daemon, and decoded data comes back
+ * in the reply and is written by the client. With --memfd the files are
+ * passed as descriptors and the output comes back as a memfd.
+ *
+ * INPUTS: Argument vector from the main() function.
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status run_client(char *argv[])
+{
+    if(!argv)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    if(!argv[2] || !argv[3])
+    {
+	fprintf(stderr, "Error: Please input a socket path and a job:\n%s %s <socket_path> <%s/%s> ...\n", argv[0], CLIENT_ARG, ENCODE_ARG, DECODE_ARG);
+	return e_failure;
+    }
+
+    // The job arguments are parsed as if argv started at the socket path.
+    char **job_argv = argv + 2;
+    const char *socket_path = argv[2];
+    OperationType operation = check_operation_type(job_argv);
+    if(operation != e_encode && operation != e_decode)
+    {
+	fprintf(stderr, "Error. Please input the encode/decode argument after the socket path.\n");
+	return e_failure;
+    }
+
+    for(int i = 3; job_argv[i]; ++i)
+	if(!strcmp(job_argv[i], MEMFD_ARG))
+	    return run_fd_client(socket_path, operation, job_argv);
+
+    char image_path[PATH_MAX] = "", secret_path[PATH_MAX] = "", output_path[PATH_MAX] = "";
+    unsigned char *inline_data = NULL;
+    size_t inline_len = 0;
+    const char *local_output = NULL;
+
+    RequestHeader request;
+    memset(&request, 0, sizeof(request));
+    request.operation = operation;
+
+    StegOptions options;
+    if(operation == e_encode)
+    {
+	EncodeInfo encInfo;
+	if(read_and_validate_encode_args(job_argv, &encInfo) == e_failure)
+	    return e_failure;
+	options = encInfo.options;
+
+	Status path_status = make_absolute_path(encInfo.src_image_fname, image_path);
+	if(path_status == e_success)
+	    path_status = make_absolute_path(encInfo.stego_image_fname, output_path);
+	if(path_status == e_success && options.inline_data)
+	{
+	    snprintf(secret_path, sizeof(secret_path), "%s", encInfo.secret_fname);
+	    path_status = read_whole_file(encInfo.secret_fname, &inline_data, &inline_len);
+	    request.flags |= REQ_FLAG_INLINE_SECRET;
+	}
+	else if(path_status == e_success)
+	    path_status = make_absolute_path(encInfo.secret_fname, secret_path);
+	free(encInfo.stego_image_fname);
+	free(encInfo.pool_cover_fname);
+	if(path_status == e_failure)
+	    return e_failure;
+    }
+    else
+    {
+	DecodeInfo decInfo;
+	if(read_and_validate_decode_args(job_argv, &decInfo) == e_failure)
+	    return e_failure;
+	options = decInfo.options;
+
+	if(make_absolute_path(decInfo.stego_image_fname, image_path) == e_failure)
+	    return e_failure;
+	if(options.inline_data)
+	{
+	    request.flags |= REQ_FLAG_INLINE_OUTPUT;
+	    local_output = job_argv[3];
+	}
+	else if(job_argv[3] && make_absolute_path(job_argv[3], output_path) == e_failure)
+	    return e_failure;
+    }
+
+    if(set_request_options(&request, &options) == e_failure)
+    {
+	free(inline_data);
+	return e_failure;
+    }
+    request.inline_data_len = inline_len;
+
+    ReplyHeader reply;
+    char reply_name[PATH_MAX];
+    unsigned char *reply_data;
+    int reply_fd;
+    Status status = exchange_request(socket_path, &request, image_path, secret_path, output_path, inline_data, NULL, 0, &reply, reply_name, &reply_data, &reply_fd);
+    free(inline_data);
+    if(reply_fd >= 0)
+	close(reply_fd);
+    if(status == e_failure || reply.status != e_success)
+    {
+	free(reply_data);
+	return e_failure;
+    }
+
+    if(request.flags & REQ_FLAG_INLINE_OUTPUT)
+    {
+	const char *fname = local_output? local_output: reply_name;
+	FILE *fptr = fopen(fname, "wb");
+	if(!fptr || (reply.data_len && fwrite(reply_data, reply.data_len, 1, fptr) != 1))
+	{
+	    FILE_WRITE_ERR;
+	    if(fptr)
+		fclose(fptr);
+	    free(reply_data);
+	    return e_failure;
+	}
+	fclose(fptr);
+	printf("Output file: %s\n", fname);
+    }
+    else
+	printf("Output file: %s\n", reply_name);
+    free(reply_data);
+    return e_success;
+}
@@ -0,0 +1,128 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "types.h" 	// Contains user defined types
+#include "common.h"	// Contains common strings
+#include "error.h"	// Contains standard error messages
+
+/* Marks every request and reply of the daemon protocol: "STG1" */
+#define STEG_PROTOCOL_MAGIC 0x31475453
+
+/* Worker threads started by the daemon unless --workers says otherwise */
+#define DEFAULT_SERVER_WORKERS 4
+
+/* Permission bits of the daemon socket unless --socket-mode says otherwise */
+#define DEFAULT_SOCKET_MODE 0600
+
+/* Limits on the variable length parts of a request */
+#define MAX_REQUEST_PATH_SIZE 4096
+#define MAX_REQUEST_INLINE_SIZE (64u * 1024 * 1024)
+
+/* Request flags */
+#define REQ_FLAG_SKIP_ALPHA	0x01	// Same as --skip-alpha
+#define REQ_FLAG_INLINE_SECRET	0x02	// Secret data follows the paths
+#define REQ_FLAG_INLINE_OUTPUT	0x04	// Return the decoded data in the reply
+#define REQ_FLAG_FD_IMAGE	0x08	// Image passed as a descriptor
+#define REQ_FLAG_FD_SECRET	0x10	// Secret passed as a descriptor
+#define REQ_FLAG_FD_OUTPUT	0x20	// Return the output as a memfd
+#define REQ_FLAG_ENCRYPT	0x40	// Same as --encrypt, with the daemon's key
+#define REQ_FLAG_VERIFY		0x80	// Same as --verify
+
+/* Most descriptors a request can pass: the image and the secret */
+#define MAX_PASSED_FDS 2
+
+/*
+ * Fixed size header of a request sent to the daemon. It is followed by
+ * the image path, the secret path and the output path (each without a
+ * terminator, any of them may be empty) and inline_data_len bytes of
+ * secret data. For an inline secret the secret path only supplies the
+ * file extension. All fields are in host byte order.
+ *
+ * Instead of paths, the image and secret may be passed as descriptors
+ * (memfds, typically) with SCM_RIGHTS along with the header, in that
+ * order. The daemon maps them and never touches the file system; the
+ * path fields then only supply names, like for inline secrets.
+ *
+ * Only the options that have a flag or field here travel with a request;
+ * the key, the cache and the rest are the daemon's own.
+ */
+typedef struct _RequestHeader
+{
+    uint32_t magic;
+    uint8_t operation;		// e_encode or e_decode
+    uint8_t flags;		// REQ_FLAG_* bits
+    uint8_t fec_parity;		// Same as --fec, 0 for none
+    uint8_t reserved;
+    uint32_t image_path_len;
+    uint32_t secret_path_len;
+    uint32_t output_path_len;
+    uint32_t inline_data_len;
+
+} RequestHeader;
+
+/*
+ * Fixed size header of a reply from the daemon. It is followed by the
+ * output file name and, for REQ_FLAG_INLINE_OUTPUT requests, the decoded
+ * data. For REQ_FLAG_FD_OUTPUT requests the output memfd is passed with
+ * SCM_RIGHTS along with the header.
+ */
+typedef struct _ReplyHeader
+{
+    uint32_t magic;
+    uint8_t status;		// e_success or e_failure
+    uint8_t reserved[3];
+    uint32_t name_len;
+    uint32_t data_len;
+
+} ReplyHeader;
+
+/* A read-only or writable mapping of a passed descriptor */
+typedef struct _MappedFile
+{
+    void *data;
+    size_t size;
+
+} MappedFile;
+
+/*
+ * Structure to store the state of one daemon worker thread. The request
+ * buffer is kept and grown across requests, and the scratch memory of the
+ * jobs comes from an arena reset after each request, so that steady state
+ * requests do not allocate either again.
+ */
+typedef struct _ServerWorker
+{
+    pthread_t thread;
+    int listen_fd;
+    const StegOptions *options;	// Daemon options, for the key and the decode cache
+    uint socket_mode;		// Permission bits of the socket, for the peer check
+    unsigned char *request_buf;
+    size_t request_buf_size;
+    Arena arena;		// Scratch memory of the current request
+    char reply_name[MAX_REQUEST_PATH_SIZE];
+
+} ServerWorker;
+
+/* Daemon and client function prototypes */
+
+/* Run the daemon on the socket path given in argv */
+Status run_server(char *argv[]);
+
+/* Send the encode/decode request given in argv to a daemon */
+Status run_client(char *argv[]);
+
+/* Encode through a daemon, passing the image and secret as descriptors */
+Status daemon_encode_fds(const char *socket_path, int image_fd, int secret_fd, const char *secret_name, const StegOptions *options, int *stego_fd);
+
+/* Decode through a daemon, passing the image as a descriptor */
+Status daemon_decode_fd(const char *socket_path, int image_fd, const StegOptions *options, int *secret_fd, char *secret_name, size_t name_size);
+
+/* Read exactly len bytes from a socket */
+Status read_full(int fd, void *buf, size_t len);
+
+/* Write exactly len bytes to a socket */
+Status write_full(int fd, const void *buf, size_t len);
+
+#endif
@@ -0,0 +1,622 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "span.h"
+#include "broadcast.h"
+#include "encode.h"
+#include "decode.h"
+#include "lsb.h"
+#include "directio.h"
+#include "chacha20.h"
+#include "crc32c.h"
+#include "types.h"
+#include "error.h"
+
+/* Function Definitions */
+
+/*
+ * Function to store a little endian value of len bytes.
+ */
+static void store_le(unsigned char *buf, uint64_t value, uint len)
+{
+    for(uint i = 0; i < len; ++i)
+	buf[i] = value >> (8 * i);
+}
+
+/*
+ * Function to load a little endian value of len bytes.
+ */
+static uint64_t load_le(const unsigned char *buf, uint len)
+{
+    uint64_t value = 0;
+    for(uint i = 0; i < len; ++i)
+	value |= (uint64_t)buf[i] << (8 * i);
+    return value;
+}
+
+/*
+ * Function to check the span arguments input by the user.
+ *
+ * Spanning needs the secret file, an existing output directory and at
+ * least one cover image, in that order:
+ *	--span <secret_file> <output_dir> <cover.bmp> [cover.bmp ...]
+ *
+ * Optional "--" arguments may appear anywhere after the operation argument.
+ *
+ * INPUTS: Argument vector from the main() function and the SpanInfo
+ * variable pointer.
+ *
+ * RETURNS: The check status enum: e_success or e_failure.
+ */
+Status read_and_validate_span_args(char *argv[], SpanInfo *spInfo)
+{
+    if(!argv || !spInfo)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    memset(spInfo, 0, sizeof(*spInfo));
+    if(read_steg_options(argv, &spInfo->options) == e_failure)
+	return e_failure;
+
+    if(!argv[2] || !argv[3] || !argv[4])
+    {
+	fprintf(stderr, "Error: Please input a secret file, an output directory and the cover images:\n%s %s <secret_file> <output_dir> <image%s> [image%s ...]\n", argv[0], SPAN_ARG, IMG_FILE_EXTN, IMG_FILE_EXTN);
+	return e_failure;
+    }
+
+    spInfo->secret_fname = argv[2];
+    spInfo->output_dir = argv[3];
+    uint count = 0;
+    for(char **name = argv + 4; *name; ++name, ++count)
+    {
+	if(!strstr(*name, IMG_FILE_EXTN))
+	{
+	    fprintf(stderr, "Error: %s is not a %s file.\n", *name, IMG_FILE_EXTN);
+	    return e_failure;
+	}
+    }
+    if(count > MAX_SPAN_SHARDS)
+    {
+	fprintf(stderr, "Error: At most %d covers can be spanned.\n", MAX_SPAN_SHARDS);
+	return e_failure;
+    }
+
+    spInfo->shards = calloc(count, sizeof(SpanShard));
+    if(!spInfo->shards)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+    for(uint i = 0; i < count; ++i)
+	spInfo->shards[i].image_fname = argv[4 + i];
+    spInfo->shard_count = count;
+    return e_success;
+}
+
+/*
+ * Function to check the join arguments input by the user.
+ *
+ * Joining needs the output file and the stego images of the set, which
+ * may be given in any order:
+ *	--join <output_file> <stego.bmp> [stego.bmp ...]
+ *
+ * INPUTS: Argument vector from the main() function and the SpanInfo
+ * variable pointer.
+ *
+ * RETURNS: The check status enum: e_success or e_failure.
+ */
+Status read_and_validate_join_args(char *argv[], SpanInfo *spInfo)
+{
+    if(!argv || !spInfo)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    memset(spInfo, 0, sizeof(*spInfo));
+    if(read_steg_options(argv, &spInfo->options) == e_failure)
+	return e_failure;
+
+    if(!argv[2] || !argv[3])
+    {
+	fprintf(stderr, "Error: Please input an output file and the stego images:\n%s %s <output_file> <image%s> [image%s ...]\n", argv[0], JOIN_ARG, IMG_FILE_EXTN, IMG_FILE_EXTN);
+	return e_failure;
+    }
+
+    spInfo->output_fname = argv[2];
+    uint count = 0;
+    for(char **name = argv + 3; *name; ++name, ++count)
+    {
+	if(!strstr(*name, IMG_FILE_EXTN) && !is_stdio_file_name(*name))
+	{
+	    fprintf(stderr, "Error: %s is not a %s file.\n", *name, IMG_FILE_EXTN);
+	    return e_failure;
+	}
+    }
+    if(count > MAX_SPAN_SHARDS)
+    {
+	fprintf(stderr, "Error: At most %d images can be joined.\n", MAX_SPAN_SHARDS);
+	return e_failure;
+    }
+
+    spInfo->shards = calloc(count, sizeof(SpanShard));
+    if(!spInfo->shards)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+    for(uint i = 0; i < count; ++i)
+	spInfo->shards[i].image_fname = argv[3 + i];
+    spInfo->shard_count = count;
+    return e_success;
+}
+
+/*
+ * Function to find how many shard bytes a cover can carry: the largest
+ * shard whose encoded message, sequence header included, fits within the
+ * carrier capacity of the cover with the given options.
+ */
+static Status get_shard_capacity(const char *cover_fname, const StegOptions *options, uint *shard_capacity)
+{
+    FILE *fptr_cover = fopen(cover_fname, "rb");
+    if(!fptr_cover)
+    {
+	perror("fopen");
+	fprintf(stderr, "ERROR: Unable to open file %s\n", cover_fname);
+	return e_failure;
+    }
+
+    BmpImage bmp_image;
+    Status status = read_bmp_image_info(fptr_cover, &bmp_image);
+    fclose(fptr_cover);
+    if(status == e_failure || lsb_check_image_support(&bmp_image, options->skip_alpha) == e_failure)
+    {
+	fprintf(stderr, "%s: unsupported image.\n", cover_fname);
+	return e_failure;
+    }
+
+    // The message size grows with the shard size, so the largest shard
+    // that fits is found with a binary search.
+    uint capacity = lsb_image_capacity(&bmp_image, options->skip_alpha);
+    uint low = 0, high = capacity;
+    while(low < high)
+    {
+	uint mid = low + (high - low + 1) / 2;
+	size_t size = get_message_size_allowance(SPAN_HEADER_SIZE + mid, options);
+	if(size && size <= capacity)
+	    low = mid;
+	else
+	    high = mid - 1;
+    }
+    *shard_capacity = low;
+    return e_success;
+}
+
+/*
+ * Function to read the whole payload into memory. STDIO_FILE_NAME stands
+ * for the standard input.
+ */
+static Status load_span_payload(SpanInfo *spInfo)
+{
+    void *stream_buf = NULL;
+    FILE *fptr_secret = open_data_stream(spInfo->secret_fname, "rb");
+    if(!fptr_secret || make_stream_seekable(&fptr_secret, &stream_buf) == e_failure)
+    {
+	perror("fopen");
+	fprintf(stderr, "ERROR: Unable to open file %s\n", spInfo->secret_fname);
+	if(fptr_secret)
+	    fclose(fptr_secret);
+	return e_failure;
+    }
+
+    Status status = e_success;
+    spInfo->payload_len = get_file_size(fptr_secret);
+    spInfo->payload = spInfo->payload_len? malloc(spInfo->payload_len): NULL;
+    if(!spInfo->payload_len)
+    {
+	fprintf(stderr, "The data file contains no data to encode.\n");
+	status = e_failure;
+    }
+    else if(!spInfo->payload)
+    {
+	FATAL_ERR_MSG;
+	status = e_failure;
+    }
+    else if(fread(spInfo->payload, spInfo->payload_len, 1, fptr_secret) != 1)
+    {
+	FILE_READ_ERR;
+	status = e_failure;
+    }
+    fclose(fptr_secret);
+    free(stream_buf);
+    return status;
+}
+
+/*
+ * Function to encode one shard into its cover image.
+ *
+ * The sequence header and the shard data are put together and run
+ * through build_encoded_message(), so every shard is a complete message
+ * of its own (encrypted and FEC protected as the options say) that
+ * carries the extension of the payload. The message is expanded into LSB
+ * bits and embedded with embed_message_bits().
+ *
+ * INPUTS: The SpanInfo object, whose payload is loaded, and the shard.
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status span_shard_to_cover(SpanInfo *spInfo, SpanShard *shard)
+{
+    if(!spInfo || !shard || !spInfo->payload)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    uint shard_size = SPAN_HEADER_SIZE + shard->length;
+    unsigned char *shard_data = malloc(shard_size);
+    char *stego_fname = get_broadcast_output_filename(spInfo->output_dir, shard->image_fname, NULL);
+    if(!shard_data || !stego_fname)
+    {
+	FATAL_ERR_MSG;
+	free(shard_data);
+	free(stego_fname);
+	return e_failure;
+    }
+
+    const unsigned char *data = spInfo->payload + shard->offset;
+    memcpy(shard_data, SPAN_MAGIC, 4);
+    store_le(shard_data + 4, spInfo->set_id, 8);
+    store_le(shard_data + 12, shard->index, 2);
+    store_le(shard_data + 14, spInfo->shard_count, 2);
+    store_le(shard_data + 16, spInfo->payload_len, 4);
+    store_le(shard_data + 20, shard->offset, 4);
+    store_le(shard_data + 24, shard->length, 4);
+    store_le(shard_data + 28, crc32c_update(0, data, shard->length), 4);
+    memcpy(shard_data + SPAN_HEADER_SIZE, data, shard->length);
+
+    unsigned char *message = NULL;
+    unsigned char *message_bits = NULL;
+    uint message_len = 0;
+    Status status = e_failure;
+    FILE *fptr_shard = fmemopen(shard_data, shard_size, "rb");
+    if(fptr_shard && build_encoded_message(spInfo->secret_fname, fptr_shard, &spInfo->options, &message, &message_len, NULL) == e_success)
+    {
+	message_bits = malloc((size_t)message_len * 8 + LSB_KERNEL_SLACK);
+	if(message_bits)
+	{
+	    lsb_expand_bits(message, message_len, message_bits);
+	    memset(message_bits + (size_t)message_len * 8, 0, LSB_KERNEL_SLACK);
+	    status = embed_message_bits(&spInfo->options, shard->image_fname, stego_fname, message_bits, message_len, NULL);
+	}
+    }
+    if(fptr_shard)
+	fclose(fptr_shard);
+
+    if(status == e_success)
+	printf("Shard %u of %u (%u bytes): %s\n", shard->index + 1, spInfo->shard_count, shard->length, stego_fname);
+    else
+	fprintf(stderr, "%s: shard %u could not be encoded.\n", shard->image_fname, shard->index + 1);
+    free(message_bits);
+    free(message);
+    free(shard_data);
+    free(stego_fname);
+    return status;
+}
+
+/*
+ * Function to decode one shard from its stego image and check it.
+ *
+ * The image is decoded in memory like a single image, then the sequence
+ * header is read and the shard data is checked against its length and
+ * its CRC-32C. Whether the shard fits with the rest of the set is checked
+ * by do_join() once all of them are in.
+ *
+ * INPUTS: The SpanInfo object and the shard.
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status join_shard_from_image(SpanInfo *spInfo, SpanShard *shard)
+{
+    if(!spInfo || !shard)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    DecodeInfo decInfo;
+    memset(&decInfo, 0, sizeof(decInfo));
+    decInfo.stego_image_fname = (char *)shard->image_fname;
+    decInfo.options = spInfo->options;
+    decInfo.inline_output = 1;
+    Status status = do_decoding(NULL, &decInfo);
+    shard->decoded = (unsigned char *)decInfo.output_data;
+    if(status == e_failure)
+    {
+	fprintf(stderr, "%s: decoding failed.\n", shard->image_fname);
+	return e_failure;
+    }
+
+    const unsigned char *header = shard->decoded;
+    if(decInfo.output_size < SPAN_HEADER_SIZE || memcmp(header, SPAN_MAGIC, 4))
+    {
+	fprintf(stderr, "%s: not part of a spanned set.\n", shard->image_fname);
+	return e_failure;
+    }
+
+    shard->set_id = load_le(header + 4, 8);
+    shard->index = load_le(header + 12, 2);
+    shard->count = load_le(header + 14, 2);
+    shard->total_len = load_le(header + 16, 4);
+    shard->offset = load_le(header + 20, 4);
+    shard->length = load_le(header + 24, 4);
+    uint32_t checksum = load_le(header + 28, 4);
+    if(shard->length != decInfo.output_size - SPAN_HEADER_SIZE || crc32c_update(0, header + SPAN_HEADER_SIZE, shard->length) != checksum)
+    {
+	fprintf(stderr, "%s: shard %u failed its checksum.\n", shard->image_fname, shard->index + 1);
+	return e_failure;
+    }
+    return e_success;
+}
+
+/*
+ * Function run by each span or join worker thread: takes shards off the
+ * shared list until none are left.
+ */
+static void *span_worker_main(void *arg)
+{
+    SpanInfo *spInfo = arg;
+    while(1)
+    {
+	pthread_mutex_lock(&spInfo->lock);
+	uint index = spInfo->next_shard++;
+	pthread_mutex_unlock(&spInfo->lock);
+	if(index >= spInfo->shard_count)
+	    break;
+
+	if(spInfo->shard_job(spInfo, &spInfo->shards[index]) == e_failure)
+	{
+	    pthread_mutex_lock(&spInfo->lock);
+	    ++spInfo->failed_shards;
+	    pthread_mutex_unlock(&spInfo->lock);
+	}
+    }
+    return NULL;
+}
+
+/*
+ * Function to run the shard job over every shard with a pool of worker
+ * threads (--workers, default DEFAULT_SPAN_WORKERS, never more than the
+ * shards).
+ */
+static Status run_span_workers(SpanInfo *spInfo)
+{
+    uint worker_count = spInfo->options.workers? spInfo->options.workers: DEFAULT_SPAN_WORKERS;
+    if(worker_count > spInfo->shard_count)
+	worker_count = spInfo->shard_count;
+    pthread_t *workers = malloc(worker_count * sizeof(pthread_t));
+    pthread_mutex_init(&spInfo->lock, NULL);
+    spInfo->next_shard = 0;
+    spInfo->failed_shards = 0;
+
+    uint started = 0;
+    for(; workers && started < worker_count; ++started)
+	if(pthread_create(&workers[started], NULL, span_worker_main, spInfo))
+	    break;
+    // With no thread at all, the shards are done on this one.
+    if(!started)
+	span_worker_main(spInfo);
+    for(uint i = 0; i < started; ++i)
+	pthread_join(workers[i], NULL);
+
+    pthread_mutex_destroy(&spInfo->lock);
+    free(workers);
+    if(spInfo->failed_shards)
+    {
+	fprintf(stderr, "%u of %u shards failed.\n", spInfo->failed_shards, spInfo->shard_count);
+	return e_failure;
+    }
+    return e_success;
+}
+
+/*
+ * Function to split a payload over several covers and encode them.
+ *
+ * The capacity of every cover is read from its header first, and the
+ * payload is shared out between the covers in proportion to what they
+ * can carry, so that the shards take about the same time to encode. A
+ * cover whose share comes to nothing is left out of the set. Every shard
+ * gets a sequence header with the set id, its index, the shard count and
+ * its checksum, and the shards are encoded in parallel. The stego images
+ * are named as for --broadcast.
+ *
+ * INPUTS: Pointer to SpanInfo object.
+ *
+ * RETURNS: e_success if every shard was encoded, e_failure otherwise.
+ */
+Status do_span(SpanInfo *spInfo)
+{
+    if(!spInfo || !spInfo->shards)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    uint64_t total_capacity = 0;
+    for(uint i = 0; i < spInfo->shard_count; ++i)
+    {
+	SpanShard *shard = &spInfo->shards[i];
+	if(get_shard_capacity(shard->image_fname, &spInfo->options, &shard->capacity) == e_failure)
+	{
+	    cleanup_span(spInfo);
+	    return e_failure;
+	}
+	total_capacity += shard->capacity;
+    }
+
+    unsigned char set_id[8];
+    if(load_span_payload(spInfo) == e_failure || fill_random_bytes(set_id, sizeof(set_id)) == e_failure)
+    {
+	cleanup_span(spInfo);
+	return e_failure;
+    }
+    spInfo->set_id = load_le(set_id, 8);
+    printf("Payload size: %u bytes, covers can carry %llu bytes\n", spInfo->payload_len, (unsigned long long)total_capacity);
+    if(spInfo->payload_len > total_capacity)
+    {
+	fprintf(stderr, "The covers are not large enough to hold the payload.\n");
+	cleanup_span(spInfo);
+	return e_failure;
+    }
+
+    // Shard i ends where the running capacity share of the payload does;
+    // covers with an empty share are dropped from the set.
+    uint64_t running_capacity = 0;
+    uint offset = 0, count = 0;
+    for(uint i = 0; i < spInfo->shard_count; ++i)
+    {
+	running_capacity += spInfo->shards[i].capacity;
+	uint end = spInfo->payload_len * running_capacity / total_capacity;
+	if(end == offset)
+	    continue;
+
+	SpanShard *shard = &spInfo->shards[count];
+	*shard = spInfo->shards[i];
+	shard->index = count++;
+	shard->offset = offset;
+	shard->length = end - offset;
+	offset = end;
+    }
+    spInfo->shard_count = count;
+    printf("Payload split into %u shards.\n", count);
+
+    spInfo->shard_job = span_shard_to_cover;
+    Status status = run_span_workers(spInfo);
+    cleanup_span(spInfo);
+    return status;
+}
+
+/*
+ * Function to decode a set of stego images and reassemble the payload.
+ *
+ * The images may be given in any order. They are decoded and checked in
+ * parallel, then the set is checked as a whole: every shard must have the
+ * same set id, count and payload size, every index must be present once
+ * and the shards must cover the payload without gaps. The payload is
+ * then written out in index order.
+ *
+ * INPUTS: Pointer to SpanInfo object.
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status do_join(SpanInfo *spInfo)
+{
+    if(!spInfo || !spInfo->shards)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    // The output is opened first so that, for the standard output, the
+    // progress messages of the workers go to the standard error.
+    FILE *fptr_output = open_data_stream(spInfo->output_fname, "wb");
+    if(!fptr_output)
+    {
+	perror("fopen");
+	fprintf(stderr, "ERROR: Unable to open file %s\n", spInfo->output_fname);
+	cleanup_span(spInfo);
+	return e_failure;
+    }
+
+    spInfo->shard_job = join_shard_from_image;
+    Status status = run_span_workers(spInfo);
+
+    SpanShard **ordered = status == e_success? calloc(spInfo->shard_count, sizeof(SpanShard *)): NULL;
+    const SpanShard *first = &spInfo->shards[0];
+    if(status == e_success && !ordered)
+    {
+	FATAL_ERR_MSG;
+	status = e_failure;
+    }
+    else if(status == e_success && first->count != spInfo->shard_count)
+    {
+	fprintf(stderr, "The set has %u shards, %u images were given.\n", first->count, spInfo->shard_count);
+	status = e_failure;
+    }
+    for(uint i = 0; status == e_success && i < spInfo->shard_count; ++i)
+    {
+	SpanShard *shard = &spInfo->shards[i];
+	if(shard->set_id != first->set_id || shard->count != first->count || shard->total_len != first->total_len)
+	{
+	    fprintf(stderr, "%s: belongs to another set.\n", shard->image_fname);
+	    status = e_failure;
+	}
+	else if(shard->index >= shard->count || ordered[shard->index])
+	{
+	    fprintf(stderr, "%s: shard %u is given twice.\n", shard->image_fname, shard->index + 1);
+	    status = e_failure;
+	}
+	else
+	    ordered[shard->index] = shard;
+    }
+
+    uint64_t offset = 0;
+    for(uint i = 0; status == e_success && i < spInfo->shard_count; ++i)
+    {
+	if(ordered[i]->offset != offset)
+	{
+	    fprintf(stderr, "Shard %u does not follow on from shard %u.\n", i + 1, i);
+	    status = e_failure;
+	}
+	offset += ordered[i]->length;
+    }
+    if(status == e_success && offset != first->total_len)
+    {
+	fprintf(stderr, "The shards do not add up to the payload size.\n");
+	status = e_failure;
+    }
+
+    for(uint i = 0; status == e_success && i < spInfo->shard_count; ++i)
+    {
+	if(ordered[i]->length && fwrite(ordered[i]->decoded + SPAN_HEADER_SIZE, ordered[i]->length, 1, fptr_output) != 1)
+	{
+	    FILE_WRITE_ERR;
+	    status = e_failure;
+	}
+    }
+    if(fclose(fptr_output))
+	status = e_failure;
+    if(status == e_success)
+	printf("Payload of %u bytes joined from %u shards: %s\n", first->total_len, spInfo->shard_count, spInfo->output_fname);
+    else if(!is_stdio_file_name(spInfo->output_fname))
+	remove(spInfo->output_fname);
+
+    free(ordered);
+    cleanup_span(spInfo);
+    return status;
+}
+
+/*
+ * Function to release the shards and the payload of a span or join job.
+ *
+ * INPUTS: Pointer to SpanInfo object.
+ *
+ * RETURNS: Nothing.
+ */
+void cleanup_span(SpanInfo *spInfo)
+{
+    if(!spInfo)
+    {
+	FATAL_ERR_MSG;
+	return;
+    }
+
+    for(uint i = 0; spInfo->shards && i < spInfo->shard_count; ++i)
+	free(spInfo->shards[i].decoded);
+    free(spInfo->shards);
+    free(spInfo->payload);
+    spInfo->shards = NULL;
+    spInfo->payload = NULL;
+}
@@ -0,0 +1,101 @@
+#ifndef SPAN_H
+#define SPAN_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "types.h" 	// Contains user defined types
+#include "common.h"	// Contains common strings
+#include "error.h"	// Contains standard error messages
+
+/* Worker threads used for spanning and joining unless --workers says otherwise */
+#define DEFAULT_SPAN_WORKERS 4
+
+/* Marks the sequence header at the start of every shard: "STSP" */
+#define SPAN_MAGIC "STSP"
+
+/*
+ * Size of the sequence header embedded in front of every shard. All its
+ * fields are little endian:
+ *	0  magic	SPAN_MAGIC
+ *	4  set id	8 random bytes shared by the shards of one payload
+ *	12 index	16 bit index of the shard in the set
+ *	14 count	16 bit number of shards in the set
+ *	16 total	32 bit size of the whole payload
+ *	20 offset	32 bit offset of the shard in the payload
+ *	24 length	32 bit size of the shard
+ *	28 checksum	CRC-32C of the shard data
+ */
+#define SPAN_HEADER_SIZE 32
+
+/* Most shards a payload can be split into */
+#define MAX_SPAN_SHARDS 65535
+
+/*
+ * Structure to store one shard of a spanned payload and the image that
+ * carries it: a cover when spanning, a stego image when joining.
+ */
+typedef struct _SpanShard
+{
+    const char *image_fname;
+    uint capacity;		// Span: shard bytes the cover can carry
+    uint index;
+    uint count;
+    uint total_len;
+    uint offset;		// Offset of the shard in the payload
+    uint length;		// Bytes of the shard
+    uint64_t set_id;
+    unsigned char *decoded;	// Join: decoded shard, sequence header included
+
+} SpanShard;
+
+/*
+ * Structure to store a span or a join job. The shards are handed out to
+ * the worker threads one at a time through next_shard, and each one is
+ * processed by shard_job.
+ */
+typedef struct _SpanInfo
+{
+    const char *secret_fname;		// Span: the payload file
+    const char *output_dir;		// Span: where the stego images go
+    const char *output_fname;		// Join: where the payload goes
+    SpanShard *shards;
+    uint shard_count;
+    StegOptions options;
+
+    /* The payload being spanned, shared read-only */
+    unsigned char *payload;
+    uint payload_len;
+    uint64_t set_id;
+
+    /* Work distribution between the workers */
+    Status (*shard_job)(struct _SpanInfo *spInfo, SpanShard *shard);
+    pthread_mutex_t lock;
+    uint next_shard;
+    uint failed_shards;
+
+} SpanInfo;
+
+/* Span function prototypes */
+
+/* Read and validate the span args from argv */
+Status read_and_validate_span_args(char *argv[], SpanInfo *spInfo);
+
+/* Read and validate the join args from argv */
+Status read_and_validate_join_args(char *argv[], SpanInfo *spInfo);
+
+/* Split the payload over the covers and encode the shards in parallel */
+Status do_span(SpanInfo *spInfo);
+
+/* Decode a set of shards in parallel and reassemble the payload */
+Status do_join(SpanInfo *spInfo);
+
+/* Encode one shard into its cover */
+Status span_shard_to_cover(SpanInfo *spInfo, SpanShard *shard);
+
+/* Decode and check one shard from its stego image */
+Status join_shard_from_image(SpanInfo *spInfo, SpanShard *shard);
+
+/* Release the shards and the payload */
+void cleanup_span(SpanInfo *spInfo);
+
+#endif
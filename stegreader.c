@@ -0,0 +1,289 @@
+/* fopencookie() */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include "stegreader.h"
+#include "compare.h"
+#include "decode.h"
+#include "lsb.h"
+#include "types.h"
+#include "error.h"
+
+/* Function Definitions */
+
+/*
+ * Function to decode the message header of a mapped stego image: the magic
+ * string, the file extension, the secret data size and, with --encrypt,
+ * the nonce. The cursor is left on the first byte of the secret data.
+ */
+static Status read_payload_header(StegReader *reader)
+{
+    DecodeInfo *decInfo = &reader->decInfo;
+    unsigned char *pixels = reader->image_map + decInfo->stego_image_info.data_offset;
+    if(lsb_cursor_init_mapped(&decInfo->lsb_cursor, &decInfo->stego_image_info, pixels, decInfo->options.skip_alpha, NULL) == e_failure ||
+	    lsb_cursor_use_options_key(&decInfo->lsb_cursor, &decInfo->options) == e_failure)
+	return e_failure;
+
+    if(decInfo->options.fec_parity && read_fec_message(decInfo) == e_failure)
+	return e_failure;
+
+    char magic_str[sizeof(MAGIC_STRING)] = {0};
+    if(read_message(decInfo, (unsigned char *)magic_str, strlen(MAGIC_STRING)) == e_failure ||
+	    is_magic_string(magic_str) == e_failure)
+    {
+	fprintf(stderr, "%s: no message found with these options.\n", decInfo->stego_image_fname);
+	return e_failure;
+    }
+
+    uint size;
+    if(get_secret_data_file_extn(decInfo) == e_failure || get_secret_data_size(decInfo, &size) == e_failure)
+	return e_failure;
+    if(decInfo->options.encrypt && get_secret_data_cipher(decInfo, &reader->cipher) == e_failure)
+	return e_failure;
+
+    reader->data_size = size;
+    reader->data_start = decInfo->fec_message? decInfo->fec_message_pos: decInfo->lsb_cursor.carrier_seq / 8;
+    return e_success;
+}
+
+/*
+ * Function to open the payload of a stego image for reading.
+ *
+ * The image is mapped read-only and the message header is decoded right
+ * away, so a wrong key or a clean image fails here rather than on the
+ * first read. The secret data is not touched until it is read. The file
+ * extension of the payload is left in decInfo.extn_secret_file.
+ *
+ * A message protected with --fec is the exception: its codewords are
+ * interleaved over the whole message, so it is read and repaired in full
+ * at open time and later reads are served from memory.
+ *
+ * INPUTS: The stego image file name and the options it was encoded with.
+ *
+ * RETURNS: The reader, or NULL on errors.
+ */
+StegReader *steg_open(const char *image_fname, const StegOptions *options)
+{
+    if(!image_fname || !options)
+    {
+	FATAL_ERR_MSG;
+	return NULL;
+    }
+
+    StegReader *reader = calloc(1, sizeof(StegReader));
+    if(!reader)
+    {
+	FATAL_ERR_MSG;
+	return NULL;
+    }
+    reader->decInfo.stego_image_fname = (char *)image_fname;
+    reader->decInfo.options = *options;
+
+    if((!options->key && load_options_key(&reader->decInfo.options, &reader->key) == e_failure) ||
+	    map_bmp_image_file(image_fname, &reader->image_map, &reader->image_size, &reader->decInfo.stego_image_info) == e_failure ||
+	    lsb_check_image_support(&reader->decInfo.stego_image_info, options->skip_alpha) == e_failure ||
+	    read_payload_header(reader) == e_failure)
+    {
+	steg_close(reader);
+	return NULL;
+    }
+    madvise(reader->image_map, reader->image_size, MADV_RANDOM);
+    return reader;
+}
+
+/*
+ * Function to read payload bytes from the current position.
+ *
+ * Only the carriers of the bytes asked for are extracted: the mapped
+ * cursor is moved to them, and with --encrypt the keystream is moved to
+ * the same offset, so reads can come in any order. Reads stop at the end
+ * of the payload.
+ *
+ * INPUTS: The reader, the buffer and the byte count.
+ *
+ * RETURNS: The number of bytes read, 0 at the end of the payload or on
+ * errors, which set the error flag of the reader.
+ */
+size_t steg_read(StegReader *reader, void *buf, size_t len)
+{
+    if(!reader || !buf)
+    {
+	FATAL_ERR_MSG;
+	return 0;
+    }
+
+    if(reader->pos >= reader->data_size)
+	return 0;
+    if(len > reader->data_size - reader->pos)
+	len = reader->data_size - reader->pos;
+
+    DecodeInfo *decInfo = &reader->decInfo;
+    uint64_t offset = reader->data_start + reader->pos;
+    if(decInfo->fec_message)
+	memcpy(buf, decInfo->fec_message + offset, len);
+    else if(lsb_cursor_seek(&decInfo->lsb_cursor, offset) == e_failure ||
+	    lsb_cursor_read(&decInfo->lsb_cursor, buf, len) == e_failure)
+    {
+	reader->error = 1;
+	return 0;
+    }
+
+    if(decInfo->options.encrypt)
+    {
+	chacha20_seek(&reader->cipher, reader->pos);
+	chacha20_xor(&reader->cipher, buf, len);
+    }
+    reader->pos += len;
+    return len;
+}
+
+/*
+ * Function to move the read position to a payload byte offset. Offsets
+ * up to the payload size are allowed; reading at the end returns nothing.
+ *
+ * INPUTS: The reader and the offset.
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status steg_seek(StegReader *reader, uint64_t offset)
+{
+    if(!reader)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    if(offset > reader->data_size)
+	return e_failure;
+    reader->pos = offset;
+    return e_success;
+}
+
+/*
+ * Function to get the current payload byte offset.
+ *
+ * INPUTS: The reader.
+ *
+ * RETURNS: The offset.
+ */
+uint64_t steg_tell(const StegReader *reader)
+{
+    if(!reader)
+    {
+	FATAL_ERR_MSG;
+	return 0;
+    }
+    return reader->pos;
+}
+
+/*
+ * Function to get the payload size.
+ *
+ * INPUTS: The reader.
+ *
+ * RETURNS: The size in bytes.
+ */
+uint64_t steg_size(const StegReader *reader)
+{
+    if(!reader)
+    {
+	FATAL_ERR_MSG;
+	return 0;
+    }
+    return reader->data_size;
+}
+
+/*
+ * Function to close a reader: the cursor and the repaired message are
+ * freed, the image is unmapped and the cipher state is wiped.
+ *
+ * INPUTS: The reader.
+ *
+ * RETURNS: Nothing.
+ */
+void steg_close(StegReader *reader)
+{
+    if(!reader)
+    {
+	FATAL_ERR_MSG;
+	return;
+    }
+
+    lsb_cursor_free(&reader->decInfo.lsb_cursor);
+    free(reader->decInfo.fec_message);
+    if(reader->image_map)
+	munmap(reader->image_map, reader->image_size);
+    memset(&reader->cipher, 0, sizeof(reader->cipher));
+    free(reader);
+}
+
+/*
+ * Function called by stdio to read from a payload stream.
+ */
+static ssize_t steg_stream_read(void *cookie, char *buf, size_t size)
+{
+    StegReader *reader = cookie;
+    size_t done = steg_read(reader, buf, size);
+    return reader->error? -1: (ssize_t)done;
+}
+
+/*
+ * Function called by stdio to move a payload stream.
+ */
+static int steg_stream_seek(void *cookie, off64_t *offset, int whence)
+{
+    StegReader *reader = cookie;
+    if(whence != SEEK_SET && whence != SEEK_CUR && whence != SEEK_END)
+	return -1;
+    int64_t base = whence == SEEK_SET? 0: whence == SEEK_CUR? (int64_t)reader->pos: (int64_t)reader->data_size;
+    if(*offset < -base || steg_seek(reader, base + *offset) == e_failure)
+	return -1;
+    *offset = reader->pos;
+    return 0;
+}
+
+/*
+ * Function called by stdio to close a payload stream.
+ */
+static int steg_stream_close(void *cookie)
+{
+    steg_close(cookie);
+    return 0;
+}
+
+/*
+ * Function to open the payload of a stego image as a read-only stdio
+ * stream over steg_open(), so that any code that parses a FILE can read a
+ * hidden payload directly. The stream can seek, and is read lazily like
+ * the reader under it.
+ *
+ * INPUTS: The stego image file name and the options it was encoded with.
+ *
+ * RETURNS: The stream, or NULL on errors.
+ */
+FILE *steg_fopen(const char *image_fname, const StegOptions *options)
+{
+    if(!image_fname || !options)
+    {
+	FATAL_ERR_MSG;
+	return NULL;
+    }
+
+    StegReader *reader = steg_open(image_fname, options);
+    if(!reader)
+	return NULL;
+
+    cookie_io_functions_t functions = {
+	.read = steg_stream_read,
+	.write = NULL,
+	.seek = steg_stream_seek,
+	.close = steg_stream_close
+    };
+    FILE *fptr = fopencookie(reader, "rb", functions);
+    if(!fptr)
+	steg_close(reader);
+    return fptr;
+}
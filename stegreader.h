@@ -0,0 +1,59 @@
+#ifndef STEGREADER_H
+#define STEGREADER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "types.h" 	// Contains user defined types
+#include "common.h"	// Contains common strings
+#include "error.h"	// Contains standard error messages
+#include "decode.h"	// Contains the decoding stages
+#include "chacha20.h"	// Contains the ChaCha20 stream cipher
+
+/*
+ * Structure to store an open payload reader. The stego image is mapped
+ * read-only and the message header is decoded at open time; the secret
+ * data itself is only extracted from the carriers it is read from, so
+ * reading a few bytes from the middle of a large payload touches only the
+ * pixel bytes that hold them.
+ */
+typedef struct _StegReader
+{
+    /* Decoding state: options, image descriptor and the mapped cursor */
+    DecodeInfo decInfo;
+
+    unsigned char *image_map;
+    size_t image_size;
+
+    uint64_t data_start;	// Message byte offset of the secret data
+    uint64_t data_size;		// Secret data size
+    uint64_t pos;		// Read position in the secret data
+    ChaCha20 cipher;		// Set up with --encrypt only
+    StegKey key;		// Key material, unless the options came with it
+    int error;			// Set when a read failed
+
+} StegReader;
+
+/* Payload reader function prototypes */
+
+/* Open the payload of a stego image for reading */
+StegReader *steg_open(const char *image_fname, const StegOptions *options);
+
+/* Read payload bytes from the current position */
+size_t steg_read(StegReader *reader, void *buf, size_t len);
+
+/* Move to a payload byte offset */
+Status steg_seek(StegReader *reader, uint64_t offset);
+
+/* Get the current payload byte offset */
+uint64_t steg_tell(const StegReader *reader);
+
+/* Get the payload size */
+uint64_t steg_size(const StegReader *reader);
+
+/* Close the reader and unmap the image */
+void steg_close(StegReader *reader);
+
+/* Open the payload of a stego image as a read-only stdio stream */
+FILE *steg_fopen(const char *image_fname, const StegOptions *options);
+
+#endif
@@ -0,0 +1,402 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "telemetry.h"
+#include "trace.h"
+#include "common.h"
+#include "types.h"
+#include "error.h"
+
+/* Labels of the operations and stages in the stats */
+static const char *operation_names[TELEMETRY_OPERATIONS] = { "encode", "decode", "batch" };
+static const char *stage_names[TELEMETRY_STAGES] = {
+    "open", "cache", "header", "capacity", "setup", "embed", "extract", "flush", "copy", "commit", "store"
+};
+
+/* Quantiles given for each latency summary */
+static const double summary_quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+/* Stats file and refresh interval, set once by start_telemetry() */
+static const char *stats_fname;
+static uint stats_interval;
+static int telemetry_enabled;
+
+/* Shards of all the threads that ran jobs, and the lock guarding the list and the stats file */
+static TelemetryShard *shards;
+static pthread_mutex_t telemetry_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread TelemetryShard *thread_shard;
+
+/* Function Definitions */
+
+/*
+ * Function to add to a counter of the calling thread's shard. Only the
+ * owning thread writes it, so a relaxed load and store are enough; the
+ * writer of the stats file may read it at any time.
+ */
+static void shard_add(uint64_t *counter, uint64_t value)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+/*
+ * Function to get the shard of the calling thread, linking a new one in on
+ * the first job the thread runs.
+ */
+static TelemetryShard *get_thread_shard(void)
+{
+    if(thread_shard)
+	return thread_shard;
+
+    TelemetryShard *shard = calloc(1, sizeof(TelemetryShard));
+    if(!shard)
+	return NULL;
+    pthread_mutex_lock(&telemetry_lock);
+    shard->next = shards;
+    shards = shard;
+    pthread_mutex_unlock(&telemetry_lock);
+    thread_shard = shard;
+    return shard;
+}
+
+/*
+ * Function to get the histogram bucket of a value in microseconds.
+ */
+static uint get_bucket_index(uint64_t value)
+{
+    if(value < 2 * TELEMETRY_SUB_BUCKETS)
+	return value;
+    if(value >> TELEMETRY_MAX_VALUE_BITS)
+	return TELEMETRY_BUCKETS - 1;
+    uint shift = 63 - __builtin_clzll(value) - TELEMETRY_SUB_BUCKET_BITS;
+    return (shift + 1) * TELEMETRY_SUB_BUCKETS + (value >> shift) - TELEMETRY_SUB_BUCKETS;
+}
+
+/*
+ * Function to get the value in the middle of a histogram bucket, in
+ * microseconds.
+ */
+static double get_bucket_value(uint index)
+{
+    if(index < 2 * TELEMETRY_SUB_BUCKETS)
+	return index;
+    uint shift = index / TELEMETRY_SUB_BUCKETS - 1;
+    uint64_t lower = (uint64_t)(index % TELEMETRY_SUB_BUCKETS + TELEMETRY_SUB_BUCKETS) << shift;
+    return lower + (double)((uint64_t)1 << shift) / 2;
+}
+
+/*
+ * Function to add a latency in nanoseconds to a histogram of the calling
+ * thread's shard.
+ */
+static void histogram_record(TelemetryHistogram *histogram, uint64_t latency_ns)
+{
+    uint64_t latency_us = latency_ns / 1000;
+    shard_add(&histogram->count, 1);
+    shard_add(&histogram->sum_us, latency_us);
+    shard_add(&histogram->buckets[get_bucket_index(latency_us)], 1);
+}
+
+/*
+ * Function to add a histogram of a shard to a running total.
+ */
+static void histogram_merge(TelemetryHistogram *total, const TelemetryHistogram *histogram)
+{
+    total->count += __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+    total->sum_us += __atomic_load_n(&histogram->sum_us, __ATOMIC_RELAXED);
+    for(uint i = 0; i < TELEMETRY_BUCKETS; ++i)
+	total->buckets[i] += __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+}
+
+/*
+ * Function to write a histogram as a Prometheus summary: the quantiles in
+ * seconds, the sum and the count. Quantiles are read off the buckets and
+ * are within 1/16 of the true latency.
+ */
+static void write_summary(FILE *fptr, const char *name, const char *labels, const TelemetryHistogram *histogram)
+{
+    for(uint q = 0; q < sizeof(summary_quantiles) / sizeof(summary_quantiles[0]); ++q)
+    {
+	uint64_t rank = summary_quantiles[q] * histogram->count;
+	uint64_t seen = 0;
+	uint index = 0;
+	while(index < TELEMETRY_BUCKETS - 1 && (seen += histogram->buckets[index]) <= rank)
+	    ++index;
+	fprintf(fptr, "%s{%s,quantile=\"%g\"} %.6f\n", name, labels, summary_quantiles[q], get_bucket_value(index) / 1e6);
+    }
+    fprintf(fptr, "%s_sum{%s} %.6f\n", name, labels, histogram->sum_us / 1e6);
+    fprintf(fptr, "%s_count{%s} %llu\n", name, labels, (unsigned long long)histogram->count);
+}
+
+/*
+ * Function to write the stats summed over all the shards in the
+ * Prometheus text format.
+ */
+static void write_stats(FILE *fptr, const TelemetryShard *total)
+{
+    char labels[64];
+
+    fprintf(fptr, "# HELP steg_jobs_total Jobs run, successful or not.\n# TYPE steg_jobs_total counter\n");
+    for(uint op = 0; op < TELEMETRY_OPERATIONS; ++op)
+	fprintf(fptr, "steg_jobs_total{operation=\"%s\"} %llu\n", operation_names[op], (unsigned long long)total->jobs[op]);
+
+    fprintf(fptr, "# HELP steg_payload_bytes_total Secret bytes embedded or extracted by the successful jobs, whole encoded messages for batch covers.\n# TYPE steg_payload_bytes_total counter\n");
+    for(uint op = 0; op < TELEMETRY_OPERATIONS; ++op)
+	fprintf(fptr, "steg_payload_bytes_total{operation=\"%s\"} %llu\n", operation_names[op], (unsigned long long)total->bytes[op]);
+
+    fprintf(fptr, "# HELP steg_job_failures_total Failed jobs, by the stage they failed in.\n# TYPE steg_job_failures_total counter\n");
+    for(uint op = 0; op < TELEMETRY_OPERATIONS; ++op)
+	for(uint stage = 0; stage < TELEMETRY_STAGES; ++stage)
+	    if(total->failures[op][stage])
+		fprintf(fptr, "steg_job_failures_total{operation=\"%s\",stage=\"%s\"} %llu\n", operation_names[op], stage_names[stage],
+			(unsigned long long)total->failures[op][stage]);
+
+    fprintf(fptr, "# HELP steg_job_duration_seconds Time from the start to the end of a job.\n# TYPE steg_job_duration_seconds summary\n");
+    for(uint op = 0; op < TELEMETRY_OPERATIONS; ++op)
+    {
+	if(!total->job_latency[op].count)
+	    continue;
+	snprintf(labels, sizeof(labels), "operation=\"%s\"", operation_names[op]);
+	write_summary(fptr, "steg_job_duration_seconds", labels, &total->job_latency[op]);
+    }
+
+    fprintf(fptr, "# HELP steg_stage_duration_seconds Time spent in each stage of a job.\n# TYPE steg_stage_duration_seconds summary\n");
+    for(uint op = 0; op < TELEMETRY_OPERATIONS; ++op)
+	for(uint stage = 0; stage < TELEMETRY_STAGES; ++stage)
+	{
+	    if(!total->stage_latency[op][stage].count)
+		continue;
+	    snprintf(labels, sizeof(labels), "operation=\"%s\",stage=\"%s\"", operation_names[op], stage_names[stage]);
+	    write_summary(fptr, "steg_stage_duration_seconds", labels, &total->stage_latency[op][stage]);
+	}
+}
+
+/*
+ * Function to write the stats in the Prometheus text format, for a
+ * textfile collector to pick up.
+ *
+ * The counters of all the threads are summed without stopping them. The
+ * file is written under its temporary name and renamed, so a collector
+ * never reads half of it.
+ *
+ * INPUTS: The stats file name.
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status write_telemetry_stats(const char *fname)
+{
+    if(!fname)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    TelemetryShard *total = calloc(1, sizeof(TelemetryShard));
+    char *temp_fname = get_temp_output_filename(fname, NULL);
+    if(!total || !temp_fname)
+    {
+	FATAL_ERR_MSG;
+	free(total);
+	if(temp_fname)
+	    remove(temp_fname);
+	free(temp_fname);
+	return e_failure;
+    }
+
+    pthread_mutex_lock(&telemetry_lock);
+    for(const TelemetryShard *shard = shards; shard; shard = shard->next)
+	for(uint op = 0; op < TELEMETRY_OPERATIONS; ++op)
+	{
+	    total->jobs[op] += __atomic_load_n(&shard->jobs[op], __ATOMIC_RELAXED);
+	    total->bytes[op] += __atomic_load_n(&shard->bytes[op], __ATOMIC_RELAXED);
+	    histogram_merge(&total->job_latency[op], &shard->job_latency[op]);
+	    for(uint stage = 0; stage < TELEMETRY_STAGES; ++stage)
+	    {
+		total->failures[op][stage] += __atomic_load_n(&shard->failures[op][stage], __ATOMIC_RELAXED);
+		histogram_merge(&total->stage_latency[op][stage], &shard->stage_latency[op][stage]);
+	    }
+	}
+
+    Status status = e_success;
+    FILE *fptr = fopen(temp_fname, "w");
+    if(fptr)
+    {
+	write_stats(fptr, total);
+	if(fclose(fptr) || rename(temp_fname, fname))
+	    status = e_failure;
+    }
+    else
+	status = e_failure;
+    if(status == e_failure)
+    {
+	perror("stats");
+	fprintf(stderr, "ERROR: Unable to write file %s\n", fname);
+	remove(temp_fname);
+    }
+    pthread_mutex_unlock(&telemetry_lock);
+
+    free(total);
+    free(temp_fname);
+    return status;
+}
+
+/*
+ * Function run by the stats thread: refreshes the stats file every
+ * stats_interval seconds for as long as the process runs.
+ */
+static void *telemetry_thread_main(void *arg)
+{
+    (void)arg;
+    while(1)
+    {
+	sleep(stats_interval);
+	write_telemetry_stats(stats_fname);
+    }
+    return NULL;
+}
+
+/*
+ * Function to write the stats file one last time as the process exits.
+ */
+static void write_final_stats(void)
+{
+    write_telemetry_stats(stats_fname);
+}
+
+/*
+ * Function to start collecting stats for --stats-file.
+ *
+ * Jobs are only timed and counted from here on. A detached thread
+ * refreshes the file every interval seconds, and it is written one last
+ * time at exit, so a one-off run leaves the stats of its job behind and
+ * a daemon or a long broadcast can be watched while it runs. Without a
+ * stats file, nothing is collected.
+ *
+ * INPUTS: The stats file name (may be NULL) and the refresh interval in
+ * seconds, 0 for DEFAULT_STATS_INTERVAL.
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status start_telemetry(const char *stats_file, uint interval)
+{
+    if(!stats_file || telemetry_enabled)
+	return e_success;
+
+    stats_fname = stats_file;
+    stats_interval = interval? interval: DEFAULT_STATS_INTERVAL;
+    if(write_telemetry_stats(stats_fname) == e_failure)
+	return e_failure;
+
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, telemetry_thread_main, NULL))
+    {
+	fprintf(stderr, "Could not start the stats thread.\n");
+	return e_failure;
+    }
+    pthread_detach(thread);
+    atexit(write_final_stats);
+    telemetry_enabled = 1;
+    return e_success;
+}
+
+/*
+ * Function to start timing a job, in its first stage, e_telemetry_open.
+ * Nothing is done unless stats are collected or a trace is recorded.
+ *
+ * INPUTS: The job and its operation.
+ *
+ * RETURNS: Nothing.
+ */
+void telemetry_job_begin(TelemetryJob *job, TelemetryOperation operation)
+{
+    if(!job)
+    {
+	FATAL_ERR_MSG;
+	return;
+    }
+
+    memset(job, 0, sizeof(*job));
+    if(!telemetry_enabled && !trace_enabled())
+	return;
+    job->started = 1;
+    job->operation = operation;
+    job->stage = e_telemetry_open;
+    job->job_start_ns = trace_now();
+    job->stage_start_ns = job->job_start_ns;
+}
+
+/*
+ * Function to end the stage a job is in, recording its latency and its
+ * span in the trace, and start the next one. Moving to e_telemetry_done
+ * marks the job successful.
+ *
+ * INPUTS: The job and the next stage.
+ *
+ * RETURNS: Nothing.
+ */
+void telemetry_job_stage(TelemetryJob *job, TelemetryStage stage)
+{
+    if(!job)
+    {
+	FATAL_ERR_MSG;
+	return;
+    }
+
+    if(!job->started)
+	return;
+
+    uint64_t now = trace_now();
+    if(job->stage != e_telemetry_done)
+    {
+	TelemetryShard *shard = telemetry_enabled? get_thread_shard(): NULL;
+	if(shard)
+	    histogram_record(&shard->stage_latency[job->operation][job->stage], now - job->stage_start_ns);
+	trace_span(stage_names[job->stage], operation_names[job->operation], job->stage_start_ns, now, 0);
+    }
+    job->stage = stage;
+    job->stage_start_ns = now;
+}
+
+/*
+ * Function to count a job that has ended. A job that did not reach
+ * e_telemetry_done is counted as a failure of the stage it was in, whose
+ * latency is still recorded; a successful one adds its payload bytes.
+ * The whole job is a span of the trace, in the "job" category, or in the
+ * "failed" one for a failure.
+ * Calling it on a job that was never begun, or again, does nothing, so it
+ * can be called from the cleanup functions.
+ *
+ * INPUTS: The job.
+ *
+ * RETURNS: Nothing.
+ */
+void telemetry_job_end(TelemetryJob *job)
+{
+    if(!job)
+    {
+	FATAL_ERR_MSG;
+	return;
+    }
+
+    if(!job->started)
+	return;
+
+    TelemetryStage stage = job->stage;
+    telemetry_job_stage(job, e_telemetry_done);
+    trace_span(operation_names[job->operation], stage == e_telemetry_done? "job": "failed",
+	    job->job_start_ns, job->stage_start_ns, stage == e_telemetry_done? job->bytes: 0);
+    job->started = 0;
+
+    TelemetryShard *shard = telemetry_enabled? get_thread_shard(): NULL;
+    if(!shard)
+	return;
+
+    shard_add(&shard->jobs[job->operation], 1);
+    if(stage == e_telemetry_done)
+	shard_add(&shard->bytes[job->operation], job->bytes);
+    else
+	shard_add(&shard->failures[job->operation][stage], 1);
+    histogram_record(&shard->job_latency[job->operation], job->stage_start_ns - job->job_start_ns);
+}
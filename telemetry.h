@@ -0,0 +1,112 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdint.h>
+#include "types.h" 	// Contains user defined types
+#include "error.h"	// Contains standard error messages
+
+/* Seconds between two refreshes of the --stats-file unless --stats-interval says otherwise */
+#define DEFAULT_STATS_INTERVAL 10
+
+/*
+ * Latency histogram layout, in microseconds: values below twice the sub
+ * bucket count get a bucket each, and every power of two above is cut into
+ * TELEMETRY_SUB_BUCKETS buckets, so a bucket is never wider than 1/8 of
+ * its value. Values of 2^40 us (about 12 days) and more share the last one.
+ */
+#define TELEMETRY_SUB_BUCKET_BITS 3
+#define TELEMETRY_SUB_BUCKETS (1 << TELEMETRY_SUB_BUCKET_BITS)
+#define TELEMETRY_MAX_VALUE_BITS 40
+#define TELEMETRY_BUCKETS ((TELEMETRY_MAX_VALUE_BITS - TELEMETRY_SUB_BUCKET_BITS + 1) * TELEMETRY_SUB_BUCKETS)
+
+/* Operations the jobs are counted under */
+typedef enum
+{
+    e_telemetry_encode,
+    e_telemetry_decode,
+    e_telemetry_batch,		// A cover of --broadcast or --span
+    TELEMETRY_OPERATIONS
+
+} TelemetryOperation;
+
+/*
+ * Stages of a job, timed one after the other. A job that ends before
+ * reaching e_telemetry_done is counted as failed in the stage it was in.
+ */
+typedef enum
+{
+    e_telemetry_open,		// Opening the files
+    e_telemetry_cache,		// Looking the payload up in the decode cache
+    e_telemetry_header,		// Reading the image header and message header
+    e_telemetry_capacity,	// Checking the secret fits
+    e_telemetry_setup,		// Setting up the row cursor or the output file
+    e_telemetry_embed,		// Embedding the message
+    e_telemetry_extract,	// Extracting the secret data
+    e_telemetry_flush,		// Writing out the last rows and verifying them
+    e_telemetry_copy,		// Copying the rest of the image
+    e_telemetry_commit,		// Renaming the output into place
+    e_telemetry_store,		// Adding the payload to the decode cache
+    e_telemetry_done,
+    TELEMETRY_STAGES = e_telemetry_done
+
+} TelemetryStage;
+
+/* HDR style latency histogram */
+typedef struct _TelemetryHistogram
+{
+    uint64_t count;
+    uint64_t sum_us;
+    uint64_t buckets[TELEMETRY_BUCKETS];
+
+} TelemetryHistogram;
+
+/*
+ * Structure to store the counters of one thread. Each thread only ever
+ * adds to its own shard, with relaxed atomic stores and no lock, and the
+ * shards are summed when the stats are written. Shards are kept once their
+ * thread is gone, so the counts stay cumulative.
+ */
+typedef struct _TelemetryShard
+{
+    struct _TelemetryShard *next;
+    uint64_t jobs[TELEMETRY_OPERATIONS];
+    uint64_t bytes[TELEMETRY_OPERATIONS];
+    uint64_t failures[TELEMETRY_OPERATIONS][TELEMETRY_STAGES];
+    TelemetryHistogram job_latency[TELEMETRY_OPERATIONS];
+    TelemetryHistogram stage_latency[TELEMETRY_OPERATIONS][TELEMETRY_STAGES];
+
+} TelemetryShard;
+
+/*
+ * Structure to store the timing state of a job in progress. It lives in
+ * the EncodeInfo or DecodeInfo object of the job.
+ */
+typedef struct _TelemetryJob
+{
+    int started;		// 1 between telemetry_job_begin() and telemetry_job_end()
+    TelemetryOperation operation;
+    TelemetryStage stage;	// Stage in progress
+    uint64_t job_start_ns;
+    uint64_t stage_start_ns;
+    uint64_t bytes;		// Payload bytes embedded or extracted
+
+} TelemetryJob;
+
+/* Telemetry function prototypes */
+
+/* Start writing the stats file given by the options */
+Status start_telemetry(const char *stats_file, uint interval);
+
+/* Start timing a job */
+void telemetry_job_begin(TelemetryJob *job, TelemetryOperation operation);
+
+/* Move a job on to its next stage */
+void telemetry_job_stage(TelemetryJob *job, TelemetryStage stage);
+
+/* Count a job that has ended, successful if it reached e_telemetry_done */
+void telemetry_job_end(TelemetryJob *job);
+
+/* Write the stats in the Prometheus text format */
+Status write_telemetry_stats(const char *fname);
+
+#endif
@@ -1,6 +1,13 @@
 #include <stdio.h>
 #include "encode.h"
 #include "decode.h"
+#include "server.h"
+#include "broadcast.h"
+#include "span.h"
+#include "update.h"
+#include "compare.h"
+#include "detect.h"
+#include "progress.h"
 #include "error.h"
 #include <string.h>
 #include <stdlib.h>
@@ -8,33 +15,123 @@
 int main(int argc, char **argv)
 {
     OperationType opr = check_operation_type(argv);
+    int exit_status = EXIT_FAILURE;	// Until the operation succeeds
 
     switch(opr)
     {
 	case e_encode:
 	    EncodeInfo encInfo;
-	    if(read_and_validate_encode_args(argv, &encInfo) == e_success)
+	    if(read_and_validate_encode_args(argv, &encInfo) == e_success && watch_cancel_signals() == e_success)
 	    {
 		Status encode_success = do_encoding(&encInfo);
 		if(encode_success == e_failure)
 		    fprintf(stderr, "Encoding failed.\n");
 		else
+		{
 		    fprintf(stdout, "Encoding complete.\n");
+		    exit_status = EXIT_SUCCESS;
+		}
 	    }
 	    break;
 	case e_decode:
 	    DecodeInfo decInfo;
-	    if(read_and_validate_decode_args(argv, &decInfo) == e_success)
+	    if(read_and_validate_decode_args(argv, &decInfo) == e_success && watch_cancel_signals() == e_success)
 	    {
 		Status decode_success = do_decoding(argv[3], &decInfo);
 		if(decode_success == e_failure)
 		    fprintf(stderr, "Decoding failed.\n");
 		else
+		{
 		    fprintf(stdout, "Decoding complete.\n");
+		    exit_status = EXIT_SUCCESS;
+		}
 	    }
 	    break;
+	case e_serve:
+	    if(run_server(argv) == e_failure)
+		fprintf(stderr, "Daemon failed.\n");
+	    else
+		exit_status = EXIT_SUCCESS;
+	    break;
+	case e_client:
+	    if(run_client(argv) == e_failure)
+		fprintf(stderr, "Request failed.\n");
+	    else
+		exit_status = EXIT_SUCCESS;
+	    break;
+	case e_broadcast:
+	    BroadcastInfo bcInfo;
+	    if(read_and_validate_broadcast_args(argv, &bcInfo) == e_success)
+	    {
+		if(do_broadcast(&bcInfo) == e_failure)
+		    fprintf(stderr, "Broadcast failed.\n");
+		else
+		{
+		    fprintf(stdout, "Broadcast complete.\n");
+		    exit_status = EXIT_SUCCESS;
+		}
+	    }
+	    break;
+	case e_span:
+	    SpanInfo spanInfo;
+	    if(read_and_validate_span_args(argv, &spanInfo) == e_success)
+	    {
+		if(do_span(&spanInfo) == e_failure)
+		    fprintf(stderr, "Span failed.\n");
+		else
+		{
+		    fprintf(stdout, "Span complete.\n");
+		    exit_status = EXIT_SUCCESS;
+		}
+	    }
+	    break;
+	case e_join:
+	    SpanInfo joinInfo;
+	    if(read_and_validate_join_args(argv, &joinInfo) == e_success)
+	    {
+		if(do_join(&joinInfo) == e_failure)
+		    fprintf(stderr, "Join failed.\n");
+		else
+		{
+		    fprintf(stdout, "Join complete.\n");
+		    exit_status = EXIT_SUCCESS;
+		}
+	    }
+	    break;
+	case e_update:
+	    UpdateInfo updInfo;
+	    if(read_and_validate_update_args(argv, &updInfo) == e_success)
+	    {
+		if(do_update(&updInfo) == e_failure)
+		    fprintf(stderr, "Update failed.\n");
+		else
+		{
+		    fprintf(stdout, "Update complete.\n");
+		    exit_status = EXIT_SUCCESS;
+		}
+	    }
+	    break;
+	case e_compare:
+	    CompareInfo cmpInfo;
+	    if(read_and_validate_compare_args(argv, &cmpInfo) == e_failure)
+		break;
+	    if(do_compare(&cmpInfo) == e_failure)
+		fprintf(stderr, "Comparison failed.\n");
+	    else
+		exit_status = EXIT_SUCCESS;
+	    break;
+	case e_detect:
+	    DetectInfo detInfo;
+	    if(read_and_validate_detect_args(argv, &detInfo) == e_failure)
+		break;
+	    if(do_detect(&detInfo) == e_failure)
+		fprintf(stderr, "Screening failed.\n");
+	    else
+		exit_status = EXIT_SUCCESS;
+	    break;
 	default:
-	    fprintf(stderr, "Error. Please input the encode/decode argument:\n%s <%s/%s>\n", argv[0], ENCODE_ARG, DECODE_ARG);
+	    fprintf(stderr, "Error. Please input the encode/decode argument:\n%s <%s/%s/%s/%s/%s/%s/%s/%s/%s/%s>\n", argv[0], ENCODE_ARG, DECODE_ARG, SERVE_ARG, CLIENT_ARG, BROADCAST_ARG, SPAN_ARG, JOIN_ARG, UPDATE_ARG, COMPARE_ARG, DETECT_ARG);
 	    break;
     }
+    return exit_status;
 }
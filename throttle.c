@@ -0,0 +1,231 @@
+/* fopencookie() */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "throttle.h"
+#include "trace.h"
+#include "types.h"
+#include "error.h"
+
+/* Buckets shared by every image stream of the process */
+static TokenBucket read_bucket = { PTHREAD_MUTEX_INITIALIZER, 0, 0, 0 };
+static TokenBucket write_bucket = { PTHREAD_MUTEX_INITIALIZER, 0, 0, 0 };
+
+/* Function Definitions */
+
+/*
+ * Function to read the monotonic clock in nanoseconds.
+ */
+static uint64_t monotonic_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*
+ * Function to set a bucket up for a rate in MB per second, full.
+ */
+static void set_bucket_rate(TokenBucket *bucket, uint mbps)
+{
+    pthread_mutex_lock(&bucket->lock);
+    bucket->rate = (uint64_t)mbps * THROTTLE_MB;
+    bucket->tokens = (double)bucket->rate * THROTTLE_BURST_MS / 1000;
+    bucket->last_ns = monotonic_ns();
+    pthread_mutex_unlock(&bucket->lock);
+}
+
+/*
+ * Function to set the process wide I/O limits and priority given by the
+ * options: --max-read-mbps and --max-write-mbps set the rates of the read
+ * and write buckets that image streams are charged to, and --idle-io puts
+ * the process in the idle I/O scheduling class, so that its disk requests
+ * are only served when no one else needs the disk. The class is inherited
+ * by the threads started later. Without these options, nothing changes.
+ *
+ * INPUTS: The options.
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status set_io_limits(const StegOptions *options)
+{
+    if(!options)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    if(options->max_read_mbps)
+	set_bucket_rate(&read_bucket, options->max_read_mbps);
+    if(options->max_write_mbps)
+	set_bucket_rate(&write_bucket, options->max_write_mbps);
+
+    int idle_priority = THROTTLE_IOPRIO_CLASS_IDLE << THROTTLE_IOPRIO_CLASS_SHIFT;
+    if(options->idle_io && syscall(SYS_ioprio_set, THROTTLE_IOPRIO_WHO_PROCESS, 0, idle_priority) < 0)
+    {
+	perror("ioprio_set");
+	return e_failure;
+    }
+    return e_success;
+}
+
+/*
+ * Function to take tokens for a transfer from a bucket.
+ *
+ * The bucket is refilled for the time since the last transfer, the tokens
+ * are taken, and if that leaves the bucket in debt, the caller sleeps for
+ * as long as the rate takes to pay the debt off. The sleep happens outside
+ * the lock, and is a "throttle" span of the trace. A bucket without a rate
+ * costs nothing.
+ *
+ * INPUTS: The bucket and the transfer length in bytes.
+ *
+ * RETURNS: Nothing.
+ */
+void throttle_take(TokenBucket *bucket, size_t len)
+{
+    if(!bucket)
+    {
+	FATAL_ERR_MSG;
+	return;
+    }
+
+    if(!bucket->rate || !len)
+	return;
+
+    pthread_mutex_lock(&bucket->lock);
+    uint64_t now = monotonic_ns();
+    double burst = (double)bucket->rate * THROTTLE_BURST_MS / 1000;
+    bucket->tokens += (double)(now - bucket->last_ns) * bucket->rate / 1e9;
+    if(bucket->tokens > burst)
+	bucket->tokens = burst;
+    bucket->last_ns = now;
+    bucket->tokens -= len;
+    double debt = -bucket->tokens;
+    pthread_mutex_unlock(&bucket->lock);
+
+    if(debt <= 0)
+	return;
+    uint64_t wait_ns = debt * 1e9 / bucket->rate;
+    struct timespec wait = { wait_ns / 1000000000, wait_ns % 1000000000 };
+    while(nanosleep(&wait, &wait) < 0 && errno == EINTR)
+	;
+    trace_span("throttle", "io", now, monotonic_ns(), len);
+}
+
+/*
+ * Function called by stdio to read from a throttled stream. Large reads
+ * are cut into THROTTLE_CHUNK_SIZE pieces, each paid for as it arrives.
+ */
+static ssize_t throttled_stream_read(void *cookie, char *buf, size_t size)
+{
+    ThrottledStream *stream = cookie;
+    size_t done = 0;
+    while(done < size)
+    {
+	size_t chunk = size - done < THROTTLE_CHUNK_SIZE? size - done: THROTTLE_CHUNK_SIZE;
+	size_t got = fread(buf + done, 1, chunk, stream->fptr);
+	throttle_take(stream->bucket, got);
+	done += got;
+	if(got < chunk)
+	    break;
+    }
+    return (done || !ferror(stream->fptr))? (ssize_t)done: -1;
+}
+
+/*
+ * Function called by stdio to write to a throttled stream. Large writes
+ * are cut into THROTTLE_CHUNK_SIZE pieces, each paid for before it leaves.
+ */
+static ssize_t throttled_stream_write(void *cookie, const char *buf, size_t size)
+{
+    ThrottledStream *stream = cookie;
+    size_t done = 0;
+    while(done < size)
+    {
+	size_t chunk = size - done < THROTTLE_CHUNK_SIZE? size - done: THROTTLE_CHUNK_SIZE;
+	throttle_take(stream->bucket, chunk);
+	if(fwrite(buf + done, chunk, 1, stream->fptr) != 1)
+	    return done? (ssize_t)done: -1;
+	done += chunk;
+    }
+    return done;
+}
+
+/*
+ * Function called by stdio to move a throttled stream.
+ */
+static int throttled_stream_seek(void *cookie, off64_t *offset, int whence)
+{
+    ThrottledStream *stream = cookie;
+    if(fseeko(stream->fptr, *offset, whence) < 0)
+	return -1;
+    *offset = ftello(stream->fptr);
+    return *offset < 0? -1: 0;
+}
+
+/*
+ * Function called by stdio to close a throttled stream.
+ */
+static int throttled_stream_close(void *cookie)
+{
+    ThrottledStream *stream = cookie;
+    int status = fclose(stream->fptr);
+    arena_release(stream->arena, stream);
+    return status;
+}
+
+/*
+ * Function to wrap a freshly opened stream so that its transfers are
+ * charged to the read or the write bucket, according to the mode. When
+ * that bucket has no rate, the stream is returned as it is and costs
+ * nothing. The wrapper owns the stream and closes it.
+ *
+ * INPUTS: The stream, NULL being passed through, its fopen() mode and the
+ * arena the wrapper state comes from (may be NULL).
+ *
+ * RETURNS: The stream to use, or NULL on errors, the stream being closed.
+ */
+FILE *throttle_stream(FILE *fptr, const char *mode, Arena *arena)
+{
+    if(!mode)
+    {
+	FATAL_ERR_MSG;
+	return NULL;
+    }
+
+    TokenBucket *bucket = mode[0] == 'r'? &read_bucket: &write_bucket;
+    if(!fptr || !bucket->rate)
+	return fptr;
+
+    ThrottledStream *stream = arena_alloc(arena, sizeof(ThrottledStream));
+    if(!stream)
+    {
+	FATAL_ERR_MSG;
+	fclose(fptr);
+	return NULL;
+    }
+    stream->fptr = fptr;
+    stream->bucket = bucket;
+    stream->arena = arena;
+
+    cookie_io_functions_t functions = {
+	.read = mode[0] == 'r'? throttled_stream_read: NULL,
+	.write = mode[0] == 'r'? NULL: throttled_stream_write,
+	.seek = throttled_stream_seek,
+	.close = throttled_stream_close
+    };
+    FILE *throttled = fopencookie(stream, mode, functions);
+    if(!throttled)
+    {
+	fclose(fptr);
+	arena_release(arena, stream);
+    }
+    return throttled;
+}
@@ -0,0 +1,66 @@
+#ifndef THROTTLE_H
+#define THROTTLE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "types.h" 	// Contains user defined types
+#include "common.h"	// Contains common strings
+#include "error.h"	// Contains standard error messages
+
+/* Largest transfer charged to a bucket at once, so that pacing stays smooth */
+#define THROTTLE_CHUNK_SIZE (64 * 1024)
+
+/* Time worth of tokens a bucket can save up while idle, in milliseconds */
+#define THROTTLE_BURST_MS 50
+
+/* Bytes in the megabyte of --max-read-mbps and --max-write-mbps */
+#define THROTTLE_MB 1000000
+
+/* I/O priority class and the ioprio_set() target of the calling thread */
+#define THROTTLE_IOPRIO_CLASS_IDLE 3
+#define THROTTLE_IOPRIO_CLASS_SHIFT 13
+#define THROTTLE_IOPRIO_WHO_PROCESS 1
+
+/*
+ * Structure to store a token bucket. Tokens are bytes, added at rate per
+ * second up to THROTTLE_BURST_MS worth. A transfer takes its tokens up
+ * front, leaving the bucket in debt if there are not enough, and then
+ * sleeps until the debt is paid off; later transfers see the debt and
+ * sleep longer, so concurrent threads queue up behind each other and the
+ * total rate stays at the limit. The bucket is shared by all the threads
+ * of the process.
+ */
+typedef struct _TokenBucket
+{
+    pthread_mutex_t lock;
+    uint64_t rate;		// Bytes per second, 0 for no limit
+    double tokens;		// Negative when in debt
+    uint64_t last_ns;		// CLOCK_MONOTONIC time of the last refill
+
+} TokenBucket;
+
+/*
+ * Structure to store the state of a throttled stream: the stream it wraps
+ * and the bucket its transfers are charged to.
+ */
+typedef struct _ThrottledStream
+{
+    FILE *fptr;
+    TokenBucket *bucket;
+    Arena *arena;		// Arena the state comes from (may be NULL)
+
+} ThrottledStream;
+
+/* Throttling function prototypes */
+
+/* Set the process wide I/O limits and priority from the options */
+Status set_io_limits(const StegOptions *options);
+
+/* Take tokens for a transfer, sleeping until they are paid for */
+void throttle_take(TokenBucket *bucket, size_t len);
+
+/* Wrap a stream so that its transfers follow the I/O limits */
+FILE *throttle_stream(FILE *fptr, const char *mode, Arena *arena);
+
+#endif
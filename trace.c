@@ -0,0 +1,303 @@
+/* fopencookie() */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include "trace.h"
+#include "common.h"
+#include "types.h"
+#include "error.h"
+
+/* Trace file and the time the recording started, set once by start_trace() */
+static const char *trace_fname;
+static uint64_t trace_start_ns;
+static int tracing;
+
+/* Rings of all the threads that recorded spans, and the lock guarding the list */
+static TraceBuffer *buffers;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread TraceBuffer *thread_buffer;
+
+/* Function Definitions */
+
+/*
+ * Function to read the monotonic clock the spans are timed with, in
+ * nanoseconds.
+ *
+ * INPUTS: None.
+ *
+ * RETURNS: The time in nanoseconds.
+ */
+uint64_t trace_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*
+ * Function to check whether a trace is being recorded, so that callers
+ * can skip reading the clock for nothing.
+ *
+ * INPUTS: None.
+ *
+ * RETURNS: 1 if --trace was given, 0 otherwise.
+ */
+int trace_enabled(void)
+{
+    return tracing;
+}
+
+/*
+ * Function to get the ring of the calling thread, linking a new one in on
+ * the first span the thread records.
+ */
+static TraceBuffer *get_thread_buffer(void)
+{
+    if(thread_buffer)
+	return thread_buffer;
+
+    TraceBuffer *buffer = calloc(1, sizeof(TraceBuffer));
+    if(!buffer)
+	return NULL;
+    buffer->tid = syscall(SYS_gettid);
+    pthread_mutex_lock(&trace_lock);
+    buffer->next = buffers;
+    buffers = buffer;
+    pthread_mutex_unlock(&trace_lock);
+    thread_buffer = buffer;
+    return buffer;
+}
+
+/*
+ * Function to record a span of the calling thread in its ring. No lock is
+ * taken: the event is filled in and then published by bumping the head.
+ * Nothing is done unless a trace is being recorded.
+ *
+ * INPUTS: The span name and category (static strings), its start and end
+ * times from trace_now() and the bytes it moved, 0 for none.
+ *
+ * RETURNS: Nothing.
+ */
+void trace_span(const char *name, const char *category, uint64_t start_ns, uint64_t end_ns, uint64_t bytes)
+{
+    TraceBuffer *buffer = tracing? get_thread_buffer(): NULL;
+    if(!buffer || !name || !category)
+	return;
+
+    uint64_t head = buffer->head;
+    TraceEvent *event = &buffer->events[head % TRACE_RING_EVENTS];
+    event->name = name;
+    event->category = category;
+    event->start_ns = start_ns;
+    event->duration_ns = end_ns > start_ns? end_ns - start_ns: 0;
+    event->bytes = bytes;
+    __atomic_store_n(&buffer->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Function called by stdio to read from a traced stream.
+ */
+static ssize_t traced_stream_read(void *cookie, char *buf, size_t size)
+{
+    TracedStream *stream = cookie;
+    uint64_t start = trace_now();
+    size_t got = fread(buf, 1, size, stream->fptr);
+    trace_span(stream->name, "io", start, trace_now(), got);
+    return (got || !ferror(stream->fptr))? (ssize_t)got: -1;
+}
+
+/*
+ * Function called by stdio to write to a traced stream.
+ */
+static ssize_t traced_stream_write(void *cookie, const char *buf, size_t size)
+{
+    TracedStream *stream = cookie;
+    uint64_t start = trace_now();
+    size_t wrote = fwrite(buf, 1, size, stream->fptr);
+    trace_span(stream->name, "io", start, trace_now(), wrote);
+    return (wrote || !size)? (ssize_t)wrote: -1;
+}
+
+/*
+ * Function called by stdio to move a traced stream.
+ */
+static int traced_stream_seek(void *cookie, off64_t *offset, int whence)
+{
+    TracedStream *stream = cookie;
+    if(fseeko(stream->fptr, *offset, whence) < 0)
+	return -1;
+    *offset = ftello(stream->fptr);
+    return *offset < 0? -1: 0;
+}
+
+/*
+ * Function called by stdio to close a traced stream. The wrapped stream
+ * flushes its last block here, so the close is a span of its own.
+ */
+static int traced_stream_close(void *cookie)
+{
+    TracedStream *stream = cookie;
+    uint64_t start = trace_now();
+    int status = fclose(stream->fptr);
+    trace_span("close", "io", start, trace_now(), 0);
+    arena_release(stream->arena, stream);
+    return status;
+}
+
+/*
+ * Function to wrap a freshly opened stream so that each read and write
+ * that reaches it is recorded as a span, from the request to its
+ * completion, including the time spent waiting for an I/O limit. When no
+ * trace is being recorded, the stream is returned as it is. The wrapper
+ * owns the stream and closes it.
+ *
+ * INPUTS: The stream, NULL being passed through, its fopen() mode and the
+ * arena the wrapper state comes from (may be NULL).
+ *
+ * RETURNS: The stream to use, or NULL on errors, the stream being closed.
+ */
+FILE *trace_stream(FILE *fptr, const char *mode, Arena *arena)
+{
+    if(!mode)
+    {
+	FATAL_ERR_MSG;
+	return NULL;
+    }
+
+    if(!fptr || !tracing)
+	return fptr;
+
+    TracedStream *stream = arena_alloc(arena, sizeof(TracedStream));
+    if(!stream)
+    {
+	FATAL_ERR_MSG;
+	fclose(fptr);
+	return NULL;
+    }
+    stream->fptr = fptr;
+    stream->name = mode[0] == 'r'? "read": "write";
+    stream->arena = arena;
+
+    cookie_io_functions_t functions = {
+	.read = mode[0] == 'r'? traced_stream_read: NULL,
+	.write = mode[0] == 'r'? NULL: traced_stream_write,
+	.seek = traced_stream_seek,
+	.close = traced_stream_close
+    };
+    FILE *traced = fopencookie(stream, mode, functions);
+    if(!traced)
+    {
+	fclose(fptr);
+	arena_release(arena, stream);
+    }
+    return traced;
+}
+
+/*
+ * Function to write the events of one ring, oldest first. Each event
+ * follows the process name event, so each is preceded by a separator.
+ */
+static void write_ring_events(FILE *fptr, const TraceBuffer *buffer, pid_t pid, uint64_t *dropped)
+{
+    uint64_t head = __atomic_load_n(&buffer->head, __ATOMIC_ACQUIRE);
+    uint64_t oldest = head > TRACE_RING_EVENTS? head - TRACE_RING_EVENTS: 0;
+    *dropped += oldest;
+    for(uint64_t i = oldest; i < head; ++i)
+    {
+	const TraceEvent *event = &buffer->events[i % TRACE_RING_EVENTS];
+	double ts_us = event->start_ns >= trace_start_ns? (event->start_ns - trace_start_ns) / 1e3: 0;
+	fprintf(fptr, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d",
+		event->name, event->category, ts_us, event->duration_ns / 1e3, (int)pid, (int)buffer->tid);
+	if(event->bytes)
+	    fprintf(fptr, ",\"args\":{\"bytes\":%llu}", (unsigned long long)event->bytes);
+	fputc('}', fptr);
+    }
+}
+
+/*
+ * Function to write the recorded spans of all the threads as a Chrome
+ * trace event file, which Perfetto and chrome://tracing open. Each thread
+ * shows as a track of its own, with the stages of its jobs nested in the
+ * jobs and the I/O nested in the stages. Threads that recorded more than
+ * TRACE_RING_EVENTS spans keep their last ones; the number of spans lost
+ * is given as dropped_events.
+ *
+ * INPUTS: The trace file name.
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status write_trace(const char *fname)
+{
+    if(!fname)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    char *temp_fname = get_temp_output_filename(fname, NULL);
+    FILE *fptr = temp_fname? fopen(temp_fname, "w"): NULL;
+    if(!fptr)
+    {
+	perror("fopen");
+	fprintf(stderr, "ERROR: Unable to open file %s\n", fname);
+	if(temp_fname)
+	    remove(temp_fname);
+	free(temp_fname);
+	return e_failure;
+    }
+
+    pid_t pid = getpid();
+    uint64_t dropped = 0;
+    fprintf(fptr, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    fprintf(fptr, "\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"steg\"}}", (int)pid);
+    pthread_mutex_lock(&trace_lock);
+    for(const TraceBuffer *buffer = buffers; buffer; buffer = buffer->next)
+	write_ring_events(fptr, buffer, pid, &dropped);
+    pthread_mutex_unlock(&trace_lock);
+    fprintf(fptr, "\n],\"otherData\":{\"dropped_events\":%llu}}\n", (unsigned long long)dropped);
+
+    Status status = e_success;
+    if(fclose(fptr) || rename(temp_fname, fname))
+    {
+	FILE_WRITE_ERR;
+	remove(temp_fname);
+	status = e_failure;
+    }
+    free(temp_fname);
+    return status;
+}
+
+/*
+ * Function to write the trace as the process exits.
+ */
+static void write_final_trace(void)
+{
+    write_trace(trace_fname);
+}
+
+/*
+ * Function to start recording the trace given by --trace. Spans are only
+ * recorded from here on, into a ring per thread, and the trace file is
+ * written at exit. Without a trace file, nothing is recorded.
+ *
+ * INPUTS: The trace file name (may be NULL).
+ *
+ * RETURNS: Operation status: e_success or e_failure.
+ */
+Status start_trace(const char *trace_file)
+{
+    if(!trace_file || tracing)
+	return e_success;
+
+    trace_fname = trace_file;
+    trace_start_ns = trace_now();
+    atexit(write_final_trace);
+    tracing = 1;
+    return e_success;
+}
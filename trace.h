@@ -0,0 +1,74 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "types.h" 	// Contains user defined types
+#include "arena.h"	// Contains the per-job arena
+#include "error.h"	// Contains standard error messages
+
+/* Events kept per thread; older ones are overwritten once the ring is full */
+#define TRACE_RING_EVENTS 16384
+
+/*
+ * Structure to store one span, a Chrome trace "complete" event. The name
+ * and category are static strings, so recording an event copies no text.
+ */
+typedef struct _TraceEvent
+{
+    const char *name;
+    const char *category;
+    uint64_t start_ns;		// CLOCK_MONOTONIC time the span started
+    uint64_t duration_ns;
+    uint64_t bytes;		// Bytes moved by an I/O span, 0 for none
+
+} TraceEvent;
+
+/*
+ * Structure to store the ring of events of one thread. Only the owning
+ * thread writes it, bumping head after each event, and the rings are read
+ * when the trace is written. Rings are kept once their thread is gone.
+ */
+typedef struct _TraceBuffer
+{
+    struct _TraceBuffer *next;
+    pid_t tid;
+    uint64_t head;		// Events recorded so far, the ring holding the last ones
+    TraceEvent events[TRACE_RING_EVENTS];
+
+} TraceBuffer;
+
+/*
+ * Structure to store the state of a traced stream: the stream it wraps
+ * and the names of its spans.
+ */
+typedef struct _TracedStream
+{
+    FILE *fptr;
+    const char *name;		// "read" or "write"
+    Arena *arena;		// Arena the state comes from (may be NULL)
+
+} TracedStream;
+
+/* Tracing function prototypes */
+
+/* Start recording the trace given by --trace */
+Status start_trace(const char *trace_file);
+
+/* Check whether a trace is being recorded */
+int trace_enabled(void);
+
+/* Read the clock the spans are timed with */
+uint64_t trace_now(void);
+
+/* Record a span of the calling thread */
+void trace_span(const char *name, const char *category, uint64_t start_ns, uint64_t end_ns, uint64_t bytes);
+
+/* Wrap a stream so that its reads and writes are recorded as spans */
+FILE *trace_stream(FILE *fptr, const char *mode, Arena *arena);
+
+/* Write the recorded spans in the Chrome trace event format */
+Status write_trace(const char *fname);
+
+#endif
@@ -16,6 +16,14 @@ typedef enum
 {
     e_encode,
     e_decode,
+    e_serve,
+    e_client,
+    e_broadcast,
+    e_span,
+    e_join,
+    e_update,
+    e_compare,
+    e_detect,
     e_unsupported
 } OperationType;
 
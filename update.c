@@ -0,0 +1,338 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "update.h"
+#include "encode.h"
+#include "decode.h"
+#include "lsb.h"
+#include "types.h"
+#include "error.h"
+
+/* Function Definitions */
+
+/*
+ * Function to check the update arguments input by the user.
+ *
+ * Updating needs the stego image, which must be a regular file since it is
+ * changed in place, and the file holding the new secret, in that order:
+ *	--update <stegged.bmp> <secret_file>
+ *
+ * Optional "--" arguments may appear anywhere after the operation argument.
+ * They must match the ones the image was encoded with.
+ *
+ * INPUTS: Argument vector from the main() function and the UpdateInfo
+ * variable pointer.
+ *
+ * RETURNS: The check status enum: e_success or e_failure.
+ */
+Status read_and_validate_update_args(char *argv[], UpdateInfo *updInfo)
+{
+    if(!argv || !updInfo)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    memset(updInfo, 0, sizeof(*updInfo));
+    updInfo->image_fd = -1;
+    if(read_steg_options(argv, &updInfo->options) == e_failure)
+	return e_failure;
+
+    if(!argv[2] || !argv[3] || !strstr(argv[2], IMG_FILE_EXTN))
+    {
+	fprintf(stderr, "Error: Please input the stego image and the new secret file:\n%s %s <image%s> <secret_file>\n", argv[0], UPDATE_ARG, IMG_FILE_EXTN);
+	return e_failure;
+    }
+
+    updInfo->stego_image_fname = argv[2];
+    updInfo->secret_fname = argv[3];
+    return e_success;
+}
+
+/*
+ * Function to map the stego image read-write and parse its header.
+ *
+ * The mapping is shared, so stores into it go back to the file. The pixel
+ * array described by the header must lie within the file.
+ *
+ * INPUTS: The UpdateInfo object.
+ *
+ * RETURNS: Operation status enum: e_success or e_failure.
+ */
+Status map_stego_image(UpdateInfo *updInfo)
+{
+    if(!updInfo)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    struct stat st;
+    updInfo->image_fd = open(updInfo->stego_image_fname, O_RDWR);
+    if(updInfo->image_fd < 0 || fstat(updInfo->image_fd, &st) < 0)
+    {
+	perror("open");
+	fprintf(stderr, "ERROR: Unable to open file %s\n", updInfo->stego_image_fname);
+	return e_failure;
+    }
+    if(!S_ISREG(st.st_mode) || st.st_size < BMP_PARSED_HEADER_SIZE)
+    {
+	fprintf(stderr, "%s: not a BMP image file that can be updated in place.\n", updInfo->stego_image_fname);
+	return e_failure;
+    }
+
+    updInfo->image_size = st.st_size;
+    updInfo->image_map = mmap(NULL, updInfo->image_size, PROT_READ | PROT_WRITE, MAP_SHARED, updInfo->image_fd, 0);
+    if(updInfo->image_map == MAP_FAILED)
+    {
+	perror("mmap");
+	updInfo->image_map = NULL;
+	return e_failure;
+    }
+
+    const BmpImage *bmp_image = &updInfo->image_info;
+    if(parse_bmp_image_info(updInfo->image_map, &updInfo->image_info) == e_failure ||
+	    lsb_check_image_support(bmp_image, updInfo->options.skip_alpha) == e_failure)
+	return e_failure;
+    if(bmp_image->data_offset > updInfo->image_size ||
+	    (size_t)bmp_image->row_stride * bmp_image->height > updInfo->image_size - bmp_image->data_offset)
+    {
+	fprintf(stderr, "%s: the pixel array runs past the end of the file.\n", updInfo->stego_image_fname);
+	return e_failure;
+    }
+    return e_success;
+}
+
+/*
+ * Function to check the image holds a message that decodes with the given
+ * options.
+ *
+ * The mapped image is run through the usual decoding steps, starting with
+ * find_magic_string(), with the output kept in memory. This makes sure
+ * the image really is a stego image and that the key and the options
+ * match, so a mistyped option can not scramble it. The size of the old
+ * message is worked out from its fields, for the carriers a shorter new
+ * one leaves behind.
+ *
+ * INPUTS: The UpdateInfo object, with the image mapped.
+ *
+ * RETURNS: Operation status enum: e_success or e_failure.
+ */
+Status check_embedded_message(UpdateInfo *updInfo)
+{
+    if(!updInfo || !updInfo->image_map)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    DecodeInfo decInfo;
+    memset(&decInfo, 0, sizeof(decInfo));
+    decInfo.stego_image_fname = (char *)updInfo->stego_image_fname;
+    decInfo.options = updInfo->options;
+    decInfo.inline_output = 1;
+    decInfo.fptr_stego_image = fmemopen(updInfo->image_map, updInfo->image_size, "rb");
+    if(!decInfo.fptr_stego_image)
+    {
+	perror("fmemopen");
+	return e_failure;
+    }
+
+    Status status = do_decoding(NULL, &decInfo);
+    if(status == e_success)
+    {
+	printf("Embedded message found: %zu bytes\n", decInfo.output_size);
+	updInfo->embedded_len = get_encoded_message_size(decInfo.extn_secret_file, decInfo.output_size, &updInfo->options);
+    }
+    free(decInfo.output_data);
+    return status;
+}
+
+/*
+ * Function to write the new message over the old one, block by block.
+ *
+ * Two cursors walk the carriers of the mapped pixel array in the same
+ * order. For every block of LSB_CHUNK_SIZE message bytes, the first one
+ * reads what is embedded there now; blocks that are already right are
+ * skipped, and the others are written by the second cursor, which only
+ * flips the LSBs that differ. Carriers past the end of the old message
+ * simply hold cover LSBs, so the message may grow up to the capacity of
+ * the image. When it shrinks, the carriers of the tail of the old one are
+ * overwritten with random bits, which look like cover LSBs, so that no
+ * part of the old secret stays in the image.
+ *
+ * INPUTS: The UpdateInfo object, with the image mapped, and the new
+ * encoded message.
+ *
+ * RETURNS: Operation status enum: e_success or e_failure.
+ */
+Status rewrite_changed_blocks(UpdateInfo *updInfo, const unsigned char *message, uint message_len)
+{
+    if(!updInfo || !updInfo->image_map || !message)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    unsigned char *pixels = updInfo->image_map + updInfo->image_info.data_offset;
+    int skip_alpha = updInfo->options.skip_alpha;
+    LsbCursor reader, writer;
+    memset(&reader, 0, sizeof(reader));
+    memset(&writer, 0, sizeof(writer));
+    Status status = e_failure;
+    if(lsb_cursor_init_mapped(&reader, &updInfo->image_info, pixels, skip_alpha, NULL) == e_success &&
+	    lsb_cursor_init_mapped(&writer, &updInfo->image_info, pixels, skip_alpha, NULL) == e_success &&
+	    lsb_cursor_use_options_key(&reader, &updInfo->options) == e_success &&
+	    lsb_cursor_use_options_key(&writer, &updInfo->options) == e_success)
+	status = e_success;
+
+    unsigned char embedded[LSB_CHUNK_SIZE];
+    for(uint done = 0; status == e_success && done < message_len;)
+    {
+	uint chunk = message_len - done < LSB_CHUNK_SIZE? message_len - done: LSB_CHUNK_SIZE;
+	status = lsb_cursor_read(&reader, embedded, chunk);
+	if(status == e_success && !memcmp(embedded, message + done, chunk))
+	    status = lsb_cursor_skip(&writer, chunk);
+	else if(status == e_success)
+	{
+	    status = lsb_cursor_write(&writer, message + done, chunk);
+	    ++updInfo->blocks_rewritten;
+	}
+	++updInfo->blocks_total;
+	done += chunk;
+    }
+
+    for(size_t done = message_len; status == e_success && done < updInfo->embedded_len;)
+    {
+	uint chunk = updInfo->embedded_len - done < LSB_CHUNK_SIZE? updInfo->embedded_len - done: LSB_CHUNK_SIZE;
+	status = fill_random_bytes(embedded, chunk);
+	if(status == e_success)
+	    status = lsb_cursor_write(&writer, embedded, chunk);
+	updInfo->stale_len += chunk;
+	done += chunk;
+    }
+
+    updInfo->changed_carriers = writer.changed_carriers;
+    lsb_cursor_free(&reader);
+    lsb_cursor_free(&writer);
+    return status;
+}
+
+/*
+ * Function to replace the message of a stego image in place.
+ *
+ * The original cover is not needed: the stego image is mapped, checked to
+ * hold a message that decodes with the given options, and the new message
+ * is built and written over the old one with rewrite_changed_blocks(), so
+ * only the pages whose carriers change are written back to the file.
+ * Unchanged parts of the payload cost no writes at all. The new message
+ * must fit in the capacity of the image, which is checked before anything
+ * is changed.
+ *
+ * Note that with --encrypt every update draws a new nonce, so the whole
+ * message changes. The update is not crash-atomic: the pages are written
+ * back as the kernel sees fit until the final msync(), so a crash part
+ * way leaves a mix of the old and new message that decodes as neither.
+ *
+ * INPUTS: Pointer to UpdateInfo object.
+ *
+ * RETURNS: Operation status enum: e_success or e_failure.
+ */
+Status do_update(UpdateInfo *updInfo)
+{
+    if(!updInfo)
+    {
+	FATAL_ERR_MSG;
+	return e_failure;
+    }
+
+    if(map_stego_image(updInfo) == e_failure)
+    {
+	fprintf(stderr, "Image mapping failed.\n");
+	cleanup_update(updInfo);
+	return e_failure;
+    }
+
+    if(check_embedded_message(updInfo) == e_failure)
+    {
+	fprintf(stderr, "The image holds no message that decodes with these options.\n");
+	cleanup_update(updInfo);
+	return e_failure;
+    }
+
+    void *secret_stream_buf = NULL;
+    unsigned char *message = NULL;
+    uint message_len = 0;
+    FILE *fptr_secret = open_data_stream(updInfo->secret_fname, "rb");
+    Status status = e_failure;
+    if(!fptr_secret || make_stream_seekable(&fptr_secret, &secret_stream_buf) == e_failure)
+    {
+	perror("fopen");
+	fprintf(stderr, "ERROR: Unable to open file %s\n", updInfo->secret_fname);
+    }
+    else if(build_encoded_message(updInfo->secret_fname, fptr_secret, &updInfo->options, &message, &message_len, NULL) == e_success)
+	status = e_success;
+    if(fptr_secret)
+	fclose(fptr_secret);
+    free(secret_stream_buf);
+    if(status == e_failure)
+    {
+	fprintf(stderr, "Secret message preparation failed.\n");
+	cleanup_update(updInfo);
+	return e_failure;
+    }
+
+    if(message_len > lsb_image_capacity(&updInfo->image_info, updInfo->options.skip_alpha))
+    {
+	fprintf(stderr, "Image file not large enough to hold the encoded data.\n");
+	free(message);
+	cleanup_update(updInfo);
+	return e_failure;
+    }
+
+    status = rewrite_changed_blocks(updInfo, message, message_len);
+    free(message);
+    if(status == e_success && msync(updInfo->image_map, updInfo->image_size, MS_SYNC) < 0)
+    {
+	perror("msync");
+	status = e_failure;
+    }
+    if(status == e_success)
+    {
+	if(updInfo->stale_len)
+	    printf("Overwrote the last %zu bytes of the old message with random bits.\n", updInfo->stale_len);
+	printf("Rewrote %u of %u message blocks, %zu carrier bytes changed: %s\n", updInfo->blocks_rewritten, updInfo->blocks_total, updInfo->changed_carriers, updInfo->stego_image_fname);
+    }
+    else
+	fprintf(stderr, "Message rewrite failed, the image may hold a damaged message.\n");
+
+    cleanup_update(updInfo);
+    return status;
+}
+
+/*
+ * Function to unmap the stego image and close it.
+ *
+ * INPUTS: The UpdateInfo object.
+ *
+ * RETURNS: Nothing.
+ */
+void cleanup_update(UpdateInfo *updInfo)
+{
+    if(!updInfo)
+    {
+	FATAL_ERR_MSG;
+	return;
+    }
+
+    if(updInfo->image_map)
+	munmap(updInfo->image_map, updInfo->image_size);
+    if(updInfo->image_fd >= 0)
+	close(updInfo->image_fd);
+    updInfo->image_map = NULL;
+    updInfo->image_fd = -1;
+}
@@ -0,0 +1,56 @@
+#ifndef UPDATE_H
+#define UPDATE_H
+
+#include <stdio.h>
+#include "types.h" 	// Contains user defined types
+#include "common.h"	// Contains common strings
+#include "error.h"	// Contains standard error messages
+
+/*
+ * Structure to store an in place update of the message of a stego image.
+ * The image file is mapped shared and read-write, so the pixel bytes that
+ * change are written back by the kernel a page at a time and the rest of
+ * the file is never rewritten.
+ */
+typedef struct _UpdateInfo
+{
+    const char *stego_image_fname;
+    const char *secret_fname;
+    StegOptions options;
+
+    /* The mapped image */
+    int image_fd;
+    unsigned char *image_map;
+    size_t image_size;
+    BmpImage image_info;
+    size_t embedded_len;	// Carrier bytes the old message takes up
+
+    /* Outcome of the update */
+    uint blocks_total;
+    uint blocks_rewritten;
+    size_t changed_carriers;
+    size_t stale_len;		// Bytes of the old message tail overwritten
+
+} UpdateInfo;
+
+/* Update function prototypes */
+
+/* Read and validate the update args from argv */
+Status read_and_validate_update_args(char *argv[], UpdateInfo *updInfo);
+
+/* Replace the message of a stego image in place */
+Status do_update(UpdateInfo *updInfo);
+
+/* Map the stego image read-write and parse its header */
+Status map_stego_image(UpdateInfo *updInfo);
+
+/* Check the image holds a message that decodes with the given options */
+Status check_embedded_message(UpdateInfo *updInfo);
+
+/* Write the new message over the old one, block by block */
+Status rewrite_changed_blocks(UpdateInfo *updInfo, const unsigned char *message, uint message_len);
+
+/* Unmap the image and close it */
+void cleanup_update(UpdateInfo *updInfo);
+
+#endif